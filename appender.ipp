@@ -0,0 +1,220 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _FILESYSTEM_HPP_
+#error "appender.ipp can ONLY be included into fs.hpp"
+#endif
+
+namespace detail
+{
+
+// buffered_appender::append会隐藏掉命名空间中的append
+inline
+offset_t append_block(file_t p_file,
+		      const void *p_buffer,
+		      size_t p_count) {
+	return append(p_file, p_buffer, p_count);
+}
+
+} // namespace detail
+
+//
+// 合并小记录的append：记录先拷贝到内存中的块里，块满、超过
+// p_linger_ms或调用flush时，整块一次append到文件。
+//
+// append返回记录在文件中的偏移，同fs::append；这个偏移是根据
+// 打开时的文件长度推算的，所以文件只能通过这个appender追加。
+// 可以被多个线程同时使用；析构时会flush，但不关闭文件。
+//
+class buffered_appender : boost::noncopyable
+{
+public:
+	// p_linger_ms为0时只在块满或flush时写出
+	explicit buffered_appender(file_t p_file,
+				   size_t p_block_size = 1024 * 1024,
+				   unsigned p_linger_ms = 0)
+		: m_file(p_file),
+		  m_block_size(p_block_size),
+		  m_linger_ms(p_linger_ms),
+		  m_next(seek(p_file, 0, ST_SEEK_END)),
+		  m_errno(0),
+		  m_stop(false),
+		  m_thread(NULL) {
+		m_block.reserve(m_block_size);
+		if(m_next == BAD_OFFSET)
+		{
+			m_errno = get_errno();
+		}
+		if(m_linger_ms != 0)
+		{
+			m_thread = new boost::thread(boost::bind(&buffered_appender::run, this));
+		}
+	}
+
+	~buffered_appender() {
+		if(m_thread != NULL)
+		{
+			{
+				boost::mutex::scoped_lock _lock(m_mutex);
+				m_stop = true;
+			}
+			m_cond.notify_all();
+			m_thread->join();
+			delete m_thread;
+		}
+		flush();
+	}
+
+	// 返回记录的偏移，出错时返回BAD_OFFSET；之前的写出失败后，
+	// 之后的append都会失败
+	offset_t append(const void *p_buffer,
+			size_t p_count) {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		if(m_errno != 0)
+		{
+			set_errno(m_errno);
+			return BAD_OFFSET;
+		}
+
+		// 大记录和已有的块一起写出，不再拷贝
+		if(p_count >= m_block_size)
+		{
+			const offset_t _offset = m_next;
+			m_next += p_count;
+			return do_flush(_lock, p_buffer, p_count) ? _offset : BAD_OFFSET;
+		}
+
+		// 放不下时先写出已有的块；写出时释放了锁，所以要重新检查
+		while(m_block.size() + p_count > m_block_size)
+		{
+			if(! do_flush(_lock, NULL, 0))
+				return BAD_OFFSET;
+		}
+		if(m_errno != 0)
+		{
+			set_errno(m_errno);
+			return BAD_OFFSET;
+		}
+
+		const offset_t _offset = m_next;
+		m_next += p_count;
+		if(m_block.empty())
+		{
+			m_first_time = boost::get_system_time();
+		}
+		const char *_data = static_cast<const char*>(p_buffer);
+		m_block.insert(m_block.end(), _data, _data + p_count);
+		if(m_block.size() < m_block_size)
+			return _offset;
+		return do_flush(_lock, NULL, 0) ? _offset : BAD_OFFSET;
+	}
+
+	offset_t append(const boost::asio::const_buffer &p_buffer) {
+		return append(boost::asio::buffer_cast<const char*>(p_buffer),
+			      boost::asio::buffer_size(p_buffer));
+	}
+
+	bool flush() {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		if(m_errno != 0)
+		{
+			set_errno(m_errno);
+			return false;
+		}
+		return do_flush(_lock, NULL, 0);
+	}
+
+	// 下一条记录的偏移
+	offset_t tell() const {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		return m_next;
+	}
+
+private:
+	// 在锁外写出当前块和p_extra；写出按调用顺序进行，m_write_mutex
+	// 保证后面的块不会先于前面的块写到文件中
+	bool do_flush(boost::mutex::scoped_lock &p_lock,
+		      const void *p_extra,
+		      size_t p_extra_count) {
+		if(m_block.empty() && p_extra_count == 0)
+			return true;
+
+		std::vector<char> _block;
+		_block.reserve(m_block_size);
+		_block.swap(m_block);
+		boost::mutex::scoped_lock _write_lock(m_write_mutex);
+		const offset_t _expected = m_next - _block.size() - p_extra_count;
+		p_lock.unlock();
+
+		bool _ok = write_block(_block.empty() ? NULL : &_block[0],
+				       _block.size(),
+				       _expected);
+		_ok = _ok && write_block(p_extra,
+					 p_extra_count,
+					 _expected + _block.size());
+		const int _errno = get_errno();
+
+		_write_lock.unlock();
+		p_lock.lock();
+		if(! _ok && m_errno == 0)
+		{
+			m_errno = (_errno == 0) ? EIO : _errno;
+		}
+		return _ok;
+	}
+
+	bool write_block(const void *p_buffer,
+			 size_t p_count,
+			 offset_t p_expected) {
+		if(p_count == 0)
+			return true;
+		const offset_t _offset = detail::append_block(m_file, p_buffer, p_count);
+		if(_offset == BAD_OFFSET)
+			return false;
+		if(_offset != p_expected) // 有别人在追加，之前返回的偏移不对了
+		{
+			set_errno(EIO);
+			return false;
+		}
+		return true;
+	}
+
+	void run() {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		const boost::posix_time::milliseconds _linger(m_linger_ms);
+		while(! m_stop)
+		{
+			if(m_block.empty())
+			{
+				m_cond.timed_wait(_lock, boost::get_system_time() + _linger);
+				continue;
+			}
+			const boost::system_time _deadline = m_first_time + _linger;
+			if(boost::get_system_time() < _deadline)
+			{
+				m_cond.timed_wait(_lock, _deadline);
+				continue;
+			}
+			if(m_errno == 0)
+			{
+				do_flush(_lock, NULL, 0);
+			}
+			else
+			{
+				m_block.clear();
+			}
+		}
+	}
+
+	const file_t m_file;
+	const size_t m_block_size;
+	const unsigned m_linger_ms;
+	offset_t m_next;		// 下一条记录的偏移
+	int m_errno;			// 第一次写出失败的错误
+	bool m_stop;
+	std::vector<char> m_block;
+	boost::system_time m_first_time; // 块中第一条记录的时间
+	mutable boost::mutex m_mutex;
+	boost::mutex m_write_mutex;
+	boost::condition_variable m_cond;
+	boost::thread *m_thread;
+};
@@ -0,0 +1,390 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _FILESYSTEM_HPP_
+#error "backend.ipp can ONLY be included into fs.hpp"
+#endif
+
+namespace detail
+{
+
+// backend的成员函数会隐藏命名空间中的同名函数
+
+inline
+int backend_get_errno() {
+	return get_errno();
+}
+
+inline
+file_t backend_open(const char *p_path,
+		    int p_mode) {
+	return open(p_path, mode_t(p_mode));
+}
+
+inline
+file_t backend_open(const char *p_path,
+		    int p_mode,
+		    std::size_t p_replica_number) {
+	return open(p_path, mode_t(p_mode), p_replica_number);
+}
+
+inline
+file_t backend_create(const char *p_path) {
+	return create(p_path);
+}
+
+inline
+file_t backend_create(const char *p_path,
+		      std::size_t p_replica_number) {
+	return create(p_path, p_replica_number);
+}
+
+inline
+bool backend_close(file_t p_file) {
+	return close(p_file);
+}
+
+inline
+ssize_t backend_read(file_t p_file,
+		     void *p_buffer,
+		     size_t p_count) {
+	return read(p_file, p_buffer, p_count);
+}
+
+inline
+ssize_t backend_readv(file_t p_file,
+		      const iovec_t *p_iov,
+		      size_t p_count) {
+	return readv(p_file, p_iov, p_count);
+}
+
+inline
+ssize_t backend_write(file_t p_file,
+		      const void *p_buffer,
+		      size_t p_count) {
+	return write(p_file, p_buffer, p_count);
+}
+
+inline
+ssize_t backend_writev(file_t p_file,
+		       const iovec_t *p_iov,
+		       size_t p_count) {
+	return writev(p_file, p_iov, p_count);
+}
+
+inline
+offset_t backend_append(file_t p_file,
+			const void *p_buffer,
+			size_t p_count) {
+	return append(p_file, p_buffer, p_count);
+}
+
+inline
+offset_t backend_seek(file_t p_file,
+		      offset_t p_offset,
+		      int p_whence) {
+	return seek(p_file, p_offset, seek_t(p_whence));
+}
+
+inline
+ssize_t backend_pread(file_t p_file,
+		      void *p_buffer,
+		      size_t p_count,
+		      offset_t p_offset) {
+	return pread(p_file, p_buffer, p_count, p_offset);
+}
+
+inline
+ssize_t backend_pwrite(file_t p_file,
+		       const void *p_buffer,
+		       size_t p_count,
+		       offset_t p_offset) {
+	return pwrite(p_file, p_buffer, p_count, p_offset);
+}
+
+inline
+ssize_t backend_readn(file_t p_file,
+		      void *p_buffer,
+		      size_t p_count) {
+	return readn(p_file, p_buffer, p_count);
+}
+
+inline
+ssize_t backend_writen(file_t p_file,
+		       const void *p_buffer,
+		       size_t p_count) {
+	return writen(p_file, p_buffer, p_count);
+}
+
+inline
+ssize_t backend_preadn(file_t p_file,
+		       void *p_buffer,
+		       size_t p_count,
+		       offset_t p_offset) {
+	return preadn(p_file, p_buffer, p_count, p_offset);
+}
+
+inline
+ssize_t backend_pwriten(file_t p_file,
+			const void *p_buffer,
+			size_t p_count,
+			offset_t p_offset) {
+	return pwriten(p_file, p_buffer, p_count, p_offset);
+}
+
+inline
+bool backend_advise(file_t p_file,
+		    offset_t p_offset,
+		    offset_t p_length,
+		    int p_advice) {
+	return advise(p_file, p_offset, p_length, advice_t(p_advice));
+}
+
+inline
+bool backend_preallocate(file_t p_file,
+			 offset_t p_length) {
+	return preallocate(p_file, p_length);
+}
+
+inline
+bool backend_sync(file_t p_file) {
+	return sync(p_file);
+}
+
+inline
+bool backend_datasync(file_t p_file) {
+	return datasync(p_file);
+}
+
+inline
+bool backend_sync_directory(const char *p_path) {
+	return sync_directory(p_path);
+}
+
+inline
+bool backend_remove(const char *p_path) {
+	return remove(p_path);
+}
+
+inline
+bool backend_rename(const char *p_old_path,
+		    const char *p_new_path) {
+	return rename(p_old_path, p_new_path);
+}
+
+inline
+bool backend_exists(const char *p_path) {
+	return exists(p_path);
+}
+
+inline
+bool backend_stat(file_status &p_status,
+		  const char *p_path) {
+	return stat(p_status, p_path);
+}
+
+inline
+bool backend_mkdir(const char *p_path) {
+	return mkdir(p_path);
+}
+
+template<typename FileInfoContainer>
+inline
+bool backend_list_files(FileInfoContainer &p_infos,
+			const char *p_path) {
+	return list_files(p_infos, p_path);
+}
+
+} // namespace detail
+
+//
+// 本命名空间的静态接口，模板（如fsutil::router）通过它在编译期
+// 绑定到具体的文件系统，调用没有虚函数的开销。
+// 打开方式、seek和advise的参数为int，取值同MT_*, ST_*, AT_*。
+//
+struct backend
+{
+	typedef file_t file_type;
+	typedef file_status status_type;
+	typedef file_info info_type;
+
+	static file_t bad_file() {
+		return BAD_FILE;
+	}
+
+	static int get_errno() {
+		return detail::backend_get_errno();
+	}
+
+	static file_t open(const char *p_path,
+			   int p_mode) {
+		return detail::backend_open(p_path, p_mode);
+	}
+
+	static file_t open(const char *p_path,
+			   int p_mode,
+			   std::size_t p_replica_number) {
+		return detail::backend_open(p_path, p_mode, p_replica_number);
+	}
+
+	static file_t create(const char *p_path) {
+		return detail::backend_create(p_path);
+	}
+
+	static file_t create(const char *p_path,
+			     std::size_t p_replica_number) {
+		return detail::backend_create(p_path, p_replica_number);
+	}
+
+	static bool close(file_t p_file) {
+		return detail::backend_close(p_file);
+	}
+
+	static ssize_t read(file_t p_file,
+			    void *p_buffer,
+			    size_t p_count) {
+		return detail::backend_read(p_file, p_buffer, p_count);
+	}
+
+	static ssize_t readv(file_t p_file,
+			     const iovec_t *p_iov,
+			     size_t p_count) {
+		return detail::backend_readv(p_file, p_iov, p_count);
+	}
+
+	static ssize_t write(file_t p_file,
+			     const void *p_buffer,
+			     size_t p_count) {
+		return detail::backend_write(p_file, p_buffer, p_count);
+	}
+
+	static ssize_t writev(file_t p_file,
+			      const iovec_t *p_iov,
+			      size_t p_count) {
+		return detail::backend_writev(p_file, p_iov, p_count);
+	}
+
+	static offset_t append(file_t p_file,
+			       const void *p_buffer,
+			       size_t p_count) {
+		return detail::backend_append(p_file, p_buffer, p_count);
+	}
+
+	static offset_t seek(file_t p_file,
+			     offset_t p_offset,
+			     int p_whence) {
+		return detail::backend_seek(p_file, p_offset, p_whence);
+	}
+
+	static ssize_t pread(file_t p_file,
+			     void *p_buffer,
+			     size_t p_count,
+			     offset_t p_offset) {
+		return detail::backend_pread(p_file, p_buffer, p_count, p_offset);
+	}
+
+	static ssize_t pwrite(file_t p_file,
+			      const void *p_buffer,
+			      size_t p_count,
+			      offset_t p_offset) {
+		return detail::backend_pwrite(p_file, p_buffer, p_count, p_offset);
+	}
+
+	static ssize_t readn(file_t p_file,
+			     void *p_buffer,
+			     size_t p_count) {
+		return detail::backend_readn(p_file, p_buffer, p_count);
+	}
+
+	static ssize_t writen(file_t p_file,
+			      const void *p_buffer,
+			      size_t p_count) {
+		return detail::backend_writen(p_file, p_buffer, p_count);
+	}
+
+	static ssize_t preadn(file_t p_file,
+			      void *p_buffer,
+			      size_t p_count,
+			      offset_t p_offset) {
+		return detail::backend_preadn(p_file, p_buffer, p_count, p_offset);
+	}
+
+	static ssize_t pwriten(file_t p_file,
+			       const void *p_buffer,
+			       size_t p_count,
+			       offset_t p_offset) {
+		return detail::backend_pwriten(p_file, p_buffer, p_count, p_offset);
+	}
+
+	static bool advise(file_t p_file,
+			   offset_t p_offset,
+			   offset_t p_length,
+			   int p_advice) {
+		return detail::backend_advise(p_file, p_offset, p_length, p_advice);
+	}
+
+	static bool preallocate(file_t p_file,
+				offset_t p_length) {
+		return detail::backend_preallocate(p_file, p_length);
+	}
+
+	static bool sync(file_t p_file) {
+		return detail::backend_sync(p_file);
+	}
+
+	static bool datasync(file_t p_file) {
+		return detail::backend_datasync(p_file);
+	}
+
+	static bool sync_directory(const char *p_path) {
+		return detail::backend_sync_directory(p_path);
+	}
+
+	static bool remove(const char *p_path) {
+		return detail::backend_remove(p_path);
+	}
+
+	static bool rename(const char *p_old_path,
+			   const char *p_new_path) {
+		return detail::backend_rename(p_old_path, p_new_path);
+	}
+
+	static bool exists(const char *p_path) {
+		return detail::backend_exists(p_path);
+	}
+
+	static bool stat(file_status &p_status,
+			 const char *p_path) {
+		return detail::backend_stat(p_status, p_path);
+	}
+
+	static bool mkdir(const char *p_path) {
+		return detail::backend_mkdir(p_path);
+	}
+
+	template<typename FileInfoContainer>
+	static bool list_files(FileInfoContainer &p_infos,
+			       const char *p_path) {
+		return detail::backend_list_files(p_infos, p_path);
+	}
+
+	static uint64_t status_size(const file_status &p_status) {
+		return get_size(p_status);
+	}
+
+	// 0表示该文件系统不提供修改时间
+	static time_t status_mtime(const file_status &p_status) {
+		return get_mtime(p_status);
+	}
+
+	static bool status_is_directory(const file_status &p_status) {
+		return is_directory(p_status);
+	}
+
+	static std::string info_name(const file_info &p_info) {
+		return get_name(p_info);
+	}
+
+	static bool info_is_directory(const file_info &p_info) {
+		return is_directory(p_info);
+	}
+};
@@ -0,0 +1,323 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _FILESYSTEM_HPP_
+#error "batch.ipp can ONLY be included into fs.hpp"
+#endif
+
+//
+// 批量的元数据操作：stat_many, exists_many, remove_many,
+// create_directories_many。最多p_threads个线程同时执行，每个线程
+// 依次取下一项，所以项数很多时也不会为每一项建立任务。
+// 每一项的结果在p_errnos中（0表示成功，否则为get_errno()），
+// 全部成功时返回true。
+//
+
+namespace detail
+{
+
+enum {
+	BATCH_THREADS = 16,
+	DIRECTORY_CACHE_SHARDS = 16,
+	DIRECTORY_CACHE_LIMIT = 64 * 1024	// 每个分片，超过时清空
+};
+
+// p_op(i)依次处理第i项，多个线程共享p_next
+template<typename Op>
+void batch_worker(Op *p_op,
+		  boost::atomic<std::size_t> *p_next,
+		  std::size_t p_count) {
+	for(std::size_t i = (*p_next)++; i < p_count; i = (*p_next)++)
+	{
+		(*p_op)(i);
+	}
+}
+
+template<typename Op>
+void batch_run(Op &p_op,
+	       std::size_t p_count,
+	       std::size_t p_threads) {
+	boost::atomic<std::size_t> _next(0);
+	const std::size_t _threads = std::min(p_threads, p_count);
+	if(_threads <= 1)
+	{
+		batch_worker(&p_op, &_next, p_count);
+		return;
+	}
+	boost::thread_group _group;
+	for(std::size_t i = 1; i < _threads; ++i)
+	{
+		_group.create_thread(boost::bind(&batch_worker<Op>, &p_op, &_next, p_count));
+	}
+	batch_worker(&p_op, &_next, p_count);
+	_group.join_all();
+}
+
+inline
+bool batch_ok(const std::vector<int> &p_errnos) {
+	for(std::size_t i = 0; i < p_errnos.size(); ++i)
+	{
+		if(p_errnos[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+struct stat_op
+{
+	const std::vector<std::string> &m_paths;
+	std::vector<file_status> &m_status;
+	std::vector<int> &m_errnos;
+
+	void operator()(std::size_t p_index) {
+		m_errnos[p_index] = stat(m_status[p_index], m_paths[p_index].c_str())
+			? 0 : get_errno();
+	}
+};
+
+struct exists_op
+{
+	const std::vector<std::string> &m_paths;
+	std::vector<char> &m_exists;
+
+	void operator()(std::size_t p_index) {
+		m_exists[p_index] = exists(m_paths[p_index].c_str());
+	}
+};
+
+struct remove_op
+{
+	const std::vector<std::string> &m_paths;
+	std::vector<int> &m_errnos;
+
+	void operator()(std::size_t p_index) {
+		m_errnos[p_index] = remove(m_paths[p_index].c_str())
+			? 0 : get_errno();
+	}
+};
+
+void forget_directories(const char *p_path);
+
+// 已知存在的目录，create_directories不再检查它们。本进程的remove,
+// rename通过path_changed去掉相应的项；本进程外删除了其中的目录时，
+// create_directories会出错，此时去掉相应的项后重试一次
+class directory_cache : boost::noncopyable
+{
+public:
+	directory_cache() {
+		global_path_changed_hook(PH_DIRECTORY_CACHE).store(&forget_directories);
+	}
+
+	bool contains(const std::string &p_path) {
+		shard &_shard = get_shard(p_path);
+		boost::mutex::scoped_lock _lock(_shard.m_mutex);
+		return _shard.m_dirs.find(p_path) != _shard.m_dirs.end();
+	}
+
+	void insert(const std::string &p_path) {
+		shard &_shard = get_shard(p_path);
+		boost::mutex::scoped_lock _lock(_shard.m_mutex);
+		if(_shard.m_dirs.size() >= DIRECTORY_CACHE_LIMIT)
+			_shard.m_dirs.clear();
+		_shard.m_dirs.insert(p_path);
+	}
+
+	void erase(const std::string &p_path) {
+		shard &_shard = get_shard(p_path);
+		boost::mutex::scoped_lock _lock(_shard.m_mutex);
+		_shard.m_dirs.erase(p_path);
+	}
+
+	// 去掉p_path和其下的所有目录
+	void erase_tree(const std::string &p_path) {
+		std::string _path = p_path;
+		while(_path.size() > 1 && _path[_path.size() - 1] == '/')
+		{
+			_path.resize(_path.size() - 1);
+		}
+		const std::string _prefix = (_path == "/") ? _path : _path + "/";
+		for(std::size_t i = 0; i < DIRECTORY_CACHE_SHARDS; ++i)
+		{
+			boost::mutex::scoped_lock _lock(m_shards[i].m_mutex);
+			std::set<std::string> &_dirs = m_shards[i].m_dirs;
+			_dirs.erase(_path);
+			std::set<std::string>::iterator _iter = _dirs.lower_bound(_prefix);
+			while(_iter != _dirs.end() &&
+			      _iter->compare(0, _prefix.size(), _prefix) == 0)
+			{
+				_dirs.erase(_iter++);
+			}
+		}
+	}
+
+	void clear() {
+		for(std::size_t i = 0; i < DIRECTORY_CACHE_SHARDS; ++i)
+		{
+			boost::mutex::scoped_lock _lock(m_shards[i].m_mutex);
+			m_shards[i].m_dirs.clear();
+		}
+	}
+
+private:
+	struct shard
+	{
+		boost::mutex m_mutex;
+		std::set<std::string> m_dirs;	// 有序，以便去掉目录下的所有项
+	};
+
+	shard &get_shard(const std::string &p_path) {
+		return m_shards[boost::hash<std::string>()(p_path) % DIRECTORY_CACHE_SHARDS];
+	}
+
+	shard m_shards[DIRECTORY_CACHE_SHARDS];
+};
+
+inline
+directory_cache &global_directory_cache() {
+	static directory_cache _cache;
+	return _cache;
+}
+
+inline
+void forget_directories(const char *p_path) {
+	global_directory_cache().erase_tree(p_path);
+}
+
+// 从已知存在的最长前缀开始，逐级mkdir；p_use_cache为false时
+// 不信任缓存，从第一级开始
+inline
+bool create_directories(const std::string &p_path,
+			bool p_use_cache) {
+	directory_cache &_cache = global_directory_cache();
+	std::string _path = p_path;
+	while(_path.size() > 1 && _path[_path.size() - 1] == '/')
+	{
+		_path.resize(_path.size() - 1);
+	}
+	if(_path.empty() || _path == "/")
+		return true;
+	if(p_use_cache && _cache.contains(_path))
+		return true;
+
+	// 各级目录的结束位置，从长到短
+	std::vector<std::size_t> _ends;
+	_ends.push_back(_path.size());
+	for(std::size_t _pos = _path.rfind('/', _path.size() - 1);
+	    _pos != std::string::npos && _pos > 0;
+	    _pos = _path.rfind('/', _pos - 1))
+	{
+		if(_path[_pos - 1] != '/')	// 跳过连续的'/'
+			_ends.push_back(_pos);
+	}
+
+	std::size_t _first = _ends.size();	// 需要检查的最浅的一级
+	if(p_use_cache)
+	{
+		for(std::size_t i = 1; i < _ends.size(); ++i)
+		{
+			if(_cache.contains(_path.substr(0, _ends[i])))
+			{
+				_first = i;
+				break;
+			}
+		}
+	}
+
+	for(std::size_t i = _first; i > 0; --i)
+	{
+		const std::string _dir = _path.substr(0, _ends[i - 1]);
+		if(! mkdir(_dir.c_str()))
+		{
+			const int _errno = get_errno();
+			if(! is_directory(_dir.c_str()))
+			{
+				// 可能是缓存中的目录已经被删除了
+				if(p_use_cache && _first < _ends.size())
+				{
+					for(std::size_t j = _first; j < _ends.size(); ++j)
+					{
+						_cache.erase(_path.substr(0, _ends[j]));
+					}
+					return create_directories(_path, false);
+				}
+				set_errno(_errno);
+				return false;
+			}
+		}
+		_cache.insert(_dir);
+	}
+	return true;
+}
+
+struct create_directories_op
+{
+	const std::vector<std::string> &m_paths;
+	std::vector<int> &m_errnos;
+
+	void operator()(std::size_t p_index) {
+		m_errnos[p_index] = create_directories(m_paths[p_index], true)
+			? 0 : get_errno();
+	}
+};
+
+} // namespace detail
+
+// 同mkdir -p，已经存在时也返回true。已知存在的上级目录会被记住，
+// 所以大量有共同前缀的路径不会反复检查同样的上级目录
+inline
+bool create_directories(const char *p_path) {
+	return detail::create_directories(p_path, true);
+}
+
+inline
+bool create_directories(const std::string &p_path) {
+	return detail::create_directories(p_path, true);
+}
+
+// 忘记create_directories记住的目录，比如在别的进程删除了目录树之后；
+// 本进程的remove, rename会自动去掉相应的目录
+inline
+void clear_directory_cache() {
+	detail::global_directory_cache().clear();
+}
+
+inline
+bool stat_many(std::vector<file_status> &p_status,
+	       std::vector<int> &p_errnos,
+	       const std::vector<std::string> &p_paths,
+	       std::size_t p_threads = detail::BATCH_THREADS) {
+	p_status.resize(p_paths.size());
+	p_errnos.assign(p_paths.size(), 0);
+	detail::stat_op _op = {p_paths, p_status, p_errnos};
+	detail::batch_run(_op, p_paths.size(), p_threads);
+	return detail::batch_ok(p_errnos);
+}
+
+// p_exists[i]不为0表示第i项存在
+inline
+void exists_many(std::vector<char> &p_exists,
+		 const std::vector<std::string> &p_paths,
+		 std::size_t p_threads = detail::BATCH_THREADS) {
+	p_exists.assign(p_paths.size(), 0);
+	detail::exists_op _op = {p_paths, p_exists};
+	detail::batch_run(_op, p_paths.size(), p_threads);
+}
+
+inline
+bool remove_many(std::vector<int> &p_errnos,
+		 const std::vector<std::string> &p_paths,
+		 std::size_t p_threads = detail::BATCH_THREADS) {
+	p_errnos.assign(p_paths.size(), 0);
+	detail::remove_op _op = {p_paths, p_errnos};
+	detail::batch_run(_op, p_paths.size(), p_threads);
+	return detail::batch_ok(p_errnos);
+}
+
+inline
+bool create_directories_many(std::vector<int> &p_errnos,
+			     const std::vector<std::string> &p_paths,
+			     std::size_t p_threads = detail::BATCH_THREADS) {
+	p_errnos.assign(p_paths.size(), 0);
+	detail::create_directories_op _op = {p_paths, p_errnos};
+	detail::batch_run(_op, p_paths.size(), p_threads);
+	return detail::batch_ok(p_errnos);
+}
@@ -0,0 +1,556 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _BUFFER_POOL_HPP_
+#define _BUFFER_POOL_HPP_
+
+//
+// 读写用的缓冲区池，代替每次调用时分配的std::vector<char>：
+//
+//   fsutil::pooled_buffer _buffer;
+//   if(! fsutil::buffer_pool::instance().allocate(_buffer, 1024 * 1024)) ...
+//   const ssize_t _ret = gfs::readn(_file, _buffer);
+//
+// 缓冲区按2的幂分为4K到m_max_size的各级，每级从mmap得到的slab中切分，
+// 所以都至少按4K对齐，可以直接用于O_DIRECT。slab用MAP_POPULATE预先
+// 分配物理页，之后使用时不再有缺页；m_huge_pages时优先用MAP_HUGETLB，
+// 没有预留的大页时改用透明大页（madvise）。
+//
+// 每个NUMA节点一个arena，线程从所在节点的arena取缓冲区；slab由该节点
+// 上的线程映射并预先分配，按Linux默认的本地分配策略，其物理页在本节点。
+// 每个线程另有一个小缓存，释放的缓冲区先放回本线程的缓存，满了再把一半
+// 还给arena，所以同一个线程反复分配、释放时不加锁。
+//
+// 超过m_max_size的缓冲区每次单独mmap，释放时munmap。
+// pooled_buffer必须在buffer_pool销毁之前释放；线程缓存可以晚于
+// buffer_pool销毁，内存在最后一个线程缓存释放后才归还系统。
+//
+
+#include <vector>
+#include <algorithm>
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace fsutil
+{
+
+class buffer_pool;
+
+struct buffer_pool_options
+{
+        buffer_pool_options()
+                : m_max_size(64 * 1024 * 1024),
+                  m_slab_size(2 * 1024 * 1024),
+                  m_thread_cache_bytes(4 * 1024 * 1024),
+                  m_huge_pages(false),
+                  m_numa(true) {}
+
+        std::size_t m_max_size;			// 池中最大的一级，更大的单独mmap
+        std::size_t m_slab_size;		// 小于它的缓冲区从这么大的slab中切分
+        std::size_t m_thread_cache_bytes;	// 每个线程每一级最多缓存的字节数，至少一个
+        bool m_huge_pages;
+        bool m_numa;				// 为false时只有一个arena
+};
+
+struct buffer_pool_stats
+{
+        buffer_pool_stats()
+                : m_thread_hits(0),
+                  m_arena_hits(0),
+                  m_mapped_bytes(0),
+                  m_huge_page_bytes(0),
+                  m_nodes(0) {}
+
+        uint64_t m_thread_hits;		// 从线程缓存分配
+        uint64_t m_arena_hits;		// 从arena分配，包括新映射的slab
+        uint64_t m_mapped_bytes;	// 池中映射的内存，不含单独mmap的大缓冲区
+        uint64_t m_huge_page_bytes;	// 其中用MAP_HUGETLB映射的
+        std::size_t m_nodes;
+};
+
+// buffer_pool分配的缓冲区，析构时还回池中；不能复制，可以swap。
+// 它本身是只有一项的MutableBufferSequence/ConstBufferSequence，
+// 所以可以直接传给fs.ipp中的readn, writen等
+class pooled_buffer : boost::noncopyable
+{
+public:
+        typedef boost::asio::mutable_buffer value_type;
+        typedef const boost::asio::mutable_buffer *const_iterator;
+
+        pooled_buffer()
+                : m_pool(NULL),
+                  m_data(NULL),
+                  m_size(0),
+                  m_capacity(0),
+                  m_class(0),
+                  m_node(0) {}
+
+        ~pooled_buffer() {
+                reset();
+        }
+
+        // 还回池中，之后empty()
+        void reset();
+
+        void swap(pooled_buffer &p_other) {
+                std::swap(m_pool, p_other.m_pool);
+                std::swap(m_data, p_other.m_data);
+                std::swap(m_size, p_other.m_size);
+                std::swap(m_capacity, p_other.m_capacity);
+                std::swap(m_class, p_other.m_class);
+                std::swap(m_node, p_other.m_node);
+                std::swap(m_view, p_other.m_view);
+        }
+
+        bool empty() const {
+                return m_data == NULL;
+        }
+
+        char *data() const {
+                return m_data;
+        }
+
+        // allocate时要求的长度，转换为asio的buffer时使用
+        std::size_t size() const {
+                return m_size;
+        }
+
+        // 实际的长度，为所在一级的大小
+        std::size_t capacity() const {
+                return m_capacity;
+        }
+
+        // p_size不能超过capacity()，比如读到的数据比要求的少时
+        void resize(std::size_t p_size) {
+                m_size = std::min(p_size, m_capacity);
+                m_view = boost::asio::mutable_buffer(m_data, m_size);
+        }
+
+        const_iterator begin() const {
+                return &m_view;
+        }
+
+        const_iterator end() const {
+                return &m_view + 1;
+        }
+
+        operator boost::asio::mutable_buffer() const {
+                return boost::asio::mutable_buffer(m_data, m_size);
+        }
+
+        operator boost::asio::const_buffer() const {
+                return boost::asio::const_buffer(m_data, m_size);
+        }
+
+private:
+        friend class buffer_pool;
+
+        buffer_pool *m_pool;
+        char *m_data;
+        std::size_t m_size;
+        std::size_t m_capacity;
+        std::size_t m_class;
+        std::size_t m_node;
+        boost::asio::mutable_buffer m_view;	// (m_data, m_size)，作为buffer sequence的一项
+};
+
+namespace detail
+{
+
+enum {
+        BUFFER_POOL_MIN_SHIFT = 12,		// 最小的一级为4K
+        BUFFER_POOL_HUGE_PAGE = 2 * 1024 * 1024
+};
+
+// 本线程所在的NUMA节点，无法取得时为0
+inline
+std::size_t current_numa_node() {
+#ifdef SYS_getcpu
+        unsigned _cpu = 0;
+        unsigned _node = 0;
+        if(::syscall(SYS_getcpu, &_cpu, &_node, NULL) == 0)
+                return _node;
+#endif
+        return 0;
+}
+
+// /sys/devices/system/node下nodeN的最大编号加1，至少为1
+inline
+std::size_t numa_node_count() {
+        DIR *_dir = ::opendir("/sys/devices/system/node");
+        if(_dir == NULL)
+                return 1;
+        std::size_t _count = 1;
+        for(struct dirent *_entry = ::readdir(_dir); _entry != NULL; _entry = ::readdir(_dir))
+        {
+                unsigned _node = 0;
+                if(std::sscanf(_entry->d_name, "node%u", &_node) == 1)
+                        _count = std::max<std::size_t>(_count, _node + 1);
+        }
+        ::closedir(_dir);
+        return _count;
+}
+
+// p_huge_pages时先试MAP_HUGETLB，p_huge为是否成功
+inline
+char *map_memory(std::size_t p_size,
+                 bool p_huge_pages,
+                 bool &p_huge) {
+        p_huge = false;
+        void *_memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if(p_huge_pages && p_size % BUFFER_POOL_HUGE_PAGE == 0)
+        {
+                _memory = ::mmap(NULL, p_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                                 -1, 0);
+                p_huge = (_memory != MAP_FAILED);
+        }
+#endif
+        if(_memory == MAP_FAILED)
+        {
+                _memory = ::mmap(NULL, p_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+                if(_memory == MAP_FAILED)
+                        return NULL;
+#ifdef MADV_HUGEPAGE
+                if(p_huge_pages)
+                        ::madvise(_memory, p_size, MADV_HUGEPAGE);
+#endif
+        }
+        return static_cast<char*>(_memory);
+}
+
+} // namespace detail
+
+class buffer_pool : boost::noncopyable
+{
+public:
+        explicit buffer_pool(const buffer_pool_options &p_options = buffer_pool_options())
+                : m_state(new state(p_options)),
+                  m_caches(&buffer_pool::free_cache) {
+        }
+
+        // 本线程的缓存在这里释放，其它线程的在线程退出时释放
+        ~buffer_pool() {
+                m_caches.reset();
+        }
+
+        // 分配至少p_size字节的缓冲区，p_buffer原来的缓冲区先被释放。
+        // p_size为0时也分配最小的一级。失败时返回false，errno为ENOMEM
+        bool allocate(pooled_buffer &p_buffer,
+                      std::size_t p_size) {
+                p_buffer.reset();
+                state &_state = *m_state;
+                const std::size_t _class = _state.class_of(p_size);
+                if(_class == _state.m_classes)
+                        return allocate_large(p_buffer, p_size);
+
+                thread_cache &_cache = get_cache();
+                std::vector<char*> &_free = _cache.m_free[_class];
+                char *_data = NULL;
+                if(! _free.empty())
+                {
+                        _data = _free.back();
+                        _free.pop_back();
+                        ++ _state.m_thread_hits;
+                }
+                else
+                {
+                        _data = _state.take(_cache.m_node, _class, _free,
+                                            _cache.m_limit[_class] / 2);
+                        if(_data == NULL)
+                        {
+                                errno = ENOMEM;
+                                return false;
+                        }
+                        ++ _state.m_arena_hits;
+                }
+                fill(p_buffer, _data, p_size, _class, _cache.m_node);
+                return true;
+        }
+
+        buffer_pool_stats stats() const {
+                buffer_pool_stats _stats;
+                _stats.m_thread_hits = m_state->m_thread_hits;
+                _stats.m_arena_hits = m_state->m_arena_hits;
+                _stats.m_mapped_bytes = m_state->m_mapped_bytes;
+                _stats.m_huge_page_bytes = m_state->m_huge_page_bytes;
+                _stats.m_nodes = m_state->m_nodes;
+                return _stats;
+        }
+
+        // 把本线程缓存的缓冲区还给arena，比如线程将长时间不再读写时
+        void trim() {
+                thread_cache *_cache = m_caches.get();
+                if(_cache != NULL)
+                        _cache->flush();
+        }
+
+        // 全局的池，从不销毁，所以可以在任何线程中使用
+        static buffer_pool &instance() {
+                static buffer_pool *_pool = new buffer_pool();
+                return *_pool;
+        }
+
+private:
+        friend class pooled_buffer;
+
+        // 各线程共享的部分，线程缓存也持有它，所以可以晚于buffer_pool释放
+        struct state : boost::noncopyable
+        {
+                struct free_list
+                {
+                        boost::mutex m_mutex;
+                        std::vector<char*> m_buffers;
+                        char m_padding[64];	// 避免与相邻的free_list共享缓存行
+                };
+
+                explicit state(const buffer_pool_options &p_options)
+                        : m_options(p_options),
+                          m_nodes(p_options.m_numa ? detail::numa_node_count() : 1),
+                          m_classes(0),
+                          m_thread_hits(0),
+                          m_arena_hits(0),
+                          m_mapped_bytes(0),
+                          m_huge_page_bytes(0) {
+                        while((std::size_t(1) << (detail::BUFFER_POOL_MIN_SHIFT + m_classes)) <
+                              std::max<std::size_t>(m_options.m_max_size,
+                                                    std::size_t(1) << detail::BUFFER_POOL_MIN_SHIFT))
+                        {
+                                ++ m_classes;
+                        }
+                        ++ m_classes;
+                        m_options.m_slab_size = std::max(m_options.m_slab_size,
+                                                         class_size(0));
+                        m_lists.reset(new free_list[m_nodes * m_classes]);
+                }
+
+                ~state() {
+                        for(std::size_t i = 0; i < m_slabs.size(); ++i)
+                        {
+                                ::munmap(m_slabs[i].first, m_slabs[i].second);
+                        }
+                }
+
+                std::size_t class_size(std::size_t p_class) const {
+                        return std::size_t(1) << (detail::BUFFER_POOL_MIN_SHIFT + p_class);
+                }
+
+                // 能容纳p_size的最小一级，超过m_max_size时为m_classes
+                std::size_t class_of(std::size_t p_size) const {
+                        std::size_t _class = 0;
+                        while(_class < m_classes && class_size(_class) < p_size)
+                        {
+                                ++ _class;
+                        }
+                        return _class;
+                }
+
+                free_list &get_list(std::size_t p_node,
+                                    std::size_t p_class) {
+                        return m_lists[p_node * m_classes + p_class];
+                }
+
+                // 从arena取一个缓冲区，另外最多p_extra个放入p_cache；
+                // arena为空时映射新的slab
+                char *take(std::size_t p_node,
+                           std::size_t p_class,
+                           std::vector<char*> &p_cache,
+                           std::size_t p_extra) {
+                        free_list &_list = get_list(p_node, p_class);
+                        boost::mutex::scoped_lock _lock(_list.m_mutex);
+                        if(_list.m_buffers.empty() && ! map_slab(p_class, _list.m_buffers))
+                                return NULL;
+                        char * const _data = _list.m_buffers.back();
+                        _list.m_buffers.pop_back();
+                        const std::size_t _extra = std::min(p_extra, _list.m_buffers.size());
+                        p_cache.insert(p_cache.end(), _list.m_buffers.end() - _extra,
+                                       _list.m_buffers.end());
+                        _list.m_buffers.resize(_list.m_buffers.size() - _extra);
+                        return _data;
+                }
+
+                void give(std::size_t p_node,
+                          std::size_t p_class,
+                          char *const *p_buffers,
+                          std::size_t p_count) {
+                        free_list &_list = get_list(p_node, p_class);
+                        boost::mutex::scoped_lock _lock(_list.m_mutex);
+                        _list.m_buffers.insert(_list.m_buffers.end(), p_buffers,
+                                               p_buffers + p_count);
+                }
+
+                // 在调用者的线程中映射并预先分配物理页，所以在调用者所在的节点上
+                bool map_slab(std::size_t p_class,
+                              std::vector<char*> &p_buffers) {
+                        const std::size_t _size = class_size(p_class);
+                        const std::size_t _slab_size = std::max(_size, m_options.m_slab_size);
+                        bool _huge = false;
+                        char * const _slab = detail::map_memory(_slab_size, m_options.m_huge_pages,
+                                                                _huge);
+                        if(_slab == NULL)
+                                return false;
+                        {
+                                boost::mutex::scoped_lock _lock(m_slabs_mutex);
+                                m_slabs.push_back(std::make_pair(_slab, _slab_size));
+                        }
+                        m_mapped_bytes += _slab_size;
+                        if(_huge)
+                                m_huge_page_bytes += _slab_size;
+                        for(std::size_t _offset = 0; _offset + _size <= _slab_size; _offset += _size)
+                        {
+                                p_buffers.push_back(_slab + _offset);
+                        }
+                        return true;
+                }
+
+                buffer_pool_options m_options;
+                const std::size_t m_nodes;
+                std::size_t m_classes;
+                boost::scoped_array<free_list> m_lists;	// [节点][级]
+                boost::mutex m_slabs_mutex;
+                std::vector<std::pair<char*, std::size_t> > m_slabs;
+                boost::atomic<uint64_t> m_thread_hits;
+                boost::atomic<uint64_t> m_arena_hits;
+                boost::atomic<uint64_t> m_mapped_bytes;
+                boost::atomic<uint64_t> m_huge_page_bytes;
+        };
+
+        struct thread_cache : boost::noncopyable
+        {
+                explicit thread_cache(const boost::shared_ptr<state> &p_state)
+                        : m_state(p_state),
+                          m_node(detail::current_numa_node() % p_state->m_nodes),
+                          m_free(p_state->m_classes),
+                          m_limit(p_state->m_classes) {
+                        for(std::size_t i = 0; i < m_limit.size(); ++i)
+                        {
+                                m_limit[i] = std::max<std::size_t>(
+                                        m_state->m_options.m_thread_cache_bytes /
+                                        m_state->class_size(i), 1);
+                        }
+                }
+
+                ~thread_cache() {
+                        flush();
+                }
+
+                void flush() {
+                        for(std::size_t i = 0; i < m_free.size(); ++i)
+                        {
+                                if(! m_free[i].empty())
+                                        m_state->give(m_node, i, &m_free[i][0], m_free[i].size());
+                                m_free[i].clear();
+                        }
+                }
+
+                const boost::shared_ptr<state> m_state;
+                const std::size_t m_node;
+                std::vector<std::vector<char*> > m_free;	// 每级空闲的缓冲区
+                std::vector<std::size_t> m_limit;		// 每级最多缓存的个数
+        };
+
+        static void free_cache(thread_cache *p_cache) {
+                delete p_cache;
+        }
+
+        thread_cache &get_cache() {
+                thread_cache *_cache = m_caches.get();
+                if(_cache == NULL)
+                {
+                        _cache = new thread_cache(m_state);
+                        m_caches.reset(_cache);
+                }
+                return *_cache;
+        }
+
+        void fill(pooled_buffer &p_buffer,
+                  char *p_data,
+                  std::size_t p_size,
+                  std::size_t p_class,
+                  std::size_t p_node) {
+                p_buffer.m_pool = this;
+                p_buffer.m_data = p_data;
+                p_buffer.m_size = p_size;
+                p_buffer.m_capacity = (p_class == m_state->m_classes)
+                        ? p_size : m_state->class_size(p_class);
+                p_buffer.m_class = p_class;
+                p_buffer.m_node = p_node;
+                p_buffer.m_view = boost::asio::mutable_buffer(p_data, p_size);
+        }
+
+        bool allocate_large(pooled_buffer &p_buffer,
+                            std::size_t p_size) {
+                bool _huge = false;
+                char * const _data = detail::map_memory(p_size, m_state->m_options.m_huge_pages,
+                                                        _huge);
+                if(_data == NULL)
+                {
+                        errno = ENOMEM;
+                        return false;
+                }
+                fill(p_buffer, _data, p_size, m_state->m_classes, 0);
+                return true;
+        }
+
+        // 其它节点的缓冲区直接还给所在的arena；本线程的缓存满时把一半还给arena
+        void release(pooled_buffer &p_buffer) {
+                state &_state = *m_state;
+                if(p_buffer.m_class == _state.m_classes)
+                {
+                        ::munmap(p_buffer.m_data, p_buffer.m_capacity);
+                        return;
+                }
+                thread_cache &_cache = get_cache();
+                if(p_buffer.m_node != _cache.m_node)
+                {
+                        _state.give(p_buffer.m_node, p_buffer.m_class, &p_buffer.m_data, 1);
+                        return;
+                }
+                std::vector<char*> &_free = _cache.m_free[p_buffer.m_class];
+                _free.push_back(p_buffer.m_data);
+                const std::size_t _limit = _cache.m_limit[p_buffer.m_class];
+                if(_free.size() > _limit)
+                {
+                        const std::size_t _keep = _limit / 2;
+                        _state.give(_cache.m_node, p_buffer.m_class, &_free[_keep],
+                                    _free.size() - _keep);
+                        _free.resize(_keep);
+                }
+        }
+
+        const boost::shared_ptr<state> m_state;
+        boost::thread_specific_ptr<thread_cache> m_caches;
+};
+
+inline
+void pooled_buffer::reset() {
+        if(m_data != NULL)
+                m_pool->release(*this);
+        m_pool = NULL;
+        m_data = NULL;
+        m_size = 0;
+        m_capacity = 0;
+        m_class = 0;
+        m_node = 0;
+        m_view = boost::asio::mutable_buffer();
+}
+
+} // namespace fsutil
+
+#endif	// _BUFFER_POOL_HPP_
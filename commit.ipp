@@ -0,0 +1,317 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _FILESYSTEM_HPP_
+#error "commit.ipp can ONLY be included into fs.hpp"
+#endif
+
+//
+// 持久的发布文件：先写到临时路径，sync之后rename到目标路径，再sync
+// 所在的目录。崩溃之后目标路径要么是旧的内容，要么是完整的新内容。
+//
+
+namespace detail
+{
+
+// p_path所在的目录，没有'/'时为当前目录
+inline
+std::string parent_directory(const std::string &p_path) {
+	const std::string::size_type _end = p_path.find_last_not_of('/');
+	if(_end == std::string::npos)
+		return "/";
+	const std::string::size_type _pos = p_path.rfind('/', _end);
+	if(_pos == std::string::npos)
+		return ".";
+	if(_pos == 0)
+		return "/";
+	return p_path.substr(0, _pos);
+}
+
+inline
+bool sync_file(file_t p_file,
+	       bool p_data_only) {
+	return p_data_only ? datasync(p_file) : sync(p_file);
+}
+
+struct commit_request
+{
+	file_t m_file;
+	const std::string *m_tmp_path;	// 为空时只sync
+	const std::string *m_path;
+	int m_errno;
+	bool m_done;
+};
+
+// 前m_requests.size()项sync文件，之后的项sync目录
+struct commit_sync_op
+{
+	const std::vector<commit_request*> &m_requests;
+	const std::vector<std::string> &m_dirs;
+	std::vector<int> &m_dir_errnos;
+	const bool m_data_only;
+
+	void operator()(std::size_t p_index) {
+		if(p_index < m_requests.size())
+		{
+			commit_request &_request = *m_requests[p_index];
+			if(! sync_file(_request.m_file, m_data_only))
+				_request.m_errno = get_errno();
+			return;
+		}
+		p_index -= m_requests.size();
+		m_dir_errnos[p_index] = sync_directory(m_dirs[p_index])
+			? 0 : get_errno();
+	}
+};
+
+} // namespace detail
+
+// 单个文件的发布：sync p_file，p_tmp_path rename为p_path，再sync
+// 涉及的目录。每个文件至少要两次sync，大量小文件时用group_committer。
+// 不关闭p_file
+inline
+bool publish(file_t p_file,
+	     const std::string &p_tmp_path,
+	     const std::string &p_path,
+	     bool p_data_only = false) {
+	if(! detail::sync_file(p_file, p_data_only))
+		return false;
+	if(! rename(p_tmp_path, p_path))
+		return false;
+	const std::string _dir = detail::parent_directory(p_path);
+	const std::string _tmp_dir = detail::parent_directory(p_tmp_path);
+	return sync_directory(_dir) &&
+		(_tmp_dir == _dir || sync_directory(_tmp_dir));
+}
+
+//
+// publish的group commit：多个线程写好各自的临时文件后调用commit，
+// 后台线程把同时等待的请求合成一批，每一轮：
+//   1. 并行sync这一批的文件和上一批rename涉及的目录（每个目录一次），
+//      内核可以把它们合进同一次日志提交；p_use_syncfs时改为对整个
+//      文件系统做一次syncfs
+//   2. 上一批的commit返回
+//   3. 这一批sync成功的文件按到达的顺序rename到目标路径
+// 所以连续提交时每一轮只有一次并行的sync（或一次syncfs），上一轮
+// 进行期间到达的请求进入下一批，并发的写越多，每个文件分摊的sync越少。
+//
+// sync失败的文件不会rename，目标路径保持原样。commit不关闭文件。
+// p_use_syncfs时所有文件需要在同一个文件系统上。
+//
+class group_committer : boost::noncopyable
+{
+public:
+	struct stats
+	{
+		uint64_t m_commits;
+		uint64_t m_rounds;	// 每轮sync一次，见上
+		uint64_t m_syncs;	// sync, syncfs, sync_directory的次数
+		uint64_t m_errors;	// 失败的commit
+	};
+
+	// p_linger_us: 一批的第一个请求到达后最多再等多久以凑成更大的
+	// 一批，0表示不等待；p_threads: 并行sync的线程数
+	explicit group_committer(std::size_t p_max_batch = 1024,
+				 unsigned p_linger_us = 0,
+				 bool p_use_syncfs = false,
+				 bool p_data_only = false,
+				 std::size_t p_threads = detail::BATCH_THREADS)
+		: m_max_batch(p_max_batch == 0 ? 1 : p_max_batch),
+		  m_linger_us(p_linger_us),
+		  m_use_syncfs(p_use_syncfs),
+		  m_data_only(p_data_only),
+		  m_threads(p_threads == 0 ? 1 : p_threads),
+		  m_stop(false),
+		  m_stats(stats()),
+		  m_thread(boost::bind(&group_committer::run, this)) {}
+
+	// 等待已提交的请求完成；此时不能再有新的commit
+	~group_committer() {
+		{
+			boost::mutex::scoped_lock _lock(m_mutex);
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		m_thread.join();
+	}
+
+	// 持久化p_file并把p_tmp_path rename为p_path，完成后返回；
+	// 失败时错误码见get_errno()
+	bool commit(file_t p_file,
+		    const std::string &p_tmp_path,
+		    const std::string &p_path) {
+		detail::commit_request _request = {p_file, &p_tmp_path, &p_path, 0, false};
+		return wait(_request);
+	}
+
+	// 只持久化p_file，用于覆盖写已有的文件
+	bool commit(file_t p_file) {
+		const std::string _empty;
+		detail::commit_request _request = {p_file, &_empty, &_empty, 0, false};
+		return wait(_request);
+	}
+
+	stats get_stats() const {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		return m_stats;
+	}
+
+private:
+	typedef std::vector<detail::commit_request*> request_list;
+
+	bool wait(detail::commit_request &p_request) {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		m_pending.push_back(&p_request);
+		m_cond.notify_all();
+		while(! p_request.m_done)
+		{
+			m_done_cond.wait(_lock);
+		}
+		if(p_request.m_errno != 0)
+		{
+			set_errno(p_request.m_errno);
+			return false;
+		}
+		return true;
+	}
+
+	void run() {
+		request_list _batch;
+		request_list _renamed;	// 上一轮rename的，等待sync目录
+		request_list _done;
+		boost::mutex::scoped_lock _lock(m_mutex);
+		for(;;)
+		{
+			while(m_pending.empty() && _renamed.empty() && ! m_stop)
+			{
+				m_cond.wait(_lock);
+			}
+			if(m_pending.empty() && _renamed.empty())
+				return; // m_stop
+
+			// 有等待sync目录的请求时不再等待
+			if(m_linger_us != 0 && _renamed.empty())
+			{
+				const boost::system_time _deadline = boost::get_system_time() +
+					boost::posix_time::microseconds(m_linger_us);
+				while(m_pending.size() < m_max_batch && ! m_stop &&
+				      m_cond.timed_wait(_lock, _deadline))
+				{
+				}
+			}
+
+			const std::size_t _count = std::min(m_pending.size(), m_max_batch);
+			_batch.assign(m_pending.begin(), m_pending.begin() + _count);
+			m_pending.erase(m_pending.begin(), m_pending.begin() + _count);
+			_lock.unlock();
+
+			const uint64_t _syncs = commit_round(_batch, _renamed, _done);
+
+			_lock.lock();
+			++ m_stats.m_rounds;
+			m_stats.m_syncs += _syncs;
+			for(std::size_t i = 0; i < _done.size(); ++i)
+			{
+				++ m_stats.m_commits;
+				if(_done[i]->m_errno != 0)
+					++ m_stats.m_errors;
+				_done[i]->m_done = true;
+			}
+			_done.clear();
+			m_done_cond.notify_all();
+		}
+	}
+
+	// sync p_batch和p_renamed的目录，完成的请求移到p_done，
+	// p_batch中rename了的移到p_renamed；返回sync的次数
+	uint64_t commit_round(const request_list &p_batch,
+			      request_list &p_renamed,
+			      request_list &p_done) {
+		// 目录 -> sync的错误
+		typedef std::map<std::string, int> dir_map;
+		dir_map _dirs;
+		for(std::size_t i = 0; i < p_renamed.size(); ++i)
+		{
+			_dirs[detail::parent_directory(*p_renamed[i]->m_path)] = 0;
+			_dirs[detail::parent_directory(*p_renamed[i]->m_tmp_path)] = 0;
+		}
+
+		uint64_t _syncs = 0;
+		if(m_use_syncfs)
+		{
+			++ _syncs;
+			const file_t _file = p_batch.empty() ? p_renamed[0]->m_file : p_batch[0]->m_file;
+			if(! syncfs(_file))
+			{
+				const int _errno = get_errno();
+				fail_all(p_batch, _errno);
+				fail_all(p_renamed, _errno);
+			}
+		}
+		else
+		{
+			std::vector<std::string> _names;
+			_names.reserve(_dirs.size());
+			for(dir_map::iterator _iter = _dirs.begin(); _iter != _dirs.end(); ++_iter)
+			{
+				_names.push_back(_iter->first);
+			}
+			std::vector<int> _errnos(_names.size(), 0);
+			detail::commit_sync_op _op = {p_batch, _names, _errnos, m_data_only};
+			_syncs = p_batch.size() + _names.size();
+			detail::batch_run(_op, _syncs, m_threads);
+			for(std::size_t i = 0; i < _names.size(); ++i)
+			{
+				_dirs[_names[i]] = _errnos[i];
+			}
+			for(std::size_t i = 0; i < p_renamed.size(); ++i)
+			{
+				detail::commit_request &_request = *p_renamed[i];
+				const int _errno = _dirs[detail::parent_directory(*_request.m_path)];
+				const int _tmp_errno = _dirs[detail::parent_directory(*_request.m_tmp_path)];
+				if(_request.m_errno == 0)
+					_request.m_errno = (_errno != 0) ? _errno : _tmp_errno;
+			}
+		}
+		p_done.insert(p_done.end(), p_renamed.begin(), p_renamed.end());
+		p_renamed.clear();
+
+		for(std::size_t i = 0; i < p_batch.size(); ++i)
+		{
+			detail::commit_request &_request = *p_batch[i];
+			if(_request.m_errno == 0 && ! _request.m_tmp_path->empty())
+			{
+				if(rename(*_request.m_tmp_path, *_request.m_path))
+				{
+					p_renamed.push_back(&_request);
+					continue;
+				}
+				_request.m_errno = get_errno();
+			}
+			p_done.push_back(&_request);
+		}
+		return _syncs;
+	}
+
+	// 已经有错误的请求保留第一个错误
+	static void fail_all(const request_list &p_requests,
+			     int p_errno) {
+		for(std::size_t i = 0; i < p_requests.size(); ++i)
+		{
+			if(p_requests[i]->m_errno == 0)
+				p_requests[i]->m_errno = (p_errno == 0) ? EIO : p_errno;
+		}
+	}
+
+	const std::size_t m_max_batch;
+	const unsigned m_linger_us;
+	const bool m_use_syncfs;
+	const bool m_data_only;
+	const std::size_t m_threads;
+	bool m_stop;
+	std::deque<detail::commit_request*> m_pending;
+	stats m_stats;
+	mutable boost::mutex m_mutex;
+	boost::condition_variable m_cond;	// 有新的请求或m_stop
+	boost::condition_variable m_done_cond;	// 一轮完成
+	boost::thread m_thread;
+};
@@ -3,14 +3,66 @@
 #ifndef _FILESYSTEM_HPP_
 #define _FILESYSTEM_HPP_
 
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <climits>
+
 #include <boost/filesystem/path.hpp>
 #include <boost/asio/buffer.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
+
+#include "walk.hpp"
 
 #include "localfs.hpp"
 // 向命名空间中加入一些其它便利的操作
 namespace localfs
 {
 #include "fs.ipp"		
+#include "appender.ipp"
+#include "readahead.ipp"
+#include "backend.ipp"
+#include "walk.ipp"
+#include "batch.ipp"
+#include "handle_cache.ipp"
+#include "commit.ipp"
+}
+
+#include "gfs.hpp"
+namespace gfs
+{
+#include "fs.ipp"
+#include "appender.ipp"
+#include "readahead.ipp"
+#include "backend.ipp"
+#include "walk.ipp"
+#include "batch.ipp"
+#include "handle_cache.ipp"
+#include "commit.ipp"
+}
+
+#include "memfs.hpp"
+namespace memfs
+{
+#include "fs.ipp"
+#include "appender.ipp"
+#include "readahead.ipp"
+#include "backend.ipp"
+#include "walk.ipp"
+#include "batch.ipp"
+#include "handle_cache.ipp"
+#include "commit.ipp"
 }
 
 /*
@@ -1,6 +1,6 @@
 // -*-mode:c++; coding:utf-8-*-
 
-#ifndef _XBASE_FILESYSTEM_HPP_
+#ifndef _FILESYSTEM_HPP_
 #error "fs.ipp can ONLY be included into fs.hpp"
 #endif
 
@@ -131,6 +131,16 @@ bool mkdir(const path &p_path) {
 	return mkdir(p_path.string());
 }
 
+inline
+bool sync_directory(const std::string &p_path) {
+	return sync_directory(p_path.c_str());
+}
+
+inline
+bool sync_directory(const path &p_path) {
+	return sync_directory(p_path.string());
+}
+
 template<typename FileInfoContainer>
 inline
 bool list_files(FileInfoContainer &p_infos,
@@ -189,31 +199,65 @@ ssize_t writen(file_t p_file,
 		      boost::asio::buffer_size(p_buffer));
 }
 
+// 跳过iov中已经处理的p_bytes字节，p_count同时更新为剩余的个数
+inline
+iovec_t *iovec_advance(iovec_t *p_iov,
+		       size_t &p_count,
+		       size_t p_bytes) {
+	while((p_count > 0) && (p_bytes >= p_iov->iov_len))
+	{
+		p_bytes -= p_iov->iov_len;
+		++ p_iov;
+		-- p_count;
+	}
+	if(p_count > 0)
+	{
+		p_iov->iov_base = static_cast<char*>(p_iov->iov_base) + p_bytes;
+		p_iov->iov_len -= p_bytes;
+	}
+	return p_iov;
+}
+
 template<typename MutableBufferSequence>
 inline
 ssize_t readn(file_t p_file,
 	      const MutableBufferSequence &p_buffer) {
+	iovec_t bufs[MAX_IOVEC_LEN];
 	typename MutableBufferSequence::const_iterator iter = p_buffer.begin();
 	typename MutableBufferSequence::const_iterator end = p_buffer.end();
-	ssize_t total_bytes_readed = 0;
-	for(;iter != end; ++ iter)
+	ssize_t all_bytes_readed = 0;
+	while(iter != end)
 	{
-		boost::asio::mutable_buffer buffer(*iter);
-		ssize_t bytes_readed = readn(p_file, buffer);
-		if(bytes_readed < (ssize_t)boost::asio::buffer_size(buffer)) // maybe end or error
-		{
-			return total_bytes_readed == 0 ? bytes_readed : total_bytes_readed;
-		}
-		else if(bytes_readed == 0) // end
+		size_t i = 0;
+		size_t total_buffer_size = 0;
+		for(i = 0; (iter != end) && (i < MAX_IOVEC_LEN); ++i, ++iter)
 		{
-			return total_bytes_readed;
+			boost::asio::mutable_buffer buffer(*iter);
+			iovec_init(bufs[i],
+				   boost::asio::buffer_cast<void*>(buffer),
+				   boost::asio::buffer_size(buffer));
+			total_buffer_size += boost::asio::buffer_size(buffer);
 		}
-		else
+		iovec_t *iov = bufs;
+		size_t bytes_readed = 0;
+		while(bytes_readed < total_buffer_size)
 		{
-			total_bytes_readed += bytes_readed;
+			ssize_t ret = readv(p_file, iov, i);
+			if(ret < 0) // error
+			{
+				all_bytes_readed += bytes_readed;
+				return (all_bytes_readed == 0) ? ret : all_bytes_readed;
+			}
+			else if(ret == 0) // end
+			{
+				return all_bytes_readed + bytes_readed;
+			}
+			bytes_readed += ret;
+			iov = iovec_advance(iov, i, ret);
 		}
+		all_bytes_readed += bytes_readed;
 	}
-	return total_bytes_readed;
+	return all_bytes_readed;
 }
 
 template<typename ConstBufferSequence>
@@ -255,3 +299,112 @@ ssize_t writen(file_t p_file,
 	}
 	return all_bytes_wrote;
 }
+
+//
+// preadn, pwriten 的buffer序列版本，每次最多MAX_IOVEC_LEN个
+// buffer合并为一次preadv/pwritev，不更新文件指针
+//
+
+inline
+ssize_t preadn(file_t p_file,
+	       const boost::asio::mutable_buffer &p_buffer,
+	       offset_t p_offset) {
+	return preadn(p_file,
+		      boost::asio::buffer_cast<char*>(p_buffer),
+		      boost::asio::buffer_size(p_buffer),
+		      p_offset);
+}
+
+inline
+ssize_t pwriten(file_t p_file,
+		const boost::asio::const_buffer &p_buffer,
+		offset_t p_offset) {
+	return pwriten(p_file,
+		       boost::asio::buffer_cast<const char*>(p_buffer),
+		       boost::asio::buffer_size(p_buffer),
+		       p_offset);
+}
+
+template<typename MutableBufferSequence>
+inline
+ssize_t preadn(file_t p_file,
+	       const MutableBufferSequence &p_buffer,
+	       offset_t p_offset) {
+	iovec_t bufs[MAX_IOVEC_LEN];
+	typename MutableBufferSequence::const_iterator iter = p_buffer.begin();
+	typename MutableBufferSequence::const_iterator end = p_buffer.end();
+	ssize_t all_bytes_readed = 0;
+	while(iter != end)
+	{
+		size_t i = 0;
+		size_t total_buffer_size = 0;
+		for(i = 0; (iter != end) && (i < MAX_IOVEC_LEN); ++i, ++iter)
+		{
+			boost::asio::mutable_buffer buffer(*iter);
+			iovec_init(bufs[i],
+				   boost::asio::buffer_cast<void*>(buffer),
+				   boost::asio::buffer_size(buffer));
+			total_buffer_size += boost::asio::buffer_size(buffer);
+		}
+		iovec_t *iov = bufs;
+		size_t bytes_readed = 0;
+		while(bytes_readed < total_buffer_size)
+		{
+			ssize_t ret = preadv(p_file, iov, i,
+					     p_offset + all_bytes_readed + bytes_readed);
+			if(ret < 0) // error
+			{
+				all_bytes_readed += bytes_readed;
+				return (all_bytes_readed == 0) ? ret : all_bytes_readed;
+			}
+			else if(ret == 0) // end
+			{
+				return all_bytes_readed + bytes_readed;
+			}
+			bytes_readed += ret;
+			iov = iovec_advance(iov, i, ret);
+		}
+		all_bytes_readed += bytes_readed;
+	}
+	return all_bytes_readed;
+}
+
+template<typename ConstBufferSequence>
+inline
+ssize_t pwriten(file_t p_file,
+		const ConstBufferSequence &p_buffer,
+		offset_t p_offset) {
+	iovec_t bufs[MAX_IOVEC_LEN];
+	typename ConstBufferSequence::const_iterator iter = p_buffer.begin();
+	typename ConstBufferSequence::const_iterator end = p_buffer.end();
+	ssize_t all_bytes_wrote = 0;
+	while(iter != end)
+	{
+		size_t i = 0;
+		size_t total_buffer_size = 0;
+		for(i = 0; (iter != end) && (i < MAX_IOVEC_LEN); ++i, ++iter)
+		{
+			boost::asio::const_buffer buffer(*iter);
+			iovec_init(bufs[i],
+				   const_cast<void*>(boost::asio::buffer_cast<const void*>(buffer)),
+				   boost::asio::buffer_size(buffer));
+			total_buffer_size += boost::asio::buffer_size(buffer);
+		}
+		iovec_t *iov = bufs;
+		size_t bytes_wrote = 0;
+		while(bytes_wrote < total_buffer_size)
+		{
+			ssize_t ret = pwritev(p_file, iov, i,
+					      p_offset + all_bytes_wrote + bytes_wrote);
+			if(ret <= 0) // error
+			{
+				all_bytes_wrote += bytes_wrote;
+				return (all_bytes_wrote == 0) ? ret : all_bytes_wrote;
+			}
+			bytes_wrote += ret;
+			iov = iovec_advance(iov, i, ret);
+		}
+		all_bytes_wrote += bytes_wrote;
+	}
+	return all_bytes_wrote;
+}
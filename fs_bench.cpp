@@ -0,0 +1,1811 @@
+// -*-mode:c++; coding:utf-8-*-
+
+//
+// 文件系统性能测试，类似fio，只使用fs.ipp中的公共接口，所以可以
+// 测试任何包含了fs.ipp的文件系统。每个测试结果输出为一行JSON，
+// 包括吞吐量和延迟的p50/p99/p999，便于对比每次修改前后的性能。
+//
+// 编译：
+//   g++ -O2 -I. -I<gfs_client所在目录> fs_bench.cpp -o fs_bench
+//       -lboost_thread -lboost_filesystem -lboost_system -lpthread <gfs client库>
+// 加上-DFS_METRICS_ENABLED时，最后一行额外输出fsutil::snapshot()的结果。
+//
+// 用法：
+//   fs_bench --backend localfs --dir /data/bench --threads 4
+//            --bs 4k,64k,1m --size 256m --workloads all
+//
+// 测试项：
+//   seqwrite   每个线程用writen顺序写一个--size大小的文件
+//   seqread    每个线程用readn顺序读自己的文件
+//   prealloc   同seqwrite，但先用preallocate分配--size大小的空间
+//   scan       同seqread，但先advise(AT_SEQUENTIAL)，每读16m用AT_DONTNEED
+//              丢弃已读过的部分
+//   randread   每个线程用preadn在自己的文件中随机读--ops次
+//   randread_shared  同randread，但所有线程通过同一个file_t读第一个线程
+//              的文件；gfs的pread不能共享file_t（CONCURRENT_PREAD），
+//              每个线程打开自己的
+//   randwrite  每个线程用pwriten在自己的文件中随机写--ops次
+//   asyncread  只有localfs：同randread，但每个线程用localfs_async::ring
+//              保持--depths中的每个深度的请求在途，结果为asyncread.qdN；
+//              不能使用io_uring时为asyncread_pool.qdN（线程池）。
+//              与同样--threads的randread（阻塞的pread）对比
+//   append     每个线程用append写--size大小的文件
+//   appender   同append，但经过buffered_appender合并
+//   readahead  同seqread，但经过readahead_reader
+//   reopen     每个线程--ops次：打开自己的文件，随机preadn一块，关闭
+//   reopen_cached  同reopen，但经过handle_cache
+//   directwrite  同seqwrite，但localfs用MT_O_DIRECT和direct_writer写direct.N，
+//              其它文件系统没有O_DIRECT，同seqwrite
+//   rangeread  每个线程用range_reader读自己的文件，--handles个句柄并行，
+//              块大小为--bs
+//   publish    每个线程--files次：写一个--bs大小的临时文件，用publish
+//              sync后rename到同一个目录中，再sync目录
+//   groupcommit  同publish，但经过所有线程共用的group_committer
+//   groupsyncfs  同groupcommit，但每批用syncfs代替逐个文件的sync
+//   copy       每个线程复制自己的文件，localfs使用copy_file，
+//              其它文件系统用readn/writen
+//   copybuf    同copy，但localfs::copy_file只用pread/pwrite，作为对照
+//   create     每个线程在自己的目录中创建--files个空文件
+//   stat       每个线程随机stat上面的文件--ops次
+//   stat_cached  同stat，但gfs打开enable_metadata_cache，其它文件系统
+//              没有元数据缓存，同stat
+//   listdir    每个线程list_files自己的目录--rounds次
+//   listdir_scale  对--entries中的每个文件数N，建立有N个空文件的目录，
+//              每个线程list_files它--rounds次；再作为对照，每次list_files
+//              之后stat每一项（相当于按名字逐项lstat的实现），结果为
+//              listdir_stat。这两项的block_size为N
+//   delete     每个线程remove自己创建的文件
+//   rmtree     建立有64个子目录、每个子目录--files个文件的树（不计时），
+//              用一次remove删除；ops为删除的文件和目录数
+//   rmtree_parallel  同rmtree，但localfs用remove(path, --threads)并行删除，
+//              其它文件系统没有并行的remove，同rmtree
+//   delete_cached  同delete，但gfs打开元数据缓存，用来代替delete，
+//              测量remove使缓存失效的开销
+// copy, copybuf和后面各项与块大小无关，输出中block_size为0；stat, listdir,
+// delete等使用create建立的文件，需要排在create之后。
+//
+// 目录很大时list_files的开销：
+//   fs_bench --dir /data/bench --entries 10000,100000,1000000 --rounds 3
+//            --workloads listdir_scale
+//
+// 每项的rpc_saved为元数据缓存省去的远程调用数（stat_cached, delete_cached
+// 以外为0），比如比较gfs有无元数据缓存时的stat：
+//   fs_bench --backend gfs --dir /bench --threads 8 --ops 100000
+//            --workloads create,stat,stat_cached,delete_cached
+//
+// --sparse时读、复制测试使用的文件每16m中只有开头1m有数据，其余为空洞，
+// 比如比较copy和copybuf在稀疏文件上的差别：
+//   fs_bench --dir /data/bench --size 4g --workloads copy,copybuf
+//   fs_bench --dir /data/bench --size 4g --workloads copy,copybuf --sparse
+//
+// 每项的page_cache_mb为测试前后/proc/meminfo中Cached的变化，比如比较
+// 普通写和O_DIRECT写对page cache的影响：
+//   fs_bench --dir /data/bench --size 4g --bs 1m --workloads seqwrite,directwrite
+// 或者顺序扫描时是否丢弃已读过的页：
+//   fs_bench --dir /data/bench --size 4g --bs 1m --workloads seqread,scan
+//
+// publish, groupcommit的ops_per_sec即每秒发布的文件数；group commit
+// 需要多个线程同时提交才能合批，比如：
+//   fs_bench --dir /data/bench --threads 32 --files 200 --bs 4k
+//            --workloads publish,groupcommit,groupsyncfs
+//
+// 增加别的文件系统：在下面的FS_BENCH_BACKEND之后加一行，
+// 并在main中的分派处加上对应的名字。
+//
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>		// for POSIX_FADV_*
+#include <unistd.h>
+
+#include <boost/bind/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "fs.hpp"
+#include "range_reader.hpp"
+#include "localfs_async.hpp"
+
+// 把一个文件系统命名空间包装为测试使用的接口
+#define FS_BENCH_BACKEND(ns)						\
+        struct ns##_backend						\
+        {								\
+                typedef ns::file_t file_t;				\
+                typedef ns::file_status file_status;			\
+                typedef ns::file_info file_info;			\
+                typedef ns::buffered_appender appender;			\
+                typedef ns::readahead_reader reader;			\
+                typedef ns::handle_cache handle_cache;			\
+                typedef fsutil::range_reader<ns::backend> range_reader;	\
+                typedef ns::group_committer committer;			\
+                static const bool concurrent_pread = ns::CONCURRENT_PREAD; \
+                static const char *name() {				\
+                        return #ns;					\
+                }							\
+                static void init(const std::string &p_conf) {		\
+                        ns::init(p_conf);				\
+                }							\
+                static bool is_bad(file_t p_file) {			\
+                        return p_file == ns::BAD_FILE;			\
+                }							\
+                static file_t open_read(const std::string &p_path) {	\
+                        return ns::open(p_path, ns::MT_O_RDONLY);	\
+                }							\
+                static file_t open_rdwr(const std::string &p_path) {	\
+                        return ns::open(p_path, ns::MT_O_RDWR);		\
+                }							\
+                static file_t create(const std::string &p_path) {	\
+                        return ns::create(p_path);			\
+                }							\
+                static bool close(file_t p_file) {			\
+                        return ns::close(p_file);			\
+                }							\
+                static int64_t readn(file_t p_file, void *p_buffer,	\
+                                     size_t p_count) {			\
+                        return ns::readn(p_file, p_buffer, p_count);	\
+                }							\
+                static int64_t writen(file_t p_file, const void *p_buffer, \
+                                      size_t p_count) {			\
+                        return ns::writen(p_file, p_buffer, p_count);	\
+                }							\
+                static int64_t preadn(file_t p_file, void *p_buffer,	\
+                                      size_t p_count, int64_t p_offset) { \
+                        return ns::preadn(p_file, p_buffer, p_count, p_offset); \
+                }							\
+                static int64_t pwriten(file_t p_file, const void *p_buffer, \
+                                       size_t p_count, int64_t p_offset) { \
+                        return ns::pwriten(p_file, p_buffer, p_count, p_offset); \
+                }							\
+                static bool advise(file_t p_file, int64_t p_offset,	\
+                                   int64_t p_length, int p_advice) {	\
+                        return ns::advise(p_file, p_offset, p_length,	\
+                                          ns::advice_t(p_advice));	\
+                }							\
+                static bool preallocate(file_t p_file, int64_t p_length) { \
+                        return ns::preallocate(p_file, p_length);	\
+                }							\
+                static bool publish(file_t p_file, const std::string &p_tmp_path, \
+                                    const std::string &p_path) {	\
+                        return ns::publish(p_file, p_tmp_path, p_path);	\
+                }							\
+                static bool append(file_t p_file, const void *p_buffer, \
+                                   size_t p_count) {			\
+                        return ns::append(p_file, p_buffer, p_count) != ns::BAD_OFFSET; \
+                }							\
+                static bool remove(const std::string &p_path) {		\
+                        return ns::remove(p_path);			\
+                }							\
+                static bool mkdir(const std::string &p_path) {		\
+                        return ns::mkdir(p_path);			\
+                }							\
+                static bool exists(const std::string &p_path) {		\
+                        return ns::exists(p_path);			\
+                }							\
+                static bool stat(const std::string &p_path,		\
+                                 uint64_t &p_size) {			\
+                        file_status _status;				\
+                        if(! ns::stat(_status, p_path))			\
+                                return false;				\
+                        p_size = ns::get_size(_status);			\
+                        return true;					\
+                }							\
+                static bool list_files(const std::string &p_path,	\
+                                       std::vector<file_info> &p_infos) { \
+                        return ns::list_files(p_infos, p_path);		\
+                }							\
+                static std::string get_name(const file_info &p_info) {	\
+                        return ns::get_name(p_info);			\
+                }							\
+        }
+
+FS_BENCH_BACKEND(localfs);
+FS_BENCH_BACKEND(gfs);
+FS_BENCH_BACKEND(memfs);
+
+namespace
+{
+
+using boost::placeholders::_1;
+using boost::placeholders::_2;
+
+std::vector<size_t> split_sizes(const std::string &p_text);
+
+struct options
+{
+        options()
+                : m_backend("localfs"),
+                  m_dir("/tmp"),
+                  m_workloads("all"),
+                  m_threads(1),
+                  m_file_size(64 * 1024 * 1024),
+                  m_files(1000),
+                  m_ops(10000),
+                  m_rounds(10),
+                  m_handles(4),
+                  m_entries(split_sizes("10000,100000,1000000")),
+                  m_depths(split_sizes("1,4,16,64")),
+                  m_sparse(false),
+                  m_keep(false) {}
+
+        std::string m_backend;
+        std::string m_dir;		// 在其下建立fs_bench.<pid>目录
+        std::string m_conf;		// 传给init
+        std::string m_workloads;	// 逗号分隔，或all
+        std::vector<size_t> m_block_sizes;
+        size_t m_threads;
+        uint64_t m_file_size;		// 每个线程的数据文件大小
+        size_t m_files;			// 每个线程create的文件数
+        size_t m_ops;			// 每个线程的随机操作次数
+        size_t m_rounds;		// 每个线程list_files的次数
+        size_t m_handles;		// rangeread每个文件的句柄数
+        std::vector<size_t> m_entries;	// listdir_scale的目录大小
+        std::vector<size_t> m_depths;	// asyncread的队列深度
+        bool m_sparse;			// 数据文件中大部分是空洞
+        bool m_keep;			// 结束后保留测试目录
+};
+
+// 一个线程的结果
+struct thread_result
+{
+        thread_result()
+                : m_ops(0),
+                  m_bytes(0),
+                  m_errors(0),
+                  m_start_ns(0),
+                  m_end_ns(0) {}
+
+        uint64_t m_ops;
+        uint64_t m_bytes;
+        uint64_t m_errors;
+        std::vector<uint64_t> m_latencies;	// 纳秒
+        uint64_t m_start_ns;
+        uint64_t m_end_ns;
+};
+
+inline
+uint64_t now_ns() {
+        struct timespec _now;
+        ::clock_gettime(CLOCK_MONOTONIC, &_now);
+        return uint64_t(_now.tv_sec) * 1000 * 1000 * 1000 + _now.tv_nsec;
+}
+
+// 各线程独立的xorshift随机数
+inline
+uint64_t next_random(uint64_t &p_state) {
+        p_state ^= p_state << 13;
+        p_state ^= p_state >> 7;
+        p_state ^= p_state << 17;
+        return p_state;
+}
+
+bool parse_size(const std::string &p_text,
+                uint64_t &p_size) {
+        char *_end = NULL;
+        const unsigned long long _value = std::strtoull(p_text.c_str(), &_end, 10);
+        if(_end == p_text.c_str())
+                return false;
+        uint64_t _unit = 1;
+        switch(*_end)
+        {
+        case '\0':
+                break;
+        case 'k': case 'K':
+                _unit = 1024;
+                break;
+        case 'm': case 'M':
+                _unit = 1024 * 1024;
+                break;
+        case 'g': case 'G':
+                _unit = 1024 * 1024 * 1024;
+                break;
+        default:
+                return false;
+        }
+        if(*_end != '\0' && _end[1] != '\0')
+                return false;
+        p_size = uint64_t(_value) * _unit;
+        return true;
+}
+
+// 复制一个文件，p_native为false时使用和其它文件系统一样的方法
+template<typename Backend>
+bool copy_file(const std::string &p_path,
+               const std::string &p_new_path,
+               bool) {
+        const typename Backend::file_t _in = Backend::open_read(p_path);
+        if(Backend::is_bad(_in))
+                return false;
+        const typename Backend::file_t _out = Backend::create(p_new_path);
+        if(Backend::is_bad(_out))
+        {
+                Backend::close(_in);
+                return false;
+        }
+        std::vector<char> _buffer(4 * 1024 * 1024);
+        bool _ok = true;
+        while(_ok)
+        {
+                const int64_t _ret = Backend::readn(_in, &_buffer[0], _buffer.size());
+                if(_ret <= 0)
+                {
+                        _ok = (_ret == 0);
+                        break;
+                }
+                _ok = Backend::writen(_out, &_buffer[0], size_t(_ret)) == _ret;
+        }
+        Backend::close(_in);
+        return Backend::close(_out) && _ok;
+}
+
+// 删除目录树，p_threads只有localfs使用
+template<typename Backend>
+bool remove_tree(const std::string &p_path,
+                 size_t) {
+        return Backend::remove(p_path);
+}
+
+template<>
+bool remove_tree<localfs_backend>(const std::string &p_path,
+                                  size_t p_threads) {
+        return localfs::remove(p_path.c_str(), p_threads);
+}
+
+template<>
+bool copy_file<localfs_backend>(const std::string &p_path,
+                                const std::string &p_new_path,
+                                bool p_native) {
+        return localfs::copy_file(p_path.c_str(), p_new_path.c_str(),
+                                  p_native ? localfs::CM_CLONE : localfs::CM_BUFFER);
+}
+
+// 在作用域内打开元数据缓存，只有gfs有，其它文件系统什么也不做
+template<typename Backend>
+struct metadata_cache_scope : boost::noncopyable
+{
+        // 缓存省去的远程调用数
+        uint64_t saved() const {
+                return 0;
+        }
+};
+
+template<>
+struct metadata_cache_scope<gfs_backend> : boost::noncopyable
+{
+        metadata_cache_scope() {
+                gfs::enable_metadata_cache();
+        }
+
+        ~metadata_cache_scope() {
+                gfs::disable_metadata_cache();
+        }
+
+        uint64_t saved() const {
+                return gfs::metadata_cache::instance()->get_stats().m_hits;
+        }
+};
+
+// 保持p_depth个请求在途的随机读，只有localfs有异步接口
+template<typename Backend>
+struct async_reader
+{
+        static bool supported() {
+                return false;
+        }
+
+        static bool is_uring() {
+                return false;
+        }
+
+        static void rand_read(const std::string &, size_t, size_t, size_t, size_t,
+                              uint64_t, thread_result &) {}
+};
+
+template<>
+struct async_reader<localfs_backend>
+{
+        static bool supported() {
+                return true;
+        }
+
+        static bool is_uring() {
+                return localfs_async::ring(1).is_uring();
+        }
+
+        // 每个请求的延迟从准备到取回结果
+        static void rand_read(const std::string &p_path,
+                              size_t p_depth,
+                              size_t p_block_size,
+                              size_t p_blocks,
+                              size_t p_ops,
+                              uint64_t p_seed,
+                              thread_result &p_result) {
+                const localfs::file_t _file = localfs::open(p_path, localfs::MT_O_RDONLY);
+                if(_file == localfs::BAD_FILE)
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                {
+                        const unsigned _entries = unsigned(p_depth);
+                        localfs_async::ring _ring(_entries);
+                        std::vector<char> _buffer(p_depth * p_block_size);
+                        std::vector<uint64_t> _start(p_depth);
+                        std::vector<localfs_async::completion> _done(p_depth);
+                        std::vector<size_t> _free;	// 空闲的buffer
+                        for(size_t i = 0; i < p_depth; ++i)
+                        {
+                                _free.push_back(i);
+                        }
+                        uint64_t _random = p_seed;
+                        size_t _issued = 0;
+                        size_t _finished = 0;
+                        p_result.m_latencies.reserve(p_ops);
+                        while(_finished < p_ops)
+                        {
+                                while(! _free.empty() && _issued < p_ops)
+                                {
+                                        const size_t _slot = _free.back();
+                                        const int64_t _offset =
+                                                int64_t(next_random(_random) % p_blocks) * p_block_size;
+                                        if(! _ring.pread(_file, &_buffer[_slot * p_block_size],
+                                                         p_block_size, _offset, _slot))
+                                                break;
+                                        _start[_slot] = now_ns();
+                                        _free.pop_back();
+                                        ++ _issued;
+                                }
+                                if(_ring.submit() < 0)
+                                {
+                                        ++ p_result.m_errors;
+                                        break;
+                                }
+                                const size_t _got = _ring.wait(&_done[0], _done.size(), 1);
+                                if(_got == 0)
+                                {
+                                        ++ p_result.m_errors;
+                                        break;
+                                }
+                                const uint64_t _now = now_ns();
+                                for(size_t i = 0; i < _got; ++i)
+                                {
+                                        const size_t _slot = size_t(_done[i].m_user_data);
+                                        p_result.m_latencies.push_back(_now - _start[_slot]);
+                                        ++ p_result.m_ops;
+                                        if(_done[i].m_result == int64_t(p_block_size))
+                                                p_result.m_bytes += p_block_size;
+                                        else
+                                                ++ p_result.m_errors;
+                                        _free.push_back(_slot);
+                                        ++ _finished;
+                                }
+                        }
+                        // 出错退出时等待在途的请求，之后才能释放buffer
+                        while(_ring.inflight() != 0 &&
+                              _ring.wait(&_done[0], _done.size(), 1) != 0)
+                        {
+                        }
+                }
+                localfs::close(_file);
+        }
+};
+
+// 顺序写一个新文件；只有localfs使用O_DIRECT，其它文件系统同seqwrite
+template<typename Backend>
+class direct_output : boost::noncopyable
+{
+public:
+        explicit direct_output(const std::string &p_path)
+                : m_file(Backend::create(p_path)) {}
+
+        ~direct_output() {
+                if(! Backend::is_bad(m_file))
+                        Backend::close(m_file);
+        }
+
+        bool is_bad() const {
+                return Backend::is_bad(m_file);
+        }
+
+        bool writen(const char *p_buffer,
+                    size_t p_count) {
+                return Backend::writen(m_file, p_buffer, p_count) == int64_t(p_count);
+        }
+
+        bool finish() {
+                return true;
+        }
+
+private:
+        const typename Backend::file_t m_file;
+};
+
+template<>
+class direct_output<localfs_backend> : boost::noncopyable
+{
+public:
+        explicit direct_output(const std::string &p_path)
+                : m_file(localfs::open(p_path.c_str(),
+                                       localfs::mode_t(localfs::MT_O_WRONLY | localfs::MT_O_CREATE |
+                                                       localfs::MT_O_TRUNC | localfs::MT_O_DIRECT))),
+                  m_writer(m_file) {}
+
+        ~direct_output() {
+                if(m_file != localfs::BAD_FILE)
+                        localfs::close(m_file);
+        }
+
+        bool is_bad() const {
+                return m_file == localfs::BAD_FILE;
+        }
+
+        bool writen(const char *p_buffer,
+                    size_t p_count) {
+                return m_writer.writen(p_buffer, p_count) == int64_t(p_count);
+        }
+
+        bool finish() {
+                return m_writer.finish();
+        }
+
+private:
+        const localfs::file_t m_file;
+        localfs::direct_writer m_writer;
+};
+
+// /proc/meminfo中的Cached，单位为KB；无法读取时为0
+inline
+int64_t page_cache_kb() {
+        FILE *_file = std::fopen("/proc/meminfo", "r");
+        if(_file == NULL)
+                return 0;
+        char _line[256];
+        long long _kb = 0;
+        while(std::fgets(_line, sizeof(_line), _file) != NULL)
+        {
+                if(std::sscanf(_line, "Cached: %lld kB", &_kb) == 1)
+                        break;
+        }
+        std::fclose(_file);
+        return _kb;
+}
+
+std::vector<std::string> split(const std::string &p_text) {
+        std::vector<std::string> _parts;
+        std::istringstream _in(p_text);
+        std::string _part;
+        while(std::getline(_in, _part, ','))
+        {
+                if(! _part.empty())
+                        _parts.push_back(_part);
+        }
+        return _parts;
+}
+
+// 逗号分隔的大小，如4k,1m；有不合法或为0的项时返回空
+std::vector<size_t> split_sizes(const std::string &p_text) {
+        const std::vector<std::string> _parts = split(p_text);
+        std::vector<size_t> _sizes;
+        for(size_t i = 0; i < _parts.size(); ++i)
+        {
+                uint64_t _size = 0;
+                if(! parse_size(_parts[i], _size) || _size == 0)
+                        return std::vector<size_t>();
+                _sizes.push_back(size_t(_size));
+        }
+        return _sizes;
+}
+
+template<typename Backend>
+class runner
+{
+public:
+        explicit runner(const options &p_options)
+                : m_options(p_options),
+                  m_elapsed_ns(0),
+                  m_cache_delta_kb(0),
+                  m_rpc_saved(0) {
+                std::ostringstream _dir;
+                _dir << m_options.m_dir << "/fs_bench." << ::getpid();
+                m_root = _dir.str();
+        }
+
+        int run() {
+                Backend::init(m_options.m_conf);
+                if(! Backend::exists(m_options.m_dir))
+                {
+                        Backend::mkdir(m_options.m_dir); // 比如memfs中还没有/tmp
+                }
+                if(! Backend::mkdir(m_root))
+                {
+                        std::cerr << "can not create " << m_root << std::endl;
+                        return 1;
+                }
+
+                std::vector<std::string> _workloads = split(m_options.m_workloads);
+                if(_workloads.size() == 1 && _workloads[0] == "all")
+                {
+                        _workloads = split("seqwrite,prealloc,seqread,scan,randread,randread_shared,randwrite,append,"
+                                           "directwrite,appender,readahead,reopen,reopen_cached,rangeread,"
+                                           "publish,groupcommit,groupsyncfs,copy,"
+                                           "copybuf,create,stat,stat_cached,listdir,delete");
+                }
+
+                bool _ok = true;
+                for(size_t i = 0; i < _workloads.size() && _ok; ++i)
+                {
+                        _ok = run_workload(_workloads[i]);
+                }
+
+                if(! m_options.m_keep)
+                {
+                        Backend::remove(m_root);
+                }
+                return _ok ? 0 : 1;
+        }
+
+private:
+        typedef typename Backend::file_t file_t;
+        typedef boost::function<void(size_t, thread_result&)> job_type;
+
+        bool run_workload(const std::string &p_name) {
+                if(p_name == "create")
+                        return report(p_name, 0, run_threads(boost::bind(&runner::create_files, this, _1, _2)));
+                if(p_name == "stat")
+                        return report(p_name, 0, run_threads(boost::bind(&runner::stat_files, this, _1, _2)));
+                if(p_name == "listdir")
+                        return report(p_name, 0, run_threads(boost::bind(&runner::list_dir, this, _1, _2)));
+                if(p_name == "delete")
+                        return report(p_name, 0, run_threads(boost::bind(&runner::delete_files, this, _1, _2)));
+                if(p_name == "listdir_scale")
+                        return list_scale();
+                if(p_name == "asyncread")
+                        return async_sweep();
+                if(p_name == "rmtree" || p_name == "rmtree_parallel")
+                        return remove_tree_once(p_name, p_name == "rmtree" ? 1 : m_options.m_threads);
+                if(p_name == "stat_cached" || p_name == "delete_cached")
+                {
+                        metadata_cache_scope<Backend> _scope;
+                        const std::vector<thread_result> _results = run_threads(
+                                p_name == "stat_cached"
+                                ? job_type(boost::bind(&runner::stat_files, this, _1, _2))
+                                : job_type(boost::bind(&runner::delete_files, this, _1, _2)));
+                        m_rpc_saved = _scope.saved();
+                        const bool _ok = report(p_name, 0, _results);
+                        m_rpc_saved = 0;
+                        return _ok;
+                }
+                if(p_name == "copy" || p_name == "copybuf")
+                        return prepare_data_files() &&
+                                report(p_name, 0, run_threads(boost::bind(&runner::copy_files, this, _1,
+                                                                          p_name == "copy", _2)));
+
+                for(size_t i = 0; i < m_options.m_block_sizes.size(); ++i)
+                {
+                        const size_t _bs = m_options.m_block_sizes[i];
+                        job_type _job;
+                        boost::scoped_ptr<typename Backend::handle_cache> _cache;
+                        boost::scoped_ptr<typename Backend::committer> _committer;
+                        boost::scoped_ptr<shared_file> _shared;
+                        if(p_name == "seqwrite" || p_name == "prealloc")
+                                _job = boost::bind(&runner::seq_write, this, _1, _bs,
+                                                   p_name == "prealloc", _2);
+                        else if(p_name == "seqread" || p_name == "scan")
+                                _job = boost::bind(&runner::seq_read, this, _1, _bs,
+                                                   p_name == "scan", _2);
+                        else if(p_name == "randread")
+                                _job = boost::bind(&runner::rand_read, this, _1, _bs, _2);
+                        else if(p_name == "randread_shared")
+                        {
+                                if(! prepare_data_files())
+                                        return false;
+                                _shared.reset(new shared_file(data_file(0)));
+                                _job = boost::bind(&runner::shared_read, this, _shared.get(),
+                                                   _1, _bs, _2);
+                        }
+                        else if(p_name == "randwrite")
+                                _job = boost::bind(&runner::rand_write, this, _1, _bs, _2);
+                        else if(p_name == "append")
+                                _job = boost::bind(&runner::append_blocks, this, _1, _bs, _2);
+                        else if(p_name == "appender")
+                                _job = boost::bind(&runner::appender_blocks, this, _1, _bs, _2);
+                        else if(p_name == "readahead")
+                                _job = boost::bind(&runner::readahead_read, this, _1, _bs, _2);
+                        else if(p_name == "directwrite")
+                                _job = boost::bind(&runner::direct_write, this, _1, _bs, _2);
+                        else if(p_name == "rangeread")
+                                _job = boost::bind(&runner::range_read, this, _1, _bs, _2);
+                        else if(p_name == "reopen")
+                                _job = boost::bind(&runner::reopen_read, this, _1, _bs, _2);
+                        else if(p_name == "reopen_cached")
+                        {
+                                _cache.reset(new typename Backend::handle_cache);
+                                _job = boost::bind(&runner::cached_read, this, _cache.get(),
+                                                   _1, _bs, _2);
+                        }
+                        else if(p_name == "publish")
+                                _job = boost::bind(&runner::publish_files, this,
+                                                   static_cast<typename Backend::committer*>(NULL),
+                                                   _1, _bs, _2);
+                        else if(p_name == "groupcommit" || p_name == "groupsyncfs")
+                        {
+                                _committer.reset(new typename Backend::committer(
+                                                         1024, 0, p_name == "groupsyncfs"));
+                                _job = boost::bind(&runner::publish_files, this, _committer.get(),
+                                                   _1, _bs, _2);
+                        }
+                        else
+                        {
+                                std::cerr << "unknown workload: " << p_name << std::endl;
+                                return false;
+                        }
+
+                        if(p_name != "seqwrite" && p_name != "prealloc" &&
+                           p_name != "directwrite" && p_name != "append" &&
+                           p_name != "publish" && p_name != "groupcommit" &&
+                           p_name != "groupsyncfs" &&
+                           p_name != "appender" && ! prepare_data_files())
+                                return false;
+                        if(! report(p_name, _bs, run_threads(_job)))
+                                return false;
+                }
+                return true;
+        }
+
+        // 所有线程同时开始，计时从最早开始的线程到最晚结束的线程
+        std::vector<thread_result> run_threads(const job_type &p_job) {
+                std::vector<thread_result> _results(m_options.m_threads);
+                boost::barrier _barrier(unsigned(m_options.m_threads));
+                boost::thread_group _threads;
+                const int64_t _cache_kb = page_cache_kb();
+                for(size_t i = 0; i < m_options.m_threads; ++i)
+                {
+                        _threads.create_thread(boost::bind(&runner::run_job, this,
+                                                           boost::cref(p_job), i,
+                                                           boost::ref(_results[i]),
+                                                           boost::ref(_barrier)));
+                }
+                _threads.join_all();
+                m_cache_delta_kb = page_cache_kb() - _cache_kb;
+
+                uint64_t _start = _results[0].m_start_ns;
+                uint64_t _end = _results[0].m_end_ns;
+                for(size_t i = 1; i < _results.size(); ++i)
+                {
+                        _start = std::min(_start, _results[i].m_start_ns);
+                        _end = std::max(_end, _results[i].m_end_ns);
+                }
+                m_elapsed_ns = _end - _start;
+                return _results;
+        }
+
+        void run_job(const job_type &p_job,
+                     size_t p_index,
+                     thread_result &p_result,
+                     boost::barrier &p_barrier) {
+                p_barrier.wait();
+                p_result.m_start_ns = now_ns();
+                p_job(p_index, p_result);
+                p_result.m_end_ns = now_ns();
+        }
+
+        // p_threads为0时输出--threads
+        bool report(const std::string &p_name,
+                    size_t p_block_size,
+                    const std::vector<thread_result> &p_results,
+                    size_t p_threads = 0) {
+                thread_result _total;
+                for(size_t i = 0; i < p_results.size(); ++i)
+                {
+                        _total.m_ops += p_results[i].m_ops;
+                        _total.m_bytes += p_results[i].m_bytes;
+                        _total.m_errors += p_results[i].m_errors;
+                        _total.m_latencies.insert(_total.m_latencies.end(),
+                                                  p_results[i].m_latencies.begin(),
+                                                  p_results[i].m_latencies.end());
+                }
+                std::sort(_total.m_latencies.begin(), _total.m_latencies.end());
+
+                const double _seconds = double(m_elapsed_ns) / 1e9;
+                char _line[1024];
+                std::snprintf(_line, sizeof(_line),
+                              "{\"backend\":\"%s\",\"workload\":\"%s\",\"block_size\":%lu,"
+                              "\"threads\":%lu,\"ops\":%llu,\"bytes\":%llu,\"errors\":%llu,"
+                              "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+                              "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+                              "\"page_cache_mb\":%.1f,\"rpc_saved\":%llu}",
+                              Backend::name(), p_name.c_str(),
+                              (unsigned long)p_block_size,
+                              (unsigned long)(p_threads == 0 ? m_options.m_threads : p_threads),
+                              (unsigned long long)_total.m_ops,
+                              (unsigned long long)_total.m_bytes,
+                              (unsigned long long)_total.m_errors,
+                              _seconds,
+                              _seconds > 0 ? double(_total.m_ops) / _seconds : 0.0,
+                              _seconds > 0 ? double(_total.m_bytes) / _seconds / (1024 * 1024) : 0.0,
+                              percentile_us(_total.m_latencies, 0.5),
+                              percentile_us(_total.m_latencies, 0.99),
+                              percentile_us(_total.m_latencies, 0.999),
+                              percentile_us(_total.m_latencies, 1.0),
+                              double(m_cache_delta_kb) / 1024,
+                              (unsigned long long)m_rpc_saved);
+                std::cout << _line << std::endl;
+                return true;
+        }
+
+        static double percentile_us(const std::vector<uint64_t> &p_sorted,
+                                    double p_ratio) {
+                if(p_sorted.empty())
+                        return 0;
+                const size_t _index = size_t(p_ratio * double(p_sorted.size() - 1));
+                return double(p_sorted[_index]) / 1000;
+        }
+
+        // 计时执行一次操作
+        template<typename Op>
+        static bool timed(thread_result &p_result,
+                          uint64_t p_bytes,
+                          Op p_op) {
+                const uint64_t _start = now_ns();
+                const bool _ok = p_op();
+                p_result.m_latencies.push_back(now_ns() - _start);
+                ++ p_result.m_ops;
+                if(_ok)
+                        p_result.m_bytes += p_bytes;
+                else
+                        ++ p_result.m_errors;
+                return _ok;
+        }
+
+        std::string data_file(size_t p_index) const {
+                std::ostringstream _path;
+                _path << m_root << (m_options.m_sparse ? "/sparse." : "/data.") << p_index;
+                return _path.str();
+        }
+
+        std::string direct_file(size_t p_index) const {
+                std::ostringstream _path;
+                _path << m_root << "/direct." << p_index;
+                return _path.str();
+        }
+
+        std::string thread_dir(size_t p_index) const {
+                std::ostringstream _path;
+                _path << m_root << "/files." << p_index;
+                return _path.str();
+        }
+
+        std::string small_file(size_t p_index,
+                               size_t p_file) const {
+                std::ostringstream _path;
+                _path << thread_dir(p_index) << "/f" << p_file;
+                return _path.str();
+        }
+
+        // 读测试之前确保数据文件已经写好（不计时）
+        bool prepare_data_files() {
+                for(size_t i = 0; i < m_options.m_threads; ++i)
+                {
+                        uint64_t _size = 0;
+                        if(Backend::stat(data_file(i), _size) &&
+                           _size >= m_options.m_file_size)
+                                continue;
+
+                        const file_t _file = Backend::create(data_file(i));
+                        if(Backend::is_bad(_file))
+                        {
+                                std::cerr << "can not create " << data_file(i) << std::endl;
+                                return false;
+                        }
+                        std::vector<char> _block(1024 * 1024, 'x');
+                        const uint64_t _step = m_options.m_sparse ? 16 * _block.size() : _block.size();
+                        bool _ok = true;
+                        for(uint64_t _pos = 0; _ok && _pos < m_options.m_file_size; _pos += _step)
+                        {
+                                const size_t _count = size_t(std::min<uint64_t>(_block.size(),
+                                                                                m_options.m_file_size - _pos));
+                                _ok = Backend::pwriten(_file, &_block[0], _count, _pos) == int64_t(_count);
+                        }
+                        if(_ok && m_options.m_sparse && m_options.m_file_size > 0)
+                        {
+                                // 最后一个字节决定文件长度
+                                _ok = Backend::pwriten(_file, &_block[0], 1,
+                                                       m_options.m_file_size - 1) == 1;
+                        }
+                        Backend::close(_file);
+                        if(! _ok)
+                        {
+                                std::cerr << "can not write " << data_file(i) << std::endl;
+                                return false;
+                        }
+                }
+                return true;
+        }
+
+        // 块数，至少为1
+        size_t block_count(size_t p_block_size) const {
+                const uint64_t _count = m_options.m_file_size / p_block_size;
+                return _count == 0 ? 1 : size_t(_count);
+        }
+
+        struct read_op
+        {
+                file_t m_file;
+                char *m_buffer;
+                size_t m_count;
+                bool operator()() const {
+                        return Backend::readn(m_file, m_buffer, m_count) == int64_t(m_count);
+                }
+        };
+
+        struct write_op
+        {
+                file_t m_file;
+                const char *m_buffer;
+                size_t m_count;
+                bool operator()() const {
+                        return Backend::writen(m_file, m_buffer, m_count) == int64_t(m_count);
+                }
+        };
+
+        struct pread_op
+        {
+                file_t m_file;
+                char *m_buffer;
+                size_t m_count;
+                int64_t m_offset;
+                bool operator()() const {
+                        return Backend::preadn(m_file, m_buffer, m_count, m_offset) == int64_t(m_count);
+                }
+        };
+
+        struct pwrite_op
+        {
+                file_t m_file;
+                const char *m_buffer;
+                size_t m_count;
+                int64_t m_offset;
+                bool operator()() const {
+                        return Backend::pwriten(m_file, m_buffer, m_count, m_offset) == int64_t(m_count);
+                }
+        };
+
+        struct append_op
+        {
+                file_t m_file;
+                const char *m_buffer;
+                size_t m_count;
+                bool operator()() const {
+                        return Backend::append(m_file, m_buffer, m_count);
+                }
+        };
+
+        struct appender_op
+        {
+                typename Backend::appender *m_appender;
+                const char *m_buffer;
+                size_t m_count;
+                bool operator()() const {
+                        return m_appender->append(m_buffer, m_count) >= 0;
+                }
+        };
+
+        struct reader_op
+        {
+                typename Backend::reader *m_reader;
+                char *m_buffer;
+                size_t m_count;
+                bool operator()() const {
+                        return m_reader->readn(m_buffer, m_count) == int64_t(m_count);
+                }
+        };
+
+        void seq_write(size_t p_index,
+                       size_t p_block_size,
+                       bool p_preallocate,
+                       thread_result &p_result) {
+                const file_t _file = Backend::create(data_file(p_index));
+                if(Backend::is_bad(_file))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                if(p_preallocate &&
+                   ! Backend::preallocate(_file, int64_t(block_count(p_block_size) * p_block_size)))
+                        ++ p_result.m_errors;
+                std::vector<char> _buffer(p_block_size, 'w');
+                const write_op _op = {_file, &_buffer[0], p_block_size};
+                const size_t _blocks = block_count(p_block_size);
+                p_result.m_latencies.reserve(_blocks);
+                for(size_t i = 0; i < _blocks; ++i)
+                {
+                        if(! timed(p_result, p_block_size, _op))
+                                break;
+                }
+                Backend::close(_file);
+        }
+
+        struct direct_op
+        {
+                direct_output<Backend> *m_output;
+                const char *m_buffer;
+                size_t m_count;
+                bool operator()() const {
+                        return m_output->writen(m_buffer, m_count);
+                }
+        };
+
+        void direct_write(size_t p_index,
+                          size_t p_block_size,
+                          thread_result &p_result) {
+                // 文件保留到最后，删除会释放它占用的page cache
+                direct_output<Backend> _output(direct_file(p_index));
+                if(_output.is_bad())
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                std::vector<char> _buffer(p_block_size, 'd');
+                const direct_op _op = {&_output, &_buffer[0], p_block_size};
+                const size_t _blocks = block_count(p_block_size);
+                p_result.m_latencies.reserve(_blocks);
+                for(size_t i = 0; i < _blocks; ++i)
+                {
+                        if(! timed(p_result, p_block_size, _op))
+                                break;
+                }
+                if(! _output.finish())
+                        ++ p_result.m_errors;
+        }
+
+        void seq_read(size_t p_index,
+                      size_t p_block_size,
+                      bool p_drop_behind,
+                      thread_result &p_result) {
+                static const uint64_t DROP_BEHIND_BYTES = 16 * 1024 * 1024;
+                const file_t _file = Backend::open_read(data_file(p_index));
+                if(Backend::is_bad(_file))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                if(p_drop_behind)
+                        Backend::advise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+                std::vector<char> _buffer(p_block_size);
+                const read_op _op = {_file, &_buffer[0], p_block_size};
+                const size_t _blocks = block_count(p_block_size);
+                p_result.m_latencies.reserve(_blocks);
+                uint64_t _dropped = 0;
+                for(size_t i = 0; i < _blocks; ++i)
+                {
+                        if(! timed(p_result, p_block_size, _op))
+                                break;
+                        const uint64_t _readed = uint64_t(i + 1) * p_block_size;
+                        if(p_drop_behind && _readed - _dropped >= DROP_BEHIND_BYTES)
+                        {
+                                Backend::advise(_file, int64_t(_dropped),
+                                                int64_t(_readed - _dropped), POSIX_FADV_DONTNEED);
+                                _dropped = _readed;
+                        }
+                }
+                Backend::close(_file);
+        }
+
+        void readahead_read(size_t p_index,
+                            size_t p_block_size,
+                            thread_result &p_result) {
+                const file_t _file = Backend::open_read(data_file(p_index));
+                if(Backend::is_bad(_file))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                {
+                        typename Backend::reader _reader(_file);
+                        std::vector<char> _buffer(p_block_size);
+                        const reader_op _op = {&_reader, &_buffer[0], p_block_size};
+                        const size_t _blocks = block_count(p_block_size);
+                        p_result.m_latencies.reserve(_blocks);
+                        for(size_t i = 0; i < _blocks; ++i)
+                        {
+                                if(! timed(p_result, p_block_size, _op))
+                                        break;
+                        }
+                }
+                Backend::close(_file);
+        }
+
+        void rand_read(size_t p_index,
+                       size_t p_block_size,
+                       thread_result &p_result) {
+                const file_t _file = Backend::open_read(data_file(p_index));
+                if(Backend::is_bad(_file))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                rand_read_file(_file, p_index, p_block_size, p_result);
+                Backend::close(_file);
+        }
+
+        // randread_shared的所有线程共用的file_t
+        class shared_file : boost::noncopyable
+        {
+        public:
+                explicit shared_file(const std::string &p_path)
+                        : m_path(p_path),
+                          m_file(Backend::open_read(p_path)) {}
+
+                ~shared_file() {
+                        if(! Backend::is_bad(m_file))
+                                Backend::close(m_file);
+                }
+
+                const std::string &path() const {
+                        return m_path;
+                }
+
+                file_t file() const {
+                        return m_file;
+                }
+
+        private:
+                const std::string m_path;
+                const file_t m_file;
+        };
+
+        void shared_read(shared_file *p_shared,
+                         size_t p_index,
+                         size_t p_block_size,
+                         thread_result &p_result) {
+                if(Backend::concurrent_pread)
+                {
+                        if(Backend::is_bad(p_shared->file()))
+                                ++ p_result.m_errors;
+                        else
+                                rand_read_file(p_shared->file(), p_index, p_block_size, p_result);
+                        return;
+                }
+                const file_t _file = Backend::open_read(p_shared->path());
+                if(Backend::is_bad(_file))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                rand_read_file(_file, p_index, p_block_size, p_result);
+                Backend::close(_file);
+        }
+
+        void rand_read_file(file_t p_file,
+                            size_t p_index,
+                            size_t p_block_size,
+                            thread_result &p_result) {
+                std::vector<char> _buffer(p_block_size);
+                pread_op _op = {p_file, &_buffer[0], p_block_size, 0};
+                const size_t _blocks = block_count(p_block_size);
+                uint64_t _random = 0x9E3779B97F4A7C15ULL * (p_index + 1);
+                p_result.m_latencies.reserve(m_options.m_ops);
+                for(size_t i = 0; i < m_options.m_ops; ++i)
+                {
+                        _op.m_offset = int64_t(next_random(_random) % _blocks) * p_block_size;
+                        timed(p_result, p_block_size, _op);
+                }
+        }
+
+        struct range_op
+        {
+                typename Backend::range_reader *m_reader;
+                std::string m_path;
+                bool operator()() const {
+                        return m_reader->read(m_path.c_str(), &range_op::consume);
+                }
+                static bool consume(const char *, size_t, uint64_t) {
+                        return true;
+                }
+        };
+
+        // 整个文件计为一次操作
+        void range_read(size_t p_index,
+                        size_t p_block_size,
+                        thread_result &p_result) {
+                fsutil::range_options _options;
+                _options.m_threads = m_options.m_handles;
+                _options.m_chunk_size = p_block_size;
+                typename Backend::range_reader _reader(_options);
+                const range_op _op = {&_reader, data_file(p_index)};
+                timed(p_result, m_options.m_file_size, _op);
+        }
+
+        struct reopen_op
+        {
+                std::string m_path;
+                char *m_buffer;
+                size_t m_count;
+                int64_t m_offset;
+                bool operator()() const {
+                        const file_t _file = Backend::open_read(m_path);
+                        if(Backend::is_bad(_file))
+                                return false;
+                        const bool _ok = Backend::preadn(_file, m_buffer, m_count, m_offset) ==
+                                int64_t(m_count);
+                        return Backend::close(_file) && _ok;
+                }
+        };
+
+        struct cached_op
+        {
+                typename Backend::handle_cache *m_cache;
+                std::string m_path;
+                char *m_buffer;
+                size_t m_count;
+                int64_t m_offset;
+                bool operator()() const {
+                        const typename Backend::handle_cache::lease _lease =
+                                m_cache->acquire(m_path.c_str());
+                        return (! _lease.is_bad()) &&
+                                Backend::preadn(_lease.file(), m_buffer, m_count, m_offset) ==
+                                int64_t(m_count);
+                }
+        };
+
+        void reopen_read(size_t p_index,
+                         size_t p_block_size,
+                         thread_result &p_result) {
+                std::vector<char> _buffer(p_block_size);
+                reopen_op _op = {data_file(p_index), &_buffer[0], p_block_size, 0};
+                const size_t _blocks = block_count(p_block_size);
+                uint64_t _random = 0xD6E8FEB86659FD93ULL * (p_index + 1);
+                p_result.m_latencies.reserve(m_options.m_ops);
+                for(size_t i = 0; i < m_options.m_ops; ++i)
+                {
+                        _op.m_offset = int64_t(next_random(_random) % _blocks) * p_block_size;
+                        timed(p_result, p_block_size, _op);
+                }
+        }
+
+        void cached_read(typename Backend::handle_cache *p_cache,
+                         size_t p_index,
+                         size_t p_block_size,
+                         thread_result &p_result) {
+                std::vector<char> _buffer(p_block_size);
+                cached_op _op = {p_cache, data_file(p_index), &_buffer[0], p_block_size, 0};
+                const size_t _blocks = block_count(p_block_size);
+                uint64_t _random = 0xD6E8FEB86659FD93ULL * (p_index + 1);
+                p_result.m_latencies.reserve(m_options.m_ops);
+                for(size_t i = 0; i < m_options.m_ops; ++i)
+                {
+                        _op.m_offset = int64_t(next_random(_random) % _blocks) * p_block_size;
+                        timed(p_result, p_block_size, _op);
+                }
+        }
+
+        // p_committer为NULL时每个文件单独publish
+        struct publish_op
+        {
+                typename Backend::committer *m_committer;
+                std::string m_tmp_path;
+                std::string m_path;
+                const char *m_buffer;
+                size_t m_count;
+                bool operator()() const {
+                        const file_t _file = Backend::create(m_tmp_path);
+                        if(Backend::is_bad(_file))
+                                return false;
+                        bool _ok = Backend::writen(_file, m_buffer, m_count) == int64_t(m_count);
+                        if(_ok)
+                        {
+                                _ok = (m_committer == NULL)
+                                        ? Backend::publish(_file, m_tmp_path, m_path)
+                                        : m_committer->commit(_file, m_tmp_path, m_path);
+                        }
+                        return Backend::close(_file) && _ok;
+                }
+        };
+
+        void publish_files(typename Backend::committer *p_committer,
+                           size_t p_index,
+                           size_t p_block_size,
+                           thread_result &p_result) {
+                // 所有线程发布到同一个目录
+                const std::string _dir = m_root + "/publish";
+                if(! Backend::mkdir(_dir) && ! Backend::exists(_dir))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                std::ostringstream _tmp_path;
+                _tmp_path << _dir << "/tmp." << p_index;
+                std::vector<char> _buffer(p_block_size, 'p');
+                publish_op _op = {p_committer, _tmp_path.str(), std::string(),
+                                  &_buffer[0], p_block_size};
+                p_result.m_latencies.reserve(m_options.m_files);
+                for(size_t i = 0; i < m_options.m_files; ++i)
+                {
+                        std::ostringstream _path;
+                        _path << _dir << "/p" << p_index << "." << i;
+                        _op.m_path = _path.str();
+                        timed(p_result, p_block_size, _op);
+                }
+        }
+
+        void rand_write(size_t p_index,
+                        size_t p_block_size,
+                        thread_result &p_result) {
+                const file_t _file = Backend::open_rdwr(data_file(p_index));
+                if(Backend::is_bad(_file))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                std::vector<char> _buffer(p_block_size, 'r');
+                pwrite_op _op = {_file, &_buffer[0], p_block_size, 0};
+                const size_t _blocks = block_count(p_block_size);
+                uint64_t _random = 0xBF58476D1CE4E5B9ULL * (p_index + 1);
+                p_result.m_latencies.reserve(m_options.m_ops);
+                for(size_t i = 0; i < m_options.m_ops; ++i)
+                {
+                        _op.m_offset = int64_t(next_random(_random) % _blocks) * p_block_size;
+                        timed(p_result, p_block_size, _op);
+                }
+                Backend::close(_file);
+        }
+
+        std::string append_file(size_t p_index) const {
+                std::ostringstream _path;
+                _path << m_root << "/append." << p_index;
+                return _path.str();
+        }
+
+        void append_blocks(size_t p_index,
+                           size_t p_block_size,
+                           thread_result &p_result) {
+                const file_t _file = Backend::create(append_file(p_index));
+                if(Backend::is_bad(_file))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                std::vector<char> _buffer(p_block_size, 'a');
+                const append_op _op = {_file, &_buffer[0], p_block_size};
+                const size_t _blocks = block_count(p_block_size);
+                p_result.m_latencies.reserve(_blocks);
+                for(size_t i = 0; i < _blocks; ++i)
+                {
+                        if(! timed(p_result, p_block_size, _op))
+                                break;
+                }
+                Backend::close(_file);
+                Backend::remove(append_file(p_index));
+        }
+
+        // 最后flush的时间计入总时间，但不计入单次append的延迟
+        void appender_blocks(size_t p_index,
+                             size_t p_block_size,
+                             thread_result &p_result) {
+                const file_t _file = Backend::create(append_file(p_index));
+                if(Backend::is_bad(_file))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                {
+                        typename Backend::appender _appender(_file);
+                        std::vector<char> _buffer(p_block_size, 'b');
+                        const appender_op _op = {&_appender, &_buffer[0], p_block_size};
+                        const size_t _blocks = block_count(p_block_size);
+                        p_result.m_latencies.reserve(_blocks);
+                        for(size_t i = 0; i < _blocks; ++i)
+                        {
+                                if(! timed(p_result, p_block_size, _op))
+                                        break;
+                        }
+                        if(! _appender.flush())
+                                ++ p_result.m_errors;
+                }
+                Backend::close(_file);
+                Backend::remove(append_file(p_index));
+        }
+
+        struct copy_op
+        {
+                std::string m_path;
+                std::string m_new_path;
+                bool m_native;
+                bool operator()() const {
+                        return copy_file<Backend>(m_path, m_new_path, m_native);
+                }
+        };
+
+        void copy_files(size_t p_index,
+                        bool p_native,
+                        thread_result &p_result) {
+                copy_op _op;
+                _op.m_path = data_file(p_index);
+                _op.m_new_path = data_file(p_index) + ".copy";
+                _op.m_native = p_native;
+                timed(p_result, m_options.m_file_size, _op);
+                Backend::remove(_op.m_new_path);
+        }
+
+        struct create_op
+        {
+                std::string m_path;
+                bool operator()() const {
+                        const file_t _file = Backend::create(m_path);
+                        return (! Backend::is_bad(_file)) && Backend::close(_file);
+                }
+        };
+
+        struct stat_op
+        {
+                std::string m_path;
+                bool operator()() const {
+                        uint64_t _size = 0;
+                        return Backend::stat(m_path, _size);
+                }
+        };
+
+        struct list_op
+        {
+                std::string m_path;
+                size_t m_expected;
+                bool operator()() const {
+                        std::vector<typename Backend::file_info> _infos;
+                        _infos.reserve(m_expected);
+                        return Backend::list_files(m_path, _infos) &&
+                                _infos.size() == m_expected;
+                }
+        };
+
+        // list_files之后逐项stat
+        struct list_stat_op
+        {
+                std::string m_path;
+                size_t m_expected;
+                bool operator()() const {
+                        std::vector<typename Backend::file_info> _infos;
+                        _infos.reserve(m_expected);
+                        if(! Backend::list_files(m_path, _infos) ||
+                           _infos.size() != m_expected)
+                                return false;
+                        uint64_t _size = 0;
+                        for(size_t i = 0; i < _infos.size(); ++i)
+                        {
+                                if(! Backend::stat(m_path + "/" + Backend::get_name(_infos[i]), _size))
+                                        return false;
+                        }
+                        return true;
+                }
+        };
+
+        struct remove_op
+        {
+                std::string m_path;
+                bool operator()() const {
+                        return Backend::remove(m_path);
+                }
+        };
+
+        void create_files(size_t p_index,
+                          thread_result &p_result) {
+                if(! Backend::exists(thread_dir(p_index)) &&
+                   ! Backend::mkdir(thread_dir(p_index)))
+                {
+                        ++ p_result.m_errors;
+                        return;
+                }
+                create_op _op;
+                p_result.m_latencies.reserve(m_options.m_files);
+                for(size_t i = 0; i < m_options.m_files; ++i)
+                {
+                        _op.m_path = small_file(p_index, i);
+                        timed(p_result, 0, _op);
+                }
+        }
+
+        void stat_files(size_t p_index,
+                        thread_result &p_result) {
+                stat_op _op;
+                uint64_t _random = 0x94D049BB133111EBULL * (p_index + 1);
+                p_result.m_latencies.reserve(m_options.m_ops);
+                for(size_t i = 0; i < m_options.m_ops; ++i)
+                {
+                        _op.m_path = small_file(next_random(_random) % m_options.m_threads,
+                                                next_random(_random) % m_options.m_files);
+                        timed(p_result, 0, _op);
+                }
+        }
+
+        void list_dir(size_t p_index,
+                      thread_result &p_result) {
+                list_op _op;
+                _op.m_path = thread_dir(p_index);
+                _op.m_expected = m_options.m_files;
+                p_result.m_latencies.reserve(m_options.m_rounds);
+                for(size_t i = 0; i < m_options.m_rounds; ++i)
+                {
+                        timed(p_result, 0, _op);
+                }
+        }
+
+        template<typename Op>
+        void repeat(const Op &p_op,
+                    size_t,
+                    thread_result &p_result) {
+                p_result.m_latencies.reserve(m_options.m_rounds);
+                for(size_t i = 0; i < m_options.m_rounds; ++i)
+                {
+                        timed(p_result, 0, p_op);
+                }
+        }
+
+        // 建立目录不计时，每种大小测试后删除
+        bool list_scale() {
+                for(size_t i = 0; i < m_options.m_entries.size(); ++i)
+                {
+                        const size_t _entries = m_options.m_entries[i];
+                        std::ostringstream _dir;
+                        _dir << m_root << "/scale." << _entries;
+                        if(! Backend::mkdir(_dir.str()))
+                        {
+                                std::cerr << "can not create " << _dir.str() << std::endl;
+                                return false;
+                        }
+                        create_op _create;
+                        for(size_t n = 0; n < _entries; ++n)
+                        {
+                                std::ostringstream _path;
+                                _path << _dir.str() << "/f" << n;
+                                _create.m_path = _path.str();
+                                if(! _create())
+                                {
+                                        std::cerr << "can not create " << _create.m_path << std::endl;
+                                        return false;
+                                }
+                        }
+
+                        const list_op _list = {_dir.str(), _entries};
+                        const list_stat_op _list_stat = {_dir.str(), _entries};
+                        const bool _ok =
+                                report("listdir_scale", _entries,
+                                       run_threads(boost::bind(&runner::repeat<list_op>, this,
+                                                               boost::cref(_list), _1, _2))) &&
+                                report("listdir_stat", _entries,
+                                       run_threads(boost::bind(&runner::repeat<list_stat_op>, this,
+                                                               boost::cref(_list_stat), _1, _2)));
+                        Backend::remove(_dir.str());
+                        if(! _ok)
+                                return false;
+                }
+                return true;
+        }
+
+        void async_read(size_t p_depth,
+                        size_t p_index,
+                        size_t p_block_size,
+                        thread_result &p_result) {
+                async_reader<Backend>::rand_read(data_file(p_index), p_depth, p_block_size,
+                                                 block_count(p_block_size), m_options.m_ops,
+                                                 0x9E3779B97F4A7C15ULL * (p_index + 1), p_result);
+        }
+
+        bool async_sweep() {
+                if(! async_reader<Backend>::supported())
+                {
+                        std::cerr << "asyncread: " << Backend::name()
+                                  << " has no asynchronous interface, skipped" << std::endl;
+                        return true;
+                }
+                if(! prepare_data_files())
+                        return false;
+                const char * const _prefix = async_reader<Backend>::is_uring()
+                        ? "asyncread.qd" : "asyncread_pool.qd";
+                for(size_t i = 0; i < m_options.m_block_sizes.size(); ++i)
+                {
+                        for(size_t d = 0; d < m_options.m_depths.size(); ++d)
+                        {
+                                std::ostringstream _name;
+                                _name << _prefix << m_options.m_depths[d];
+                                if(! report(_name.str(), m_options.m_block_sizes[i],
+                                            run_threads(boost::bind(&runner::async_read, this,
+                                                                    m_options.m_depths[d], _1,
+                                                                    m_options.m_block_sizes[i], _2))))
+                                        return false;
+                        }
+                }
+                return true;
+        }
+
+        // 目录树不计时建立，在本线程中用一次remove删除
+        bool remove_tree_once(const std::string &p_name,
+                              size_t p_threads) {
+                static const size_t TREE_DIRS = 64;
+                const std::string _tree = m_root + "/tree";
+                if(! Backend::mkdir(_tree))
+                {
+                        std::cerr << "can not create " << _tree << std::endl;
+                        return false;
+                }
+                create_op _create;
+                for(size_t d = 0; d < TREE_DIRS; ++d)
+                {
+                        std::ostringstream _dir;
+                        _dir << _tree << "/d" << d;
+                        if(! Backend::mkdir(_dir.str()))
+                        {
+                                std::cerr << "can not create " << _dir.str() << std::endl;
+                                return false;
+                        }
+                        for(size_t n = 0; n < m_options.m_files; ++n)
+                        {
+                                std::ostringstream _path;
+                                _path << _dir.str() << "/f" << n;
+                                _create.m_path = _path.str();
+                                if(! _create())
+                                {
+                                        std::cerr << "can not create " << _create.m_path << std::endl;
+                                        return false;
+                                }
+                        }
+                }
+
+                std::vector<thread_result> _results(1);
+                thread_result &_result = _results[0];
+                _result.m_start_ns = now_ns();
+                if(! remove_tree<Backend>(_tree, p_threads))
+                        ++ _result.m_errors;
+                _result.m_end_ns = now_ns();
+                _result.m_latencies.push_back(_result.m_end_ns - _result.m_start_ns);
+                _result.m_ops = TREE_DIRS * (m_options.m_files + 1) + 1;
+                m_elapsed_ns = _result.m_end_ns - _result.m_start_ns;
+                m_cache_delta_kb = 0;
+                return report(p_name, 0, _results, p_threads);
+        }
+
+        void delete_files(size_t p_index,
+                          thread_result &p_result) {
+                remove_op _op;
+                p_result.m_latencies.reserve(m_options.m_files);
+                for(size_t i = 0; i < m_options.m_files; ++i)
+                {
+                        _op.m_path = small_file(p_index, i);
+                        timed(p_result, 0, _op);
+                }
+        }
+
+        const options &m_options;
+        std::string m_root;
+        uint64_t m_elapsed_ns;
+        int64_t m_cache_delta_kb;	// 最近一次run_threads前后page cache的变化
+        uint64_t m_rpc_saved;		// 元数据缓存省去的远程调用，见metadata_cache_scope
+};
+
+void usage(const char *p_program) {
+        std::cerr << "usage: " << p_program << " [options]\n"
+                  << "  --backend NAME     localfs, gfs or memfs (default localfs)\n"
+                  << "  --conf PATH        configuration passed to init\n"
+                  << "  --dir PATH         base directory (default /tmp)\n"
+                  << "  --workloads LIST   comma separated, or all (default)\n"
+                  << "  --bs LIST          block sizes, e.g. 4k,64k,1m (default 4k,1m)\n"
+                  << "  --threads N        (default 1)\n"
+                  << "  --size SIZE        data file size per thread (default 64m)\n"
+                  << "  --files N          files created per thread (default 1000)\n"
+                  << "  --ops N            random operations per thread (default 10000)\n"
+                  << "  --rounds N         list_files calls per thread (default 10)\n"
+                  << "  --handles N        handles per file for rangeread (default 4)\n"
+                  << "  --entries LIST     directory sizes for listdir_scale (default 10000,100000,1000000)\n"
+                  << "  --depths LIST      queue depths for asyncread (default 1,4,16,64)\n"
+                  << "  --sparse           data files are mostly holes\n"
+                  << "  --keep             keep the benchmark directory\n";
+}
+
+bool parse_options(int p_argc,
+                   char **p_argv,
+                   options &p_options) {
+        std::string _block_sizes = "4k,1m";
+        for(int i = 1; i < p_argc; ++i)
+        {
+                const std::string _name = p_argv[i];
+                if(_name == "--keep")
+                {
+                        p_options.m_keep = true;
+                        continue;
+                }
+                if(_name == "--sparse")
+                {
+                        p_options.m_sparse = true;
+                        continue;
+                }
+                if(i + 1 >= p_argc)
+                        return false;
+                const std::string _value = p_argv[++ i];
+                uint64_t _number = 0;
+                if(_name == "--backend")
+                        p_options.m_backend = _value;
+                else if(_name == "--conf")
+                        p_options.m_conf = _value;
+                else if(_name == "--dir")
+                        p_options.m_dir = _value;
+                else if(_name == "--workloads")
+                        p_options.m_workloads = _value;
+                else if(_name == "--bs")
+                        _block_sizes = _value;
+                else if(_name == "--depths")
+                {
+                        p_options.m_depths = split_sizes(_value);
+                        if(p_options.m_depths.empty())
+                                return false;
+                }
+                else if(_name == "--entries")
+                {
+                        p_options.m_entries = split_sizes(_value);
+                        if(p_options.m_entries.empty())
+                                return false;
+                }
+                else if(! parse_size(_value, _number))
+                        return false;
+                else if(_name == "--threads")
+                        p_options.m_threads = size_t(std::max<uint64_t>(_number, 1));
+                else if(_name == "--size")
+                        p_options.m_file_size = _number;
+                else if(_name == "--files")
+                        p_options.m_files = size_t(std::max<uint64_t>(_number, 1));
+                else if(_name == "--ops")
+                        p_options.m_ops = size_t(_number);
+                else if(_name == "--rounds")
+                        p_options.m_rounds = size_t(_number);
+                else if(_name == "--handles")
+                        p_options.m_handles = size_t(std::max<uint64_t>(_number, 1));
+                else
+                        return false;
+        }
+
+        const std::vector<std::string> _sizes = split(_block_sizes);
+        for(size_t i = 0; i < _sizes.size(); ++i)
+        {
+                uint64_t _size = 0;
+                if(! parse_size(_sizes[i], _size) || _size == 0)
+                        return false;
+                p_options.m_block_sizes.push_back(size_t(_size));
+        }
+        return ! p_options.m_block_sizes.empty();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+        options _options;
+        if(! parse_options(argc, argv, _options))
+        {
+                usage(argv[0]);
+                return 2;
+        }
+
+        int _ret = 2;
+        if(_options.m_backend == "localfs")
+                _ret = runner<localfs_backend>(_options).run();
+        else if(_options.m_backend == "gfs")
+                _ret = runner<gfs_backend>(_options).run();
+        else if(_options.m_backend == "memfs")
+                _ret = runner<memfs_backend>(_options).run();
+        else
+        {
+                usage(argv[0]);
+                return 2;
+        }
+
+#ifdef FS_METRICS_ENABLED
+        fsutil::snapshot().write_json(std::cout);
+        std::cout << std::endl;
+#endif
+        return _ret;
+}
@@ -4,9 +4,22 @@
 #define _GFS_HPP_
 
 #include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
 #include <cassert>
+#include <list>
+#include <map>
 
 #include <sys/uio.h>		// for iovec
+#include <fcntl.h>		// for POSIX_FADV_*
+#include <time.h>		// for clock_gettime
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "metrics.hpp"
 
 #include <gfs_client/file_system.h>
 #include <gfs_client/file.h>
@@ -22,24 +35,30 @@
 #	define RETRY_DO do
 #	define RETRY_LOG(msg)
 #	define RETRY_ON(cond) while(false)
+#	define GFS_METRIC_END(ok, bytes)					\
+	FS_METRIC_END_RETRY((ok), (bytes), get_errno(), 0, 0)
 
 #else
 
-#	include <unistd.h>		// for usleep
+#	include <map>
+#	include <errno.h>
+#	include <time.h>		// for clock_gettime, nanosleep
+#	include <pthread.h>
 
 #ifndef RETRY_HOOK
 #       define RETRY_HOOK(errno, couter) // nothing
 #endif
 
-#	define RETRY_DO std::size_t retry_counter = 0; do
-#	define RETRY_LOG(msg) do {					\
-		if(retry_counter != 0)					\
-		{							\
-                        RETRY_HOOK(get_errno(), retry_counter);         \
-			retry_interval_sleep();				\
-		}							\
-	}while(false)
-#	define RETRY_ON(cond) while((cond) && can_retry(retry_counter ++))
+// 重试的状态保存在retry_context中，策略见retry_policy
+#	define RETRY_DO retry_context retry_ctx; do
+#	define RETRY_LOG(msg) retry_ctx.before_attempt(msg)
+#	define RETRY_ON(cond) while((cond) && retry_ctx.should_retry(get_errno()))
+// 重试次数和等待的时间计入统计，等待之外的时间都算作gfs client的延迟。
+// 操作的结果只有这里知道：RETRY_ON的条件在不需要重试的错误上也为false
+#	define GFS_METRIC_END(ok, bytes)					\
+	retry_ctx.finish((ok), get_errno());				\
+	FS_METRIC_END_RETRY((ok), (bytes), get_errno(),			\
+			    retry_ctx.retries(), retry_ctx.slept_us())
 
 #endif	// GFS_RETRY_DISABLED
 
@@ -59,20 +78,222 @@ namespace gfs
 #	define GFS_RETRY_INTERVAL 9
 #endif  // GFS_RETRY_INTERVAL
 
-static const std::size_t retry_times = GFS_RETRY_TIMES;
-static const std::size_t retry_interval = GFS_RETRY_INTERVAL; // seconds
+// 每个操作结束（成功或放弃重试）时调用一次，可以用来统计延迟分布。
+// p_operation为RETRY_LOG的参数，p_errno为0表示成功，
+// p_attempts为尝试的次数，p_elapsed_us为包括重试在内的总耗时
+typedef void (*retry_hook_type)(const char *p_operation,
+                                int p_errno,
+                                std::size_t p_attempts,
+                                uint64_t p_elapsed_us);
+
+enum retry_class
+{
+        RC_RETRY,		// 可以重试
+        RC_NO_RETRY		// 重试也不会成功，比如文件已存在、不存在
+};
+
+//
+// 重试策略：指数退避加随机抖动，每个操作有总的期限。
+// 第n次重试前等待 min(m_max_interval_us, m_initial_interval_us * m_multiplier^n)，
+// 再随机减去其中的m_jitter比例。
+//
+struct retry_policy
+{
+        retry_policy()
+                : m_max_retries(GFS_RETRY_TIMES),
+                  m_initial_interval_us(50 * 1000),
+                  m_max_interval_us(uint64_t(GFS_RETRY_INTERVAL) * 1000 * 1000),
+                  m_multiplier(2.0),
+                  m_jitter(0.5),
+                  m_deadline_us(uint64_t(GFS_RETRY_TIMES) * GFS_RETRY_INTERVAL * 1000 * 1000),
+                  m_default_class(RC_RETRY),
+                  m_hook(NULL) {
+                m_classes[ERR_EXIST] = RC_NO_RETRY;
+                m_classes[ERR_NODE_NOEXIST] = RC_NO_RETRY;
+        }
+
+        retry_class classify(int p_errno) const {
+                std::map<int, retry_class>::const_iterator _iter = m_classes.find(p_errno);
+                return (_iter == m_classes.end()) ? m_default_class : _iter->second;
+        }
+
+        std::size_t m_max_retries;
+        uint64_t m_initial_interval_us;
+        uint64_t m_max_interval_us;
+        double m_multiplier;
+        double m_jitter;		// [0, 1]
+        uint64_t m_deadline_us;		// 0表示不限时间，只限次数
+        retry_class m_default_class;	// 不在m_classes中的错误
+        std::map<int, retry_class> m_classes;
+        retry_hook_type m_hook;
+};
 
 inline
-bool can_retry(std::size_t i) {
-        return i < retry_times;
+retry_policy *&global_retry_policy() {
+        static retry_policy *_policy = new retry_policy;
+        return _policy;
 }
 
-// 由于gfs内部有重试、sleep机制，所以这里就不需要sleep了
 inline
-void retry_interval_sleep() {
-        ::sleep(retry_interval);
+retry_policy *&thread_retry_policy() {
+        static __thread retry_policy *_policy = NULL;
+        return _policy;
 }
 
+// 设置全局的策略，需要在其它线程使用gfs之前调用
+inline
+void set_retry_policy(const retry_policy &p_policy) {
+        *global_retry_policy() = p_policy;
+}
+
+inline
+const retry_policy &get_retry_policy() {
+        const retry_policy *_policy = thread_retry_policy();
+        return (_policy != NULL) ? *_policy : *global_retry_policy();
+}
+
+// 在当前线程的作用域内使用另外的策略，比如期限更短的
+class scoped_retry_policy : boost::noncopyable
+{
+public:
+        explicit scoped_retry_policy(retry_policy &p_policy)
+                : m_saved(thread_retry_policy()) {
+                thread_retry_policy() = &p_policy;
+        }
+
+        ~scoped_retry_policy() {
+                thread_retry_policy() = m_saved;
+        }
+
+private:
+        retry_policy *m_saved;
+};
+
+// 一次操作（包括所有重试）的状态，由RETRY_DO等宏使用
+class retry_context : boost::noncopyable
+{
+public:
+        retry_context()
+                : m_policy(get_retry_policy()),
+                  m_operation(""),
+                  m_start_us(now_us()),
+                  m_sleep_us(0),
+                  m_slept_us(0),
+                  m_attempts(0),
+                  m_errno(0),
+                  m_failed(false),
+                  m_finished(false) {}
+
+        // 没有调用finish时，只知道should_retry见过的失败
+        ~retry_context() {
+                if(m_policy.m_hook != NULL)
+                {
+                        m_policy.m_hook(m_operation,
+                                        m_failed ? m_errno : 0,
+                                        m_attempts,
+                                        now_us() - m_start_us);
+                }
+        }
+
+        void before_attempt(const char *p_operation) {
+                m_operation = p_operation;
+                if(m_attempts != 0)
+                {
+                        RETRY_HOOK(m_errno, m_attempts);
+                        sleep_us(m_sleep_us);
+                        m_slept_us += m_sleep_us;
+                }
+                ++ m_attempts;
+                m_failed = false;
+        }
+
+        // 操作（包括所有重试）的最终结果，由GFS_METRIC_END调用；
+        // 多次调用时以第一次为准
+        void finish(bool p_ok,
+                    int p_errno) {
+                if(m_finished)
+                        return;
+                m_finished = true;
+                m_failed = ! p_ok;
+                m_errno = p_ok ? 0 : (p_errno == 0 ? -1 : p_errno);
+        }
+
+        // 本次尝试失败，决定是否重试并计算下次等待的时间
+        bool should_retry(int p_errno) {
+                m_failed = true;
+                m_errno = p_errno;
+                if(m_attempts > m_policy.m_max_retries ||
+                   m_policy.classify(p_errno) == RC_NO_RETRY)
+                        return false;
+
+                double _interval = double(m_policy.m_initial_interval_us);
+                for(std::size_t i = 1; i < m_attempts && _interval < m_policy.m_max_interval_us; ++i)
+                {
+                        _interval *= m_policy.m_multiplier;
+                }
+                _interval = std::min(_interval, double(m_policy.m_max_interval_us));
+                _interval -= _interval * m_policy.m_jitter * random_ratio();
+                m_sleep_us = uint64_t(_interval);
+
+                if(m_policy.m_deadline_us != 0)
+                {
+                        const uint64_t _elapsed = now_us() - m_start_us;
+                        if(_elapsed >= m_policy.m_deadline_us)
+                                return false;
+                        m_sleep_us = std::min(m_sleep_us, m_policy.m_deadline_us - _elapsed);
+                }
+                return true;
+        }
+
+        // 已经重试的次数
+        std::size_t retries() const {
+                return m_attempts == 0 ? 0 : m_attempts - 1;
+        }
+
+        // 重试前等待的总时间
+        uint64_t slept_us() const {
+                return m_slept_us;
+        }
+
+private:
+        static uint64_t now_us() {
+                struct timespec _now;
+                ::clock_gettime(CLOCK_MONOTONIC, &_now);
+                return uint64_t(_now.tv_sec) * 1000 * 1000 + _now.tv_nsec / 1000;
+        }
+
+        static void sleep_us(uint64_t p_us) {
+                struct timespec _request;
+                _request.tv_sec = time_t(p_us / (1000 * 1000));
+                _request.tv_nsec = long(p_us % (1000 * 1000)) * 1000;
+                while(::nanosleep(&_request, &_request) != 0 && errno == EINTR)
+                        ;
+        }
+
+        // [0, 1)之间的随机数，各线程独立
+        static double random_ratio() {
+                static __thread uint64_t _state = 0;
+                if(_state == 0)
+                {
+                        _state = (now_us() << 16) ^ uint64_t(::pthread_self()) ^ 0x9E3779B97F4A7C15ULL;
+                }
+                _state ^= _state << 13;
+                _state ^= _state >> 7;
+                _state ^= _state << 17;
+                return double(_state >> 11) / double(1ULL << 53);
+        }
+
+        const retry_policy &m_policy;
+        const char *m_operation;
+        const uint64_t m_start_us;
+        uint64_t m_sleep_us;	// 下次重试前要等待的时间
+        uint64_t m_slept_us;
+        std::size_t m_attempts;
+        int m_errno;
+        bool m_failed;
+        bool m_finished;	// 调用过finish
+};
+
 #endif	// GFS_RETRY_DISABLED
 
 typedef FileSystem filesystem_type;
@@ -90,6 +311,12 @@ filesystem_type *file_system() {
         return filesystem_type::get();
 }
 
+// 使用已有的（默认的）配置
+inline
+void init() {
+        assert(file_system() != NULL);
+}
+
 inline
 int get_errno() {
         return gfs_errno;
@@ -125,6 +352,10 @@ void iovec_init(iovec_t &iov,
 static const file_t BAD_FILE = NULL;
 static const offset_t BAD_OFFSET = -1LL;
 
+// pread等通过seek实现，多个线程不能同时对同一个file_t调用，
+// 见gfs_pread.hpp, handle_cache.ipp
+static const bool CONCURRENT_PREAD = false;
+
 enum seek_type
 {
         ST_SEEK_SET = SEEK_SET,
@@ -146,6 +377,17 @@ enum mode_type
 };
 typedef mode_type mode_t;
 
+// advise的访问方式提示，取值同posix_fadvise
+enum advice_type
+{
+        AT_NORMAL = POSIX_FADV_NORMAL,
+        AT_SEQUENTIAL = POSIX_FADV_SEQUENTIAL,
+        AT_RANDOM = POSIX_FADV_RANDOM,
+        AT_WILLNEED = POSIX_FADV_WILLNEED,
+        AT_DONTNEED = POSIX_FADV_DONTNEED
+};
+typedef advice_type advice_t;
+
 typedef ::FileStatus file_status;
 
 inline
@@ -153,6 +395,12 @@ size_t get_size(const file_status &p_status) {
         return p_status.get_len();
 }
 
+// FileStatus没有修改时间，返回0表示未知
+inline
+time_t get_mtime(const file_status &) {
+        return 0;
+}
+
 inline
 bool is_directory(const file_status &p_status) {
         return p_status.is_dir();
@@ -184,17 +432,282 @@ bool is_regular(const file_info &p_info) {
         return p_info.m_is_dir == false;
 }
 
+//
+// stat, exists等的元数据缓存，默认关闭，用enable_metadata_cache打开。
+// 同时缓存存在（含file_status）和不存在的结果，各有自己的TTL；
+// 本进程的create, remove, rename, mkdir会使相应的项失效，其他
+// 进程的修改最多在TTL之后可见。stat的文件长度在TTL内可能不是最新的。
+//
+class metadata_cache : boost::noncopyable
+{
+public:
+        enum lookup_result
+        {
+                LR_MISS,
+                LR_EXISTS,
+                LR_NOT_EXISTS
+        };
+
+        struct stats
+        {
+                uint64_t m_hits;		// 省去的远程调用
+                uint64_t m_negative_hits;	// 其中不存在的
+                uint64_t m_misses;
+                uint64_t m_invalidations;
+                uint64_t m_evictions;
+        };
+
+        metadata_cache(uint64_t p_ttl_ms,
+                       uint64_t p_negative_ttl_ms,
+                       std::size_t p_capacity)
+                : m_ttl_us(p_ttl_ms * 1000),
+                  m_negative_ttl_us(p_negative_ttl_ms * 1000),
+                  m_shard_capacity(std::max<std::size_t>(1, p_capacity / SHARD_COUNT)) {}
+
+        // p_status为NULL时只查询是否存在
+        lookup_result lookup(const char *p_path,
+                             file_status *p_status) {
+                shard &_shard = get_shard(p_path);
+                const uint64_t _now = now_us();
+                boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                entry_map::iterator _iter = _shard.m_entries.find(p_path);
+                if(_iter == _shard.m_entries.end() ||
+                   _iter->second.m_expire_us <= _now ||
+                   (p_status != NULL && _iter->second.m_exists && ! _iter->second.m_has_status))
+                {
+                        ++ _shard.m_stats.m_misses;
+                        return LR_MISS;
+                }
+                ++ _shard.m_stats.m_hits;
+                if(! _iter->second.m_exists)
+                {
+                        ++ _shard.m_stats.m_negative_hits;
+                        return LR_NOT_EXISTS;
+                }
+                if(p_status != NULL)
+                {
+                        *p_status = _iter->second.m_status;
+                }
+                return LR_EXISTS;
+        }
+
+        // p_status为NULL时只记录是否存在
+        void store(const char *p_path,
+                   bool p_exists,
+                   const file_status *p_status) {
+                shard &_shard = get_shard(p_path);
+                const uint64_t _expire = now_us() + (p_exists ? m_ttl_us : m_negative_ttl_us);
+                boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                entry_map::iterator _iter = _shard.m_entries.find(p_path);
+                if(_iter == _shard.m_entries.end())
+                {
+                        while(_shard.m_entries.size() >= m_shard_capacity)
+                        {
+                                // 按插入顺序淘汰最老的
+                                _shard.m_entries.erase(_shard.m_order.front());
+                                _shard.m_order.pop_front();
+                                ++ _shard.m_stats.m_evictions;
+                        }
+                        _shard.m_order.push_back(p_path);
+                        _iter = _shard.m_entries.insert(
+                                std::make_pair(_shard.m_order.back(), entry())).first;
+                        _iter->second.m_order = -- _shard.m_order.end();
+                }
+                _iter->second.m_exists = p_exists;
+                _iter->second.m_has_status = (p_status != NULL);
+                if(p_status != NULL)
+                {
+                        _iter->second.m_status = *p_status;
+                }
+                _iter->second.m_expire_us = _expire;
+        }
+
+        // 使p_path失效；p_recursive时p_path之下的所有项也失效
+        void invalidate(const char *p_path,
+                        bool p_recursive) {
+                erase(get_shard(p_path), p_path);
+                if(! p_recursive)
+                        return;
+
+                std::string _prefix = p_path;
+                if(_prefix.empty() || _prefix[_prefix.size() - 1] != '/')
+                {
+                        _prefix += '/';
+                }
+                // 每个分片中p_path之下的项是连续的一段
+                for(std::size_t i = 0; i < SHARD_COUNT; ++i)
+                {
+                        shard &_shard = m_shards[i];
+                        boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                        entry_map::iterator _iter = _shard.m_entries.lower_bound(_prefix);
+                        while(_iter != _shard.m_entries.end() &&
+                              _iter->first.compare(0, _prefix.size(), _prefix) == 0)
+                        {
+                                _shard.m_order.erase(_iter->second.m_order);
+                                _shard.m_entries.erase(_iter++);
+                                ++ _shard.m_stats.m_invalidations;
+                        }
+                }
+        }
+
+        // 是否已知p_path不是目录，此时删除、改名时不需要让子项失效
+        bool is_known_file(const char *p_path) {
+                shard &_shard = get_shard(p_path);
+                boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                entry_map::const_iterator _iter = _shard.m_entries.find(p_path);
+                return _iter != _shard.m_entries.end() &&
+                        _iter->second.m_exists &&
+                        _iter->second.m_has_status &&
+                        (! _iter->second.m_status.is_dir());
+        }
+
+        stats get_stats() {
+                stats _stats = stats();
+                for(std::size_t i = 0; i < SHARD_COUNT; ++i)
+                {
+                        boost::mutex::scoped_lock _lock(m_shards[i].m_mutex);
+                        const stats &_shard = m_shards[i].m_stats;
+                        _stats.m_hits += _shard.m_hits;
+                        _stats.m_negative_hits += _shard.m_negative_hits;
+                        _stats.m_misses += _shard.m_misses;
+                        _stats.m_invalidations += _shard.m_invalidations;
+                        _stats.m_evictions += _shard.m_evictions;
+                }
+                return _stats;
+        }
+
+        // 打开以后返回全局的缓存，否则返回NULL
+        static metadata_cache *&instance() {
+                static metadata_cache *_cache = NULL;
+                return _cache;
+        }
+
+private:
+        enum {
+                SHARD_COUNT = 64
+        };
+
+        struct entry
+        {
+                bool m_exists;
+                bool m_has_status;
+                file_status m_status;
+                uint64_t m_expire_us;
+                std::list<std::string>::iterator m_order;
+        };
+
+        // 有序，以便找出目录下的所有项
+        typedef std::map<std::string, entry> entry_map;
+
+        struct shard
+        {
+                shard() : m_stats(stats()) {}
+
+                boost::mutex m_mutex;
+                entry_map m_entries;
+                std::list<std::string> m_order; // 插入顺序
+                stats m_stats;
+        };
+
+        static uint64_t now_us() {
+                struct timespec _now;
+                ::clock_gettime(CLOCK_MONOTONIC, &_now);
+                return uint64_t(_now.tv_sec) * 1000 * 1000 + _now.tv_nsec / 1000;
+        }
+
+        shard &get_shard(const char *p_path) {
+                std::size_t _hash = 5381;
+                for(const char *_pos = p_path; *_pos != '\0'; ++_pos)
+                {
+                        _hash = _hash * 33 + static_cast<unsigned char>(*_pos);
+                }
+                return m_shards[_hash % SHARD_COUNT];
+        }
+
+        void erase(shard &p_shard, const char *p_path) {
+                boost::mutex::scoped_lock _lock(p_shard.m_mutex);
+                entry_map::iterator _iter = p_shard.m_entries.find(p_path);
+                if(_iter != p_shard.m_entries.end())
+                {
+                        p_shard.m_order.erase(_iter->second.m_order);
+                        p_shard.m_entries.erase(_iter);
+                        ++ p_shard.m_stats.m_invalidations;
+                }
+        }
+
+        const uint64_t m_ttl_us;
+        const uint64_t m_negative_ttl_us;
+        const std::size_t m_shard_capacity;
+        shard m_shards[SHARD_COUNT];
+};
+
+// 打开元数据缓存，需要在其它线程使用gfs之前调用
+inline
+void enable_metadata_cache(uint64_t p_ttl_ms = 1000,
+                           uint64_t p_negative_ttl_ms = 200,
+                           std::size_t p_capacity = 1024 * 1024) {
+        delete metadata_cache::instance();
+        metadata_cache::instance() = new metadata_cache(p_ttl_ms,
+                                                        p_negative_ttl_ms,
+                                                        p_capacity);
+}
+
+// 关闭元数据缓存，同样不能与其它线程中的gfs调用同时进行
 inline
-bool exists(const char *p_path) {
+void disable_metadata_cache() {
+        delete metadata_cache::instance();
+        metadata_cache::instance() = NULL;
+}
+
+// 本进程修改了p_path，使缓存中的相应项失效
+inline
+void invalidate_metadata(const char *p_path,
+                         bool p_recursive = false) {
+        metadata_cache * const _cache = metadata_cache::instance();
+        if(_cache != NULL)
+        {
+                _cache->invalidate(p_path,
+                                   p_recursive && ! _cache->is_known_file(p_path));
+        }
+}
+
+namespace detail
+{
+
+// 不经过缓存，create, mkdir确认结果时使用
+inline
+bool remote_exists(const char *p_path) {
+        FS_METRIC_BEGIN(MB_GFS, OP_STAT);
         int32_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::exists failed");
                 ret = file_system()->exists(p_path);
         } RETRY_ON ((ret != 0) && (ret != 1));
+        GFS_METRIC_END((ret == 0) || (ret == 1), 0);
         // TODO: 可能这里无限重试更好？
         return ret == 1;
 }
 
+} // namespace detail
+
+inline
+bool exists(const char *p_path) {
+        metadata_cache * const _cache = metadata_cache::instance();
+        if(_cache == NULL)
+                return detail::remote_exists(p_path);
+
+        FS_METRIC_BEGIN(MB_GFS, OP_STAT);
+        const metadata_cache::lookup_result _cached = _cache->lookup(p_path, NULL);
+        if(_cached != metadata_cache::LR_MISS)
+        {
+                FS_METRIC_END_RETRY(true, 0, 0, 0, ::fsutil::LOCAL_ONLY);
+                return _cached == metadata_cache::LR_EXISTS;
+        }
+        const bool _exists = detail::remote_exists(p_path);
+        _cache->store(p_path, _exists, NULL);
+        return _exists;
+}
+
 inline
 bool close(file_t p_file) {
         return file_system()->close(p_file) == 0;
@@ -203,6 +716,7 @@ bool close(file_t p_file) {
 inline
 file_t open(const char *p_path,
             mode_t p_mode = MT_O_RDONLY) {
+        FS_METRIC_BEGIN(MB_GFS, OP_OPEN);
         file_t fd = BAD_FILE;
         RETRY_DO {
                 RETRY_LOG("gfs::open failed");
@@ -210,13 +724,19 @@ file_t open(const char *p_path,
                                          static_cast<int32_t>(p_mode));
         } RETRY_ON ((fd == BAD_FILE)
                     && (ERR_EXIST != get_errno())); // 文件已存在错误则不重试
+        GFS_METRIC_END(fd != BAD_FILE, 0);
+        if(p_mode & (MT_O_CREATE | MT_O_TRUNC))
+        {
+                invalidate_metadata(p_path);
+        }
         return fd;
 }
 
 inline
 file_t open(const char *p_path,
-            mode_t p_mode = MT_O_RDONLY,
+            mode_t p_mode,
             std::size_t replica_number) {
+        FS_METRIC_BEGIN(MB_GFS, OP_OPEN);
         file_t fd = BAD_FILE;
         RETRY_DO {
                 RETRY_LOG("gfs::open failed");
@@ -225,11 +745,17 @@ file_t open(const char *p_path,
                                          static_cast<int32_t>(replica_number));
         } RETRY_ON ((fd == BAD_FILE)
                     && (ERR_EXIST != get_errno())); // 文件已存在错误则不重试
+        GFS_METRIC_END(fd != BAD_FILE, 0);
+        if(p_mode & (MT_O_CREATE | MT_O_TRUNC))
+        {
+                invalidate_metadata(p_path);
+        }
         return fd;
 }
 
 inline
 file_t create(const char *p_path) {
+        FS_METRIC_BEGIN(MB_GFS, OP_OPEN);
         file_t fd = BAD_FILE;
         RETRY_DO {
                 RETRY_LOG("gfs::create failed");
@@ -239,15 +765,18 @@ file_t create(const char *p_path) {
                 }
                 fd = file_system()->creat(p_path);
         } RETRY_ON ((fd == BAD_FILE) &&
-                    (! exists(p_path)));
+                    (! detail::remote_exists(p_path)));
+        GFS_METRIC_END(fd != BAD_FILE, 0);
         // 创建成功后，验证文件是否存在；因为发生过创建
         // 成功后，文件不存在的现象。
+        invalidate_metadata(p_path);
         return fd;
 }
 
 inline
 file_t create(const char *p_path,
               std::size_t replica_number) {
+        FS_METRIC_BEGIN(MB_GFS, OP_OPEN);
         file_t fd = BAD_FILE;
         RETRY_DO {
                 RETRY_LOG("gfs::create failed");
@@ -258,9 +787,11 @@ file_t create(const char *p_path,
                 fd = file_system()->creat(p_path,
                                           static_cast<int32_t>(replica_number));
         } RETRY_ON ((fd == BAD_FILE) &&
-                    (! exists(p_path)));
+                    (! detail::remote_exists(p_path)));
+        GFS_METRIC_END(fd != BAD_FILE, 0);
         // 创建成功后，验证文件是否存在；因为发生过创建
         // 成功后，文件不存在的现象。
+        invalidate_metadata(p_path);
         return fd;
 }
 
@@ -268,24 +799,58 @@ inline
 ssize_t read(file_t p_file,
              void *p_buffer,
              size_t p_count) {
+        FS_METRIC_BEGIN(MB_GFS, OP_READ);
         ssize_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::read failed");
                 ret = p_file->read(p_buffer, p_count);
         } RETRY_ON ((ret == -1LL)
                     && (ERR_NODE_NOEXIST != get_errno()));
+        GFS_METRIC_END(ret >= 0, ret);
         return ret;
 }
 
+// gfs没有readv，这里先读到一块连续的buffer中，再分散到各个iov
+inline
+ssize_t readv(file_t p_file,
+              const iovec_t *p_iov,
+              size_t p_count) {
+        if(p_count == 1)
+        {
+                return read(p_file, p_iov[0].iov_base, p_iov[0].iov_len);
+        }
+
+        size_t _total = 0;
+        for(size_t i = 0; i < p_count; ++i)
+        {
+                _total += p_iov[i].iov_len;
+        }
+        if(_total == 0)
+                return 0;
+
+        std::vector<char> _buffer(_total);
+        const ssize_t _ret = read(p_file, &_buffer[0], _total);
+        size_t _pos = 0;
+        for(size_t i = 0; (i < p_count) && (_ret > 0) && (_pos < size_t(_ret)); ++i)
+        {
+                const size_t _len = std::min(p_iov[i].iov_len, size_t(_ret) - _pos);
+                std::memcpy(p_iov[i].iov_base, &_buffer[_pos], _len);
+                _pos += _len;
+        }
+        return _ret;
+}
+
 inline
 offset_t append(file_t p_file,
                 const void *p_buffer,
                 size_t p_count) {
+        FS_METRIC_BEGIN(MB_GFS, OP_APPEND);
         offset_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::append failed");
                 ret = p_file->append(p_buffer, p_count);
         } RETRY_ON(ret < 0);
+        GFS_METRIC_END(ret >= 0, p_count);
         return ret;
 }
 
@@ -293,12 +858,14 @@ inline
 ssize_t write(file_t p_file,
               const void *p_buffer,
               size_t p_count) {
+        FS_METRIC_BEGIN(MB_GFS, OP_WRITE);
         ssize_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::write failed");
                 ret = p_file->write(p_buffer, p_count);
         } RETRY_ON((ret < 0)
                    && (ERR_NODE_NOEXIST != get_errno()));
+        GFS_METRIC_END(ret >= 0, ret);
         return ret;
 }
 		
@@ -306,12 +873,14 @@ inline
 ssize_t writev(file_t p_file,
                const iovec_t *p_iov,
                size_t p_count) {
+        FS_METRIC_BEGIN(MB_GFS, OP_WRITE);
         ssize_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::write failed");
                 ret = p_file->writev(p_iov, p_count);
         } RETRY_ON((ret < 0)
                    && (ERR_NODE_NOEXIST != get_errno()));
+        GFS_METRIC_END(ret >= 0, ret);
         return ret;
 }
 		
@@ -320,6 +889,7 @@ inline
 offset_t seek(file_t p_file,
               offset_t p_offset,
               seek_t p_whence) {
+        FS_METRIC_BEGIN(MB_GFS, OP_SEEK);
         offset_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::seek failed");
@@ -327,50 +897,93 @@ offset_t seek(file_t p_file,
                                     static_cast<int32_t>(p_whence));
         } RETRY_ON((ret < 0)
                    && (ERR_NODE_NOEXIST != get_errno()));
+        GFS_METRIC_END(ret >= 0, 0);
         return ret;
 }
 
+#include "path_hook.ipp"
+
 inline
 bool remove(const char *p_path) {
+        FS_METRIC_BEGIN(MB_GFS, OP_REMOVE);
         int32_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::remove failed");
                 ret = file_system()->unlink(p_path);
         } RETRY_ON(ret < 0);
+        GFS_METRIC_END(ret == 0, 0);
+        invalidate_metadata(p_path, true);
+        detail::path_changed(p_path);
         return ret == 0;
 }
 
 inline
 bool rename(const char *p_old_path,
             const char *p_new_path) {
+        FS_METRIC_BEGIN(MB_GFS, OP_RENAME);
         int32_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::rename failed");
                 ret = file_system()->rename(p_old_path,
                                             p_new_path);
         } RETRY_ON(ret < 0);
+        GFS_METRIC_END(ret == 0, 0);
+        invalidate_metadata(p_old_path, true);
+        invalidate_metadata(p_new_path, true);
+        detail::path_changed(p_old_path);
+        detail::path_changed(p_new_path);
         return ret == 0;
 }
 
 inline
 bool stat(file_status &p_status,
           const char *p_path) {
-        uint32_t ret = 0;
+        FS_METRIC_BEGIN(MB_GFS, OP_STAT);
+        metadata_cache * const _cache = metadata_cache::instance();
+        if(_cache != NULL)
+        {
+                switch(_cache->lookup(p_path, &p_status))
+                {
+                case metadata_cache::LR_EXISTS:
+                        FS_METRIC_END_RETRY(true, 0, 0, 0, ::fsutil::LOCAL_ONLY);
+                        return true;
+                case metadata_cache::LR_NOT_EXISTS:
+                        set_errno(ERR_NODE_NOEXIST);
+                        FS_METRIC_END_RETRY(false, 0, ERR_NODE_NOEXIST, 0, ::fsutil::LOCAL_ONLY);
+                        return false;
+                default:
+                        break;
+                }
+        }
+
+        int32_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::stat failed");
                 ret = file_system()->stat(p_path, &p_status, true/*get_exact_len*/);
         } RETRY_ON((ret < 0) &&
                    (get_errno() != ERR_NODE_NOEXIST));
+        GFS_METRIC_END(ret == 0, 0);
+
+        if(_cache != NULL)
+        {
+                if(ret == 0)
+                        _cache->store(p_path, true, &p_status);
+                else if(get_errno() == ERR_NODE_NOEXIST)
+                        _cache->store(p_path, false, NULL);
+        }
         return ret == 0;
 }
 
 inline
 bool mkdir(const char *p_path) {
+        FS_METRIC_BEGIN(MB_GFS, OP_MKDIR);
         int32_t ret = 0;
         RETRY_DO {
                 RETRY_LOG("gfs::mkdir failed");
                 ret = file_system()->mkdir(p_path);
-        } RETRY_ON((ret < 0) && (! exists(p_path)));
+        } RETRY_ON((ret < 0) && (! detail::remote_exists(p_path)));
+        GFS_METRIC_END(ret == 0, 0);
+        invalidate_metadata(p_path);
         return ret == 0;
 }
 
@@ -402,6 +1015,7 @@ template<typename FileInfoContainer>
 inline
 bool list_files(FileInfoContainer &p_infos,
                 const char *p_path) {
+        FS_METRIC_BEGIN(MB_GFS, OP_LIST_FILES);
         dir_t _dir = NULL;
         RETRY_DO {
                 RETRY_LOG("gfs::list_files failed");
@@ -409,7 +1023,10 @@ bool list_files(FileInfoContainer &p_infos,
         } RETRY_ON((_dir == NULL) && is_directory(p_path));
 
         if (_dir == NULL)
+        {
+                GFS_METRIC_END(false, 0);
                 return false;
+        }
 
         // 注意，如果有. ..的话，要过滤掉
         Directory::iterator _iter;
@@ -423,6 +1040,7 @@ bool list_files(FileInfoContainer &p_infos,
         }
 
         file_system()->closedir(_dir);
+        GFS_METRIC_END(true, 0);
         return true;
 }
 
@@ -475,15 +1093,47 @@ ssize_t writen(file_t p_file,
 // pread, preadn, pwrite, pwriten 操作，不更新文件指针（偏移量）
 // 
 
+namespace detail
+{
+
+// gfs没有pread等，用seek实现：记住原来的位置，析构时恢复，不改变errno。
+// 同一个file_t不能同时在多个线程中使用，见CONCURRENT_PREAD
+class position_guard : boost::noncopyable
+{
+public:
+        explicit position_guard(file_t p_file)
+                : m_file(p_file),
+                  m_org(gfs::seek(p_file, 0, ST_SEEK_CUR)) {}
+
+        ~position_guard() {
+                if(m_org < 0)
+                        return;
+                const int _errno = get_errno();
+                gfs::seek(m_file, m_org, ST_SEEK_SET);
+                set_errno(_errno);
+        }
+
+        // 取得原来的位置失败时也返回false
+        bool seek(offset_t p_offset) {
+                return m_org >= 0 && gfs::seek(m_file, p_offset, ST_SEEK_SET) >= 0;
+        }
+
+private:
+        file_t m_file;
+        const offset_t m_org;
+};
+
+} // namespace detail
+
 inline
 ssize_t pread(file_t p_file,
               void *p_buffer,
               size_t p_count,
               offset_t p_offset) {
-        offset_t _org = seek(p_file, p_offset, ST_SEEK_SET);
-        ssize_t _ret = read(p_file, p_buffer, p_count);
-        seek(p_file, _org, ST_SEEK_SET);
-        return _ret;
+        detail::position_guard _guard(p_file);
+        if(! _guard.seek(p_offset))
+                return -1;
+        return read(p_file, p_buffer, p_count);
 }
 
 inline
@@ -491,10 +1141,32 @@ ssize_t pwrite(file_t p_file,
                const void *p_buffer,
                size_t p_count,
                offset_t p_offset) {
-        offset_t _org = seek(p_file, p_offset, ST_SEEK_SET);
-        ssize_t _ret = write(p_file, p_buffer, p_count);
-        seek(p_file, _org, ST_SEEK_SET);
-        return _ret;
+        detail::position_guard _guard(p_file);
+        if(! _guard.seek(p_offset))
+                return -1;
+        return write(p_file, p_buffer, p_count);
+}
+
+inline
+ssize_t preadv(file_t p_file,
+               const iovec_t *p_iov,
+               size_t p_count,
+               offset_t p_offset) {
+        detail::position_guard _guard(p_file);
+        if(! _guard.seek(p_offset))
+                return -1;
+        return readv(p_file, p_iov, p_count);
+}
+
+inline
+ssize_t pwritev(file_t p_file,
+                const iovec_t *p_iov,
+                size_t p_count,
+                offset_t p_offset) {
+        detail::position_guard _guard(p_file);
+        if(! _guard.seek(p_offset))
+                return -1;
+        return writev(p_file, p_iov, p_count);
 }
 
 inline
@@ -502,10 +1174,10 @@ ssize_t preadn(file_t p_file,
                void *p_buffer,
                size_t p_count,
                offset_t p_offset) {
-        offset_t _org = seek(p_file, p_offset, ST_SEEK_SET);
-        ssize_t _ret = readn(p_file, p_buffer, p_count);
-        seek(p_file, _org, ST_SEEK_SET);
-        return _ret;
+        detail::position_guard _guard(p_file);
+        if(! _guard.seek(p_offset))
+                return -1;
+        return readn(p_file, p_buffer, p_count);
 }
 
 inline
@@ -513,16 +1185,64 @@ ssize_t pwriten(file_t p_file,
                 const void *p_buffer,
                 size_t p_count,
                 offset_t p_offset) {
-        offset_t _org = seek(p_file, p_offset, ST_SEEK_SET);
-        ssize_t _ret = writen(p_file, p_buffer, p_count);
-        seek(p_file, _org, ST_SEEK_SET);
-        return _ret;
+        detail::position_guard _guard(p_file);
+        if(! _guard.seek(p_offset))
+                return -1;
+        return writen(p_file, p_buffer, p_count);
 }
 
+// gfs client没有page cache，也不能预先分配空间，advise, preallocate
+// 什么也不做；顺序读的预读见readahead_reader::advise
+inline
+bool advise(file_t /*p_file*/,
+            offset_t /*p_offset*/,
+            offset_t /*p_length*/,
+            advice_t /*p_advice*/) {
+        return true;
+}
+
+inline
+bool preallocate(file_t /*p_file*/,
+                 offset_t /*p_length*/) {
+        return true;
+}
+
+// gfs的write, append返回时数据已经写到各个副本，rename在服务端是
+// 原子的，所以sync, datasync, syncfs, sync_directory什么也不做
+inline
+bool sync(file_t /*p_file*/) {
+        return true;
+}
+
+inline
+bool datasync(file_t /*p_file*/) {
+        return true;
+}
+
+inline
+bool syncfs(file_t /*p_file*/) {
+        return true;
+}
+
+inline
+bool sync_directory(const char * /*p_path*/) {
+        return true;
+}
+
+namespace detail
+{
+
+// walk, disk_usage只能按路径逐个stat，见walk.ipp
+struct path_walk_source;
+typedef path_walk_source walk_source;
+
+} // namespace detail
+
 } // namespace gfs
 
 #undef RETRY_DO
 #undef RETRY_LOG
 #undef RETRY_ON
+#undef GFS_METRIC_END
 
 #endif	// _LOCAL_FS_HPP_
@@ -0,0 +1,435 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _GFS_PREAD_HPP_
+#define _GFS_PREAD_HPP_
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "gfs.hpp"
+
+namespace gfs
+{
+
+//
+// gfs::pread等通过seek实现，多个线程共享一个File*时并不安全。
+// pread_pool为每个路径缓存若干只读的File*，并发的随机读各自
+// 租用一个handle，seek和read都在锁外进行；每个handle记住自己
+// 的当前偏移，顺序的读不需要再seek。
+//
+// 没有在读的路径按LRU排列，超过p_max_paths个或空闲超过p_idle_ms时
+// 关闭它的所有handle。
+//
+// 缓存的handle在文件被删除、改名后仍然读原来的文件。用enable_pread_pool
+// 打开的全局pread_pool，在本进程gfs::remove, gfs::rename了缓存的路径
+// （或其上级目录）时关闭相应的handle，正在使用的在归还时关闭；
+// 自己构造的pread_pool需要自己调用invalidate。其它进程的修改不会被发现。
+//
+class pread_pool : boost::noncopyable
+{
+public:
+        // p_max_handles - 每个路径最多同时打开的handle数
+        // p_max_paths - 最多缓存多少个路径的handle
+        // p_idle_ms - 多久没有读的路径被关闭，0表示不限
+        explicit pread_pool(std::size_t p_max_handles = 4,
+                            std::size_t p_max_paths = 1024,
+                            uint64_t p_idle_ms = 60 * 1000)
+                : m_max_handles(p_max_handles == 0 ? 1 : p_max_handles),
+                  m_shard_paths(std::max<std::size_t>(1, p_max_paths / SHARD_COUNT)),
+                  m_idle_us(p_idle_ms * 1000),
+                  m_next_sweep_us(0) {}
+
+        // 调用时不能再有未归还的handle
+        ~pread_pool() {
+                for(std::size_t i = 0; i < SHARD_COUNT; ++i)
+                {
+                        entry_map &_entries = m_shards[i].m_entries;
+                        for(entry_map::iterator _iter = _entries.begin();
+                            _iter != _entries.end(); ++_iter)
+                        {
+                                close_all(_iter->second->m_idle);
+                                delete _iter->second;
+                        }
+                }
+        }
+
+        // 语义同gfs::pread, gfs::preadn，不过以路径代替file_t
+        ssize_t pread(const char *p_path,
+                      void *p_buffer,
+                      size_t p_count,
+                      offset_t p_offset) {
+                return do_read(p_path, p_buffer, p_count, p_offset, false);
+        }
+
+        ssize_t preadn(const char *p_path,
+                       void *p_buffer,
+                       size_t p_count,
+                       offset_t p_offset) {
+                return do_read(p_path, p_buffer, p_count, p_offset, true);
+        }
+
+        // 文件被修改、删除后调用：关闭p_path空闲的handle，正在使用的
+        // handle归还时关闭；p_recursive时也关闭p_path之下的
+        void invalidate(const char *p_path,
+                        bool p_recursive = true) {
+                const std::string _path = p_path;
+                if(_path.empty())
+                        return;
+                std::vector<entry*> _entries;
+                {
+                        shard &_shard = get_shard(p_path);
+                        boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                        find_range(_shard, _path, false, _entries);
+                }
+                if(p_recursive)
+                {
+                        const std::string _prefix =
+                                (_path[_path.size() - 1] == '/') ? _path : _path + "/";
+                        for(std::size_t i = 0; i < SHARD_COUNT; ++i)
+                        {
+                                boost::mutex::scoped_lock _lock(m_shards[i].m_mutex);
+                                find_range(m_shards[i], _prefix, true, _entries);
+                        }
+                }
+
+                std::vector<handle> _idle;
+                for(std::size_t i = 0; i < _entries.size(); ++i)
+                {
+                        entry * const _entry = _entries[i];
+                        {
+                                boost::mutex::scoped_lock _lock(_entry->m_mutex);
+                                ++ _entry->m_generation;
+                                _entry->m_opened -= _entry->m_idle.size();
+                                _idle.swap(_entry->m_idle);
+                        }
+                        _entry->m_cond.notify_all();
+                        close_all(_idle);
+                        put_entry(_entry->m_self->first.c_str(), _entry);
+                }
+        }
+
+        // 全局的pool，为NULL表示没有打开
+        static pread_pool *&instance() {
+                static pread_pool *_pool = NULL;
+                return _pool;
+        }
+
+        // 缓存的路径数
+        std::size_t size() {
+                std::size_t _size = 0;
+                for(std::size_t i = 0; i < SHARD_COUNT; ++i)
+                {
+                        boost::mutex::scoped_lock _lock(m_shards[i].m_mutex);
+                        _size += m_shards[i].m_entries.size();
+                }
+                return _size;
+        }
+
+private:
+        enum {
+                SHARD_COUNT = 16
+        };
+
+        struct handle
+        {
+                file_t m_file;
+                offset_t m_offset;	// 当前文件指针，BAD_OFFSET表示未知
+                std::size_t m_generation;
+        };
+
+        struct entry;
+        typedef std::map<std::string, entry*> entry_map;
+        typedef std::list<entry*> entry_list;
+
+        struct entry
+        {
+                entry() : m_opened(0), m_generation(0), m_users(0), m_last_used_us(0) {}
+
+                boost::mutex m_mutex;
+                boost::condition_variable m_cond;
+                std::vector<handle> m_idle;
+                std::size_t m_opened;	// 已打开的handle数，包括租出去的
+                std::size_t m_generation;
+
+                // 以下由shard的m_mutex保护
+                std::size_t m_users;	// 正在使用的线程数，不为0时不会被关闭
+                uint64_t m_last_used_us;
+                entry_map::iterator m_self;
+                entry_list::iterator m_lru;
+        };
+
+        struct shard
+        {
+                boost::mutex m_mutex;
+                entry_map m_entries;
+                entry_list m_lru;	// 最近使用的在前
+        };
+
+        static void close_all(std::vector<handle> &p_handles) {
+                for(std::size_t i = 0; i < p_handles.size(); ++i)
+                {
+                        close(p_handles[i].m_file);
+                }
+                p_handles.clear();
+        }
+
+        static std::size_t hash(const char *p_path) {
+                std::size_t _hash = 5381;
+                for(; *p_path != '\0'; ++p_path)
+                {
+                        _hash = _hash * 33 + static_cast<unsigned char>(*p_path);
+                }
+                return _hash;
+        }
+
+        shard &get_shard(const char *p_path) {
+                return m_shards[hash(p_path) % SHARD_COUNT];
+        }
+
+        // 用完后需要调用put_entry
+        entry *find_entry(const char *p_path) {
+                shard &_shard = get_shard(p_path);
+                boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                std::pair<entry_map::iterator, bool> _ret =
+                        _shard.m_entries.insert(std::make_pair(std::string(p_path),
+                                                               static_cast<entry*>(NULL)));
+                if(_ret.second)
+                {
+                        _ret.first->second = new entry;
+                        _ret.first->second->m_self = _ret.first;
+                        _shard.m_lru.push_front(_ret.first->second);
+                        _ret.first->second->m_lru = _shard.m_lru.begin();
+                }
+                entry * const _entry = _ret.first->second;
+                ++ _entry->m_users;
+                return _entry;
+        }
+
+        // 找出已缓存的p_path（p_prefix时为以p_path开头的路径），增加
+        // m_users使它们不会被关闭，用完后需要调用put_entry；
+        // 调用者持有p_shard的锁
+        static void find_range(shard &p_shard,
+                               const std::string &p_path,
+                               bool p_prefix,
+                               std::vector<entry*> &p_entries) {
+                entry_map::iterator _iter = p_shard.m_entries.lower_bound(p_path);
+                while(_iter != p_shard.m_entries.end() &&
+                      (p_prefix
+                       ? _iter->first.compare(0, p_path.size(), p_path) == 0
+                       : _iter->first == p_path))
+                {
+                        ++ _iter->second->m_users;
+                        p_entries.push_back(_iter->second);
+                        ++ _iter;
+                }
+        }
+
+        // 移到LRU的最前面，并关闭超出数量或空闲太久的路径；
+        // 每过半个p_idle_ms检查一次所有的shard
+        void put_entry(const char *p_path,
+                       entry *p_entry) {
+                shard &_shard = get_shard(p_path);
+                const uint64_t _now = fsutil::monotonic_us();
+                std::vector<entry*> _evicted;
+                {
+                        boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                        -- p_entry->m_users;
+                        p_entry->m_last_used_us = _now;
+                        _shard.m_lru.splice(_shard.m_lru.begin(), _shard.m_lru, p_entry->m_lru);
+                        evict(_shard, _now, _evicted);
+                }
+                uint64_t _sweep = m_next_sweep_us.load();
+                if(m_idle_us != 0 && _now >= _sweep &&
+                   m_next_sweep_us.compare_exchange_strong(_sweep, _now + m_idle_us / 2))
+                {
+                        for(std::size_t i = 0; i < SHARD_COUNT; ++i)
+                        {
+                                boost::mutex::scoped_lock _lock(m_shards[i].m_mutex);
+                                evict(m_shards[i], _now, _evicted);
+                        }
+                }
+                // 没有使用者时所有的handle都是空闲的
+                for(std::size_t i = 0; i < _evicted.size(); ++i)
+                {
+                        close_all(_evicted[i]->m_idle);
+                        delete _evicted[i];
+                }
+        }
+
+        // 租用一个handle，优先选择文件指针正好在p_offset处的
+        bool acquire(entry &p_entry,
+                     const char *p_path,
+                     offset_t p_offset,
+                     handle &p_handle) {
+                {
+                        boost::mutex::scoped_lock _lock(p_entry.m_mutex);
+                        while(p_entry.m_idle.empty() &&
+                              p_entry.m_opened >= m_max_handles)
+                        {
+                                p_entry.m_cond.wait(_lock);
+                        }
+                        if(! p_entry.m_idle.empty())
+                        {
+                                std::size_t _pos = p_entry.m_idle.size() - 1;
+                                for(std::size_t i = 0; i < p_entry.m_idle.size(); ++i)
+                                {
+                                        if(p_entry.m_idle[i].m_offset == p_offset)
+                                        {
+                                                _pos = i;
+                                                break;
+                                        }
+                                }
+                                p_handle = p_entry.m_idle[_pos];
+                                p_entry.m_idle[_pos] = p_entry.m_idle.back();
+                                p_entry.m_idle.pop_back();
+                                return true;
+                        }
+                        ++ p_entry.m_opened;
+                        p_handle.m_generation = p_entry.m_generation;
+                }
+
+                // 在锁外打开新的handle
+                p_handle.m_file = open(p_path, MT_O_RDONLY);
+                p_handle.m_offset = 0;
+                if(p_handle.m_file == BAD_FILE)
+                {
+                        release(p_entry, p_handle, false);
+                        return false;
+                }
+                return true;
+        }
+
+        // p_reuse为false时关闭该handle，比如读出错之后
+        void release(entry &p_entry,
+                     const handle &p_handle,
+                     bool p_reuse) {
+                {
+                        boost::mutex::scoped_lock _lock(p_entry.m_mutex);
+                        p_reuse = p_reuse &&
+                                (p_handle.m_generation == p_entry.m_generation);
+                        if(p_reuse)
+                                p_entry.m_idle.push_back(p_handle);
+                        else
+                                -- p_entry.m_opened;
+                }
+                p_entry.m_cond.notify_one();
+                if((! p_reuse) && (p_handle.m_file != BAD_FILE))
+                {
+                        close(p_handle.m_file);
+                }
+        }
+
+        // 从LRU的尾部去掉超出数量或空闲太久的路径，调用者持有p_shard的锁
+        void evict(shard &p_shard,
+                   uint64_t p_now,
+                   std::vector<entry*> &p_evicted) {
+                while(! p_shard.m_lru.empty())
+                {
+                        entry * const _last = p_shard.m_lru.back();
+                        if(_last->m_users != 0 ||
+                           (p_shard.m_entries.size() <= m_shard_paths &&
+                            (m_idle_us == 0 || p_now < _last->m_last_used_us + m_idle_us)))
+                                break;
+                        p_shard.m_lru.pop_back();
+                        p_shard.m_entries.erase(_last->m_self);
+                        p_evicted.push_back(_last);
+                }
+        }
+
+        ssize_t do_read(const char *p_path,
+                        void *p_buffer,
+                        size_t p_count,
+                        offset_t p_offset,
+                        bool p_all) {
+                entry * const _entry = find_entry(p_path);
+                const ssize_t _ret = read_entry(*_entry, p_path, p_buffer, p_count,
+                                                p_offset, p_all);
+                const int _errno = get_errno();
+                put_entry(p_path, _entry);
+                set_errno(_errno);
+                return _ret;
+        }
+
+        ssize_t read_entry(entry &p_entry,
+                          const char *p_path,
+                          void *p_buffer,
+                          size_t p_count,
+                          offset_t p_offset,
+                          bool p_all) {
+                handle _handle;
+                if(! acquire(p_entry, p_path, p_offset, _handle))
+                        return -1;
+
+                if(_handle.m_offset != p_offset)
+                {
+                        _handle.m_offset = seek(_handle.m_file, p_offset, ST_SEEK_SET);
+                        if(_handle.m_offset != p_offset)
+                        {
+                                const int _errno = get_errno();
+                                release(p_entry, _handle, false);
+                                set_errno(_errno);
+                                return -1;
+                        }
+                }
+
+                const ssize_t _ret = p_all
+                        ? readn(_handle.m_file, p_buffer, p_count)
+                        : read(_handle.m_file, p_buffer, p_count);
+                const int _errno = get_errno();
+                if(_ret >= 0)
+                {
+                        _handle.m_offset += _ret;
+                }
+                release(p_entry, _handle, _ret >= 0);
+                set_errno(_errno);
+                return _ret;
+        }
+
+        const std::size_t m_max_handles;
+        const std::size_t m_shard_paths;	// 每个shard最多缓存的路径数
+        const uint64_t m_idle_us;
+        boost::atomic<uint64_t> m_next_sweep_us;	// 下次检查所有shard的时间
+        shard m_shards[SHARD_COUNT];
+};
+
+namespace detail
+{
+
+inline
+void invalidate_pread_pool(const char *p_path) {
+        pread_pool * const _pool = pread_pool::instance();
+        if(_pool != NULL)
+                _pool->invalidate(p_path, true);
+}
+
+} // namespace detail
+
+// 打开全局的pread_pool，需要在其它线程使用之前调用
+inline
+void enable_pread_pool(std::size_t p_max_handles = 4,
+                       std::size_t p_max_paths = 1024,
+                       uint64_t p_idle_ms = 60 * 1000) {
+        delete pread_pool::instance();
+        pread_pool::instance() = new pread_pool(p_max_handles, p_max_paths, p_idle_ms);
+        detail::global_path_changed_hook(detail::PH_PREAD_POOL).store(&detail::invalidate_pread_pool);
+}
+
+// 同样不能与其它线程同时进行，此时不能有正在进行的读
+inline
+void disable_pread_pool() {
+        detail::global_path_changed_hook(detail::PH_PREAD_POOL).store(NULL);
+        delete pread_pool::instance();
+        pread_pool::instance() = NULL;
+}
+
+} // namespace gfs
+
+#endif	// _GFS_PREAD_HPP_
@@ -0,0 +1,380 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _FILESYSTEM_HPP_
+#error "handle_cache.ipp can ONLY be included into fs.hpp"
+#endif
+
+namespace detail
+{
+
+// handle_cache的成员函数会隐藏命名空间中的open, close
+inline
+file_t open_handle(const char *p_path,
+		   mode_t p_mode,
+		   std::size_t p_replica_number) {
+	return (p_replica_number == 0)
+		? open(p_path, p_mode)
+		: open(p_path, p_mode, p_replica_number);
+}
+
+inline
+bool close_handle(file_t p_file) {
+	return close(p_file);
+}
+
+} // namespace detail
+
+//
+// 已打开文件的缓存，省去反复打开同一个文件的开销（gfs的open是一次
+// 带重试的远程调用）。按(路径, 打开方式, 副本数)查找，acquire返回
+// 引用计数的lease，最后一个lease释放后句柄进入LRU，空闲句柄超过
+// p_capacity个或空闲超过p_idle_ms时被关闭。
+//
+// p_exclusive为false时同一个文件的所有lease共享一个file_t，所以只能
+// 用pread, preadn等不依赖当前位置的操作，通常只缓存只读打开的文件。
+// gfs的pread通过seek实现（CONCURRENT_PREAD为false），默认p_exclusive：
+// 每个lease独占一个句柄，同一个文件可以有多个空闲的句柄。
+//
+// 用enable_handle_cache打开的全局缓存，在本进程remove, rename了
+// 缓存的路径（或其上级目录）时关闭相应的句柄，已借出的在最后一个
+// lease释放时关闭。其它进程的修改不会被发现。
+// 销毁cache之前需要释放所有的lease。
+//
+class handle_cache : boost::noncopyable
+{
+	struct entry;
+
+public:
+	struct stats
+	{
+		uint64_t m_hits;
+		uint64_t m_misses;
+		uint64_t m_evictions;		// 因为容量或空闲时间被关闭
+		uint64_t m_invalidations;	// 因为remove, rename被关闭
+	};
+
+	class lease
+	{
+	public:
+		lease()
+			: m_cache(NULL),
+			  m_entry(NULL) {}
+
+		lease(const lease &p_other)
+			: m_cache(p_other.m_cache),
+			  m_entry(p_other.m_entry) {
+			if(m_entry != NULL)
+				m_cache->add_ref(m_entry);
+		}
+
+		lease &operator=(const lease &p_other) {
+			lease _copy(p_other);
+			std::swap(m_cache, _copy.m_cache);
+			std::swap(m_entry, _copy.m_entry);
+			return *this;
+		}
+
+		~lease() {
+			reset();
+		}
+
+		void reset() {
+			if(m_entry != NULL)
+				m_cache->release(m_entry);
+			m_cache = NULL;
+			m_entry = NULL;
+		}
+
+		bool is_bad() const {
+			return m_entry == NULL;
+		}
+
+		file_t file() const {
+			return (m_entry == NULL) ? BAD_FILE : m_entry->m_file;
+		}
+
+	private:
+		friend class handle_cache;
+
+		lease(handle_cache *p_cache,
+		      entry *p_entry)
+			: m_cache(p_cache),
+			  m_entry(p_entry) {}
+
+		handle_cache *m_cache;
+		entry *m_entry;
+	};
+
+	explicit handle_cache(std::size_t p_capacity = 1024,
+			      uint64_t p_idle_ms = 60 * 1000,
+			      bool p_exclusive = ! CONCURRENT_PREAD)
+		: m_capacity(p_capacity),
+		  m_idle_us(p_idle_ms * 1000),
+		  m_exclusive(p_exclusive),
+		  m_generation(0) {
+		std::memset(&m_stats, 0, sizeof(m_stats));
+	}
+
+	~handle_cache() {
+		for(entry_map::iterator _iter = m_entries.begin();
+		    _iter != m_entries.end(); ++_iter)
+		{
+			detail::close_handle(_iter->second->m_file);
+			delete _iter->second;
+		}
+	}
+
+	// p_replica_number为0时使用open的默认副本数；打开失败时
+	// 返回的lease.is_bad()，错误码见get_errno()
+	lease acquire(const char *p_path,
+		      mode_t p_mode = MT_O_RDONLY,
+		      std::size_t p_replica_number = 0) {
+		const key _key(p_path, std::make_pair(int(p_mode), p_replica_number));
+		uint64_t _generation;
+		{
+			boost::mutex::scoped_lock _lock(m_mutex);
+			entry * const _entry = find_usable(_key);
+			if(_entry != NULL)
+			{
+				if(_entry->m_refs == 0)
+					m_idle.erase(_entry->m_idle);
+				++ _entry->m_refs;
+				++ m_stats.m_hits;
+				return lease(this, _entry);
+			}
+			++ m_stats.m_misses;
+			_generation = m_generation;
+		}
+
+		// 打开时不持有锁，其它线程可能同时打开同一个文件
+		const file_t _file = detail::open_handle(p_path, p_mode, p_replica_number);
+		if(_file == BAD_FILE)
+			return lease();
+
+		entry * const _entry = new entry;
+		_entry->m_key = _key;
+		_entry->m_file = _file;
+		_entry->m_refs = 1;
+		_entry->m_cached = false;
+
+		{
+			boost::mutex::scoped_lock _lock(m_mutex);
+			// 打开期间有remove, rename时不缓存，lease释放时关闭
+			if(_generation == m_generation)
+			{
+				entry * const _other = m_exclusive ? NULL : find_usable(_key);
+				if(_other != NULL)
+				{
+					// 其它线程先打开了，使用它的句柄
+					if(_other->m_refs == 0)
+						m_idle.erase(_other->m_idle);
+					++ _other->m_refs;
+					delete _entry;
+					_lock.unlock();
+					detail::close_handle(_file);
+					return lease(this, _other);
+				}
+				_entry->m_self = m_entries.insert(std::make_pair(_key, _entry));
+				_entry->m_cached = true;
+			}
+		}
+		return lease(this, _entry);
+	}
+
+	// 关闭p_path的句柄；p_recursive时也关闭p_path之下的
+	void invalidate(const char *p_path,
+			bool p_recursive = true) {
+		std::vector<file_t> _files;
+		{
+			const std::string _path = p_path;
+			if(_path.empty())
+				return;
+			boost::mutex::scoped_lock _lock(m_mutex);
+			++ m_generation;
+			invalidate_range(_path, false, _files);
+			if(p_recursive)
+				invalidate_range(_path[_path.size() - 1] == '/' ? _path : _path + "/",
+						 true, _files);
+		}
+		close_all(_files);
+	}
+
+	// 关闭空闲超过p_idle_ms的句柄，release时也会做
+	void trim() {
+		std::vector<file_t> _files;
+		{
+			boost::mutex::scoped_lock _lock(m_mutex);
+			evict(monotonic_us(), _files);
+		}
+		close_all(_files);
+	}
+
+	stats get_stats() {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		return m_stats;
+	}
+
+	// 缓存的句柄数，包括已借出的
+	std::size_t size() {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		return m_entries.size();
+	}
+
+	bool exclusive() const {
+		return m_exclusive;
+	}
+
+	// 全局的缓存，为NULL表示没有打开
+	static handle_cache *&instance() {
+		static handle_cache *_cache = NULL;
+		return _cache;
+	}
+
+private:
+	// (路径, (打开方式, 副本数))，按路径排序以便找出目录下的所有项；
+	// m_exclusive时同一个key可以有多个句柄
+	typedef std::pair<std::string, std::pair<int, std::size_t> > key;
+	typedef std::multimap<key, entry*> entry_map;
+	typedef std::list<entry*> idle_list;
+
+	struct entry
+	{
+		key m_key;
+		entry_map::iterator m_self;	// m_cached时在m_entries中的位置
+		file_t m_file;
+		std::size_t m_refs;
+		bool m_cached;			// 在m_entries中；失效后为false
+		idle_list::iterator m_idle;	// m_refs为0时在m_idle中的位置
+		uint64_t m_idle_since_us;
+	};
+
+	static uint64_t monotonic_us() {
+		return ::fsutil::monotonic_us();
+	}
+
+	static void close_all(const std::vector<file_t> &p_files) {
+		for(std::size_t i = 0; i < p_files.size(); ++i)
+		{
+			detail::close_handle(p_files[i]);
+		}
+	}
+
+	// 可以借出的句柄：共享时是key唯一的句柄，独占时是一个空闲的句柄
+	entry *find_usable(const key &p_key) {
+		std::pair<entry_map::iterator, entry_map::iterator> _range =
+			m_entries.equal_range(p_key);
+		for(entry_map::iterator _iter = _range.first; _iter != _range.second; ++_iter)
+		{
+			if(! m_exclusive || _iter->second->m_refs == 0)
+				return _iter->second;
+		}
+		return NULL;
+	}
+
+	void add_ref(entry *p_entry) {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		++ p_entry->m_refs;
+	}
+
+	void release(entry *p_entry) {
+		std::vector<file_t> _files;
+		{
+			boost::mutex::scoped_lock _lock(m_mutex);
+			if(-- p_entry->m_refs != 0)
+				return;
+			if(! p_entry->m_cached)
+			{
+				_files.push_back(p_entry->m_file);
+				delete p_entry;
+			}
+			else
+			{
+				const uint64_t _now = monotonic_us();
+				p_entry->m_idle_since_us = _now;
+				m_idle.push_front(p_entry);
+				p_entry->m_idle = m_idle.begin();
+				evict(_now, _files);
+			}
+		}
+		close_all(_files);
+	}
+
+	// 从LRU的尾部关闭超出容量或空闲太久的句柄
+	void evict(uint64_t p_now,
+		   std::vector<file_t> &p_files) {
+		while(! m_idle.empty())
+		{
+			entry * const _entry = m_idle.back();
+			if(m_idle.size() <= m_capacity &&
+			   (m_idle_us == 0 || p_now - _entry->m_idle_since_us < m_idle_us))
+				break;
+			m_idle.pop_back();
+			m_entries.erase(_entry->m_self);
+			p_files.push_back(_entry->m_file);
+			delete _entry;
+			++ m_stats.m_evictions;
+		}
+	}
+
+	// p_prefix为false时只处理路径等于p_path的项
+	void invalidate_range(const std::string &p_path,
+			      bool p_prefix,
+			      std::vector<file_t> &p_files) {
+		entry_map::iterator _iter =
+			m_entries.lower_bound(key(p_path, std::make_pair(INT_MIN, std::size_t(0))));
+		while(_iter != m_entries.end() &&
+		      (p_prefix
+		       ? _iter->first.first.compare(0, p_path.size(), p_path) == 0
+		       : _iter->first.first == p_path))
+		{
+			entry * const _entry = _iter->second;
+			m_entries.erase(_iter++);
+			_entry->m_cached = false;
+			++ m_stats.m_invalidations;
+			if(_entry->m_refs == 0)
+			{
+				m_idle.erase(_entry->m_idle);
+				p_files.push_back(_entry->m_file);
+				delete _entry;
+			}
+		}
+	}
+
+	const std::size_t m_capacity;
+	const uint64_t m_idle_us;
+	const bool m_exclusive;		// 每个lease独占一个句柄
+	boost::mutex m_mutex;
+	entry_map m_entries;
+	idle_list m_idle;		// 空闲的句柄，最近释放的在前
+	uint64_t m_generation;		// 每次invalidate加1
+	stats m_stats;
+};
+
+namespace detail
+{
+
+inline
+void invalidate_handles(const char *p_path) {
+	handle_cache * const _cache = handle_cache::instance();
+	if(_cache != NULL)
+		_cache->invalidate(p_path, true);
+}
+
+} // namespace detail
+
+// 打开全局的handle_cache，需要在其它线程使用之前调用
+inline
+void enable_handle_cache(std::size_t p_capacity = 1024,
+			 uint64_t p_idle_ms = 60 * 1000) {
+	delete handle_cache::instance();
+	handle_cache::instance() = new handle_cache(p_capacity, p_idle_ms);
+	detail::global_path_changed_hook(detail::PH_HANDLE_CACHE).store(&detail::invalidate_handles);
+}
+
+// 同样不能与其它线程同时进行，此时不能有未释放的lease
+inline
+void disable_handle_cache() {
+	detail::global_path_changed_hook(detail::PH_HANDLE_CACHE).store(NULL);
+	delete handle_cache::instance();
+	handle_cache::instance() = NULL;
+}
@@ -0,0 +1,138 @@
+// -*-mode:c++; coding:utf-8-*-
+
+//
+// handle_cache的并发测试：两个线程通过同一个key的lease同时preadn
+// 文件的不同位置，检查读到的内容。gfs的pread是seek+read+seek，
+// 共享一个句柄时会读到另一个线程的位置。
+//
+// 编译：
+//   g++ -O2 -I. -I<gfs_client所在目录> handle_cache_test.cpp -o handle_cache_test
+//       -lboost_thread -lboost_filesystem -lboost_system -lpthread <gfs client库>
+//
+// 用法：
+//   handle_cache_test <测试目录>
+// 依次测试localfs, gfs, memfs，全部通过时返回0。
+//
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstring>
+
+#include <stdint.h>
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/atomic.hpp>
+
+#include "fs.hpp"
+
+namespace
+{
+
+const std::size_t READ_SIZE = 4096;
+const std::size_t BLOCKS = 64;
+const std::size_t ROUNDS = 20000;
+
+// 第i块的每个字节都是i
+void fill_block(std::vector<char> &p_buffer,
+                std::size_t p_index) {
+        p_buffer.assign(READ_SIZE, char(p_index));
+}
+
+bool check_block(const std::vector<char> &p_buffer,
+                 std::size_t p_index) {
+        for(std::size_t i = 0; i < p_buffer.size(); ++i)
+        {
+                if(p_buffer[i] != char(p_index))
+                        return false;
+        }
+        return true;
+}
+
+} // namespace
+
+#define HANDLE_CACHE_TEST(ns)                                                   \
+        struct ns##_test                                                        \
+        {                                                                       \
+                ns::handle_cache &m_cache;                                      \
+                const std::string &m_path;                                      \
+                boost::barrier &m_barrier;                                      \
+                boost::atomic<std::size_t> &m_errors;                           \
+                                                                                \
+                /* p_first: 偶数块还是奇数块，两个线程不会读同一块 */                              \
+                void operator()(std::size_t p_first) {                          \
+                        std::vector<char> _buffer(READ_SIZE);                   \
+                        m_barrier.wait();                                       \
+                        for(std::size_t i = 0; i < ROUNDS; ++i)                 \
+                        {                                                       \
+                                const std::size_t _index =                      \
+                                        (p_first + i * 2) % BLOCKS;             \
+                                ns::handle_cache::lease _lease =                \
+                                        m_cache.acquire(m_path.c_str());        \
+                                if(_lease.file() == ns::BAD_FILE ||             \
+                                   ns::preadn(_lease.file(), &_buffer[0],       \
+                                              READ_SIZE,                        \
+                                              ns::offset_t(_index * READ_SIZE)) \
+                                   != ns::ssize_t(READ_SIZE) ||                 \
+                                   ! check_block(_buffer, _index))              \
+                                        ++ m_errors;                            \
+                        }                                                       \
+                }                                                               \
+                                                                                \
+                static bool run(const std::string &p_dir) {                     \
+                        const std::string _path = p_dir + "/handle_cache." #ns; \
+                        ns::file_t _file = ns::open(_path, ns::mode_t(ns::MT_O_WRONLY | \
+                                                    ns::MT_O_CREATE |           \
+                                                    ns::MT_O_TRUNC));           \
+                        if(_file == ns::BAD_FILE)                               \
+                        {                                                       \
+                                std::cerr << #ns ": open " << _path << ": "     \
+                                          << ns::get_errno() << std::endl;      \
+                                return false;                                   \
+                        }                                                       \
+                        std::vector<char> _buffer;                              \
+                        for(std::size_t i = 0; i < BLOCKS; ++i)                 \
+                        {                                                       \
+                                fill_block(_buffer, i);                         \
+                                ns::writen(_file, &_buffer[0], READ_SIZE);      \
+                        }                                                       \
+                        ns::close(_file);                                       \
+                                                                                \
+                        ns::handle_cache _cache;                                \
+                        boost::barrier _barrier(2);                             \
+                        boost::atomic<std::size_t> _errors(0);                  \
+                        ns##_test _test = {_cache, _path, _barrier, _errors};   \
+                        boost::thread _even(boost::bind<void>(boost::ref(_test), 0)); \
+                        boost::thread _odd(boost::bind<void>(boost::ref(_test), 1)); \
+                        _even.join();                                           \
+                        _odd.join();                                            \
+                        ns::remove(_path);                                      \
+                                                                                \
+                        const ns::handle_cache::stats _stats = _cache.get_stats(); \
+                        std::cout << #ns ": exclusive " << _cache.exclusive()   \
+                                  << ", handles " << _cache.size()              \
+                                  << ", hits " << _stats.m_hits                 \
+                                  << ", misses " << _stats.m_misses             \
+                                  << ", errors " << _errors.load() << std::endl; \
+                        return _errors.load() == 0;                             \
+                }                                                               \
+        }
+
+HANDLE_CACHE_TEST(localfs);
+HANDLE_CACHE_TEST(gfs);
+HANDLE_CACHE_TEST(memfs);
+
+int main(int argc, char **argv) {
+        if(argc != 2)
+        {
+                std::cerr << "usage: " << argv[0] << " <dir>" << std::endl;
+                return 2;
+        }
+        const std::string _dir = argv[1];
+        bool _ok = localfs_test::run(_dir);
+        _ok = gfs_test::run(_dir) && _ok;
+        _ok = memfs::create_directories(_dir) && memfs_test::run(_dir) && _ok;
+        return _ok ? 0 : 1;
+}
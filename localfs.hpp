@@ -5,8 +5,11 @@
 
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <vector>
+#include <algorithm>
 
 //// make sure compile with
 ////  -D_LARGEFILE_SOURCE -D_FILE_OFFSET_BITS=64
@@ -26,6 +29,20 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <sys/syscall.h>	// for SYS_getdents64, SYS_copy_file_range
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#ifdef __linux__
+#include <linux/fs.h>		// for FICLONE
+#endif
+
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "thread_pool.hpp"
+#include "metrics.hpp"
+#include "walk.hpp"
 
 namespace localfs
 {
@@ -77,6 +94,9 @@ void iovec_init(iovec_t &iov,
 static const file_t BAD_FILE = -1;
 static const offset_t BAD_OFFSET = -1LL;
 
+// preadȲʹļָ룬߳̿ͬʱͬһfile_t
+static const bool CONCURRENT_PREAD = true;
+
 enum seek_type
 {
         ST_SEEK_SET = SEEK_SET,
@@ -93,11 +113,26 @@ enum mode_type
 				
         MT_O_APPEND = O_APPEND,
         MT_O_CREATE = O_CREAT,
-        MT_O_TRUNC = O_TRUNC
+        MT_O_TRUNC = O_TRUNC,
+        // ƹpage cacheдƫơȺͻҪ
+        // DIRECT_IO_ALIGNMENT룬direct_writer
+        // ļϵͳ֧ʱopenȥ־
+        MT_O_DIRECT = O_DIRECT
         // ...
 };
 typedef mode_type mode_t;
 
+// adviseķʷʽʾȡֵͬposix_fadvise
+enum advice_type
+{
+        AT_NORMAL = POSIX_FADV_NORMAL,
+        AT_SEQUENTIAL = POSIX_FADV_SEQUENTIAL,	// ӴںԤ
+        AT_RANDOM = POSIX_FADV_RANDOM,		// رںԤ
+        AT_WILLNEED = POSIX_FADV_WILLNEED,	// ǰpage cache
+        AT_DONTNEED = POSIX_FADV_DONTNEED	// page cacheеĸɾҳ
+};
+typedef advice_type advice_t;
+
 typedef struct ::stat file_status;
 
 inline
@@ -105,6 +140,11 @@ size_t get_size(const file_status &p_status) {
         return p_status.st_size;
 }
 
+inline
+time_t get_mtime(const file_status &p_status) {
+        return p_status.st_mtime;
+}
+
 inline
 bool is_directory(const file_status &p_status) {
         return S_ISDIR(p_status.st_mode);
@@ -139,8 +179,19 @@ const char *get_name(const file_info &p_info) {
 inline
 file_t open(const char *p_path,
             mode_t p_mode = MT_O_RDONLY) {
-        return ::open(p_path,
-                      static_cast<int>(p_mode));
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_OPEN);
+        // MT_O_CREATEʱļȨͬcreate
+        file_t _ret = ::open(p_path,
+                             static_cast<int>(p_mode),
+                             S_IRWXU | S_IRWXG | S_IRWXO);
+        if(_ret == BAD_FILE && errno == EINVAL && (p_mode & MT_O_DIRECT))
+        {
+                _ret = ::open(p_path,
+                              static_cast<int>(p_mode) & ~O_DIRECT,
+                              S_IRWXU | S_IRWXG | S_IRWXO);
+        }
+        FS_METRIC_END(_ret != BAD_FILE, 0, errno);
+        return _ret;
 }
 
 inline
@@ -152,8 +203,11 @@ file_t open(const char *p_path,
 
 inline
 file_t create(const char *p_path) {
-        return ::creat(p_path,
-                       S_IRWXU | S_IRWXG | S_IRWXO);
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_OPEN);
+        const file_t _ret = ::creat(p_path,
+                                    S_IRWXU | S_IRWXG | S_IRWXO);
+        FS_METRIC_END(_ret != BAD_FILE, 0, errno);
+        return _ret;
 }
 
 inline
@@ -166,15 +220,32 @@ inline
 ssize_t read(file_t p_file,
              void *p_buffer,
              size_t p_count) {
-        return ::read(p_file, p_buffer, p_count);
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_READ);
+        const ssize_t _ret = ::read(p_file, p_buffer, p_count);
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
+}
+
+inline
+ssize_t readv(file_t p_file,
+              const iovec_t *p_iov,
+              size_t p_count) {
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_READ);
+        const ssize_t _ret = ::readv(p_file,
+                                     p_iov,
+                                     p_count);
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
 }
 
 inline
 offset_t append(file_t p_file,
                 const void *p_buffer,
                 size_t p_count) {
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_APPEND);
         const offset_t cur = ::lseek(p_file, offset_t(0), SEEK_CUR);
         const ssize_t ret = ::write(p_file, p_buffer, p_count);
+        FS_METRIC_END(ret >= 0, ret, errno);
         return (ret < 0) ? BAD_OFFSET : cur;
 }
 
@@ -182,25 +253,34 @@ inline
 ssize_t write(file_t p_file,
               const void *p_buffer,
               size_t p_count) {
-        return ::write(p_file, p_buffer, p_count);
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_WRITE);
+        const ssize_t _ret = ::write(p_file, p_buffer, p_count);
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
 }
 
 inline
 ssize_t writev(file_t p_file,
                const iovec_t *p_iov,
                size_t p_count) {
-        return ::writev(p_file,
-                        p_iov,
-                        p_count);
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_WRITE);
+        const ssize_t _ret = ::writev(p_file,
+                                      p_iov,
+                                      p_count);
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
 }
 
 inline
 offset_t seek(file_t p_file,
               offset_t p_offset,
               seek_t p_whence) {
-        return ::lseek(p_file,
-                       p_offset,
-                       static_cast<int>(p_whence));
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_SEEK);
+        const offset_t _ret = ::lseek(p_file,
+                                      p_offset,
+                                      static_cast<int>(p_whence));
+        FS_METRIC_END(_ret != BAD_OFFSET, 0, errno);
+        return _ret;
 }
 
 inline
@@ -210,26 +290,109 @@ bool close(file_t p_file) {
 
 inline
 bool mkdir(const char *p_path) {
-        return ::mkdir(p_path,
-                       S_IRWXU | S_IRWXG | S_IRWXO) == 0;
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_MKDIR);
+        const bool _ret = ::mkdir(p_path,
+                                  S_IRWXU | S_IRWXG | S_IRWXO) == 0;
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
 }
 
+#include "path_hook.ipp"
+
 inline
 bool rename(const char *p_old_path,
             const char *p_new_path) {
-        return std::rename(p_old_path,
-                           p_new_path) == 0;
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_RENAME);
+        const bool _ret = std::rename(p_old_path,
+                                      p_new_path) == 0;
+        FS_METRIC_END(_ret, 0, errno);
+        detail::path_changed(p_old_path);
+        detail::path_changed(p_new_path);
+        return _ret;
 }
 
 inline
 bool exists(const char *p_path) {
-        return ::access(p_path, F_OK) == 0;
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_STAT);
+        const bool _ret = ::access(p_path, F_OK) == 0;
+        FS_METRIC_END(_ret || errno == ENOENT, 0, errno);
+        return _ret;
 }
 
 inline
 bool stat(file_status &p_status,
           const char *p_path) {
-        return ::lstat(p_path, &p_status) == 0;
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_STAT);
+        const bool _ret = ::lstat(p_path, &p_status) == 0;
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
+}
+
+namespace detail
+{
+
+// getdents64صĿ¼glibcһṩ䶨
+struct linux_dirent64
+{
+        ::ino64_t d_ino;
+        ::off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+};
+
+enum {
+        LIST_FILES_BUFFER_SIZE = 256 * 1024 // ÿgetdents64ȡֽ
+};
+
+} // namespace detail
+
+// гѴ򿪵Ŀ¼p_dirµļƣ÷ͬlist_files
+// ļȡĿ¼d_typeֻļϵͳṩ
+// (DT_UNKNOWN)ʱŶԸһfstatat
+// ע⣺m_typeֻ֤ļλЧȨλ
+template<typename FileInfoContainer>
+inline
+bool list_files_at(FileInfoContainer &p_infos,
+                   file_t p_dir) {
+        std::vector<char> _buffer(detail::LIST_FILES_BUFFER_SIZE);
+        file_info _info;
+        file_status _status;
+        for(;;)
+        {
+                const long _len = ::syscall(SYS_getdents64,
+                                            p_dir,
+                                            &_buffer[0],
+                                            _buffer.size());
+                if(_len < 0)
+                        return false;
+                if(_len == 0)
+                        return true;
+
+                for(long _pos = 0; _pos < _len;)
+                {
+                        const detail::linux_dirent64 *_entry =
+                                reinterpret_cast<const detail::linux_dirent64*>(&_buffer[_pos]);
+                        _pos += _entry->d_reclen;
+
+                        // ע⣬. ..ĻҪ˵
+                        const char *_name = _entry->d_name;
+                        if(_name[0] == '.' &&
+                           (_name[1] == '\0' ||
+                            (_name[1] == '.' && _name[2] == '\0')))
+                                continue;
+
+                        _info.m_name.assign(_name);
+                        if(_entry->d_type != DT_UNKNOWN)
+                                _info.m_type = DTTOIF(_entry->d_type);
+                        else if(::fstatat(p_dir, _name, &_status, AT_SYMLINK_NOFOLLOW) == 0)
+                                _info.m_type = _status.st_mode;
+                        else
+                                _info.m_type = 0; // set to invalid
+
+                        p_infos.push_back(_info);
+                }
+        }
 }
 
 // гĿ¼µļ
@@ -239,40 +402,97 @@ template<typename FileInfoContainer>
 inline
 bool list_files(FileInfoContainer &p_infos,
                 const char *p_path) {
-        dir_t _dir = ::opendir(p_path);
-        if (_dir == NULL)
-                return false;
-        
-        file_info _info;
-        struct ::dirent *_entry;
-        
-        std::string _path = p_path;
-        if(_path[_path.size() - 1] != '/')
-        {
-                _path += '/';
-        }
-        file_status _status;
-        while((_entry = readdir(_dir)) != NULL)
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_LIST_FILES);
+        const file_t _dir = ::open(p_path,
+                                   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (_dir == BAD_FILE)
         {
-                _info.m_name = _entry->d_name;
-                
-                // ע⣬. ..ĻҪ˵
-                if (_info.m_name == "." ||
-                    _info.m_name == "..")
-                        continue;
-                
-                if(stat(_status, (_path + _info.m_name).c_str()))
-                        _info.m_type = _status.st_mode;
-                else
-                        _info.m_type = 0; // set to invalid
-                
-                p_infos.push_back(_info);
+                FS_METRIC_END(false, 0, errno);
+                return false;
         }
-        
-        ::closedir(_dir);
-        return true;
+
+        const bool _ret = list_files_at(p_infos, _dir);
+        const int _errno = errno;
+        ::close(_dir);
+        errno = _errno;
+        FS_METRIC_END(_ret, 0, _errno);
+        return _ret;
 }
 
+namespace detail
+{
+
+// walk, disk_usagewalk.ippĿ¼ʱʹãļȡĿ¼
+// ļĿ¼fdfstatatȡãҪÿν·
+struct fd_walk_source
+{
+        static bool stat_entry(const std::string &p_path,
+                               fsutil::walk_entry &p_entry) {
+                file_status _status;
+                if(::lstat(p_path.c_str(), &_status) != 0)
+                        return false;
+                set_entry(p_entry, _status);
+                return true;
+        }
+
+        static bool list_entries(const std::string &p_dir,
+                                 bool p_stat,
+                                 std::vector<fsutil::walk_entry> &p_children) {
+                const file_t _dir = ::open(p_dir.c_str(),
+                                           O_RDONLY | O_DIRECTORY |
+                                           O_NOFOLLOW | O_CLOEXEC);
+                if(_dir == BAD_FILE)
+                        return false;
+                std::vector<file_info> _infos;
+                if(! list_files_at(_infos, _dir))
+                {
+                        const int _errno = errno;
+                        ::close(_dir);
+                        errno = _errno;
+                        return false;
+                }
+
+                file_status _status;
+                p_children.reserve(_infos.size());
+                for(std::size_t i = 0; i < _infos.size(); ++i)
+                {
+                        fsutil::walk_entry _entry;
+                        _entry.m_path = fsutil::join_path(p_dir, _infos[i].m_name);
+                        _entry.m_is_dir = S_ISDIR(_infos[i].m_type);
+                        // δ֪(m_typeΪ0)ʱҲҪfstatatг֮ɾ
+                        if((p_stat && ! _entry.m_is_dir) || _infos[i].m_type == 0)
+                        {
+                                if(::fstatat(_dir, _infos[i].m_name.c_str(),
+                                             &_status, AT_SYMLINK_NOFOLLOW) != 0)
+                                        continue;
+                                set_entry(_entry, _status);
+                        }
+                        p_children.push_back(_entry);
+                }
+                ::close(_dir);
+                return true;
+        }
+
+        static void set_entry(fsutil::walk_entry &p_entry,
+                              const file_status &p_status) {
+                p_entry.m_is_dir = S_ISDIR(p_status.st_mode);
+                p_entry.m_size = p_entry.m_is_dir ? 0 : p_status.st_size;
+                p_entry.m_mtime = p_status.st_mtime;
+        }
+
+        static int get_errno() {
+                return errno;
+        }
+
+        static void set_errno(int p_errno) {
+                errno = p_errno;
+        }
+};
+
+typedef fd_walk_source walk_source;
+
+} // namespace detail
+
 //
 // readn, writen ֵСp_countʾΪ-1
 // дݳȣɹʱֵp_count
@@ -334,7 +554,10 @@ ssize_t pread(file_t p_file,
               void *p_buffer,
               size_t p_count,
               offset_t p_offset) {
-        return ::pread(p_file, p_buffer, p_count, p_offset);
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_READ);
+        const ssize_t _ret = ::pread(p_file, p_buffer, p_count, p_offset);
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
 }
 
 inline
@@ -342,18 +565,57 @@ ssize_t pwrite(file_t p_file,
                const void *p_buffer,
                size_t p_count,
                offset_t p_offset) {
-        return ::pwrite(p_file, p_buffer, p_count, p_offset);
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_WRITE);
+        const ssize_t _ret = ::pwrite(p_file, p_buffer, p_count, p_offset);
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
+}
+
+inline
+ssize_t preadv(file_t p_file,
+               const iovec_t *p_iov,
+               size_t p_count,
+               offset_t p_offset) {
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_READ);
+        const ssize_t _ret = ::preadv(p_file, p_iov, p_count, p_offset);
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
 }
 
+inline
+ssize_t pwritev(file_t p_file,
+                const iovec_t *p_iov,
+                size_t p_count,
+                offset_t p_offset) {
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_WRITE);
+        const ssize_t _ret = ::pwritev(p_file, p_iov, p_count, p_offset);
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
+}
+
+// preadn, pwriten ֱʹpread/pwriteѭдseek
+// Զ߳̿Թͬһfile_tֵͬreadn, writen
+
 inline
 ssize_t preadn(file_t p_file,
                void *p_buffer,
                size_t p_count,
                offset_t p_offset) {
-        offset_t _org = seek(p_file, p_offset, ST_SEEK_SET);
-        ssize_t _ret = readn(p_file, p_buffer, p_count);
-        seek(p_file, _org, ST_SEEK_SET);
-        return _ret;
+        size_t _readed = 0;
+        char *_pos = static_cast<char*>(p_buffer);
+        while(_readed < p_count) {
+                ssize_t _ret = pread(p_file, _pos, p_count - _readed,
+                                     p_offset + _readed);
+                if (_ret < 0) {
+                        return ((_readed == 0) ? ssize_t(-1) : ssize_t(_readed));
+                } else if (_ret == 0) {
+                        return _readed;
+                } else {
+                        _readed += _ret;
+                        _pos += _ret;
+                }
+        }
+        return _readed;
 }
 
 inline
@@ -361,12 +623,118 @@ ssize_t pwriten(file_t p_file,
                 const void *p_buffer,
                 size_t p_count,
                 offset_t p_offset) {
-        offset_t _org = seek(p_file, p_offset, ST_SEEK_SET);
-        ssize_t _ret = writen(p_file, p_buffer, p_count);
-        seek(p_file, _org, ST_SEEK_SET);
+        size_t _writen = 0;
+        const char *_pos = static_cast<const char*>(p_buffer);
+        while(_writen < p_count) {
+                ssize_t _ret = pwrite(p_file, _pos, p_count - _writen,
+                                      p_offset + _writen);
+                if(_ret >= 0)
+                {
+                        _writen += _ret;
+                        _pos += _ret;
+                }
+                else
+                {
+                        if((errno != EAGAIN) &&
+                           (errno != EWOULDBLOCK))
+                        {
+                                return ((_writen == 0)
+                                        ? ssize_t(-1)
+                                        : ssize_t(_writen)); // -1 or writen len
+                        }
+                }
+        }
+        return _writen;
+}
+
+//
+// advise, preallocate ֻʾıļݺͳ
+//
+
+// p_lengthΪ0ʾļĩβAT_WILLNEEDreadaheadͬ
+// ļϵͳ֧readaheadp_lengthΪ0ʱposix_fadvise
+// AT_DONTNEEDֻѾдصҳɨʱѶĲ
+inline
+bool advise(file_t p_file,
+            offset_t p_offset,
+            offset_t p_length,
+            advice_t p_advice) {
+        if(p_advice == AT_WILLNEED && p_length > 0 &&
+           ::readahead(p_file, p_offset, p_length) == 0)
+                return true;
+        const int _ret = ::posix_fadvise(p_file, p_offset, p_length,
+                                         static_cast<int>(p_advice));
+        if(_ret != 0)
+        {
+                errno = _ret;
+                return false;
+        }
+        return true;
+}
+
+// Ϊļǰp_lengthֽԤȷ̿ռ䣬ٱд߷ɵ
+// extentƬļȲ䣨FALLOC_FL_KEEP_SIZE˳д
+// appendӰ졣ļϵͳ֧fallocateʱʲôҲtrue
+// ռ䲻ȴʱfalse
+inline
+bool preallocate(file_t p_file,
+                 offset_t p_length) {
+        if(p_length <= 0)
+                return true;
+        if(::fallocate(p_file, FALLOC_FL_KEEP_SIZE, 0, p_length) == 0)
+                return true;
+        return errno == EOPNOTSUPP || errno == ENOSYS;
+}
+
+//
+// sync, datasync, syncfs, sync_directory: trueʱѾд̡
+// ½renameļҪsync_directoryڵĿ¼Ŀ¼Ż־ã
+// commit.ippеpublishgroup_committer
+//
+
+inline
+bool sync(file_t p_file) {
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_SYNC);
+        const bool _ret = ::fsync(p_file) == 0;
+        FS_METRIC_END(_ret, 0, errno);
         return _ret;
 }
-		
+
+// ֻдݺͶԪݣ糤ȣдmtime
+inline
+bool datasync(file_t p_file) {
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_SYNC);
+        const bool _ret = ::fdatasync(p_file) == 0;
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
+}
+
+// дp_fileļϵͳ޸ģһδsync
+// ļϵͳ̵дҲᱻһд
+inline
+bool syncfs(file_t p_file) {
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_SYNC);
+        const bool _ret = ::syncfs(p_file) == 0;
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
+}
+
+inline
+bool sync_directory(const char *p_path) {
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_SYNC);
+        const int _fd = ::open(p_path, O_RDONLY | O_DIRECTORY);
+        bool _ret = false;
+        if(_fd >= 0)
+        {
+                _ret = ::fsync(_fd) == 0;
+                const int _errno = errno;
+                ::close(_fd);
+                errno = _errno;
+        }
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
+}
+
 //
 // is_regular, is_directory: statfalseΪļ
 // ڣʱfalseɡ
@@ -388,36 +756,578 @@ bool is_directory(const char *p_path) {
                 is_directory(_status);
 }
 
-// Ŀ¼ݹɾĿ¼ļgfs::remove屣һ
+namespace detail
+{
+
+// ݹɾеһĿ¼Ŀ¼ȫɾɵ
+// رոĿ¼ӸĿ¼ɾԲҪȴ
+struct remove_dir
+{
+        remove_dir *m_parent;
+        file_t m_parent_fd;
+        std::string m_name;	// ڸĿ¼е
+        file_t m_fd;
+        boost::atomic<std::size_t> m_pending; // δɵĿ¼ɨ
+};
+
+struct remove_context
+{
+        fsutil::thread_pool *m_pool; // ΪNULLʱڵǰ߳ɾ
+        boost::atomic<int> m_errno;  // һ0ʾûг
+};
+
 inline
-bool remove(const char *p_path) {
-        if(is_directory(p_path))
+void remove_failed(remove_context &p_ctx, int p_errno) {
+        int _expected = 0;
+        p_ctx.m_errno.compare_exchange_strong(_expected, p_errno);
+}
+
+inline
+void remove_dir_done(remove_context &p_ctx, remove_dir *p_dir) {
+        while(p_dir != NULL &&
+              p_dir->m_pending.fetch_sub(1) == 1)
         {
-                std::vector<file_info> files;
-                if(list_files(files, p_path))
+                ::close(p_dir->m_fd);
+                if(p_ctx.m_errno.load() == 0 &&
+                   ::unlinkat(p_dir->m_parent_fd,
+                              p_dir->m_name.c_str(),
+                              AT_REMOVEDIR) != 0)
                 {
-                        std::string path_prefix = p_path;
-                        path_prefix += '/';
-                        for(std::size_t i = 0; i < files.size(); ++i)
+                        remove_failed(p_ctx, errno);
+                }
+                remove_dir *_parent = p_dir->m_parent;
+                delete p_dir;
+                p_dir = _parent;
+        }
+}
+
+inline
+void remove_dir_scan(remove_context *p_ctx, remove_dir *p_dir) {
+        std::vector<file_info> _files;
+        if(p_ctx->m_errno.load() == 0 &&
+           ! list_files_at(_files, p_dir->m_fd))
+        {
+                remove_failed(*p_ctx, errno);
+        }
+
+        for(std::size_t i = 0; i < _files.size(); ++i)
+        {
+                if(p_ctx->m_errno.load() != 0)
+                        break;
+
+                const char *_name = get_name(_files[i]);
+                if(! is_directory(_files[i]))
+                {
+                        if(::unlinkat(p_dir->m_fd, _name, 0) == 0)
+                                continue;
+                        if(errno != EISDIR) // δ֪ʱĿ¼
                         {
-                                if(! remove((path_prefix + get_name(files[i])).c_str()))
-                                {
-                                        return false;
-                                }
+                                remove_failed(*p_ctx, errno);
+                                break;
                         }
-                        return ::rmdir(p_path) == 0;
+                }
+
+                const file_t _fd = ::openat(p_dir->m_fd, _name,
+                                            O_RDONLY | O_DIRECTORY |
+                                            O_NOFOLLOW | O_CLOEXEC);
+                if(_fd == BAD_FILE)
+                {
+                        remove_failed(*p_ctx, errno);
+                        break;
+                }
+                remove_dir *_child = new remove_dir;
+                _child->m_parent = p_dir;
+                _child->m_parent_fd = p_dir->m_fd;
+                _child->m_name = _name;
+                _child->m_fd = _fd;
+                _child->m_pending.store(1);
+                p_dir->m_pending.fetch_add(1);
+
+                // ̳߳æʱֱڵǰ߳ɾͬʱ˴򿪵Ŀ¼
+                if(p_ctx->m_pool == NULL ||
+                   ! p_ctx->m_pool->try_post(boost::bind(&remove_dir_scan, p_ctx, _child)))
+                {
+                        remove_dir_scan(p_ctx, _child);
+                }
+        }
+
+        remove_dir_done(*p_ctx, p_dir);
+}
+
+} // namespace detail
+
+namespace detail
+{
+
+inline
+bool remove_path(const char *p_path,
+                 std::size_t p_threads) {
+        file_status _status;
+        if(::lstat(p_path, &_status) != 0)
+                return false;
+        if(! is_directory(_status))
+                return ::unlink(p_path) == 0;
+
+        const file_t _fd = ::open(p_path,
+                                  O_RDONLY | O_DIRECTORY |
+                                  O_NOFOLLOW | O_CLOEXEC);
+        if(_fd == BAD_FILE)
+                return false;
+
+        detail::remove_dir *_root = new detail::remove_dir;
+        _root->m_parent = NULL;
+        _root->m_parent_fd = AT_FDCWD;
+        _root->m_name = p_path;
+        _root->m_fd = _fd;
+        _root->m_pending.store(1);
+
+        detail::remove_context _ctx;
+        _ctx.m_pool = NULL;
+        _ctx.m_errno.store(0);
+        if(p_threads > 1)
+        {
+                fsutil::thread_pool _pool(p_threads, 8 * p_threads);
+                _ctx.m_pool = &_pool;
+                detail::remove_dir_scan(&_ctx, _root);
+                _pool.wait();
+        }
+        else
+        {
+                detail::remove_dir_scan(&_ctx, _root);
+        }
+
+        if(_ctx.m_errno.load() != 0)
+        {
+                errno = _ctx.m_errno.load();
+                return false;
+        }
+        return true;
+}
+
+} // namespace detail
+
+// Ŀ¼ݹɾĿ¼ļgfs::remove屣һ¡
+// Ŀ¼Ѵ򿪵Ŀ¼fdУļȡlist_files_at
+// p_threads1ʱĿ¼ɢ̳߳вɾ
+// ʱfalseerrnoΪĵһ󣬴ʱĿ¼ѱɾ
+inline
+bool remove(const char *p_path,
+            std::size_t p_threads) {
+        FS_METRIC_BEGIN(MB_LOCALFS, OP_REMOVE);
+        const bool _ret = detail::remove_path(p_path, p_threads);
+        FS_METRIC_END(_ret, 0, errno);
+        detail::path_changed(p_path);
+        return _ret;
+}
+
+inline
+bool remove(const char *p_path) {
+        return remove(p_path, 1);
+}
+
+// copy_fileʹõķָķʼԣļϵͳں
+// ֧ʱλΪķ
+enum copy_method
+{
+        CM_CLONE,		// FICLONEԴļݿ飨btrfs, xfsȣ
+        CM_COPY_RANGE,		// copy_file_rangeݲû̬
+        CM_SENDFILE,		// sendfileͬϣҪ
+        CM_BUFFER		// pread/pwriteÿCOPY_BUFFER_SIZEֽ
+};
+
+const size_t COPY_BUFFER_SIZE = 4 * 1024 * 1024;
+
+namespace detail
+{
+
+// ÷֧֣Ӧûһ
+inline
+bool copy_unsupported(int p_errno) {
+        return p_errno == ENOSYS || p_errno == EXDEV || p_errno == EINVAL ||
+                p_errno == EOPNOTSUPP || p_errno == ENOTTY;
+}
+
+inline
+ssize_t copy_file_range(int p_in,
+                        loff_t *p_in_offset,
+                        int p_out,
+                        loff_t *p_out_offset,
+                        size_t p_count) {
+#ifdef SYS_copy_file_range
+        return ::syscall(SYS_copy_file_range, p_in, p_in_offset,
+                         p_out, p_out_offset, p_count, 0u);
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+}
+
+// [p_offset, p_end)Ƶp_outͬλãp_method֧ʱ
+// Ϊһַӵǰλü
+inline
+bool copy_segment(int p_in,
+                  int p_out,
+                  offset_t p_offset,
+                  offset_t p_end,
+                  copy_method &p_method,
+                  std::vector<char> &p_buffer) {
+        while(p_offset < p_end)
+        {
+                const size_t _count = size_t(std::min<offset_t>(p_end - p_offset,
+                                                                1024 * 1024 * 1024));
+                ssize_t _ret = -1;
+                if(p_method == CM_COPY_RANGE)
+                {
+                        loff_t _in = p_offset;
+                        loff_t _out = p_offset;
+                        _ret = copy_file_range(p_in, &_in, p_out, &_out, _count);
+                }
+                else if(p_method == CM_SENDFILE)
+                {
+                        off_t _in = p_offset;
+                        if(::lseek(p_out, p_offset, SEEK_SET) < 0)
+                                return false;
+                        _ret = ::sendfile(p_out, p_in, &_in, _count);
                 }
                 else
                 {
+                        if(p_buffer.empty())
+                                p_buffer.resize(COPY_BUFFER_SIZE);
+                        _ret = ::pread(p_in, &p_buffer[0],
+                                       std::min(_count, p_buffer.size()), p_offset);
+                        if(_ret > 0 &&
+                           pwriten(p_out, &p_buffer[0], _ret, p_offset) != _ret)
+                                return false;
+                }
+
+                if(_ret < 0)
+                {
+                        if(errno == EINTR)
+                                continue;
+                        if(p_method != CM_BUFFER && copy_unsupported(errno))
+                        {
+                                p_method = copy_method(p_method + 1);
+                                continue;
+                        }
                         return false;
                 }
+                if(_ret == 0)
+                        break;	// Դļض
+                p_offset += _ret;
         }
-        else
+        return true;
+}
+
+// ֻݵ䣬նftruncate
+inline
+bool copy_data(int p_in,
+               int p_out,
+               offset_t p_size,
+               copy_method p_method) {
+        if(p_method == CM_CLONE)
         {
-                return ::unlink(p_path) == 0;
+#ifdef FICLONE
+                if(::ioctl(p_out, FICLONE, p_in) == 0)
+                        return true;
+                if(! copy_unsupported(errno))
+                        return false;
+#endif
+                p_method = CM_COPY_RANGE;
+        }
+
+        std::vector<char> _buffer;
+        offset_t _pos = 0;
+        while(_pos < p_size)
+        {
+                offset_t _data = _pos;
+                offset_t _hole = p_size;
+#ifdef SEEK_DATA
+                _data = ::lseek(p_in, _pos, SEEK_DATA);
+                if(_data < 0)
+                {
+                        if(errno == ENXIO)
+                                break;	// 涼ǿն
+                        if(errno != EINVAL)
+                                return false;
+                        _data = _pos;	// ֧SEEK_DATAȫ
+                }
+                else
+                {
+                        _hole = ::lseek(p_in, _data, SEEK_HOLE);
+                        if(_hole < 0 || _hole > p_size)
+                                _hole = p_size;
+                }
+#endif
+                if(! copy_segment(p_in, p_out, _data, _hole, p_method, _buffer))
+                        return false;
+                _pos = _hole;
+        }
+        return ::ftruncate(p_out, p_size) == 0;
+}
+
+} // namespace detail
+
+// һͨļp_new_pathѾʱǣȨͬԴļ
+// p_methodʼԸַںиƣpread/pwrite
+// ԴļеĿնĿļȻǿնFICLONEͱն
+// ֻSEEK_DATA/SEEK_HOLEҵ䣩
+// p_new_pathp_pathӲʱfalseerrnoΪEINVAL
+// ʱfalseerrnoΪ룬Ŀļɾ
+inline
+bool copy_file(const char *p_path,
+               const char *p_new_path,
+               copy_method p_method = CM_CLONE) {
+        const int _in = ::open(p_path, O_RDONLY);
+        if(_in < 0)
+                return false;
+        file_status _status;
+        if(::fstat(_in, &_status) != 0)
+        {
+                const int _errno = errno;
+                ::close(_in);
+                errno = _errno;
+                return false;
+        }
+        if(! S_ISREG(_status.st_mode))
+        {
+                ::close(_in);
+                errno = S_ISDIR(_status.st_mode) ? EISDIR : EINVAL;
+                return false;
+        }
+        // Ȳضϣp_new_pathܾp_pathӲ
+        const int _out = ::open(p_new_path, O_WRONLY | O_CREAT,
+                                _status.st_mode & 07777);
+        if(_out < 0)
+        {
+                const int _errno = errno;
+                ::close(_in);
+                errno = _errno;
+                return false;
+        }
+        file_status _out_status;
+        int _errno = 0;
+        if(::fstat(_out, &_out_status) != 0)
+                _errno = errno;
+        else if(_out_status.st_dev == _status.st_dev && _out_status.st_ino == _status.st_ino)
+                _errno = EINVAL;
+        if(_errno != 0)
+        {
+                ::close(_out);
+                ::close(_in);
+                errno = _errno;
+                return false;
+        }
+
+        // ѾڵĿļԭȨޣҪΪԴļ
+        bool _ret = ::fchmod(_out, _status.st_mode & 07777) == 0 &&
+                ::ftruncate(_out, 0) == 0 &&
+                detail::copy_data(_in, _out, _status.st_size, p_method);
+        _errno = errno;
+        if(::close(_out) != 0 && _ret)
+        {
+                _ret = false;
+                _errno = errno;
         }
+        ::close(_in);
+        if(! _ret)
+                ::unlink(p_new_path);
+        errno = _errno;
+        return _ret;
+}
+
+//
+// O_DIRECT˳дʱռpage cache⼷ҪĻ
+//
+
+enum {
+        DIRECT_IO_ALIGNMENT = 4096,		// ƫơȺͻַĶ
+        DIRECT_IO_BUFFER_SIZE = 4 * 1024 * 1024
+};
+
+// p_fileǷO_DIRECT򿪣open(MT_O_DIRECT)ļϵͳ֧ʱ
+// ȥ־ʱfalse
+inline
+bool is_direct(file_t p_file) {
+        const int _flags = ::fcntl(p_file, F_GETFL);
+        return _flags != -1 && (_flags & O_DIRECT) != 0;
 }
 
+namespace detail
+{
+
+inline
+bool set_direct(file_t p_file,
+                bool p_direct) {
+        const int _flags = ::fcntl(p_file, F_GETFL);
+        if(_flags == -1)
+                return false;
+        return ::fcntl(p_file, F_SETFL,
+                       p_direct ? (_flags | O_DIRECT) : (_flags & ~O_DIRECT)) == 0;
+}
+
+inline
+bool is_aligned(uint64_t p_value) {
+        return p_value % DIRECT_IO_ALIGNMENT == 0;
+}
+
+} // namespace detail
+
+//
+// p_offsetʼ˳дp_fileO_DIRECTĶҪȿ
+// ĻУpwriteߵݺƫƶѶʱ
+// ֱдٿp_offsetʱͷһλõĲ֡
+// finishʱļĩβDIRECT_IO_ALIGNMENTĲ֣ʱȥO_DIRECT
+// ͨд
+//
+// p_fileûO_DIRECTļϵͳ֧֣ʱͨĴд
+// ʹڼp_file̶ܱ߳дʱfinishرļ
+//
+class direct_writer : boost::noncopyable
+{
+public:
+        explicit direct_writer(file_t p_file,
+                               offset_t p_offset = 0,
+                               size_t p_buffer_size = DIRECT_IO_BUFFER_SIZE)
+                : m_file(p_file),
+                  m_direct(is_direct(p_file)),
+                  m_offset(p_offset),
+                  m_capacity(std::max<size_t>(p_buffer_size / DIRECT_IO_ALIGNMENT, 1) *
+                             DIRECT_IO_ALIGNMENT),
+                  m_buffer(NULL),
+                  m_size(0),
+                  m_errno(0) {
+                void *_buffer = NULL;
+                const int _ret = ::posix_memalign(&_buffer, DIRECT_IO_ALIGNMENT, m_capacity);
+                if(_ret != 0)
+                        m_errno = _ret;
+                else
+                        m_buffer = static_cast<char*>(_buffer);
+        }
+
+        ~direct_writer() {
+                finish();
+                ::free(m_buffer);
+        }
+
+        // p_countʱ-1֮ǰдʧ֮ܺwriten
+        // ʧ
+        ssize_t writen(const void *p_buffer,
+                       size_t p_count) {
+                const char *_pos = static_cast<const char*>(p_buffer);
+                size_t _left = p_count;
+                while(_left > 0 && m_errno == 0)
+                {
+                        // ĴֱдûO_DIRECTʱҪ
+                        if(m_size == 0 && _left >= m_capacity &&
+                           (! m_direct ||
+                            (detail::is_aligned(m_offset) &&
+                             detail::is_aligned(reinterpret_cast<uintptr_t>(_pos)))))
+                        {
+                                const size_t _count = m_direct
+                                        ? _left - _left % DIRECT_IO_ALIGNMENT : _left;
+                                if(! write_out(_pos, _count, m_direct))
+                                        break;
+                                _pos += _count;
+                                _left -= _count;
+                                continue;
+                        }
+
+                        const size_t _count = std::min<size_t>(_left, limit() - m_size);
+                        std::memcpy(m_buffer + m_size, _pos, _count);
+                        m_size += _count;
+                        _pos += _count;
+                        _left -= _count;
+                        if(m_size == limit())
+                                flush_buffer();
+                }
+                if(m_errno != 0)
+                {
+                        set_errno(m_errno);
+                        return -1;
+                }
+                return p_count;
+        }
+
+        // деݣβ֮󻹿Լwriten
+        bool finish() {
+                if(m_errno == 0 && m_size > 0)
+                {
+                        const size_t _aligned = m_size - m_size % DIRECT_IO_ALIGNMENT;
+                        if(_aligned > 0 && write_out(m_buffer, _aligned, m_direct))
+                        {
+                                std::memmove(m_buffer, m_buffer + _aligned, m_size - _aligned);
+                                m_size -= _aligned;
+                        }
+                        if(m_errno == 0 && m_size > 0 && write_out(m_buffer, m_size, false))
+                                m_size = 0;
+                }
+                if(m_errno != 0)
+                {
+                        set_errno(m_errno);
+                        return false;
+                }
+                return true;
+        }
+
+        // һwritenļеƫ
+        offset_t tell() const {
+                return m_offset + m_size;
+        }
+
+        // ļǷO_DIRECTд
+        bool direct() const {
+                return m_direct;
+        }
+
+private:
+        // ͷʱֻ嵽һλ
+        size_t limit() const {
+                const size_t _head = m_offset % DIRECT_IO_ALIGNMENT;
+                return (_head == 0) ? m_capacity : DIRECT_IO_ALIGNMENT - _head;
+        }
+
+        void flush_buffer() {
+                if(write_out(m_buffer, m_size,
+                             m_direct && detail::is_aligned(m_offset) &&
+                             detail::is_aligned(m_size)))
+                        m_size = 0;
+        }
+
+        // p_directΪfalseļO_DIRECTʱʱȥO_DIRECT
+        bool write_out(const char *p_data,
+                       size_t p_count,
+                       bool p_direct) {
+                const bool _toggle = m_direct && ! p_direct;
+                if(_toggle && ! detail::set_direct(m_file, false))
+                {
+                        m_errno = errno;
+                        return false;
+                }
+                const ssize_t _ret = pwriten(m_file, p_data, p_count, m_offset);
+                const int _errno = errno;
+                if(_toggle && ! detail::set_direct(m_file, true) && _ret == ssize_t(p_count))
+                {
+                        m_errno = errno;
+                        return false;
+                }
+                if(_ret != ssize_t(p_count))
+                {
+                        m_errno = (_ret < 0) ? _errno : EIO;
+                        return false;
+                }
+                m_offset += p_count;
+                return true;
+        }
+
+        const file_t m_file;
+        const bool m_direct;
+        offset_t m_offset;		// m_bufferͷļеƫ
+        const size_t m_capacity;
+        char *m_buffer;			// DIRECT_IO_ALIGNMENT
+        size_t m_size;
+        int m_errno;
+};
+
 } // namespace localfs
 
 #endif	// _LOCALFS_HPP_
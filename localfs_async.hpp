@@ -0,0 +1,514 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _LOCALFS_ASYNC_HPP_
+#define _LOCALFS_ASYNC_HPP_
+
+#include <deque>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "localfs.hpp"
+#include "thread_pool.hpp"
+
+// 直接使用系统调用，不依赖liburing
+#ifndef __NR_io_uring_setup
+#	define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#	define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#	define __NR_io_uring_register 427
+#endif
+
+//
+// localfs的异步版本：先用pread、pwrite等准备请求，再用submit一次
+// 提交，最后用poll或wait取回完成结果。基于io_uring实现，内核不
+// 支持io_uring时，退化为线程池中执行的阻塞调用。
+// 一个ring只能由一个线程使用。
+//
+namespace localfs_async
+{
+
+using localfs::file_t;
+using localfs::ssize_t;
+using localfs::size_t;
+using localfs::offset_t;
+using localfs::iovec_t;
+using localfs::mode_t;
+using localfs::BAD_FILE;
+
+// 请求的完成结果。m_result同对应的同步调用的返回值，
+// 出错时为-errno
+struct completion
+{
+        uint64_t m_user_data;
+        int64_t m_result;
+};
+
+// 请求标志：p_file是register_files注册的文件下标
+static const unsigned FIXED_FILE = IOSQE_FIXED_FILE;
+
+class ring : boost::noncopyable
+{
+public:
+        // p_entries - 提交队列的长度，同时在途的请求数不超过其2倍
+        // p_fallback_threads - 不能使用io_uring时线程池的线程数
+        // p_use_uring - 为false时总是使用线程池，便于对比
+        explicit ring(unsigned p_entries = 256,
+                      std::size_t p_fallback_threads = 4,
+                      bool p_use_uring = true)
+                : m_fd(-1),
+                  m_capacity(0),
+                  m_inflight(0),
+                  m_pool(NULL) {
+                if(! (p_use_uring && setup(p_entries)))
+                {
+                        m_capacity = 2 * p_entries;
+                        m_pool = new fsutil::thread_pool(p_fallback_threads);
+                }
+        }
+
+        // 调用者需要先取回所有在途请求的结果
+        ~ring() {
+                if(m_pool != NULL)
+                {
+                        delete m_pool;
+                }
+                else
+                {
+                        ::munmap(m_sqes, m_sqes_size);
+                        if(m_cq_ptr != m_sq_ptr)
+                                ::munmap(m_cq_ptr, m_cq_size);
+                        ::munmap(m_sq_ptr, m_sq_size);
+                        ::close(m_fd);
+                }
+        }
+
+        bool is_uring() const {
+                return m_pool == NULL;
+        }
+
+        // 已准备（包括已提交）但还没有取回结果的请求数
+        std::size_t inflight() const {
+                return m_inflight;
+        }
+
+        //
+        // 准备请求，直到submit时才真正提交。队列已满时返回false。
+        // 请求完成之前，buffer、iovec和路径都必须保持有效。
+        //
+
+        bool pread(file_t p_file, void *p_buffer, size_t p_count,
+                   offset_t p_offset, uint64_t p_user_data,
+                   unsigned p_flags = 0) {
+                return prepare(IORING_OP_READ, p_file, p_buffer, p_count,
+                               p_offset, p_flags, p_user_data);
+        }
+
+        bool pwrite(file_t p_file, const void *p_buffer, size_t p_count,
+                    offset_t p_offset, uint64_t p_user_data,
+                    unsigned p_flags = 0) {
+                return prepare(IORING_OP_WRITE, p_file, p_buffer, p_count,
+                               p_offset, p_flags, p_user_data);
+        }
+
+        bool readv(file_t p_file, const iovec_t *p_iov, size_t p_count,
+                   offset_t p_offset, uint64_t p_user_data,
+                   unsigned p_flags = 0) {
+                return prepare(IORING_OP_READV, p_file, p_iov, p_count,
+                               p_offset, p_flags, p_user_data);
+        }
+
+        bool writev(file_t p_file, const iovec_t *p_iov, size_t p_count,
+                    offset_t p_offset, uint64_t p_user_data,
+                    unsigned p_flags = 0) {
+                return prepare(IORING_OP_WRITEV, p_file, p_iov, p_count,
+                               p_offset, p_flags, p_user_data);
+        }
+
+        // 使用register_buffers注册的第p_index个buffer（或其中一段）
+        bool pread_fixed(file_t p_file, void *p_buffer, size_t p_count,
+                         offset_t p_offset, unsigned p_index,
+                         uint64_t p_user_data, unsigned p_flags = 0) {
+                return prepare(IORING_OP_READ_FIXED, p_file, p_buffer, p_count,
+                               p_offset, p_flags, p_user_data, p_index);
+        }
+
+        bool pwrite_fixed(file_t p_file, const void *p_buffer, size_t p_count,
+                          offset_t p_offset, unsigned p_index,
+                          uint64_t p_user_data, unsigned p_flags = 0) {
+                return prepare(IORING_OP_WRITE_FIXED, p_file, p_buffer, p_count,
+                               p_offset, p_flags, p_user_data, p_index);
+        }
+
+        // 结果为新打开的fd
+        bool open(const char *p_path, mode_t p_mode, uint64_t p_user_data) {
+                return prepare(IORING_OP_OPENAT, AT_FDCWD, p_path,
+                               S_IRWXU | S_IRWXG | S_IRWXO, 0, 0,
+                               p_user_data, 0, static_cast<int>(p_mode));
+        }
+
+        bool close(file_t p_file, uint64_t p_user_data) {
+                return prepare(IORING_OP_CLOSE, p_file, NULL, 0,
+                               0, 0, p_user_data);
+        }
+
+        bool fsync(file_t p_file, uint64_t p_user_data,
+                   bool p_datasync = false, unsigned p_flags = 0) {
+                return prepare(IORING_OP_FSYNC, p_file, NULL, 0, 0, p_flags,
+                               p_user_data, 0,
+                               p_datasync ? IORING_FSYNC_DATASYNC : 0);
+        }
+
+        // 提交所有已准备的请求，只需一次系统调用；返回提交的个数，出错时为-1
+        int submit() {
+                if(m_pool != NULL)
+                        return fallback_submit();
+
+                const unsigned _count = m_sqe_tail - *m_sq_tail;
+                __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+                if(_count == 0)
+                        return 0;
+                return enter(_count, 0, 0);
+        }
+
+        // 取回已完成的请求，不阻塞
+        std::size_t poll(completion *p_completions, std::size_t p_max) {
+                return wait(p_completions, p_max, 0);
+        }
+
+        // 至少等到p_min个请求完成
+        std::size_t wait(completion *p_completions,
+                         std::size_t p_max,
+                         std::size_t p_min) {
+                if(p_min > p_max)
+                        p_min = p_max;
+                if(m_pool != NULL)
+                        return fallback_wait(p_completions, p_max, p_min);
+
+                std::size_t _got = reap(p_completions, p_max);
+                while(_got < p_min)
+                {
+                        if(enter(0, unsigned(p_min - _got), IORING_ENTER_GETEVENTS) < 0 &&
+                           errno != EINTR)
+                                break;
+                        _got += reap(p_completions + _got, p_max - _got);
+                }
+                return _got;
+        }
+
+        //
+        // 注册buffer和文件，减少内核每次请求时的映射、引用计数开销
+        //
+
+        bool register_buffers(const iovec_t *p_iov, size_t p_count) {
+                if(m_pool != NULL)
+                        return true;
+                return do_register(IORING_REGISTER_BUFFERS, p_iov, unsigned(p_count));
+        }
+
+        bool unregister_buffers() {
+                if(m_pool != NULL)
+                        return true;
+                return do_register(IORING_UNREGISTER_BUFFERS, NULL, 0);
+        }
+
+        bool register_files(const file_t *p_files, size_t p_count) {
+                if(m_pool != NULL)
+                {
+                        boost::mutex::scoped_lock _lock(m_mutex);
+                        m_files.assign(p_files, p_files + p_count);
+                        return true;
+                }
+                return do_register(IORING_REGISTER_FILES, p_files, unsigned(p_count));
+        }
+
+        bool unregister_files() {
+                if(m_pool != NULL)
+                {
+                        boost::mutex::scoped_lock _lock(m_mutex);
+                        m_files.clear();
+                        return true;
+                }
+                return do_register(IORING_UNREGISTER_FILES, NULL, 0);
+        }
+
+private:
+        struct request
+        {
+                int m_op;
+                file_t m_file;
+                const void *m_addr;
+                size_t m_len;
+                offset_t m_offset;
+                unsigned m_flags;
+                uint64_t m_user_data;
+                unsigned m_buf_index;
+                int m_op_flags;		// open的flags或fsync的flags
+        };
+
+        bool setup(unsigned p_entries) {
+                struct io_uring_params _params;
+                std::memset(&_params, 0, sizeof(_params));
+                m_fd = int(::syscall(__NR_io_uring_setup, p_entries, &_params));
+                if(m_fd < 0)
+                        return false;
+
+                m_sq_size = _params.sq_off.array + _params.sq_entries * sizeof(unsigned);
+                m_cq_size = _params.cq_off.cqes + _params.cq_entries * sizeof(struct io_uring_cqe);
+                const bool _single = (_params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+                if(_single)
+                        m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+
+                m_sq_ptr = ::mmap(NULL, m_sq_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+                if(m_sq_ptr == MAP_FAILED)
+                {
+                        ::close(m_fd);
+                        return false;
+                }
+                m_cq_ptr = _single
+                        ? m_sq_ptr
+                        : ::mmap(NULL, m_cq_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+                m_sqes_size = _params.sq_entries * sizeof(struct io_uring_sqe);
+                m_sqes = (m_cq_ptr == MAP_FAILED)
+                        ? static_cast<struct io_uring_sqe*>(MAP_FAILED)
+                        : static_cast<struct io_uring_sqe*>(
+                                ::mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+                if(m_sqes == MAP_FAILED)
+                {
+                        if(m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+                                ::munmap(m_cq_ptr, m_cq_size);
+                        ::munmap(m_sq_ptr, m_sq_size);
+                        ::close(m_fd);
+                        return false;
+                }
+
+                char *_sq = static_cast<char*>(m_sq_ptr);
+                m_sq_head = reinterpret_cast<unsigned*>(_sq + _params.sq_off.head);
+                m_sq_tail = reinterpret_cast<unsigned*>(_sq + _params.sq_off.tail);
+                m_sq_mask = *reinterpret_cast<unsigned*>(_sq + _params.sq_off.ring_mask);
+                m_sq_array = reinterpret_cast<unsigned*>(_sq + _params.sq_off.array);
+                m_sq_entries = _params.sq_entries;
+                m_sqe_tail = *m_sq_tail;
+
+                char *_cq = static_cast<char*>(m_cq_ptr);
+                m_cq_head = reinterpret_cast<unsigned*>(_cq + _params.cq_off.head);
+                m_cq_tail = reinterpret_cast<unsigned*>(_cq + _params.cq_off.tail);
+                m_cq_mask = *reinterpret_cast<unsigned*>(_cq + _params.cq_off.ring_mask);
+                m_cqes = reinterpret_cast<struct io_uring_cqe*>(_cq + _params.cq_off.cqes);
+
+                // 在途请求不能超过完成队列的长度，否则完成结果会溢出
+                m_capacity = _params.cq_entries;
+                return true;
+        }
+
+        int enter(unsigned p_submit, unsigned p_min_complete, unsigned p_flags) {
+                return int(::syscall(__NR_io_uring_enter, m_fd, p_submit,
+                                     p_min_complete, p_flags, NULL, 0));
+        }
+
+        bool do_register(unsigned p_opcode, const void *p_arg, unsigned p_count) {
+                return ::syscall(__NR_io_uring_register, m_fd, p_opcode,
+                                 p_arg, p_count) == 0;
+        }
+
+        bool prepare(int p_op, file_t p_file, const void *p_addr, size_t p_len,
+                     offset_t p_offset, unsigned p_flags, uint64_t p_user_data,
+                     unsigned p_buf_index = 0, int p_op_flags = 0) {
+                if(m_inflight >= m_capacity)
+                        return false;
+
+                if(m_pool != NULL)
+                {
+                        request _request;
+                        _request.m_op = p_op;
+                        _request.m_file = p_file;
+                        _request.m_addr = p_addr;
+                        _request.m_len = p_len;
+                        _request.m_offset = p_offset;
+                        _request.m_flags = p_flags;
+                        _request.m_user_data = p_user_data;
+                        _request.m_buf_index = p_buf_index;
+                        _request.m_op_flags = p_op_flags;
+                        m_queued.push_back(_request);
+                        ++ m_inflight;
+                        return true;
+                }
+
+                const unsigned _head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+                if(m_sqe_tail - _head >= m_sq_entries)
+                        return false;
+
+                const unsigned _index = m_sqe_tail & m_sq_mask;
+                struct io_uring_sqe *_sqe = &m_sqes[_index];
+                std::memset(_sqe, 0, sizeof(*_sqe));
+                _sqe->opcode = static_cast<__u8>(p_op);
+                _sqe->flags = static_cast<__u8>(p_flags);
+                _sqe->fd = p_file;
+                _sqe->off = static_cast<__u64>(p_offset);
+                _sqe->addr = reinterpret_cast<__u64>(p_addr);
+                _sqe->len = static_cast<__u32>(p_len);
+                _sqe->user_data = p_user_data;
+                _sqe->buf_index = static_cast<__u16>(p_buf_index);
+                if(p_op == IORING_OP_OPENAT)
+                        _sqe->open_flags = static_cast<__u32>(p_op_flags);
+                else if(p_op == IORING_OP_FSYNC)
+                        _sqe->fsync_flags = static_cast<__u32>(p_op_flags);
+                m_sq_array[_index] = _index;
+                ++ m_sqe_tail;
+                ++ m_inflight;
+                return true;
+        }
+
+        std::size_t reap(completion *p_completions, std::size_t p_max) {
+                unsigned _head = *m_cq_head;
+                const unsigned _tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+                std::size_t _got = 0;
+                for(; (_head != _tail) && (_got < p_max); ++_head, ++_got)
+                {
+                        const struct io_uring_cqe &_cqe = m_cqes[_head & m_cq_mask];
+                        p_completions[_got].m_user_data = _cqe.user_data;
+                        p_completions[_got].m_result = _cqe.res;
+                }
+                __atomic_store_n(m_cq_head, _head, __ATOMIC_RELEASE);
+                m_inflight -= _got;
+                return _got;
+        }
+
+        //
+        // 线程池实现
+        //
+
+        int fallback_submit() {
+                const int _count = int(m_queued.size());
+                for(std::size_t i = 0; i < m_queued.size(); ++i)
+                {
+                        m_pool->post(boost::bind(&ring::execute, this, m_queued[i]));
+                }
+                m_queued.clear();
+                return _count;
+        }
+
+        std::size_t fallback_wait(completion *p_completions,
+                                  std::size_t p_max,
+                                  std::size_t p_min) {
+                boost::mutex::scoped_lock _lock(m_mutex);
+                while(m_done.size() < p_min)
+                {
+                        m_done_cond.wait(_lock);
+                }
+                std::size_t _got = 0;
+                for(; (_got < p_max) && (! m_done.empty()); ++_got)
+                {
+                        p_completions[_got] = m_done.front();
+                        m_done.pop_front();
+                }
+                m_inflight -= _got;
+                return _got;
+        }
+
+        void execute(const request &p_request) {
+                file_t _file = p_request.m_file;
+                if(p_request.m_flags & FIXED_FILE)
+                {
+                        boost::mutex::scoped_lock _lock(m_mutex);
+                        _file = (_file >= 0 && size_t(_file) < m_files.size())
+                                ? m_files[_file]
+                                : BAD_FILE;
+                }
+
+                void *_addr = const_cast<void*>(p_request.m_addr);
+                const iovec_t *_iov = static_cast<const iovec_t*>(p_request.m_addr);
+                int64_t _ret = -1;
+                switch(p_request.m_op)
+                {
+                case IORING_OP_READ:
+                case IORING_OP_READ_FIXED:
+                        _ret = ::pread(_file, _addr, p_request.m_len, p_request.m_offset);
+                        break;
+                case IORING_OP_WRITE:
+                case IORING_OP_WRITE_FIXED:
+                        _ret = ::pwrite(_file, _addr, p_request.m_len, p_request.m_offset);
+                        break;
+                case IORING_OP_READV:
+                        _ret = ::preadv(_file, _iov, int(p_request.m_len), p_request.m_offset);
+                        break;
+                case IORING_OP_WRITEV:
+                        _ret = ::pwritev(_file, _iov, int(p_request.m_len), p_request.m_offset);
+                        break;
+                case IORING_OP_OPENAT:
+                        _ret = ::open(static_cast<const char*>(p_request.m_addr),
+                                      p_request.m_op_flags,
+                                      static_cast<int>(p_request.m_len));
+                        break;
+                case IORING_OP_CLOSE:
+                        _ret = ::close(_file);
+                        break;
+                case IORING_OP_FSYNC:
+                        _ret = (p_request.m_op_flags & IORING_FSYNC_DATASYNC)
+                                ? ::fdatasync(_file)
+                                : ::fsync(_file);
+                        break;
+                default:
+                        errno = EINVAL;
+                        break;
+                }
+
+                completion _completion;
+                _completion.m_user_data = p_request.m_user_data;
+                _completion.m_result = (_ret < 0) ? -int64_t(errno) : _ret;
+                {
+                        boost::mutex::scoped_lock _lock(m_mutex);
+                        m_done.push_back(_completion);
+                }
+                m_done_cond.notify_all();
+        }
+
+        int m_fd;
+        std::size_t m_capacity;
+        std::size_t m_inflight;
+
+        // io_uring
+        void *m_sq_ptr;
+        std::size_t m_sq_size;
+        void *m_cq_ptr;
+        std::size_t m_cq_size;
+        struct io_uring_sqe *m_sqes;
+        std::size_t m_sqes_size;
+        unsigned *m_sq_head;
+        unsigned *m_sq_tail;
+        unsigned *m_sq_array;
+        unsigned m_sq_mask;
+        unsigned m_sq_entries;
+        unsigned m_sqe_tail;	// 已准备但还未提交的位置
+        unsigned *m_cq_head;
+        unsigned *m_cq_tail;
+        unsigned m_cq_mask;
+        struct io_uring_cqe *m_cqes;
+
+        // 线程池
+        fsutil::thread_pool *m_pool;
+        std::vector<request> m_queued;
+        std::vector<file_t> m_files;
+        std::deque<completion> m_done;
+        boost::mutex m_mutex;
+        boost::condition_variable m_done_cond;
+};
+
+} // namespace localfs_async
+
+#endif	// _LOCALFS_ASYNC_HPP_
@@ -0,0 +1,270 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _MAPPED_FILE_HPP_
+#define _MAPPED_FILE_HPP_
+
+#include <string>
+#include <algorithm>
+
+#include <sys/mman.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/asio/buffer.hpp>
+
+#include "localfs.hpp"
+
+namespace localfs
+{
+
+// 映射区域的访问模式提示
+enum map_advice
+{
+        MA_NORMAL = MADV_NORMAL,
+        MA_SEQUENTIAL = MADV_SEQUENTIAL,
+        MA_RANDOM = MADV_RANDOM,
+        MA_WILLNEED = MADV_WILLNEED,
+        MA_DONTNEED = MADV_DONTNEED
+};
+
+enum map_flag
+{
+        MF_POPULATE = 1,	// 映射时就读入全部页面
+        MF_HUGE_PAGES = 2	// 尽量按大页对齐并使用透明大页
+};
+
+//
+// 文件的只读内存映射，析构时自动解除映射。反复读同一个大文件时
+// 可以避免read到堆上buffer的拷贝；用buffer()得到的const_buffer
+// 可以直接传给fs.ipp中的append, writen等。
+//
+class mapped_file : boost::noncopyable
+{
+public:
+        mapped_file()
+                : m_base(NULL),
+                  m_length(0),
+                  m_data(NULL),
+                  m_size(0) {}
+
+        ~mapped_file() {
+                unmap();
+        }
+
+        // 映射整个文件
+        bool map(file_t p_file,
+                 unsigned p_flags = 0) {
+                unmap();
+                file_status _status;
+                if(::fstat(p_file, &_status) != 0)
+                        return false;
+                return map_range(p_file, 0, get_size(_status), p_flags);
+        }
+
+        // 映射文件的[p_offset, p_offset + p_size)，p_offset不需要对齐。
+        // 超出文件结尾的部分会被截掉（访问文件结尾之后的页会收到SIGBUS），
+        // size()为截掉之后的长度；p_offset在文件结尾之后时返回false，
+        // errno为EINVAL
+        bool map(file_t p_file,
+                 offset_t p_offset,
+                 size_t p_size,
+                 unsigned p_flags = 0) {
+                unmap();
+                file_status _status;
+                if(::fstat(p_file, &_status) != 0)
+                        return false;
+                const offset_t _file_size = get_size(_status);
+                if(p_offset < 0 || p_offset > _file_size)
+                {
+                        errno = EINVAL;
+                        return false;
+                }
+                if(p_size > size_t(_file_size - p_offset))
+                        p_size = size_t(_file_size - p_offset);
+                return map_range(p_file, p_offset, p_size, p_flags);
+        }
+
+        bool map(const char *p_path,
+                 unsigned p_flags = 0) {
+                const file_t _file = open(p_path, MT_O_RDONLY);
+                if(_file == BAD_FILE)
+                        return false;
+                const bool _ret = map(_file, p_flags);
+                const int _errno = errno;
+                close(_file); // 映射不依赖于fd
+                errno = _errno;
+                return _ret;
+        }
+
+        bool map(const std::string &p_path,
+                 unsigned p_flags = 0) {
+                return map(p_path.c_str(), p_flags);
+        }
+
+        void unmap() {
+                if(m_base != NULL)
+                {
+                        ::munmap(m_base, m_length);
+                }
+                m_base = NULL;
+                m_length = 0;
+                m_data = NULL;
+                m_size = 0;
+        }
+
+        // 对映射中的[p_offset, p_offset + p_size)给出访问提示，
+        // p_size为0表示到映射结尾
+        bool advise(map_advice p_advice,
+                    size_t p_offset = 0,
+                    size_t p_size = 0) const {
+                if(p_offset >= m_size)
+                        return p_offset == 0;
+                if(p_size == 0 || p_size > m_size - p_offset)
+                        p_size = m_size - p_offset;
+
+                // madvise要求起始地址按页对齐
+                const char *_begin = m_data + p_offset;
+                const size_t _head = size_t(_begin - static_cast<const char*>(m_base)) % page_size();
+                return ::madvise(const_cast<char*>(_begin - _head),
+                                 p_size + _head,
+                                 static_cast<int>(p_advice)) == 0;
+        }
+
+        bool is_mapped() const {
+                return m_data != NULL;
+        }
+
+        const char *data() const {
+                return m_data;
+        }
+
+        size_t size() const {
+                return m_size;
+        }
+
+        boost::asio::const_buffer buffer() const {
+                return boost::asio::const_buffer(m_data, m_size);
+        }
+
+        // 映射中的一段，超出的部分会被截掉
+        boost::asio::const_buffer buffer(size_t p_offset,
+                                         size_t p_size) const {
+                if(p_offset >= m_size)
+                        return boost::asio::const_buffer();
+                if(p_size > m_size - p_offset)
+                        p_size = m_size - p_offset;
+                return boost::asio::const_buffer(m_data + p_offset, p_size);
+        }
+
+        void swap(mapped_file &p_other) {
+                std::swap(m_base, p_other.m_base);
+                std::swap(m_length, p_other.m_length);
+                std::swap(m_data, p_other.m_data);
+                std::swap(m_size, p_other.m_size);
+        }
+
+private:
+        enum {
+                HUGE_PAGE_SIZE = 2 * 1024 * 1024
+        };
+
+        static size_t page_size() {
+                static const size_t _size = size_t(::sysconf(_SC_PAGESIZE));
+                return _size;
+        }
+
+        // 不检查文件长度，p_size已经截到文件结尾之内
+        bool map_range(file_t p_file,
+                       offset_t p_offset,
+                       size_t p_size,
+                       unsigned p_flags) {
+                if(p_size == 0)
+                        return true;
+
+                const size_t _align = (p_flags & MF_HUGE_PAGES)
+                        ? size_t(HUGE_PAGE_SIZE)
+                        : page_size();
+                const offset_t _map_offset = p_offset - p_offset % page_size();
+                const size_t _delta = size_t(p_offset - _map_offset);
+                const size_t _length = p_size + _delta;
+                const int _flags = MAP_SHARED |
+                        ((p_flags & MF_POPULATE) ? MAP_POPULATE : 0);
+
+                void *_base = MAP_FAILED;
+                if(_align > page_size())
+                {
+                        _base = map_aligned(p_file, _map_offset, _length,
+                                            _flags, _align);
+                }
+                if(_base == MAP_FAILED)
+                {
+                        _base = ::mmap(NULL, _length, PROT_READ, _flags,
+                                       p_file, _map_offset);
+                        if(_base == MAP_FAILED)
+                                return false;
+                }
+
+                m_base = _base;
+                m_length = _length;
+                m_data = static_cast<const char*>(_base) + _delta;
+                m_size = p_size;
+                return true;
+        }
+
+        // 透明大页要求虚拟地址与文件偏移对大页取模相同，这里先保留一段
+        // 更大的地址空间，再把文件映射到其中满足条件的位置
+        static void *map_aligned(file_t p_file,
+                                 offset_t p_offset,
+                                 size_t p_length,
+                                 int p_flags,
+                                 size_t p_align) {
+                const size_t _reserve_length = p_length + p_align;
+                void *_reserve = ::mmap(NULL, _reserve_length, PROT_NONE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                        -1, 0);
+                if(_reserve == MAP_FAILED)
+                        return MAP_FAILED;
+
+                const size_t _start = reinterpret_cast<size_t>(_reserve);
+                const size_t _phase = size_t(p_offset) % p_align;
+                size_t _target = (_start - _phase + p_align - 1) / p_align * p_align + _phase;
+                if(_target < _start)
+                        _target += p_align;
+
+                void *_base = ::mmap(reinterpret_cast<void*>(_target), p_length,
+                                     PROT_READ, p_flags | MAP_FIXED,
+                                     p_file, p_offset);
+                if(_base == MAP_FAILED)
+                {
+                        ::munmap(_reserve, _reserve_length);
+                        return MAP_FAILED;
+                }
+
+                // 释放前后多保留的部分
+                if(_target > _start)
+                        ::munmap(_reserve, _target - _start);
+                const size_t _end = _target + p_length;
+                const size_t _reserve_end = _start + _reserve_length;
+                const size_t _tail = (_end + page_size() - 1) / page_size() * page_size();
+                if(_reserve_end > _tail)
+                        ::munmap(reinterpret_cast<void*>(_tail), _reserve_end - _tail);
+
+#ifdef MADV_HUGEPAGE
+                ::madvise(_base, p_length, MADV_HUGEPAGE); // 不支持时忽略
+#endif
+                return _base;
+        }
+
+        void *m_base;		// mmap返回的地址，按页对齐
+        size_t m_length;	// mmap的长度
+        const char *m_data;	// 用户请求的起始位置
+        size_t m_size;
+};
+
+inline
+boost::asio::const_buffer buffer(const mapped_file &p_file) {
+        return p_file.buffer();
+}
+
+} // namespace localfs
+
+#endif	// _MAPPED_FILE_HPP_
@@ -0,0 +1,1230 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _MEMFS_HPP_
+#define _MEMFS_HPP_
+
+//
+// 内存中的文件系统，接口与localfs, gfs相同。用于没有gfs集群时
+// 测试和调优上层的缓存、重试、预读等，也可以作为临时的快速存储。
+//
+// 错误码与POSIX相同（ENOENT, EEXIST, ENOTDIR, EISDIR, EBADF等），
+// 通过errno返回；remove与gfs一样递归删除目录。
+//
+// 路径到节点的映射按路径的hash分片，各片有自己的锁；目录的子项
+// 由目录自己的锁保护，文件数据用读写锁，所以不同文件、同一文件
+// 的并发读都可以并行。rename需要独占整个树，应该是少见的操作。
+//
+// set_fault_policy可以给每类操作加上延迟和出错概率。
+//
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/uio.h>		// for iovec
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "metrics.hpp"
+
+namespace memfs
+{
+
+// empty init
+inline
+void init() {
+        return;
+}
+inline
+void init(const char *) {
+        return;
+}
+
+inline
+int get_errno() {
+        return errno;
+}
+
+inline
+void set_errno(int no) {
+        errno = no;
+}
+
+typedef int64_t ssize_t;
+typedef uint64_t size_t;
+typedef int64_t offset_t; // it's signed
+typedef struct ::iovec iovec_t;
+
+enum {
+        MAX_IOVEC_LEN = 64,
+        MAX_FILENAME_LEN = 512
+};
+
+inline
+void iovec_init(iovec_t &iov,
+                void *data,
+                size_t size) {
+        iov.iov_base = data;
+        iov.iov_len = size;
+}
+
+static const offset_t BAD_OFFSET = -1LL;
+
+// pread等不使用文件指针，多个线程可以同时对同一个file_t调用
+static const bool CONCURRENT_PREAD = true;
+
+enum seek_type
+{
+        ST_SEEK_SET = SEEK_SET,
+        ST_SEEK_CUR = SEEK_CUR,
+        ST_SEEK_END = SEEK_END
+};
+typedef seek_type seek_t;
+
+enum mode_type
+{
+        MT_O_RDONLY = O_RDONLY,
+        MT_O_WRONLY = O_WRONLY,
+        MT_O_RDWR = O_RDWR,
+
+        MT_O_APPEND = O_APPEND,
+        MT_O_CREATE = O_CREAT,
+        MT_O_TRUNC = O_TRUNC
+};
+typedef mode_type mode_t;
+
+// advise的访问方式提示，取值同posix_fadvise
+enum advice_type
+{
+        AT_NORMAL = POSIX_FADV_NORMAL,
+        AT_SEQUENTIAL = POSIX_FADV_SEQUENTIAL,
+        AT_RANDOM = POSIX_FADV_RANDOM,
+        AT_WILLNEED = POSIX_FADV_WILLNEED,
+        AT_DONTNEED = POSIX_FADV_DONTNEED
+};
+typedef advice_type advice_t;
+
+struct file_status
+{
+        size_t m_size;
+        bool m_is_dir;
+        time_t m_mtime;
+};
+
+inline
+size_t get_size(const file_status &p_status) {
+        return p_status.m_size;
+}
+
+inline
+time_t get_mtime(const file_status &p_status) {
+        return p_status.m_mtime;
+}
+
+inline
+bool is_directory(const file_status &p_status) {
+        return p_status.m_is_dir;
+}
+
+inline
+bool is_regular(const file_status &p_status) {
+        return ! p_status.m_is_dir;
+}
+
+struct file_info
+{
+        std::string m_name; // 文件名称，不包含路径
+        bool m_is_dir;
+};
+
+inline
+const char *get_name(const file_info &p_info) {
+        return p_info.m_name.c_str();
+}
+
+inline
+bool is_directory(const file_info &p_info) {
+        return p_info.m_is_dir;
+}
+
+inline
+bool is_regular(const file_info &p_info) {
+        return ! p_info.m_is_dir;
+}
+
+//
+// 注入的延迟和错误，按fsutil::metric_op分类；延迟在
+// [m_latency_us, m_latency_us + m_jitter_us]之间均匀分布，
+// 以m_error_rate的概率失败，errno为m_errno。
+//
+struct fault_policy
+{
+        struct op_fault
+        {
+                uint64_t m_latency_us;
+                uint64_t m_jitter_us;
+                double m_error_rate;	// [0, 1]
+                int m_errno;
+        };
+
+        fault_policy() {
+                for(std::size_t i = 0; i < fsutil::OP_COUNT; ++i)
+                {
+                        m_ops[i].m_latency_us = 0;
+                        m_ops[i].m_jitter_us = 0;
+                        m_ops[i].m_error_rate = 0;
+                        m_ops[i].m_errno = EIO;
+                }
+        }
+
+        bool is_empty() const {
+                for(std::size_t i = 0; i < fsutil::OP_COUNT; ++i)
+                {
+                        if(m_ops[i].m_latency_us != 0 ||
+                           m_ops[i].m_jitter_us != 0 ||
+                           m_ops[i].m_error_rate > 0)
+                                return false;
+                }
+                return true;
+        }
+
+        op_fault m_ops[fsutil::OP_COUNT];
+};
+
+namespace detail
+{
+
+inline
+fault_policy *&global_fault_policy() {
+        static fault_policy *_policy = NULL;	// NULL表示不注入
+        return _policy;
+}
+
+// [0, 1)之间的随机数，各线程独立
+inline
+double random_ratio() {
+        static __thread uint64_t _state = 0;
+        if(_state == 0)
+        {
+                _state = uint64_t(reinterpret_cast<std::size_t>(&_state)) ^ 0x9E3779B97F4A7C15ULL;
+        }
+        _state ^= _state << 13;
+        _state ^= _state >> 7;
+        _state ^= _state << 17;
+        return double(_state >> 11) / double(1ULL << 53);
+}
+
+// 按策略等待，需要出错时设置errno并返回false
+inline
+bool inject(fsutil::metric_op p_op) {
+        const fault_policy *_policy = global_fault_policy();
+        if(_policy == NULL)
+                return true;
+
+        const fault_policy::op_fault &_fault = _policy->m_ops[p_op];
+        uint64_t _us = _fault.m_latency_us;
+        if(_fault.m_jitter_us != 0)
+        {
+                _us += uint64_t(random_ratio() * double(_fault.m_jitter_us + 1));
+        }
+        if(_us != 0)
+        {
+                struct timespec _request;
+                _request.tv_sec = time_t(_us / (1000 * 1000));
+                _request.tv_nsec = long(_us % (1000 * 1000)) * 1000;
+                while(::nanosleep(&_request, &_request) != 0 && errno == EINTR)
+                        ;
+        }
+        if(_fault.m_error_rate > 0 && random_ratio() < _fault.m_error_rate)
+        {
+                errno = _fault.m_errno;
+                return false;
+        }
+        return true;
+}
+
+class node;
+typedef boost::shared_ptr<node> node_ptr;
+
+class node : boost::noncopyable
+{
+public:
+        explicit node(bool p_is_dir)
+                : m_is_dir(p_is_dir),
+                  m_mtime(::time(NULL)),
+                  m_removed(false) {}
+
+        const bool m_is_dir;
+
+        // 文件的数据和修改时间
+        boost::shared_mutex m_data_mutex;
+        std::vector<char> m_data;
+        time_t m_mtime;
+
+        // 目录的子项；m_removed表示目录已被删除，不能再加入子项
+        boost::mutex m_mutex;
+        std::map<std::string, node_ptr> m_children;
+        bool m_removed;
+};
+
+// 规范化路径：以'/'开头，去掉重复的'/'、结尾的'/'和"."，处理".."
+inline
+std::string normalize(const char *p_path) {
+        std::string _path = "/";
+        const char *_pos = p_path;
+        while(*_pos != '\0')
+        {
+                while(*_pos == '/')
+                        ++ _pos;
+                const char *_end = _pos;
+                while(*_end != '\0' && *_end != '/')
+                        ++ _end;
+                const std::size_t _len = std::size_t(_end - _pos);
+                if(_len == 0 || (_len == 1 && _pos[0] == '.'))
+                {
+                }
+                else if(_len == 2 && _pos[0] == '.' && _pos[1] == '.')
+                {
+                        const std::size_t _slash = _path.rfind('/', _path.size() - 1);
+                        _path.resize((_slash == 0) ? 1 : _slash);
+                }
+                else
+                {
+                        if(_path.size() > 1)
+                                _path += '/';
+                        _path.append(_pos, _len);
+                }
+                _pos = _end;
+        }
+        return _path;
+}
+
+// 规范化之后的路径的父目录和文件名；p_path不能是"/"
+inline
+void split_path(const std::string &p_path,
+                std::string &p_parent,
+                std::string &p_name) {
+        const std::size_t _slash = p_path.rfind('/');
+        p_parent.assign(p_path, 0, (_slash == 0) ? 1 : _slash);
+        p_name.assign(p_path, _slash + 1, std::string::npos);
+}
+
+inline
+std::string join_path(const std::string &p_parent,
+                      const std::string &p_name) {
+        return (p_parent.size() == 1) ? p_parent + p_name : p_parent + '/' + p_name;
+}
+
+class tree : boost::noncopyable
+{
+public:
+        enum {
+                SHARD_COUNT = 64
+        };
+
+        static tree &instance() {
+                static tree *_tree = new tree;
+                return *_tree;
+        }
+
+        node_ptr find(const std::string &p_path) {
+                shard &_shard = get_shard(p_path);
+                boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                node_map::const_iterator _iter = _shard.m_nodes.find(p_path);
+                return (_iter == _shard.m_nodes.end()) ? node_ptr() : _iter->second;
+        }
+
+        // 在已存在的目录下新建节点。已存在时，p_exist_ok为true则返回
+        // 已有的节点，否则失败，errno为EEXIST
+        node_ptr add(const std::string &p_path,
+                     bool p_is_dir,
+                     bool p_exist_ok) {
+                if(p_path.size() == 1)
+                {
+                        errno = EEXIST;
+                        return node_ptr();
+                }
+                std::string _parent_path, _name;
+                split_path(p_path, _parent_path, _name);
+                if(_name.size() >= MAX_FILENAME_LEN)
+                {
+                        errno = ENAMETOOLONG;
+                        return node_ptr();
+                }
+
+                boost::shared_lock<boost::shared_mutex> _tree_lock(m_rename_mutex);
+                const node_ptr _parent = find(_parent_path);
+                if(! _parent)
+                {
+                        errno = ENOENT;
+                        return node_ptr();
+                }
+                if(! _parent->m_is_dir)
+                {
+                        errno = ENOTDIR;
+                        return node_ptr();
+                }
+
+                boost::mutex::scoped_lock _lock(_parent->m_mutex);
+                if(_parent->m_removed)
+                {
+                        errno = ENOENT;
+                        return node_ptr();
+                }
+                std::map<std::string, node_ptr>::iterator _iter = _parent->m_children.find(_name);
+                if(_iter != _parent->m_children.end())
+                {
+                        if(! p_exist_ok)
+                        {
+                                errno = EEXIST;
+                                return node_ptr();
+                        }
+                        return _iter->second;
+                }
+
+                const node_ptr _node(new node(p_is_dir));
+                _parent->m_children.insert(std::make_pair(_name, _node));
+                insert(p_path, _node);
+                touch(*_parent);
+                return _node;
+        }
+
+        // 递归删除
+        bool remove(const std::string &p_path) {
+                if(p_path.size() == 1)
+                {
+                        errno = EBUSY;
+                        return false;
+                }
+                std::string _parent_path, _name;
+                split_path(p_path, _parent_path, _name);
+
+                boost::shared_lock<boost::shared_mutex> _tree_lock(m_rename_mutex);
+                const node_ptr _parent = find(_parent_path);
+                if(! _parent || ! _parent->m_is_dir)
+                {
+                        errno = _parent ? ENOTDIR : ENOENT;
+                        return false;
+                }
+
+                boost::mutex::scoped_lock _lock(_parent->m_mutex);
+                std::map<std::string, node_ptr>::iterator _iter = _parent->m_children.find(_name);
+                if(_iter == _parent->m_children.end())
+                {
+                        errno = ENOENT;
+                        return false;
+                }
+                destroy(p_path, *_iter->second);
+                _parent->m_children.erase(_iter);
+                touch(*_parent);
+                return true;
+        }
+
+        // 语义同POSIX rename：目标是文件时被替换，是空目录时可以被目录替换
+        bool rename(const std::string &p_old_path,
+                    const std::string &p_new_path) {
+                if(p_old_path.size() == 1 || p_new_path.size() == 1)
+                {
+                        errno = EBUSY;
+                        return false;
+                }
+                if(p_new_path.compare(0, p_old_path.size() + 1, p_old_path + '/') == 0)
+                {
+                        errno = EINVAL; // 移到自己的子目录下
+                        return false;
+                }
+
+                boost::unique_lock<boost::shared_mutex> _tree_lock(m_rename_mutex);
+                const node_ptr _node = find(p_old_path);
+                if(! _node)
+                {
+                        errno = ENOENT;
+                        return false;
+                }
+                if(p_old_path == p_new_path)
+                        return true;
+
+                std::string _old_parent_path, _old_name, _new_parent_path, _new_name;
+                split_path(p_old_path, _old_parent_path, _old_name);
+                split_path(p_new_path, _new_parent_path, _new_name);
+                const node_ptr _old_parent = find(_old_parent_path);
+                const node_ptr _new_parent = find(_new_parent_path);
+                if(! _new_parent)
+                {
+                        errno = ENOENT;
+                        return false;
+                }
+                if(! _new_parent->m_is_dir)
+                {
+                        errno = ENOTDIR;
+                        return false;
+                }
+
+                const node_ptr _target = find(p_new_path);
+                if(_target)
+                {
+                        if(_target->m_is_dir && ! _node->m_is_dir)
+                        {
+                                errno = EISDIR;
+                                return false;
+                        }
+                        if(! _target->m_is_dir && _node->m_is_dir)
+                        {
+                                errno = ENOTDIR;
+                                return false;
+                        }
+                        if(_target->m_is_dir)
+                        {
+                                boost::mutex::scoped_lock _lock(_target->m_mutex);
+                                if(! _target->m_children.empty())
+                                {
+                                        errno = ENOTEMPTY;
+                                        return false;
+                                }
+                        }
+                        boost::mutex::scoped_lock _lock(_new_parent->m_mutex);
+                        destroy(p_new_path, *_target);
+                        _new_parent->m_children.erase(_new_name);
+                }
+
+                {
+                        boost::mutex::scoped_lock _lock(_old_parent->m_mutex);
+                        _old_parent->m_children.erase(_old_name);
+                        touch(*_old_parent);
+                }
+                {
+                        boost::mutex::scoped_lock _lock(_new_parent->m_mutex);
+                        _new_parent->m_children[_new_name] = _node;
+                        touch(*_new_parent);
+                }
+                move(p_old_path, p_new_path, _node);
+                return true;
+        }
+
+private:
+        typedef boost::unordered_map<std::string, node_ptr> node_map;
+
+        struct shard
+        {
+                boost::mutex m_mutex;
+                node_map m_nodes;
+        };
+
+        tree() {
+                insert("/", node_ptr(new node(true)));
+        }
+
+        shard &get_shard(const std::string &p_path) {
+                return m_shards[boost::hash<std::string>()(p_path) % SHARD_COUNT];
+        }
+
+        void insert(const std::string &p_path,
+                    const node_ptr &p_node) {
+                shard &_shard = get_shard(p_path);
+                boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                _shard.m_nodes[p_path] = p_node;
+        }
+
+        void erase(const std::string &p_path) {
+                shard &_shard = get_shard(p_path);
+                boost::mutex::scoped_lock _lock(_shard.m_mutex);
+                _shard.m_nodes.erase(p_path);
+        }
+
+        static void touch(node &p_dir) {
+                boost::unique_lock<boost::shared_mutex> _lock(p_dir.m_data_mutex);
+                p_dir.m_mtime = ::time(NULL);
+        }
+
+        // 从映射中去掉p_node及其子项；调用者持有父目录的锁，
+        // 加锁的顺序总是从父目录到子目录。已打开的文件仍然可以读写
+        void destroy(const std::string &p_path,
+                     node &p_node) {
+                if(p_node.m_is_dir)
+                {
+                        boost::mutex::scoped_lock _lock(p_node.m_mutex);
+                        p_node.m_removed = true;
+                        for(std::map<std::string, node_ptr>::iterator _iter = p_node.m_children.begin();
+                            _iter != p_node.m_children.end(); ++_iter)
+                        {
+                                destroy(join_path(p_path, _iter->first), *_iter->second);
+                        }
+                        p_node.m_children.clear();
+                }
+                erase(p_path);
+        }
+
+        // rename时更新子树中各节点的路径，调用者独占m_rename_mutex
+        void move(const std::string &p_old_path,
+                  const std::string &p_new_path,
+                  const node_ptr &p_node) {
+                erase(p_old_path);
+                insert(p_new_path, p_node);
+                if(! p_node->m_is_dir)
+                        return;
+                boost::mutex::scoped_lock _lock(p_node->m_mutex);
+                for(std::map<std::string, node_ptr>::iterator _iter = p_node->m_children.begin();
+                    _iter != p_node->m_children.end(); ++_iter)
+                {
+                        move(join_path(p_old_path, _iter->first),
+                             join_path(p_new_path, _iter->first),
+                             _iter->second);
+                }
+        }
+
+        shard m_shards[SHARD_COUNT];
+        boost::shared_mutex m_rename_mutex;	// rename独占，增删共享
+};
+
+struct file_handle
+{
+        node_ptr m_node;
+        offset_t m_pos;
+        int m_flags;
+};
+
+inline
+bool readable(const file_handle &p_file) {
+        return (p_file.m_flags & O_ACCMODE) != O_WRONLY;
+}
+
+inline
+bool writable(const file_handle &p_file) {
+        return (p_file.m_flags & O_ACCMODE) != O_RDONLY;
+}
+
+// 在p_offset处读写，调用者检查权限
+inline
+ssize_t read_at(node &p_node,
+                const iovec_t *p_iov,
+                size_t p_count,
+                offset_t p_offset) {
+        boost::shared_lock<boost::shared_mutex> _lock(p_node.m_data_mutex);
+        const std::size_t _size = p_node.m_data.size();
+        std::size_t _pos = std::size_t(p_offset);
+        ssize_t _readed = 0;
+        for(size_t i = 0; i < p_count && _pos < _size; ++i)
+        {
+                const std::size_t _len = std::min<std::size_t>(p_iov[i].iov_len, _size - _pos);
+                std::memcpy(p_iov[i].iov_base, &p_node.m_data[_pos], _len);
+                _pos += _len;
+                _readed += _len;
+        }
+        return _readed;
+}
+
+// p_offset为BAD_OFFSET时追加到末尾；返回写入的位置
+inline
+offset_t write_at(node &p_node,
+                  const iovec_t *p_iov,
+                  size_t p_count,
+                  offset_t p_offset) {
+        std::size_t _total = 0;
+        for(size_t i = 0; i < p_count; ++i)
+        {
+                _total += p_iov[i].iov_len;
+        }
+
+        boost::unique_lock<boost::shared_mutex> _lock(p_node.m_data_mutex);
+        const std::size_t _pos = (p_offset == BAD_OFFSET)
+                ? p_node.m_data.size()
+                : std::size_t(p_offset);
+        if(_pos + _total > p_node.m_data.size())
+        {
+                p_node.m_data.resize(_pos + _total);
+        }
+        std::size_t _cur = _pos;
+        for(size_t i = 0; i < p_count; ++i)
+        {
+                if(p_iov[i].iov_len == 0)
+                        continue;
+                std::memcpy(&p_node.m_data[_cur], p_iov[i].iov_base, p_iov[i].iov_len);
+                _cur += p_iov[i].iov_len;
+        }
+        p_node.m_mtime = ::time(NULL);
+        return offset_t(_pos);
+}
+
+inline
+ssize_t total_length(const iovec_t *p_iov,
+                     size_t p_count) {
+        ssize_t _total = 0;
+        for(size_t i = 0; i < p_count; ++i)
+        {
+                _total += p_iov[i].iov_len;
+        }
+        return _total;
+}
+
+inline
+file_handle *open_file(const char *p_path,
+                       int p_flags) {
+        if(! inject(fsutil::OP_OPEN))
+                return NULL;
+
+        const std::string _path = normalize(p_path);
+        node_ptr _node = (p_flags & O_CREAT)
+                ? tree::instance().add(_path, false, true)
+                : tree::instance().find(_path);
+        if(! _node)
+        {
+                if(! (p_flags & O_CREAT))
+                        errno = ENOENT;
+                return NULL;
+        }
+        if(_node->m_is_dir)
+        {
+                errno = EISDIR;
+                return NULL;
+        }
+        if((p_flags & O_TRUNC) && (p_flags & O_ACCMODE) != O_RDONLY)
+        {
+                boost::unique_lock<boost::shared_mutex> _lock(_node->m_data_mutex);
+                std::vector<char>().swap(_node->m_data);
+                _node->m_mtime = ::time(NULL);
+        }
+
+        file_handle *_file = new file_handle;
+        _file->m_node = _node;
+        _file->m_pos = 0;
+        _file->m_flags = p_flags;
+        return _file;
+}
+
+} // namespace detail
+
+typedef detail::file_handle *file_t;
+static const file_t BAD_FILE = NULL;
+
+inline
+bool close(file_t p_file) {
+        if(p_file == BAD_FILE)
+        {
+                errno = EBADF;
+                return false;
+        }
+        delete p_file;
+        return true;
+}
+
+inline
+file_t open(const char *p_path,
+            mode_t p_mode = MT_O_RDONLY) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_OPEN);
+        const file_t _ret = detail::open_file(p_path, static_cast<int>(p_mode));
+        FS_METRIC_END(_ret != BAD_FILE, 0, errno);
+        return _ret;
+}
+
+inline
+file_t open(const char *p_path,
+            mode_t p_mode,
+            std::size_t /*replica_number*/) {
+        return open(p_path, p_mode);
+}
+
+inline
+file_t create(const char *p_path) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_OPEN);
+        const file_t _ret = detail::open_file(p_path, O_WRONLY | O_CREAT | O_TRUNC);
+        FS_METRIC_END(_ret != BAD_FILE, 0, errno);
+        return _ret;
+}
+
+inline
+file_t create(const char *p_path,
+              std::size_t /*replica_number*/) {
+        return create(p_path);
+}
+
+inline
+ssize_t readv(file_t p_file,
+              const iovec_t *p_iov,
+              size_t p_count) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_READ);
+        ssize_t _ret = -1;
+        if(p_file == BAD_FILE || ! detail::readable(*p_file))
+        {
+                errno = EBADF;
+        }
+        else if(detail::inject(fsutil::OP_READ))
+        {
+                _ret = detail::read_at(*p_file->m_node, p_iov, p_count, p_file->m_pos);
+                p_file->m_pos += _ret;
+        }
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
+}
+
+inline
+ssize_t read(file_t p_file,
+             void *p_buffer,
+             size_t p_count) {
+        iovec_t _iov;
+        iovec_init(_iov, p_buffer, p_count);
+        return readv(p_file, &_iov, 1);
+}
+
+inline
+ssize_t writev(file_t p_file,
+               const iovec_t *p_iov,
+               size_t p_count) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_WRITE);
+        ssize_t _ret = -1;
+        if(p_file == BAD_FILE || ! detail::writable(*p_file))
+        {
+                errno = EBADF;
+        }
+        else if(detail::inject(fsutil::OP_WRITE))
+        {
+                const offset_t _pos = detail::write_at(*p_file->m_node, p_iov, p_count,
+                                                       (p_file->m_flags & O_APPEND)
+                                                       ? BAD_OFFSET
+                                                       : p_file->m_pos);
+                _ret = detail::total_length(p_iov, p_count);
+                p_file->m_pos = _pos + _ret;
+        }
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
+}
+
+inline
+ssize_t write(file_t p_file,
+              const void *p_buffer,
+              size_t p_count) {
+        iovec_t _iov;
+        iovec_init(_iov, const_cast<void*>(p_buffer), p_count);
+        return writev(p_file, &_iov, 1);
+}
+
+// 原子地追加到文件末尾，返回写入的位置，同gfs::append
+inline
+offset_t append(file_t p_file,
+                const void *p_buffer,
+                size_t p_count) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_APPEND);
+        offset_t _ret = BAD_OFFSET;
+        if(p_file == BAD_FILE || ! detail::writable(*p_file))
+        {
+                errno = EBADF;
+        }
+        else if(detail::inject(fsutil::OP_APPEND))
+        {
+                iovec_t _iov;
+                iovec_init(_iov, const_cast<void*>(p_buffer), p_count);
+                _ret = detail::write_at(*p_file->m_node, &_iov, 1, BAD_OFFSET);
+                p_file->m_pos = _ret + offset_t(p_count);
+        }
+        FS_METRIC_END(_ret != BAD_OFFSET, p_count, errno);
+        return _ret;
+}
+
+inline
+offset_t seek(file_t p_file,
+              offset_t p_offset,
+              seek_t p_whence) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_SEEK);
+        offset_t _ret = BAD_OFFSET;
+        if(p_file == BAD_FILE)
+        {
+                errno = EBADF;
+        }
+        else if(detail::inject(fsutil::OP_SEEK))
+        {
+                offset_t _base = 0;
+                if(p_whence == ST_SEEK_CUR)
+                {
+                        _base = p_file->m_pos;
+                }
+                else if(p_whence == ST_SEEK_END)
+                {
+                        boost::shared_lock<boost::shared_mutex> _lock(p_file->m_node->m_data_mutex);
+                        _base = offset_t(p_file->m_node->m_data.size());
+                }
+                if(_base + p_offset < 0)
+                {
+                        errno = EINVAL;
+                }
+                else
+                {
+                        _ret = p_file->m_pos = _base + p_offset;
+                }
+        }
+        FS_METRIC_END(_ret != BAD_OFFSET, 0, errno);
+        return _ret;
+}
+
+inline
+bool mkdir(const char *p_path) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_MKDIR);
+        const bool _ret = detail::inject(fsutil::OP_MKDIR) &&
+                detail::tree::instance().add(detail::normalize(p_path), true, false);
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
+}
+
+#include "path_hook.ipp"
+
+inline
+bool rename(const char *p_old_path,
+            const char *p_new_path) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_RENAME);
+        const bool _ret = detail::inject(fsutil::OP_RENAME) &&
+                detail::tree::instance().rename(detail::normalize(p_old_path),
+                                                detail::normalize(p_new_path));
+        FS_METRIC_END(_ret, 0, errno);
+        detail::path_changed(p_old_path);
+        detail::path_changed(p_new_path);
+        return _ret;
+}
+
+// 如果是目录，则递归删除其子目录和文件；与gfs::remove语义保持一致
+inline
+bool remove(const char *p_path) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_REMOVE);
+        const bool _ret = detail::inject(fsutil::OP_REMOVE) &&
+                detail::tree::instance().remove(detail::normalize(p_path));
+        FS_METRIC_END(_ret, 0, errno);
+        detail::path_changed(p_path);
+        return _ret;
+}
+
+inline
+bool stat(file_status &p_status,
+          const char *p_path) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_STAT);
+        bool _ret = false;
+        if(detail::inject(fsutil::OP_STAT))
+        {
+                const detail::node_ptr _node = detail::tree::instance().find(detail::normalize(p_path));
+                if(_node)
+                {
+                        boost::shared_lock<boost::shared_mutex> _lock(_node->m_data_mutex);
+                        p_status.m_size = _node->m_data.size();
+                        p_status.m_is_dir = _node->m_is_dir;
+                        p_status.m_mtime = _node->m_mtime;
+                        _ret = true;
+                }
+                else
+                {
+                        errno = ENOENT;
+                }
+        }
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
+}
+
+inline
+bool exists(const char *p_path) {
+        file_status _status;
+        return stat(_status, p_path);
+}
+
+//
+// is_regular, is_directory: stat返回false，即认为文件
+// 不存在，此时返回false即可。
+//
+// 即语义为：返回false表示文件不存在或不满足属性要求
+//
+
+inline
+bool is_regular(const char *p_path) {
+        file_status _status;
+        return stat(_status, p_path) &&
+                is_regular(_status);
+}
+
+inline
+bool is_directory(const char *p_path) {
+        file_status _status;
+        return stat(_status, p_path) &&
+                is_directory(_status);
+}
+
+// 这里列出的是目录下的文件名，按名称排序
+// FileInfoContainer - fs::file_info container,
+//                     and has push_back() method
+template<typename FileInfoContainer>
+inline
+bool list_files(FileInfoContainer &p_infos,
+                const char *p_path) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_LIST_FILES);
+        bool _ret = false;
+        if(detail::inject(fsutil::OP_LIST_FILES))
+        {
+                const detail::node_ptr _dir = detail::tree::instance().find(detail::normalize(p_path));
+                if(! _dir)
+                {
+                        errno = ENOENT;
+                }
+                else if(! _dir->m_is_dir)
+                {
+                        errno = ENOTDIR;
+                }
+                else
+                {
+                        boost::mutex::scoped_lock _lock(_dir->m_mutex);
+                        file_info _info;
+                        for(std::map<std::string, detail::node_ptr>::const_iterator _iter = _dir->m_children.begin();
+                            _iter != _dir->m_children.end(); ++_iter)
+                        {
+                                _info.m_name = _iter->first;
+                                _info.m_is_dir = _iter->second->m_is_dir;
+                                p_infos.push_back(_info);
+                        }
+                        _ret = true;
+                }
+        }
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
+}
+
+//
+// readn, writen 返回值小于p_count表示出错，即为-1或已
+// 经读出或写入的数据长度；成功时返回值等于p_count
+//
+
+inline
+ssize_t readn(file_t p_file,
+              void *p_buffer,
+              size_t p_count) {
+        size_t _readed = 0;
+        char *_pos = static_cast<char*>(p_buffer);
+        while(_readed < p_count) {
+                ssize_t _ret = read(p_file, _pos, p_count - _readed);
+                if (_ret < 0) {
+                        return ((_readed == 0) ? ssize_t(-1) : ssize_t(_readed));
+                } else if (_ret == 0) {
+                        return _readed;
+                } else {
+                        _readed += _ret;
+                        _pos += _ret;
+                }
+        }
+        return _readed;
+}
+
+inline
+ssize_t writen(file_t p_file,
+               const void *p_buffer,
+               size_t p_count) {
+        size_t _writen = 0;
+        const char *_pos = static_cast<const char*>(p_buffer);
+        while(_writen < p_count) {
+                ssize_t _ret = write(p_file, _pos, p_count - _writen);
+                if (_ret < 0) {
+                        return ((_writen == 0) ? ssize_t(-1) : ssize_t(_writen)); // -1 or writen len
+                } else if (_ret == 0) {
+                        return _writen;
+                } else {
+                        _writen += _ret;
+                        _pos += _ret;
+                }
+        }
+        return _writen;
+}
+
+//
+// pread, preadn, pwrite, pwriten 操作，不更新文件指针（偏移量），
+// 多个线程可以共享同一个file_t
+//
+
+inline
+ssize_t preadv(file_t p_file,
+               const iovec_t *p_iov,
+               size_t p_count,
+               offset_t p_offset) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_READ);
+        ssize_t _ret = -1;
+        if(p_file == BAD_FILE || ! detail::readable(*p_file))
+        {
+                errno = EBADF;
+        }
+        else if(p_offset < 0)
+        {
+                errno = EINVAL;
+        }
+        else if(detail::inject(fsutil::OP_READ))
+        {
+                _ret = detail::read_at(*p_file->m_node, p_iov, p_count, p_offset);
+        }
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
+}
+
+inline
+ssize_t pwritev(file_t p_file,
+                const iovec_t *p_iov,
+                size_t p_count,
+                offset_t p_offset) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_WRITE);
+        ssize_t _ret = -1;
+        if(p_file == BAD_FILE || ! detail::writable(*p_file))
+        {
+                errno = EBADF;
+        }
+        else if(p_offset < 0)
+        {
+                errno = EINVAL;
+        }
+        else if(detail::inject(fsutil::OP_WRITE))
+        {
+                detail::write_at(*p_file->m_node, p_iov, p_count, p_offset);
+                _ret = detail::total_length(p_iov, p_count);
+        }
+        FS_METRIC_END(_ret >= 0, _ret, errno);
+        return _ret;
+}
+
+inline
+ssize_t pread(file_t p_file,
+              void *p_buffer,
+              size_t p_count,
+              offset_t p_offset) {
+        iovec_t _iov;
+        iovec_init(_iov, p_buffer, p_count);
+        return preadv(p_file, &_iov, 1, p_offset);
+}
+
+inline
+ssize_t pwrite(file_t p_file,
+               const void *p_buffer,
+               size_t p_count,
+               offset_t p_offset) {
+        iovec_t _iov;
+        iovec_init(_iov, const_cast<void*>(p_buffer), p_count);
+        return pwritev(p_file, &_iov, 1, p_offset);
+}
+
+// 内存中的读写一次完成，不会只读写一部分
+inline
+ssize_t preadn(file_t p_file,
+               void *p_buffer,
+               size_t p_count,
+               offset_t p_offset) {
+        return pread(p_file, p_buffer, p_count, p_offset);
+}
+
+inline
+ssize_t pwriten(file_t p_file,
+                const void *p_buffer,
+                size_t p_count,
+                offset_t p_offset) {
+        return pwrite(p_file, p_buffer, p_count, p_offset);
+}
+
+// 内存中没有page cache，advise什么也不做
+inline
+bool advise(file_t /*p_file*/,
+            offset_t /*p_offset*/,
+            offset_t /*p_length*/,
+            advice_t /*p_advice*/) {
+        return true;
+}
+
+// 预留p_length字节的内存，之后写到这个长度之内时不再重新分配；
+// 文件长度不变
+inline
+bool preallocate(file_t p_file,
+                 offset_t p_length) {
+        if(p_file == BAD_FILE || ! detail::writable(*p_file))
+        {
+                errno = EBADF;
+                return false;
+        }
+        if(p_length <= 0)
+                return true;
+        boost::unique_lock<boost::shared_mutex> _lock(p_file->m_node->m_data_mutex);
+        p_file->m_node->m_data.reserve(std::size_t(p_length));
+        return true;
+}
+
+// 内存中的数据不需要写出；只检查参数并注入OP_SYNC的延迟和错误，
+// 可以用来模拟磁盘上sync的开销
+inline
+bool sync(file_t p_file) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_SYNC);
+        bool _ret = false;
+        if(p_file == BAD_FILE)
+                errno = EBADF;
+        else
+                _ret = detail::inject(fsutil::OP_SYNC);
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
+}
+
+inline
+bool datasync(file_t p_file) {
+        return sync(p_file);
+}
+
+inline
+bool syncfs(file_t p_file) {
+        return sync(p_file);
+}
+
+inline
+bool sync_directory(const char *p_path) {
+        FS_METRIC_BEGIN(MB_MEMFS, OP_SYNC);
+        bool _ret = false;
+        file_status _status;
+        if(detail::inject(fsutil::OP_SYNC) && stat(_status, p_path))
+        {
+                _ret = is_directory(_status);
+                if(! _ret)
+                        errno = ENOTDIR;
+        }
+        FS_METRIC_END(_ret, 0, errno);
+        return _ret;
+}
+
+// 设置注入的延迟和错误，需要在其它线程使用memfs之前调用
+inline
+void set_fault_policy(const fault_policy &p_policy) {
+        fault_policy *&_policy = detail::global_fault_policy();
+        if(p_policy.is_empty())
+        {
+                delete _policy;
+                _policy = NULL;
+                return;
+        }
+        if(_policy == NULL)
+        {
+                _policy = new fault_policy;
+        }
+        *_policy = p_policy;
+}
+
+inline
+fault_policy get_fault_policy() {
+        const fault_policy *_policy = detail::global_fault_policy();
+        return (_policy != NULL) ? *_policy : fault_policy();
+}
+
+namespace detail
+{
+
+// walk, disk_usage只能按路径逐个stat，见walk.ipp
+struct path_walk_source;
+typedef path_walk_source walk_source;
+
+} // namespace detail
+
+} // namespace memfs
+
+#endif	// _MEMFS_HPP_
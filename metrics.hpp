@@ -0,0 +1,506 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _METRICS_HPP_
+#define _METRICS_HPP_
+
+//
+// 各文件系统操作的统计：次数、字节数、按errno的错误数、重试次数，
+// 以及总延迟和远程（如gfs client内部）延迟的分布。
+//
+// 定义FS_METRICS_ENABLED后才会统计，否则下面的宏为空，没有任何开销。
+// 也可以在包含本文件前自己定义FS_METRIC_BEGIN等宏，接入别的统计系统。
+//
+// 每个线程写自己的计数器，不加锁；snapshot把所有线程的计数加起来。
+//
+
+#ifdef FS_METRICS_ENABLED
+
+#ifndef FS_METRIC_BEGIN
+#	define FS_METRIC_BEGIN(backend, op)				\
+	::fsutil::op_timer fs_metric_timer(::fsutil::backend, ::fsutil::op)
+#endif
+
+// p_ok为false时，p_errno计入错误
+#ifndef FS_METRIC_END
+#	define FS_METRIC_END(ok, bytes, errno_value)			\
+	fs_metric_timer.finish((ok), (bytes), (errno_value))
+#endif
+
+// 带重试次数的版本，gfs使用；local_us为其中不在远程调用中的时间，
+// 如重试前的等待，其余的时间计为远程延迟
+#ifndef FS_METRIC_END_RETRY
+#	define FS_METRIC_END_RETRY(ok, bytes, errno_value, retries, local_us) \
+	fs_metric_timer.finish((ok), (bytes), (errno_value), (retries), (local_us))
+#endif
+
+#else
+
+#ifndef FS_METRIC_BEGIN
+#	define FS_METRIC_BEGIN(backend, op)
+#endif
+#ifndef FS_METRIC_END
+#	define FS_METRIC_END(ok, bytes, errno_value)
+#endif
+#ifndef FS_METRIC_END_RETRY
+#	define FS_METRIC_END_RETRY(ok, bytes, errno_value, retries, local_us)
+#endif
+
+#endif	// FS_METRICS_ENABLED
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <cstring>
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace fsutil
+{
+
+enum metric_backend
+{
+        MB_LOCALFS,
+        MB_GFS,
+        MB_MEMFS,
+        MB_COUNT
+};
+
+enum metric_op
+{
+        OP_OPEN,		// 包括create
+        OP_READ,
+        OP_WRITE,
+        OP_APPEND,
+        OP_SEEK,
+        OP_STAT,
+        OP_LIST_FILES,
+        OP_REMOVE,
+        OP_RENAME,
+        OP_MKDIR,
+        OP_SYNC,		// 包括datasync, syncfs
+        OP_COUNT
+};
+
+inline
+const char *backend_name(metric_backend p_backend) {
+        static const char * const _names[MB_COUNT] = {"localfs", "gfs", "memfs"};
+        return _names[p_backend];
+}
+
+inline
+const char *op_name(metric_op p_op) {
+        static const char * const _names[OP_COUNT] = {
+                "open", "read", "write", "append", "seek",
+                "stat", "list_files", "remove", "rename", "mkdir", "sync"
+        };
+        return _names[p_op];
+}
+
+enum {
+        // 延迟分布的桶：以微秒计，每个2的幂次再分为4个子桶，
+        // 最大约为2^32微秒
+        HISTOGRAM_SUB_BITS = 2,
+        HISTOGRAM_BUCKETS = 32 << HISTOGRAM_SUB_BITS,
+        ERRNO_SLOTS = 16	// 每个操作记录的不同errno个数，多出的计入最后一个
+};
+
+inline
+std::size_t histogram_bucket(uint64_t p_us) {
+        if(p_us < (1U << HISTOGRAM_SUB_BITS))
+                return std::size_t(p_us);
+        const unsigned _log = 63 - __builtin_clzll(p_us);
+        const std::size_t _bucket = ((_log - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+                std::size_t((p_us >> (_log - HISTOGRAM_SUB_BITS)) & ((1U << HISTOGRAM_SUB_BITS) - 1));
+        return _bucket < HISTOGRAM_BUCKETS ? _bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// 桶的下界（微秒）
+inline
+uint64_t histogram_bucket_floor(std::size_t p_bucket) {
+        if(p_bucket < (1U << HISTOGRAM_SUB_BITS))
+                return p_bucket;
+        const unsigned _log = unsigned(p_bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+        const uint64_t _sub = p_bucket & ((1U << HISTOGRAM_SUB_BITS) - 1);
+        return (uint64_t(1) << _log) | (_sub << (_log - HISTOGRAM_SUB_BITS));
+}
+
+// 一个操作的统计
+struct op_stats
+{
+        op_stats() {
+                clear();
+        }
+
+        void clear() {
+                m_count = m_errors = m_bytes = m_retries = 0;
+                m_latency_us = m_remote_us = 0;
+                for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                {
+                        m_latency[i] = m_remote[i] = 0;
+                }
+                m_errnos.clear();
+        }
+
+        // 分位数（微秒），取所在桶的下界；p_remote为true时使用远程延迟
+        uint64_t percentile(double p_ratio,
+                            bool p_remote = false) const {
+                const uint64_t *_hist = p_remote ? m_remote : m_latency;
+                uint64_t _total = 0;
+                for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                {
+                        _total += _hist[i];
+                }
+                if(_total == 0)
+                        return 0;
+                const uint64_t _rank = uint64_t(p_ratio * double(_total - 1));
+                uint64_t _seen = 0;
+                for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                {
+                        _seen += _hist[i];
+                        if(_seen > _rank)
+                                return histogram_bucket_floor(i);
+                }
+                return histogram_bucket_floor(HISTOGRAM_BUCKETS - 1);
+        }
+
+        uint64_t m_count;
+        uint64_t m_errors;
+        uint64_t m_bytes;
+        uint64_t m_retries;
+        uint64_t m_latency_us;		// 总延迟之和
+        uint64_t m_remote_us;		// 远程延迟之和
+        uint64_t m_latency[HISTOGRAM_BUCKETS];
+        uint64_t m_remote[HISTOGRAM_BUCKETS];
+        std::map<int, uint64_t> m_errnos;
+};
+
+struct metrics_snapshot
+{
+        op_stats m_ops[MB_COUNT][OP_COUNT];
+
+        // 输出为一行JSON，只包含发生过的操作
+        void write_json(std::ostream &p_out) const {
+                p_out << '{';
+                bool _first = true;
+                for(std::size_t b = 0; b < MB_COUNT; ++b)
+                {
+                        for(std::size_t o = 0; o < OP_COUNT; ++o)
+                        {
+                                const op_stats &_op = m_ops[b][o];
+                                if(_op.m_count == 0)
+                                        continue;
+                                p_out << (_first ? "" : ",")
+                                      << '"' << backend_name(metric_backend(b))
+                                      << '.' << op_name(metric_op(o)) << "\":{"
+                                      << "\"count\":" << _op.m_count
+                                      << ",\"errors\":" << _op.m_errors
+                                      << ",\"bytes\":" << _op.m_bytes
+                                      << ",\"retries\":" << _op.m_retries
+                                      << ",\"latency_us_sum\":" << _op.m_latency_us
+                                      << ",\"remote_us_sum\":" << _op.m_remote_us
+                                      << ",\"p50_us\":" << _op.percentile(0.5)
+                                      << ",\"p99_us\":" << _op.percentile(0.99)
+                                      << ",\"p999_us\":" << _op.percentile(0.999)
+                                      << ",\"remote_p50_us\":" << _op.percentile(0.5, true)
+                                      << ",\"remote_p99_us\":" << _op.percentile(0.99, true)
+                                      << ",\"remote_p999_us\":" << _op.percentile(0.999, true)
+                                      << ",\"errnos\":{";
+                                for(std::map<int, uint64_t>::const_iterator _iter = _op.m_errnos.begin();
+                                    _iter != _op.m_errnos.end(); ++_iter)
+                                {
+                                        p_out << (_iter == _op.m_errnos.begin() ? "" : ",")
+                                              << '"' << _iter->first << "\":" << _iter->second;
+                                }
+                                p_out << "}}";
+                                _first = false;
+                        }
+                }
+                p_out << '}';
+        }
+};
+
+namespace detail
+{
+
+// 只由所属线程写，读线程用relaxed的原子读
+inline
+void counter_add(uint64_t &p_counter, uint64_t p_value) {
+        __atomic_store_n(&p_counter,
+                         __atomic_load_n(&p_counter, __ATOMIC_RELAXED) + p_value,
+                         __ATOMIC_RELAXED);
+}
+
+inline
+uint64_t counter_get(const uint64_t &p_counter) {
+        return __atomic_load_n(&p_counter, __ATOMIC_RELAXED);
+}
+
+struct thread_op_counters
+{
+        uint64_t m_count;
+        uint64_t m_errors;
+        uint64_t m_bytes;
+        uint64_t m_retries;
+        uint64_t m_latency_us;
+        uint64_t m_remote_us;
+        uint64_t m_latency[HISTOGRAM_BUCKETS];
+        uint64_t m_remote[HISTOGRAM_BUCKETS];
+        int m_errno_keys[ERRNO_SLOTS];	// 0表示空位
+        uint64_t m_errno_counts[ERRNO_SLOTS];
+};
+
+struct thread_counters
+{
+        thread_op_counters m_ops[MB_COUNT][OP_COUNT];
+};
+
+// 所有线程的计数器。线程退出时计数并入m_retired，计数器清零后
+// 留给以后的线程使用，所以大量短命的线程不会让计数器越来越多
+class counters_registry
+{
+public:
+        static counters_registry &instance() {
+                static counters_registry *_registry = new counters_registry;
+                return *_registry;
+        }
+
+        thread_counters *add() {
+                boost::mutex::scoped_lock _lock(m_mutex);
+                thread_counters *_counters = NULL;
+                if(m_free.empty())
+                {
+                        _counters = new thread_counters();
+                }
+                else
+                {
+                        _counters = m_free.back();
+                        m_free.pop_back();
+                }
+                m_counters.push_back(_counters);
+                return _counters;
+        }
+
+        // 所属线程退出，之后不再写p_counters
+        void retire(thread_counters *p_counters) {
+                boost::mutex::scoped_lock _lock(m_mutex);
+                for(std::size_t b = 0; b < MB_COUNT; ++b)
+                {
+                        for(std::size_t o = 0; o < OP_COUNT; ++o)
+                        {
+                                add_to(m_retired.m_ops[b][o], p_counters->m_ops[b][o]);
+                        }
+                }
+                m_counters.erase(std::find(m_counters.begin(), m_counters.end(), p_counters));
+                std::memset(p_counters, 0, sizeof(thread_counters));
+                m_free.push_back(p_counters);
+        }
+
+        void collect(metrics_snapshot &p_snapshot) {
+                boost::mutex::scoped_lock _lock(m_mutex);
+                for(std::size_t b = 0; b < MB_COUNT; ++b)
+                {
+                        for(std::size_t o = 0; o < OP_COUNT; ++o)
+                        {
+                                add_to(p_snapshot.m_ops[b][o], m_retired.m_ops[b][o]);
+                        }
+                }
+                for(std::size_t t = 0; t < m_counters.size(); ++t)
+                {
+                        for(std::size_t b = 0; b < MB_COUNT; ++b)
+                        {
+                                for(std::size_t o = 0; o < OP_COUNT; ++o)
+                                {
+                                        add_to(p_snapshot.m_ops[b][o],
+                                               m_counters[t]->m_ops[b][o]);
+                                }
+                        }
+                }
+        }
+
+private:
+        static void add_to(op_stats &p_stats,
+                           const thread_op_counters &p_counters) {
+                p_stats.m_count += counter_get(p_counters.m_count);
+                p_stats.m_errors += counter_get(p_counters.m_errors);
+                p_stats.m_bytes += counter_get(p_counters.m_bytes);
+                p_stats.m_retries += counter_get(p_counters.m_retries);
+                p_stats.m_latency_us += counter_get(p_counters.m_latency_us);
+                p_stats.m_remote_us += counter_get(p_counters.m_remote_us);
+                for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                {
+                        p_stats.m_latency[i] += counter_get(p_counters.m_latency[i]);
+                        p_stats.m_remote[i] += counter_get(p_counters.m_remote[i]);
+                }
+                for(std::size_t i = 0; i < ERRNO_SLOTS; ++i)
+                {
+                        const int _key = __atomic_load_n(&p_counters.m_errno_keys[i], __ATOMIC_RELAXED);
+                        if(_key != 0)
+                        {
+                                p_stats.m_errnos[_key] += counter_get(p_counters.m_errno_counts[i]);
+                        }
+                }
+        }
+
+        static void add_to(op_stats &p_stats,
+                           const op_stats &p_other) {
+                p_stats.m_count += p_other.m_count;
+                p_stats.m_errors += p_other.m_errors;
+                p_stats.m_bytes += p_other.m_bytes;
+                p_stats.m_retries += p_other.m_retries;
+                p_stats.m_latency_us += p_other.m_latency_us;
+                p_stats.m_remote_us += p_other.m_remote_us;
+                for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                {
+                        p_stats.m_latency[i] += p_other.m_latency[i];
+                        p_stats.m_remote[i] += p_other.m_remote[i];
+                }
+                for(std::map<int, uint64_t>::const_iterator _iter = p_other.m_errnos.begin();
+                    _iter != p_other.m_errnos.end(); ++_iter)
+                {
+                        p_stats.m_errnos[_iter->first] += _iter->second;
+                }
+        }
+
+        boost::mutex m_mutex;
+        std::vector<thread_counters*> m_counters;	// 活着的线程的
+        std::vector<thread_counters*> m_free;		// 已退出的线程留下的
+        metrics_snapshot m_retired;			// 已退出的线程的计数
+};
+
+// 本线程的计数器，快速路径只读这个变量
+inline
+thread_counters *&local_counters_slot() {
+        static __thread thread_counters *_counters = NULL;
+        return _counters;
+}
+
+// 线程退出时由thread_specific_ptr调用
+inline
+void retire_counters(thread_counters *p_counters) {
+        local_counters_slot() = NULL;
+        counters_registry::instance().retire(p_counters);
+}
+
+inline
+thread_counters &local_counters() {
+        thread_counters *&_counters = local_counters_slot();
+        if(_counters == NULL)
+        {
+                static boost::thread_specific_ptr<thread_counters> *_owner =
+                        new boost::thread_specific_ptr<thread_counters>(&retire_counters);
+                _counters = counters_registry::instance().add();
+                _owner->reset(_counters);
+        }
+        return *_counters;
+}
+
+} // namespace detail
+
+// 作为FS_METRIC_END_RETRY的local_us，表示没有远程调用，如命中缓存
+const uint64_t LOCAL_ONLY = ~uint64_t(0);
+
+inline
+uint64_t monotonic_us() {
+        struct timespec _now;
+        ::clock_gettime(CLOCK_MONOTONIC, &_now);
+        return uint64_t(_now.tv_sec) * 1000 * 1000 + _now.tv_nsec / 1000;
+}
+
+// 记录一次操作。p_remote_us为远程部分的延迟，本地文件系统与p_latency_us相同
+inline
+void record(metric_backend p_backend,
+            metric_op p_op,
+            uint64_t p_latency_us,
+            uint64_t p_remote_us,
+            bool p_ok,
+            uint64_t p_bytes,
+            int p_errno,
+            uint64_t p_retries = 0) {
+        detail::thread_op_counters &_op = detail::local_counters().m_ops[p_backend][p_op];
+        detail::counter_add(_op.m_count, 1);
+        detail::counter_add(_op.m_bytes, p_bytes);
+        detail::counter_add(_op.m_retries, p_retries);
+        detail::counter_add(_op.m_latency_us, p_latency_us);
+        detail::counter_add(_op.m_remote_us, p_remote_us);
+        detail::counter_add(_op.m_latency[histogram_bucket(p_latency_us)], 1);
+        detail::counter_add(_op.m_remote[histogram_bucket(p_remote_us)], 1);
+        if(p_ok)
+                return;
+
+        detail::counter_add(_op.m_errors, 1);
+        if(p_errno == 0)
+                p_errno = -1; // 未知错误
+        std::size_t i = 0;
+        for(; i + 1 < ERRNO_SLOTS; ++i)
+        {
+                if(_op.m_errno_keys[i] == p_errno)
+                        break;
+                if(_op.m_errno_keys[i] == 0)
+                {
+                        __atomic_store_n(&_op.m_errno_keys[i], p_errno, __ATOMIC_RELAXED);
+                        break;
+                }
+        }
+        if(i + 1 == ERRNO_SLOTS && _op.m_errno_keys[i] == 0)
+        {
+                __atomic_store_n(&_op.m_errno_keys[i], p_errno, __ATOMIC_RELAXED);
+        }
+        detail::counter_add(_op.m_errno_counts[i], 1);
+}
+
+// 所有线程到目前为止的统计；需要一段时间内的统计时，对两次的结果求差
+inline
+metrics_snapshot snapshot() {
+        metrics_snapshot _snapshot;
+        detail::counters_registry::instance().collect(_snapshot);
+        return _snapshot;
+}
+
+// 由FS_METRIC_BEGIN, FS_METRIC_END使用
+class op_timer
+{
+public:
+        op_timer(metric_backend p_backend,
+                 metric_op p_op)
+                : m_backend(p_backend),
+                  m_op(p_op),
+                  m_start_us(monotonic_us()) {}
+
+        void finish(bool p_ok,
+                    int64_t p_bytes,
+                    int p_errno) {
+                finish(p_ok, p_bytes, p_errno, 0, 0);
+        }
+
+        // 不改变errno，调用者随后还要使用
+        void finish(bool p_ok,
+                    int64_t p_bytes,
+                    int p_errno,
+                    uint64_t p_retries,
+                    uint64_t p_local_us) {
+                const int _saved_errno = errno;
+                const uint64_t _latency = monotonic_us() - m_start_us;
+                record(m_backend, m_op, _latency,
+                       (p_local_us < _latency) ? _latency - p_local_us : 0,
+                       p_ok,
+                       (p_ok && p_bytes > 0) ? uint64_t(p_bytes) : 0,
+                       p_errno, p_retries);
+                errno = _saved_errno;
+        }
+
+private:
+        const metric_backend m_backend;
+        const metric_op m_op;
+        const uint64_t m_start_us;
+};
+
+} // namespace fsutil
+
+#endif	// _METRICS_HPP_
@@ -0,0 +1,40 @@
+// -*-mode:c++; coding:utf-8-*-
+
+//
+// 在各文件系统的头文件中include到其命名空间里，remove, rename本身
+// 需要调用path_changed，所以不能像fs.ipp那样在fs.hpp中加入。
+//
+
+namespace detail
+{
+
+// 本进程remove, rename了p_path（及其下的文件）时调用，
+// 各个缓存用它去掉相应的项
+typedef void (*path_changed_hook)(const char *p_path);
+
+enum path_hook_slot
+{
+	PH_HANDLE_CACHE,	// 关闭缓存的句柄，见handle_cache.ipp
+	PH_DIRECTORY_CACHE,	// create_directories记住的目录，见batch.ipp
+	PH_PREAD_POOL,		// gfs的pread_pool缓存的handle，见gfs_pread.hpp
+	PH_COUNT
+};
+
+// 可以在其它线程remove, rename的同时设置
+inline
+boost::atomic<path_changed_hook> &global_path_changed_hook(path_hook_slot p_slot) {
+	static boost::atomic<path_changed_hook> _hooks[PH_COUNT];
+	return _hooks[p_slot];
+}
+
+inline
+void path_changed(const char *p_path) {
+	for(int i = 0; i < PH_COUNT; ++i)
+	{
+		const path_changed_hook _hook = global_path_changed_hook(path_hook_slot(i)).load();
+		if(_hook != NULL)
+			_hook(p_path);
+	}
+}
+
+} // namespace detail
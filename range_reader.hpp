@@ -0,0 +1,412 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _RANGE_READER_HPP_
+#define _RANGE_READER_HPP_
+
+//
+// 用多个句柄并行读一个大文件，突破单个读流的带宽，比如gfs上几十G
+// 的文件：
+//
+//   fsutil::range_reader<gfs::backend> _reader;
+//   _reader.read("/gfs/big", _consumer);
+//
+// 文件按m_chunk_size分块，m_threads个线程各自打开一个句柄（可以
+// 指定不同的副本数），用preadn同时读不同的块；读好的块按文件中的
+// 顺序交给调用者。最多同时有m_max_chunks个块在读或等待交付，所以
+// 使用的内存不超过m_max_chunks * m_chunk_size，交付慢时读线程等待。
+//
+// localfs的preadn就是::pread，可以用来对比。
+//
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "metrics.hpp"
+#include "buffer_pool.hpp"
+
+namespace fsutil
+{
+
+struct range_options
+{
+        range_options()
+                : m_threads(4),
+                  m_chunk_size(8 * 1024 * 1024),
+                  m_max_chunks(0) {}
+
+        std::size_t m_threads;		// 同时读的线程数，每个线程一个句柄
+        std::size_t m_chunk_size;	// 每次preadn的大小
+        std::size_t m_max_chunks;	// 在读或等待交付的块数上限，0表示2 * m_threads
+        // 第i个线程用m_replica_numbers[i % size()]打开文件，
+        // 为空时用open的默认副本数
+        std::vector<std::size_t> m_replica_numbers;
+};
+
+struct range_stats
+{
+        range_stats()
+                : m_bytes(0),
+                  m_chunks(0),
+                  m_handles(0),
+                  m_elapsed_us(0) {}
+
+        double mb_per_sec() const {
+                return (m_elapsed_us == 0) ? 0.0 :
+                        double(m_bytes) / (1024.0 * 1024.0) / (double(m_elapsed_us) / 1e6);
+        }
+
+        uint64_t m_bytes;		// 已经交付的字节数
+        uint64_t m_chunks;
+        std::size_t m_handles;		// 打开的句柄数
+        uint64_t m_elapsed_us;
+};
+
+// 按顺序在调用read的线程中调用，p_offset为p_data在文件中的位置，
+// 返回false时停止读取
+typedef boost::function<bool(const char *p_data,
+                             std::size_t p_size,
+                             uint64_t p_offset)> range_consumer;
+
+template<typename Backend>
+class range_reader : boost::noncopyable
+{
+public:
+        explicit range_reader(const range_options &p_options = range_options())
+                : m_options(p_options),
+                  m_error(0) {
+                if(m_options.m_threads == 0)
+                        m_options.m_threads = 1;
+                if(m_options.m_chunk_size == 0)
+                        m_options.m_chunk_size = range_options().m_chunk_size;
+                if(m_options.m_max_chunks < m_options.m_threads)
+                        m_options.m_max_chunks = 2 * m_options.m_threads;
+        }
+
+        // 读整个文件，按顺序交给p_consumer。读完或p_consumer返回
+        // false时返回true，出错时返回false，错误码见error()
+        bool read(const char *p_path,
+                  const range_consumer &p_consumer) {
+                uint64_t _size = 0;
+                if(! start(p_path, _size))
+                        return false;
+                job _job(*this, p_path, _size, NULL);
+                _job.run(&p_consumer);
+                return finish(_job);
+        }
+
+        // 读文件开头的min(文件长度, p_capacity)个字节到p_buffer，
+        // 各线程直接读入p_buffer中的相应位置。返回读到的字节数，
+        // 出错时返回-1
+        int64_t read(const char *p_path,
+                     void *p_buffer,
+                     uint64_t p_capacity) {
+                uint64_t _size = 0;
+                if(! start(p_path, _size))
+                        return -1;
+                _size = std::min(_size, p_capacity);
+                job _job(*this, p_path, _size, static_cast<char*>(p_buffer));
+                _job.run(NULL);
+                return finish(_job) ? int64_t(_size) : -1;
+        }
+
+        // 最近一次read的结果
+        range_stats stats() const {
+                return m_stats;
+        }
+
+        // 最近一次read失败时的错误码，为Backend::get_errno()的值
+        int error() const {
+                return m_error;
+        }
+
+private:
+        struct chunk
+        {
+                pooled_buffer m_data;
+                std::size_t m_size;
+        };
+
+        // 一次read的状态，各线程共享
+        class job : boost::noncopyable
+        {
+        public:
+                job(range_reader &p_reader,
+                    const char *p_path,
+                    uint64_t p_size,
+                    char *p_buffer)
+                        : m_options(p_reader.m_options),
+                          m_path(p_path),
+                          m_size(p_size),
+                          m_buffer(p_buffer),
+                          m_count((p_size + p_reader.m_options.m_chunk_size - 1) /
+                                  p_reader.m_options.m_chunk_size),
+                          m_next(0),
+                          m_delivered(0),
+                          m_handles(0),
+                          m_stopped(false),
+                          m_error(0) {}
+
+                ~job() {
+                        for(std::size_t i = 0; i < m_free.size(); ++i)
+                        {
+                                delete m_free[i];
+                        }
+                        for(typename chunk_map::iterator _iter = m_ready.begin();
+                            _iter != m_ready.end(); ++_iter)
+                        {
+                                delete _iter->second;
+                        }
+                }
+
+                // p_consumer为NULL时各线程直接读入m_buffer
+                void run(const range_consumer *p_consumer) {
+                        const std::size_t _threads =
+                                std::min<uint64_t>(m_options.m_threads, m_count);
+                        boost::thread_group _group;
+                        for(std::size_t i = 0; i < _threads; ++i)
+                        {
+                                _group.create_thread(boost::bind(&job::work, this, i));
+                        }
+                        if(p_consumer != NULL)
+                                deliver(*p_consumer);
+                        _group.join_all();
+                }
+
+                bool failed() const {
+                        return m_error != 0;
+                }
+
+                int error() const {
+                        return m_error;
+                }
+
+                uint64_t delivered_bytes() const {
+                        if(m_buffer != NULL)
+                                return failed() ? 0 : m_size;
+                        return std::min<uint64_t>(m_size, m_delivered * m_options.m_chunk_size);
+                }
+
+                uint64_t delivered_chunks() const {
+                        if(m_buffer != NULL)
+                                return failed() ? 0 : m_count;
+                        return m_delivered;
+                }
+
+                std::size_t handles() const {
+                        return m_handles;
+                }
+
+        private:
+                typedef typename Backend::file_type file_type;
+                typedef std::map<uint64_t, chunk*> chunk_map;
+
+                file_type open_handle(std::size_t p_thread) {
+                        const std::vector<std::size_t> &_replicas = m_options.m_replica_numbers;
+                        if(_replicas.empty())
+                                return Backend::open(m_path, O_RDONLY);
+                        return Backend::open(m_path, O_RDONLY,
+                                             _replicas[p_thread % _replicas.size()]);
+                }
+
+                void fail(boost::mutex::scoped_lock &,
+                          int p_error) {
+                        if(m_error == 0)
+                                m_error = (p_error == 0) ? EIO : p_error;
+                        m_stopped = true;
+                        m_cond.notify_all();
+                }
+
+                // 取下一个块；交付的窗口已满时等待，没有块可读时返回false
+                bool next_chunk(uint64_t &p_index,
+                                chunk *&p_chunk) {
+                        boost::mutex::scoped_lock _lock(m_mutex);
+                        while(! m_stopped && m_next < m_count &&
+                              m_buffer == NULL &&
+                              m_next >= m_delivered + m_options.m_max_chunks)
+                        {
+                                m_cond.wait(_lock);
+                        }
+                        if(m_stopped || m_next >= m_count)
+                                return false;
+                        p_index = m_next ++;
+                        p_chunk = NULL;
+                        if(m_buffer == NULL && ! m_free.empty())
+                        {
+                                p_chunk = m_free.back();
+                                m_free.pop_back();
+                        }
+                        return true;
+                }
+
+                void work(std::size_t p_thread) {
+                        const file_type _file = open_handle(p_thread);
+                        if(_file == Backend::bad_file())
+                        {
+                                const int _errno = Backend::get_errno();
+                                boost::mutex::scoped_lock _lock(m_mutex);
+                                fail(_lock, _errno);
+                                return;
+                        }
+                        {
+                                boost::mutex::scoped_lock _lock(m_mutex);
+                                ++ m_handles;
+                        }
+
+                        const std::size_t _chunk_size = m_options.m_chunk_size;
+                        uint64_t _index = 0;
+                        chunk *_chunk = NULL;
+                        while(next_chunk(_index, _chunk))
+                        {
+                                const uint64_t _offset = _index * _chunk_size;
+                                const std::size_t _size =
+                                        std::min<uint64_t>(_chunk_size, m_size - _offset);
+                                char *_data = NULL;
+                                if(m_buffer != NULL)
+                                {
+                                        _data = m_buffer + _offset;
+                                }
+                                else
+                                {
+                                        if(_chunk == NULL)
+                                        {
+                                                _chunk = new chunk;
+                                                if(! buffer_pool::instance().allocate(_chunk->m_data,
+                                                                                      _chunk_size))
+                                                {
+                                                        delete _chunk;
+                                                        boost::mutex::scoped_lock _lock(m_mutex);
+                                                        fail(_lock, ENOMEM);
+                                                        break;
+                                                }
+                                        }
+                                        _chunk->m_size = _size;
+                                        _data = _chunk->m_data.data();
+                                }
+
+                                const ssize_t _ret = Backend::preadn(_file, _data, _size,
+                                                                     _offset);
+                                // 读到的比stat的长度少，说明文件被截短了
+                                const int _errno = (_ret < 0) ? Backend::get_errno() : EIO;
+
+                                boost::mutex::scoped_lock _lock(m_mutex);
+                                if(_ret != ssize_t(_size))
+                                {
+                                        if(_chunk != NULL)
+                                                m_free.push_back(_chunk);
+                                        fail(_lock, _errno);
+                                        break;
+                                }
+                                if(_chunk != NULL)
+                                {
+                                        m_ready[_index] = _chunk;
+                                        _chunk = NULL;
+                                        if(_index == m_delivered)
+                                                m_cond.notify_all();
+                                }
+                        }
+                        Backend::close(_file);
+                }
+
+                // 在调用者的线程中按顺序交付
+                void deliver(const range_consumer &p_consumer) {
+                        const std::size_t _chunk_size = m_options.m_chunk_size;
+                        for(;;)
+                        {
+                                chunk *_chunk = NULL;
+                                {
+                                        boost::mutex::scoped_lock _lock(m_mutex);
+                                        for(;;)
+                                        {
+                                                if(m_stopped || m_delivered >= m_count)
+                                                        return;
+                                                typename chunk_map::iterator _iter =
+                                                        m_ready.find(m_delivered);
+                                                if(_iter != m_ready.end())
+                                                {
+                                                        _chunk = _iter->second;
+                                                        m_ready.erase(_iter);
+                                                        break;
+                                                }
+                                                m_cond.wait(_lock);
+                                        }
+                                }
+
+                                const bool _more = p_consumer(_chunk->m_data.data(), _chunk->m_size,
+                                                              m_delivered * _chunk_size);
+
+                                boost::mutex::scoped_lock _lock(m_mutex);
+                                m_free.push_back(_chunk);
+                                ++ m_delivered;
+                                if(! _more)
+                                        m_stopped = true;
+                                m_cond.notify_all();
+                        }
+                }
+
+                const range_options &m_options;
+                const char * const m_path;
+                const uint64_t m_size;
+                char * const m_buffer;
+                const uint64_t m_count;		// 总块数
+
+                boost::mutex m_mutex;
+                boost::condition_variable m_cond;
+                uint64_t m_next;		// 下一个要读的块
+                uint64_t m_delivered;		// 下一个要交付的块
+                chunk_map m_ready;		// 读好等待交付的块
+                std::vector<chunk*> m_free;	// 交付过的块，可以再用
+                std::size_t m_handles;
+                bool m_stopped;			// 出错或调用者要求停止
+                int m_error;
+        };
+
+        bool start(const char *p_path,
+                   uint64_t &p_size) {
+                m_stats = range_stats();
+                m_error = 0;
+                m_start_us = monotonic_us();
+                typename Backend::status_type _status;
+                if(! Backend::stat(_status, p_path))
+                {
+                        m_error = Backend::get_errno();
+                        return false;
+                }
+                p_size = Backend::status_size(_status);
+                return true;
+        }
+
+        bool finish(const job &p_job) {
+                m_stats.m_bytes = p_job.delivered_bytes();
+                m_stats.m_chunks = p_job.delivered_chunks();
+                m_stats.m_handles = p_job.handles();
+                m_stats.m_elapsed_us = monotonic_us() - m_start_us;
+                if(p_job.failed())
+                {
+                        m_error = p_job.error();
+                        return false;
+                }
+                return true;
+        }
+
+        range_options m_options;
+        range_stats m_stats;
+        uint64_t m_start_us;
+        int m_error;
+};
+
+} // namespace fsutil
+
+#endif	// _RANGE_READER_HPP_
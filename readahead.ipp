@@ -0,0 +1,392 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _FILESYSTEM_HPP_
+#error "readahead.ipp can ONLY be included into fs.hpp"
+#endif
+
+namespace detail
+{
+
+// readahead_reader的read, readn, seek会隐藏掉命名空间中的同名函数
+inline
+ssize_t readn_block(file_t p_file,
+		    void *p_buffer,
+		    size_t p_count) {
+	return readn(p_file, p_buffer, p_count);
+}
+
+inline
+ssize_t read_file(file_t p_file,
+		  void *p_buffer,
+		  size_t p_count) {
+	return read(p_file, p_buffer, p_count);
+}
+
+inline
+offset_t seek_file(file_t p_file,
+		   offset_t p_offset,
+		   seek_t p_whence) {
+	return seek(p_file, p_offset, p_whence);
+}
+
+inline
+bool advise_file(file_t p_file,
+		 offset_t p_offset,
+		 offset_t p_length,
+		 advice_t p_advice) {
+	return advise(p_file, p_offset, p_length, p_advice);
+}
+
+} // namespace detail
+
+//
+// 顺序读的预读：连续几次顺序的read之后，后台线程开始提前读出
+// 后面的若干块，read, readn直接从预读好的块中取数据。
+//
+// 预读的块数在[2, p_max_blocks]之间调整：read需要等待预读时
+// 加倍，预读一直领先时逐渐减少。seek到已预读的范围之内时直接
+// 使用已有的数据，否则停止预读，重新检测顺序访问。
+// 也可以用advise直接告诉它访问方式。
+//
+// 使用期间不能再直接读写、seek这个file_t；析构时不关闭文件，
+// 文件指针停在tell()的位置。
+//
+class readahead_reader : boost::noncopyable
+{
+public:
+	struct stats
+	{
+		uint64_t m_hits;	// 数据已经预读好的read次数
+		uint64_t m_misses;	// 需要等待或直接读文件的read次数
+		uint64_t m_prefetched;	// 预读的块数
+		uint64_t m_discarded;	// 因为seek而丢弃的块数
+		size_t m_window;	// 当前预读的块数
+	};
+
+	explicit readahead_reader(file_t p_file,
+				  size_t p_block_size = 1024 * 1024,
+				  size_t p_max_blocks = 8)
+		: m_file(p_file),
+		  m_block_size(p_block_size == 0 ? 1 : p_block_size),
+		  m_max_window(p_max_blocks < 2 ? 2 : p_max_blocks),
+		  m_window(2),
+		  m_pos(seek_file_cur(p_file)),
+		  m_fetch_pos(0),
+		  m_sequential(0),
+		  m_continuous_hits(0),
+		  m_generation(0),
+		  m_errno(0),
+		  m_random(false),
+		  m_active(false),
+		  m_fetching(false),
+		  m_eof(false),
+		  m_stop(false),
+		  m_stats(stats()),
+		  m_thread(boost::bind(&readahead_reader::run, this)) {}
+
+	~readahead_reader() {
+		{
+			boost::mutex::scoped_lock _lock(m_mutex);
+			stop_prefetch(_lock);	// 文件指针移回m_pos
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		m_thread.join();
+	}
+
+	// 语义同fs::read
+	ssize_t read(void *p_buffer,
+		     size_t p_count) {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		if(p_count == 0)
+			return 0;
+
+		if(! m_active)
+		{
+			++ m_stats.m_misses;
+			_lock.unlock();
+			const ssize_t _ret = detail::read_file(m_file, p_buffer, p_count);
+			_lock.lock();
+			if(_ret > 0)
+			{
+				m_pos += _ret;
+				// 连续两次顺序读之后开始预读
+				if((! m_random) && ++ m_sequential >= 2)
+					start_prefetch();
+			}
+			return _ret;
+		}
+
+		if(m_blocks.empty() && (! m_eof) && (m_errno == 0))
+		{
+			++ m_stats.m_misses;
+			m_continuous_hits = 0;
+			m_window = std::min(m_window * 2, m_max_window);
+			m_cond.notify_all();
+			while(m_blocks.empty() && (! m_eof) && (m_errno == 0))
+			{
+				m_cond.wait(_lock);
+			}
+		}
+		else
+		{
+			++ m_stats.m_hits;
+		}
+
+		if(m_blocks.empty())
+		{
+			if(m_errno != 0)
+			{
+				set_errno(m_errno);
+				return -1;
+			}
+			return 0; // end
+		}
+
+		block &_front = m_blocks.front();
+		const size_t _skip = size_t(m_pos - _front.m_offset);
+		const size_t _count = std::min(p_count, _front.m_data.size() - _skip);
+		std::memcpy(p_buffer, &_front.m_data[_skip], _count);
+		m_pos += _count;
+		if(_skip + _count == _front.m_data.size())
+		{
+			m_blocks.pop_front();
+			if(++ m_continuous_hits >= 4 * m_window && m_window > 2)
+			{
+				-- m_window;
+				m_continuous_hits = 0;
+			}
+			m_cond.notify_all();
+		}
+		return _count;
+	}
+
+	// 语义同fs::readn
+	ssize_t readn(void *p_buffer,
+		      size_t p_count) {
+		size_t _readed = 0;
+		char *_pos = static_cast<char*>(p_buffer);
+		while(_readed < p_count) {
+			ssize_t _ret = read(_pos, p_count - _readed);
+			if (_ret < 0) {
+				return ((_readed == 0) ? ssize_t(-1) : ssize_t(_readed));
+			} else if (_ret == 0) {
+				return _readed;
+			} else {
+				_readed += _ret;
+				_pos += _ret;
+			}
+		}
+		return _readed;
+	}
+
+	// 语义同fs::seek
+	offset_t seek(offset_t p_offset,
+		      seek_t p_whence) {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		offset_t _target = p_offset;
+		if(p_whence == ST_SEEK_CUR)
+		{
+			_target = m_pos + p_offset;
+		}
+		else if(p_whence == ST_SEEK_END)
+		{
+			stop_prefetch(_lock);
+			const offset_t _ret = detail::seek_file(m_file, p_offset, ST_SEEK_END);
+			if(_ret == BAD_OFFSET)
+				return BAD_OFFSET;	// 保留原来的位置
+			m_pos = _ret;
+			return m_pos;
+		}
+
+		// 在已预读的范围内
+		if(m_active && (! m_blocks.empty()) &&
+		   (_target >= m_pos) &&
+		   (_target < m_blocks.back().m_offset +
+		    offset_t(m_blocks.back().m_data.size())))
+		{
+			while(_target >= m_blocks.front().m_offset +
+			      offset_t(m_blocks.front().m_data.size()))
+			{
+				m_blocks.pop_front();
+			}
+			m_pos = _target;
+			++ m_stats.m_hits;
+			m_cond.notify_all();
+			return m_pos;
+		}
+		if(_target == m_pos)
+			return m_pos;
+
+		stop_prefetch(_lock);
+		const offset_t _ret = detail::seek_file(m_file, _target, ST_SEEK_SET);
+		if(_ret != BAD_OFFSET)
+		{
+			m_pos = _ret;
+		}
+		return _ret;
+	}
+
+	// 访问方式提示，同时转给文件本身：
+	// AT_SEQUENTIAL立即以最大的块数开始预读；AT_WILLNEED立即开始预读；
+	// AT_RANDOM停止预读，之后不再检测顺序读；AT_NORMAL恢复检测；
+	// AT_DONTNEED丢弃已预读的块，并让文件丢弃已读过的部分
+	bool advise(advice_t p_advice) {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		offset_t _offset = 0;
+		offset_t _length = 0;
+		switch(p_advice)
+		{
+		case AT_SEQUENTIAL:
+			m_random = false;
+			m_window = m_max_window;
+			start_prefetch();
+			break;
+		case AT_WILLNEED:
+			m_random = false;
+			start_prefetch();
+			_offset = m_pos;
+			_length = offset_t(m_window * m_block_size);
+			break;
+		case AT_RANDOM:
+			m_random = true;
+			stop_prefetch(_lock);
+			break;
+		case AT_DONTNEED:
+			stop_prefetch(_lock);
+			_length = m_pos;
+			if(_length == 0)
+				return true;
+			break;
+		default:
+			m_random = false;
+			break;
+		}
+		_lock.unlock();
+		return detail::advise_file(m_file, _offset, _length, p_advice);
+	}
+
+	offset_t tell() const {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		return m_pos;
+	}
+
+	stats get_stats() const {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		stats _stats = m_stats;
+		_stats.m_window = m_window;
+		return _stats;
+	}
+
+private:
+	struct block
+	{
+		offset_t m_offset;
+		std::vector<char> m_data;
+	};
+
+	static offset_t seek_file_cur(file_t p_file) {
+		const offset_t _pos = detail::seek_file(p_file, 0, ST_SEEK_CUR);
+		return (_pos == BAD_OFFSET) ? 0 : _pos;
+	}
+
+	void start_prefetch() {
+		if(m_active)
+			return;
+		m_active = true;
+		m_eof = false;
+		m_errno = 0;
+		m_fetch_pos = m_pos;
+		m_cond.notify_all();
+	}
+
+	// 停止预读，等待正在进行的读完成，并把文件指针移回m_pos
+	void stop_prefetch(boost::mutex::scoped_lock &p_lock) {
+		m_sequential = 0;
+		if(! m_active)
+			return;
+		m_active = false;
+		++ m_generation;
+		while(m_fetching)
+		{
+			m_cond.wait(p_lock);
+		}
+		m_stats.m_discarded += m_blocks.size();
+		m_blocks.clear();
+		detail::seek_file(m_file, m_pos, ST_SEEK_SET);
+	}
+
+	void run() {
+		boost::mutex::scoped_lock _lock(m_mutex);
+		for(;;)
+		{
+			while((! m_stop) &&
+			      ! (m_active && (! m_eof) && (m_errno == 0) &&
+				 (m_blocks.size() < m_window)))
+			{
+				m_cond.wait(_lock);
+			}
+			if(m_stop)
+				return;
+
+			const std::size_t _generation = m_generation;
+			const offset_t _offset = m_fetch_pos;
+			m_fetching = true;
+			_lock.unlock();
+
+			block _block;
+			_block.m_offset = _offset;
+			_block.m_data.resize(m_block_size);
+			const ssize_t _ret = detail::readn_block(m_file,
+								 &_block.m_data[0],
+								 m_block_size);
+			const int _errno = get_errno();
+
+			_lock.lock();
+			m_fetching = false;
+			m_cond.notify_all();
+			if(_generation != m_generation)
+				continue; // 已经seek到别处了
+
+			if(_ret < 0)
+			{
+				m_errno = (_errno == 0) ? EIO : _errno;
+				continue;
+			}
+			if(size_t(_ret) < m_block_size)
+			{
+				m_eof = true;
+			}
+			if(_ret > 0)
+			{
+				_block.m_data.resize(_ret);
+				m_blocks.push_back(block());
+				m_blocks.back().m_offset = _block.m_offset;
+				m_blocks.back().m_data.swap(_block.m_data);
+				m_fetch_pos += _ret;
+				++ m_stats.m_prefetched;
+			}
+		}
+	}
+
+	const file_t m_file;
+	const size_t m_block_size;
+	const size_t m_max_window;
+	size_t m_window;
+	offset_t m_pos;			// 调用者看到的文件指针
+	offset_t m_fetch_pos;		// 下一块预读的位置
+	size_t m_sequential;		// 连续的顺序读次数
+	size_t m_continuous_hits;
+	std::size_t m_generation;	// 每次停止预读时加一
+	int m_errno;
+	bool m_random;			// advise(AT_RANDOM)之后不检测顺序读
+	bool m_active;
+	bool m_fetching;
+	bool m_eof;
+	bool m_stop;
+	std::deque<block> m_blocks;
+	stats m_stats;
+	mutable boost::mutex m_mutex;
+	boost::condition_variable m_cond;
+	boost::thread m_thread;
+};
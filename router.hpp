@@ -0,0 +1,661 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _ROUTER_HPP_
+#define _ROUTER_HPP_
+
+//
+// 按路径前缀把操作分发到不同的文件系统，比如/local/...到localfs，
+// /gfs/...到gfs，同一个进程可以同时使用多个文件系统。
+//
+// 文件系统在编译期通过模板参数绑定（各命名空间中的backend，见
+// backend.ipp），分发只是一次switch，没有虚函数调用。file_t带有
+// 所属文件系统的编号，read, write, close等不需要再查挂载表；
+// 按最长前缀查找挂载表时不分配内存。
+//
+// 用法：
+//   typedef fsutil::router<localfs::backend, gfs::backend> router_type;
+//   router_type _router;
+//   _router.mount<localfs::backend>("/local", "/data");
+//   _router.mount<gfs::backend>("/gfs", "/");
+//   router_type::file_t _file = _router.open("/gfs/a/b", O_RDONLY);
+//
+// mount需要在其它线程使用router之前完成。
+//
+
+#include <string>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>		// for iovec
+
+#include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_same.hpp>
+
+namespace fsutil
+{
+
+// router的file_status, file_info，与具体的文件系统无关
+struct route_status
+{
+        uint64_t m_size;
+        bool m_is_dir;
+        time_t m_mtime;		// 0表示文件系统不提供修改时间
+};
+
+inline
+uint64_t get_size(const route_status &p_status) {
+        return p_status.m_size;
+}
+
+inline
+time_t get_mtime(const route_status &p_status) {
+        return p_status.m_mtime;
+}
+
+inline
+bool is_directory(const route_status &p_status) {
+        return p_status.m_is_dir;
+}
+
+inline
+bool is_regular(const route_status &p_status) {
+        return ! p_status.m_is_dir;
+}
+
+struct route_info
+{
+        std::string m_name; // 文件名称，不包含路径
+        bool m_is_dir;
+};
+
+inline
+const char *get_name(const route_info &p_info) {
+        return p_info.m_name.c_str();
+}
+
+inline
+bool is_directory(const route_info &p_info) {
+        return p_info.m_is_dir;
+}
+
+inline
+bool is_regular(const route_info &p_info) {
+        return ! p_info.m_is_dir;
+}
+
+// 不足四个文件系统时占位，不能被mount
+struct no_backend
+{
+        typedef int file_type;
+        struct status_type {};
+        struct info_type {};
+
+        static file_type bad_file() { return -1; }
+        static int get_errno() { return ENOSYS; }
+        static file_type open(const char *, int) { return -1; }
+        static file_type open(const char *, int, std::size_t) { return -1; }
+        static file_type create(const char *) { return -1; }
+        static file_type create(const char *, std::size_t) { return -1; }
+        static bool close(file_type) { return false; }
+        static int64_t read(file_type, void *, uint64_t) { return -1; }
+        static int64_t readv(file_type, const struct ::iovec *, uint64_t) { return -1; }
+        static int64_t write(file_type, const void *, uint64_t) { return -1; }
+        static int64_t writev(file_type, const struct ::iovec *, uint64_t) { return -1; }
+        static int64_t append(file_type, const void *, uint64_t) { return -1; }
+        static int64_t seek(file_type, int64_t, int) { return -1; }
+        static int64_t pread(file_type, void *, uint64_t, int64_t) { return -1; }
+        static int64_t pwrite(file_type, const void *, uint64_t, int64_t) { return -1; }
+        static int64_t readn(file_type, void *, uint64_t) { return -1; }
+        static int64_t writen(file_type, const void *, uint64_t) { return -1; }
+        static int64_t preadn(file_type, void *, uint64_t, int64_t) { return -1; }
+        static int64_t pwriten(file_type, const void *, uint64_t, int64_t) { return -1; }
+        static bool advise(file_type, int64_t, int64_t, int) { return false; }
+        static bool preallocate(file_type, int64_t) { return false; }
+        static bool sync(file_type) { return false; }
+        static bool datasync(file_type) { return false; }
+        static bool sync_directory(const char *) { return false; }
+        static bool remove(const char *) { return false; }
+        static bool rename(const char *, const char *) { return false; }
+        static bool exists(const char *) { return false; }
+        static bool stat(status_type &, const char *) { return false; }
+        static bool mkdir(const char *) { return false; }
+        template<typename FileInfoContainer>
+        static bool list_files(FileInfoContainer &, const char *) { return false; }
+        static uint64_t status_size(const status_type &) { return 0; }
+        static time_t status_mtime(const status_type &) { return 0; }
+        static bool status_is_directory(const status_type &) { return false; }
+        static std::string info_name(const info_type &) { return std::string(); }
+        static bool info_is_directory(const info_type &) { return false; }
+};
+
+namespace detail
+{
+
+// list_files时把文件系统的file_info转换为route_info
+template<typename Backend, typename FileInfoContainer>
+struct route_info_inserter
+{
+        FileInfoContainer &m_infos;
+
+        void push_back(const typename Backend::info_type &p_info) {
+                route_info _info;
+                _info.m_name = Backend::info_name(p_info);
+                _info.m_is_dir = Backend::info_is_directory(p_info);
+                m_infos.push_back(_info);
+        }
+};
+
+} // namespace detail
+
+// 按file_t或路径所属的文件系统执行p_statement，其中B为该文件系统
+#define FS_ROUTER_DISPATCH(index, statement)				\
+        switch(index)							\
+        {								\
+        case 0: { typedef B0 B; statement; }				\
+        case 1: { typedef B1 B; statement; }				\
+        case 2: { typedef B2 B; statement; }				\
+        default: { typedef B3 B; statement; }				\
+        }
+
+template<typename B0,
+         typename B1 = no_backend,
+         typename B2 = no_backend,
+         typename B3 = no_backend>
+class router : boost::noncopyable
+{
+public:
+        enum {
+                MAX_MOUNTS = 32
+        };
+
+        typedef route_status file_status;
+        typedef route_info file_info;
+
+        // 带文件系统编号的文件句柄，默认构造的为无效句柄
+        class file_t
+        {
+        public:
+                file_t()
+                        : m_backend(-1),
+                          m_handle(0) {}
+
+                bool is_bad() const {
+                        return m_backend < 0;
+                }
+
+                // 所属文件系统在模板参数中的位置
+                int backend() const {
+                        return m_backend;
+                }
+
+        private:
+                friend class router;
+
+                int m_backend;
+                uint64_t m_handle;	// 各文件系统的file_t，都是整数或指针
+        };
+
+        static file_t bad_file() {
+                return file_t();
+        }
+
+        // 模板参数中文件系统的位置，不存在时为-1
+        template<typename Backend>
+        struct index_of
+        {
+                enum {
+                        value = boost::is_same<Backend, B0>::value ? 0 :
+                                boost::is_same<Backend, B1>::value ? 1 :
+                                boost::is_same<Backend, B2>::value ? 2 :
+                                boost::is_same<Backend, B3>::value ? 3 : -1
+                };
+        };
+
+        router()
+                : m_mount_count(0) {}
+
+        // 把p_prefix下的路径映射到Backend中p_target下的相应路径；
+        // 查找时使用最长的匹配前缀
+        template<typename Backend>
+        bool mount(const char *p_prefix,
+                   const char *p_target = "/") {
+                BOOST_STATIC_ASSERT(index_of<Backend>::value >= 0);
+                return mount(p_prefix, index_of<Backend>::value, p_target);
+        }
+
+        bool mount(const char *p_prefix,
+                   int p_backend,
+                   const char *p_target = "/") {
+                if(p_backend < 0 || p_backend > 3 || m_mount_count == MAX_MOUNTS ||
+                   backend_is_empty(p_backend))
+                {
+                        errno = EINVAL;
+                        return false;
+                }
+                mount_point _mount;
+                _mount.m_prefix = p_prefix;
+                while(_mount.m_prefix.size() > 1 &&
+                      _mount.m_prefix[_mount.m_prefix.size() - 1] == '/')
+                {
+                        _mount.m_prefix.resize(_mount.m_prefix.size() - 1);
+                }
+                _mount.m_target = p_target;
+                _mount.m_backend = p_backend;
+
+                // 按前缀长度从长到短排列，相同前缀的替换
+                std::size_t i = 0;
+                for(; i < m_mount_count; ++i)
+                {
+                        if(m_mounts[i].m_prefix == _mount.m_prefix)
+                        {
+                                m_mounts[i] = _mount;
+                                return true;
+                        }
+                        if(m_mounts[i].m_prefix.size() < _mount.m_prefix.size())
+                                break;
+                }
+                for(std::size_t j = m_mount_count; j > i; --j)
+                {
+                        m_mounts[j] = m_mounts[j - 1];
+                }
+                m_mounts[i] = _mount;
+                ++ m_mount_count;
+                return true;
+        }
+
+        // 最近一次操作的错误码，来自执行该操作的文件系统
+        int get_errno() const {
+                const int _backend = last_backend();
+                if(_backend < 0)
+                        return errno;
+                FS_ROUTER_DISPATCH(_backend, return B::get_errno());
+        }
+
+        file_t open(const char *p_path,
+                    int p_mode = O_RDONLY) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return file_t();
+                FS_ROUTER_DISPATCH(_backend, return wrap<B>(_backend, B::open(_path, p_mode)));
+        }
+
+        file_t open(const char *p_path,
+                    int p_mode,
+                    std::size_t p_replica_number) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return file_t();
+                FS_ROUTER_DISPATCH(_backend, return wrap<B>(_backend, B::open(_path, p_mode, p_replica_number)));
+        }
+
+        file_t create(const char *p_path) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return file_t();
+                FS_ROUTER_DISPATCH(_backend, return wrap<B>(_backend, B::create(_path)));
+        }
+
+        file_t create(const char *p_path,
+                      std::size_t p_replica_number) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return file_t();
+                FS_ROUTER_DISPATCH(_backend, return wrap<B>(_backend, B::create(_path, p_replica_number)));
+        }
+
+        bool close(file_t p_file) {
+                if(! check(p_file))
+                        return false;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::close(handle<B>(p_file)));
+        }
+
+        int64_t read(file_t p_file,
+                     void *p_buffer,
+                     uint64_t p_count) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::read(handle<B>(p_file), p_buffer, p_count));
+        }
+
+        int64_t readv(file_t p_file,
+                      const struct ::iovec *p_iov,
+                      uint64_t p_count) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::readv(handle<B>(p_file), p_iov, p_count));
+        }
+
+        int64_t write(file_t p_file,
+                      const void *p_buffer,
+                      uint64_t p_count) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::write(handle<B>(p_file), p_buffer, p_count));
+        }
+
+        int64_t writev(file_t p_file,
+                       const struct ::iovec *p_iov,
+                       uint64_t p_count) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::writev(handle<B>(p_file), p_iov, p_count));
+        }
+
+        int64_t append(file_t p_file,
+                       const void *p_buffer,
+                       uint64_t p_count) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::append(handle<B>(p_file), p_buffer, p_count));
+        }
+
+        int64_t seek(file_t p_file,
+                     int64_t p_offset,
+                     int p_whence) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::seek(handle<B>(p_file), p_offset, p_whence));
+        }
+
+        int64_t pread(file_t p_file,
+                      void *p_buffer,
+                      uint64_t p_count,
+                      int64_t p_offset) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::pread(handle<B>(p_file), p_buffer, p_count, p_offset));
+        }
+
+        int64_t pwrite(file_t p_file,
+                       const void *p_buffer,
+                       uint64_t p_count,
+                       int64_t p_offset) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::pwrite(handle<B>(p_file), p_buffer, p_count, p_offset));
+        }
+
+        int64_t readn(file_t p_file,
+                      void *p_buffer,
+                      uint64_t p_count) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::readn(handle<B>(p_file), p_buffer, p_count));
+        }
+
+        int64_t writen(file_t p_file,
+                       const void *p_buffer,
+                       uint64_t p_count) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::writen(handle<B>(p_file), p_buffer, p_count));
+        }
+
+        int64_t preadn(file_t p_file,
+                       void *p_buffer,
+                       uint64_t p_count,
+                       int64_t p_offset) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::preadn(handle<B>(p_file), p_buffer, p_count, p_offset));
+        }
+
+        int64_t pwriten(file_t p_file,
+                        const void *p_buffer,
+                        uint64_t p_count,
+                        int64_t p_offset) {
+                if(! check(p_file))
+                        return -1;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::pwriten(handle<B>(p_file), p_buffer, p_count, p_offset));
+        }
+
+        // p_advice取值同POSIX_FADV_*
+        bool advise(file_t p_file,
+                    int64_t p_offset,
+                    int64_t p_length,
+                    int p_advice) {
+                if(! check(p_file))
+                        return false;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::advise(handle<B>(p_file), p_offset, p_length, p_advice));
+        }
+
+        bool preallocate(file_t p_file,
+                         int64_t p_length) {
+                if(! check(p_file))
+                        return false;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::preallocate(handle<B>(p_file), p_length));
+        }
+
+        bool sync(file_t p_file) {
+                if(! check(p_file))
+                        return false;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::sync(handle<B>(p_file)));
+        }
+
+        bool datasync(file_t p_file) {
+                if(! check(p_file))
+                        return false;
+                FS_ROUTER_DISPATCH(p_file.m_backend, return B::datasync(handle<B>(p_file)));
+        }
+
+        bool sync_directory(const char *p_path) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return false;
+                FS_ROUTER_DISPATCH(_backend, return B::sync_directory(_path));
+        }
+
+        bool remove(const char *p_path) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return false;
+                FS_ROUTER_DISPATCH(_backend, return B::remove(_path));
+        }
+
+        // 不能跨文件系统rename，此时errno为EXDEV
+        bool rename(const char *p_old_path,
+                    const char *p_new_path) {
+                char _old_path[PATH_MAX];
+                char _new_path[PATH_MAX];
+                const int _backend = resolve(p_old_path, _old_path);
+                if(_backend < 0)
+                        return false;
+                const int _new_backend = resolve(p_new_path, _new_path);
+                if(_new_backend < 0)
+                        return false;
+                if(_new_backend != _backend)
+                {
+                        set_router_errno(EXDEV);
+                        return false;
+                }
+                FS_ROUTER_DISPATCH(_backend, return B::rename(_old_path, _new_path));
+        }
+
+        bool exists(const char *p_path) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return false;
+                FS_ROUTER_DISPATCH(_backend, return B::exists(_path));
+        }
+
+        bool stat(file_status &p_status,
+                  const char *p_path) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return false;
+                FS_ROUTER_DISPATCH(_backend, return stat_as<B>(p_status, _path));
+        }
+
+        bool mkdir(const char *p_path) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return false;
+                FS_ROUTER_DISPATCH(_backend, return B::mkdir(_path));
+        }
+
+        bool is_regular(const char *p_path) {
+                file_status _status;
+                return stat(_status, p_path) &&
+                        ! _status.m_is_dir;
+        }
+
+        bool is_directory(const char *p_path) {
+                file_status _status;
+                return stat(_status, p_path) &&
+                        _status.m_is_dir;
+        }
+
+        // FileInfoContainer - router::file_info container,
+        //                     and has push_back() method
+        template<typename FileInfoContainer>
+        bool list_files(FileInfoContainer &p_infos,
+                        const char *p_path) {
+                char _path[PATH_MAX];
+                const int _backend = resolve(p_path, _path);
+                if(_backend < 0)
+                        return false;
+                FS_ROUTER_DISPATCH(_backend, return list_files_as<B>(p_infos, _path));
+        }
+
+private:
+        BOOST_STATIC_ASSERT(sizeof(typename B0::file_type) <= sizeof(uint64_t));
+        BOOST_STATIC_ASSERT(sizeof(typename B1::file_type) <= sizeof(uint64_t));
+        BOOST_STATIC_ASSERT(sizeof(typename B2::file_type) <= sizeof(uint64_t));
+        BOOST_STATIC_ASSERT(sizeof(typename B3::file_type) <= sizeof(uint64_t));
+
+        struct mount_point
+        {
+                std::string m_prefix;	// 不以'/'结尾，除非就是"/"
+                std::string m_target;
+                int m_backend;
+        };
+
+        static bool backend_is_empty(int p_backend) {
+                FS_ROUTER_DISPATCH(p_backend, return (boost::is_same<B, no_backend>::value));
+        }
+
+        static int &last_backend() {
+                static __thread int _backend = -1;
+                return _backend;
+        }
+
+        static void set_router_errno(int p_errno) {
+                last_backend() = -1;
+                errno = p_errno;
+        }
+
+        static bool check(const file_t &p_file) {
+                if(p_file.m_backend < 0)
+                {
+                        set_router_errno(EBADF);
+                        return false;
+                }
+                last_backend() = p_file.m_backend;
+                return true;
+        }
+
+        template<typename Backend>
+        static typename Backend::file_type handle(const file_t &p_file) {
+                typename Backend::file_type _handle;
+                std::memcpy(&_handle, &p_file.m_handle, sizeof(_handle));
+                return _handle;
+        }
+
+        template<typename Backend>
+        static file_t wrap(int p_backend,
+                           typename Backend::file_type p_handle) {
+                file_t _file;
+                if(p_handle != Backend::bad_file())
+                {
+                        _file.m_backend = p_backend;
+                        std::memcpy(&_file.m_handle, &p_handle, sizeof(p_handle));
+                }
+                return _file;
+        }
+
+        template<typename Backend>
+        static bool stat_as(file_status &p_status,
+                            const char *p_path) {
+                typename Backend::status_type _status;
+                if(! Backend::stat(_status, p_path))
+                        return false;
+                p_status.m_size = Backend::status_size(_status);
+                p_status.m_is_dir = Backend::status_is_directory(_status);
+                p_status.m_mtime = Backend::status_mtime(_status);
+                return true;
+        }
+
+        template<typename Backend, typename FileInfoContainer>
+        static bool list_files_as(FileInfoContainer &p_infos,
+                                  const char *p_path) {
+                detail::route_info_inserter<Backend, FileInfoContainer> _inserter = {p_infos};
+                return Backend::list_files(_inserter, p_path);
+        }
+
+        // 查找最长匹配的前缀，把路径转换为文件系统中的路径写到p_buffer中
+        int resolve(const char *p_path,
+                    char (&p_buffer)[PATH_MAX]) const {
+                const std::size_t _length = std::strlen(p_path);
+                for(std::size_t i = 0; i < m_mount_count; ++i)
+                {
+                        const mount_point &_mount = m_mounts[i];
+                        const std::size_t _prefix_length = _mount.m_prefix.size();
+                        if(_length < _prefix_length ||
+                           std::memcmp(p_path, _mount.m_prefix.data(), _prefix_length) != 0)
+                                continue;
+                        const bool _is_root = (_prefix_length == 1 && _mount.m_prefix[0] == '/');
+                        if(! _is_root &&
+                           p_path[_prefix_length] != '\0' &&
+                           p_path[_prefix_length] != '/')
+                                continue;
+
+                        // p_path中剩下的部分为空或以'/'开头
+                        const char *_rest = p_path + (_is_root ? 0 : _prefix_length);
+                        const std::size_t _rest_length = _length - (_rest - p_path);
+                        std::size_t _target_length = _mount.m_target.size();
+                        if(_target_length > 0 && _rest_length > 0 &&
+                           _mount.m_target[_target_length - 1] == '/')
+                                -- _target_length;
+                        if(_target_length + _rest_length + 1 > PATH_MAX)
+                        {
+                                set_router_errno(ENAMETOOLONG);
+                                return -1;
+                        }
+                        std::memcpy(p_buffer, _mount.m_target.data(), _target_length);
+                        std::memcpy(p_buffer + _target_length, _rest, _rest_length);
+                        p_buffer[_target_length + _rest_length] = '\0';
+                        if(_target_length + _rest_length == 0)
+                        {
+                                p_buffer[0] = '/';
+                                p_buffer[1] = '\0';
+                        }
+                        last_backend() = _mount.m_backend;
+                        return _mount.m_backend;
+                }
+                set_router_errno(ENOENT);
+                return -1;
+        }
+
+        mount_point m_mounts[MAX_MOUNTS];
+        std::size_t m_mount_count;
+};
+
+#undef FS_ROUTER_DISPATCH
+
+} // namespace fsutil
+
+#endif	// _ROUTER_HPP_
@@ -0,0 +1,130 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _THREAD_POOL_HPP_
+#define _THREAD_POOL_HPP_
+
+#include <deque>
+
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace fsutil
+{
+
+// 固定线程数的简单线程池，供各文件系统的并行操作共用。
+// 任务不能抛出异常。
+class thread_pool : boost::noncopyable
+{
+public:
+        typedef boost::function<void()> task_type;
+
+        // p_max_queue为0表示任务队列不限长度
+        explicit thread_pool(std::size_t p_threads,
+                             std::size_t p_max_queue = 0)
+                : m_max_queue(p_max_queue),
+                  m_busy(0),
+                  m_stop(false) {
+                if(p_threads == 0)
+                        p_threads = 1;
+                for(std::size_t i = 0; i < p_threads; ++i)
+                {
+                        m_threads.create_thread(boost::bind(&thread_pool::run, this));
+                }
+        }
+
+        // 执行完队列中剩余的任务后再退出
+        ~thread_pool() {
+                {
+                        boost::mutex::scoped_lock _lock(m_mutex);
+                        m_stop = true;
+                }
+                m_task_cond.notify_all();
+                m_threads.join_all();
+        }
+
+        std::size_t size() const {
+                return m_threads.size();
+        }
+
+        // 投递任务，队列满时阻塞等待
+        void post(const task_type &p_task) {
+                boost::mutex::scoped_lock _lock(m_mutex);
+                while(full())
+                {
+                        m_space_cond.wait(_lock);
+                }
+                m_tasks.push_back(p_task);
+                m_task_cond.notify_one();
+        }
+
+        // 队列满时返回false，由调用者自己执行该任务
+        bool try_post(const task_type &p_task) {
+                boost::mutex::scoped_lock _lock(m_mutex);
+                if(full())
+                        return false;
+                m_tasks.push_back(p_task);
+                m_task_cond.notify_one();
+                return true;
+        }
+
+        // 等待已投递的任务（包括任务中再投递的任务）全部执行完毕
+        void wait() {
+                boost::mutex::scoped_lock _lock(m_mutex);
+                while((! m_tasks.empty()) || (m_busy != 0))
+                {
+                        m_idle_cond.wait(_lock);
+                }
+        }
+
+private:
+        bool full() const {
+                return (m_max_queue != 0) && (m_tasks.size() >= m_max_queue);
+        }
+
+        void run() {
+                for(;;)
+                {
+                        task_type _task;
+                        {
+                                boost::mutex::scoped_lock _lock(m_mutex);
+                                while((! m_stop) && m_tasks.empty())
+                                {
+                                        m_task_cond.wait(_lock);
+                                }
+                                if(m_tasks.empty())
+                                        return; // stopped
+                                _task.swap(m_tasks.front());
+                                m_tasks.pop_front();
+                                ++ m_busy;
+                                m_space_cond.notify_one();
+                        }
+
+                        _task();
+
+                        {
+                                boost::mutex::scoped_lock _lock(m_mutex);
+                                -- m_busy;
+                                if((m_busy == 0) && m_tasks.empty())
+                                        m_idle_cond.notify_all();
+                        }
+                }
+        }
+
+        const std::size_t m_max_queue;
+        std::size_t m_busy;
+        bool m_stop;
+        std::deque<task_type> m_tasks;
+        boost::mutex m_mutex;
+        boost::condition_variable m_task_cond;
+        boost::condition_variable m_space_cond;
+        boost::condition_variable m_idle_cond;
+        boost::thread_group m_threads;
+};
+
+} // namespace fsutil
+
+#endif	// _THREAD_POOL_HPP_
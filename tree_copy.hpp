@@ -0,0 +1,480 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _TREE_COPY_HPP_
+#define _TREE_COPY_HPP_
+
+//
+// 在两个文件系统之间并行复制目录树，比如localfs和gfs之间：
+//
+//   fsutil::tree_copier<localfs::backend, gfs::backend> _copier;
+//   if(! _copier.copy("/data/input", "/gfs/input")) ...
+//
+// 同时复制m_threads个文件，每个文件由读线程读入缓冲区队列，写线程
+// 从队列中取出写入目标文件，读写同时进行。每个文件最多使用
+// m_queue_depth个m_block_size大小的缓冲区，所以总的内存不超过
+// m_threads * m_queue_depth * m_block_size。
+//
+// 增量模式下跳过目标中长度相同、修改时间不早于源文件的文件；
+// 文件系统不提供修改时间时（比如gfs）只比较长度。
+//
+// 不另外重试：gfs的每个操作已经按retry_policy重试过，仍然失败的
+// 文件记录在failures()中，其它文件继续复制。
+//
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "thread_pool.hpp"
+#include "buffer_pool.hpp"
+#include "metrics.hpp"
+
+namespace fsutil
+{
+
+struct copy_options
+{
+        copy_options()
+                : m_threads(8),
+                  m_block_size(1024 * 1024),
+                  m_queue_depth(4),
+                  m_incremental(false),
+                  m_report_interval_ms(1000) {}
+
+        std::size_t m_threads;		// 同时复制的文件数
+        std::size_t m_block_size;	// 每次读写的大小
+        std::size_t m_queue_depth;	// 每个文件读写之间的缓冲区个数
+        bool m_incremental;		// 跳过长度、修改时间相同的文件
+        uint64_t m_report_interval_ms;	// 调用report的最小间隔
+};
+
+struct copy_stats
+{
+        copy_stats()
+                : m_files(0),
+                  m_skipped(0),
+                  m_failed(0),
+                  m_directories(0),
+                  m_bytes(0),
+                  m_elapsed_us(0) {}
+
+        double mb_per_sec() const {
+                return (m_elapsed_us == 0) ? 0.0 :
+                        double(m_bytes) / (1024.0 * 1024.0) / (double(m_elapsed_us) / 1e6);
+        }
+
+        double files_per_sec() const {
+                return (m_elapsed_us == 0) ? 0.0 :
+                        double(m_files) / (double(m_elapsed_us) / 1e6);
+        }
+
+        uint64_t m_files;		// 复制成功的文件
+        uint64_t m_skipped;		// 增量模式下跳过的文件
+        uint64_t m_failed;		// 复制失败的文件和目录
+        uint64_t m_directories;		// 创建或已经存在的目录
+        uint64_t m_bytes;		// 已经写入目标的字节数
+        uint64_t m_elapsed_us;
+};
+
+// 复制过程中定期调用，可能在不同的线程中调用，但不会同时调用
+typedef boost::function<void(const copy_stats &)> copy_report_type;
+
+// 失败的路径（源文件或目录）和错误码
+typedef std::vector<std::pair<std::string, int> > copy_failures;
+
+template<typename Source, typename Target>
+class tree_copier : boost::noncopyable
+{
+public:
+        explicit tree_copier(const copy_options &p_options = copy_options())
+                : m_options(p_options),
+                  m_readers(NULL),
+                  m_start_us(0),
+                  m_last_report_us(0) {
+                if(m_options.m_threads == 0)
+                        m_options.m_threads = 1;
+                if(m_options.m_block_size == 0)
+                        m_options.m_block_size = copy_options().m_block_size;
+                if(m_options.m_queue_depth == 0)
+                        m_options.m_queue_depth = 1;
+                reset();
+        }
+
+        void set_report(const copy_report_type &p_report) {
+                m_report = p_report;
+        }
+
+        // 把p_source（文件或目录）复制为p_target，目录递归复制，
+        // 目标中不存在的目录会被创建。全部成功（或跳过）时返回true。
+        // 同一个tree_copier不能同时执行多个copy
+        bool copy(const char *p_source,
+                  const char *p_target) {
+                reset();
+                m_start_us = monotonic_us();
+                m_last_report_us = m_start_us;
+                {
+                        thread_pool _writers(m_options.m_threads, m_options.m_threads);
+                        thread_pool _readers(m_options.m_threads);
+                        m_readers = &_readers;
+
+                        typename Source::status_type _status;
+                        if(! Source::stat(_status, p_source))
+                        {
+                                fail(p_source, Source::get_errno());
+                        }
+                        else if(Source::status_is_directory(_status))
+                        {
+                                copy_directory(_writers, p_source, p_target);
+                        }
+                        else
+                        {
+                                _writers.post(boost::bind(&tree_copier::copy_file, this,
+                                                          std::string(p_source),
+                                                          std::string(p_target)));
+                        }
+                        _writers.wait();
+                        m_readers = NULL;
+                }
+                report(true);
+                return m_failed == 0;
+        }
+
+        // 可以在其它线程中调用
+        copy_stats stats() const {
+                copy_stats _stats;
+                _stats.m_files = m_files;
+                _stats.m_skipped = m_skipped;
+                _stats.m_failed = m_failed;
+                _stats.m_directories = m_directories;
+                _stats.m_bytes = m_bytes;
+                const uint64_t _start_us = m_start_us;
+                _stats.m_elapsed_us = (_start_us == 0) ? 0 : monotonic_us() - _start_us;
+                return _stats;
+        }
+
+        // 最近一次copy中失败的路径
+        copy_failures failures() const {
+                boost::mutex::scoped_lock _lock(m_failures_mutex);
+                return m_failures;
+        }
+
+private:
+        struct block
+        {
+                pooled_buffer m_data;
+                std::size_t m_size;
+        };
+        typedef boost::shared_ptr<block> block_ptr;
+
+        // 一个文件的读写线程之间的缓冲区队列
+        struct pipe : boost::noncopyable
+        {
+                pipe()
+                        : m_blocks(0),
+                          m_read_done(false),
+                          m_failed(false),
+                          m_errno(0) {}
+
+                boost::mutex m_mutex;
+                boost::condition_variable m_cond;
+                std::deque<block_ptr> m_full;
+                std::deque<block_ptr> m_free;
+                std::size_t m_blocks;	// 已经分配的缓冲区个数
+                bool m_read_done;	// 读线程已经退出
+                bool m_failed;		// 读或写失败，另一方应该停止
+                int m_errno;
+        };
+        typedef boost::shared_ptr<pipe> pipe_ptr;
+
+        void reset() {
+                m_files = 0;
+                m_skipped = 0;
+                m_failed = 0;
+                m_directories = 0;
+                m_bytes = 0;
+                boost::mutex::scoped_lock _lock(m_failures_mutex);
+                m_failures.clear();
+        }
+
+        static std::string join_path(const std::string &p_dir,
+                                     const std::string &p_name) {
+                if(! p_dir.empty() && p_dir[p_dir.size() - 1] == '/')
+                        return p_dir + p_name;
+                return p_dir + "/" + p_name;
+        }
+
+        void fail(const std::string &p_path,
+                  int p_errno) {
+                ++ m_failed;
+                boost::mutex::scoped_lock _lock(m_failures_mutex);
+                m_failures.push_back(std::make_pair(p_path, p_errno));
+        }
+
+        // 在调用者的线程中遍历目录，文件交给写线程池，
+        // 线程池的队列满时等待，所以不会一次列出整个目录树
+        void copy_directory(thread_pool &p_writers,
+                            const std::string &p_source,
+                            const std::string &p_target) {
+                if(! Target::exists(p_target.c_str()) &&
+                   ! Target::mkdir(p_target.c_str()))
+                {
+                        fail(p_source, Target::get_errno());
+                        return;
+                }
+                ++ m_directories;
+
+                std::vector<typename Source::info_type> _infos;
+                if(! Source::list_files(_infos, p_source.c_str()))
+                {
+                        fail(p_source, Source::get_errno());
+                        return;
+                }
+                for(std::size_t i = 0; i < _infos.size(); ++i)
+                {
+                        const std::string _name = Source::info_name(_infos[i]);
+                        const std::string _source = join_path(p_source, _name);
+                        const std::string _target = join_path(p_target, _name);
+                        if(Source::info_is_directory(_infos[i]))
+                        {
+                                copy_directory(p_writers, _source, _target);
+                        }
+                        else
+                        {
+                                p_writers.post(boost::bind(&tree_copier::copy_file, this,
+                                                           _source, _target));
+                        }
+                }
+                report(false);
+        }
+
+        bool is_same_file(const std::string &p_source,
+                          const std::string &p_target) {
+                typename Source::status_type _source_status;
+                typename Target::status_type _target_status;
+                if(! Target::stat(_target_status, p_target.c_str()) ||
+                   ! Source::stat(_source_status, p_source.c_str()))
+                        return false;
+                if(Target::status_size(_target_status) != Source::status_size(_source_status))
+                        return false;
+                const time_t _source_mtime = Source::status_mtime(_source_status);
+                const time_t _target_mtime = Target::status_mtime(_target_status);
+                return _source_mtime == 0 || _target_mtime == 0 ||
+                        _target_mtime >= _source_mtime;
+        }
+
+        // 在写线程池中执行：读线程把源文件读入队列，本线程写目标文件
+        void copy_file(const std::string &p_source,
+                       const std::string &p_target) {
+                if(m_options.m_incremental && is_same_file(p_source, p_target))
+                {
+                        ++ m_skipped;
+                        report(false);
+                        return;
+                }
+
+                pipe_ptr _pipe = boost::make_shared<pipe>();
+                m_readers->post(boost::bind(&tree_copier::read_file, this,
+                                            _pipe, p_source));
+                int _errno = 0;
+                bool _ok = write_file(*_pipe, p_target, _errno);
+
+                // 等待读线程退出，之后才能释放缓冲区
+                {
+                        boost::mutex::scoped_lock _lock(_pipe->m_mutex);
+                        while(! _pipe->m_read_done)
+                        {
+                                _pipe->m_cond.wait(_lock);
+                        }
+                        if(_ok && _pipe->m_failed)
+                        {
+                                _ok = false;
+                                _errno = _pipe->m_errno;
+                        }
+                }
+
+                if(_ok)
+                {
+                        ++ m_files;
+                }
+                else
+                {
+                        Target::remove(p_target.c_str());
+                        fail(p_source, _errno);
+                }
+                report(false);
+        }
+
+        void read_file(pipe_ptr p_pipe,
+                       const std::string &p_source) {
+                pipe &_pipe = *p_pipe;
+                typename Source::file_type _file = Source::open(p_source.c_str(), O_RDONLY);
+                bool _ok = (_file != Source::bad_file());
+                int _errno = _ok ? 0 : Source::get_errno();
+                while(_ok)
+                {
+                        block_ptr _block;
+                        {
+                                boost::mutex::scoped_lock _lock(_pipe.m_mutex);
+                                while(_pipe.m_free.empty() && ! _pipe.m_failed &&
+                                      _pipe.m_blocks == m_options.m_queue_depth)
+                                {
+                                        _pipe.m_cond.wait(_lock);
+                                }
+                                if(_pipe.m_failed)
+                                        break;
+                                if(_pipe.m_free.empty())
+                                {
+                                        ++ _pipe.m_blocks;
+                                }
+                                else
+                                {
+                                        _block = _pipe.m_free.front();
+                                        _pipe.m_free.pop_front();
+                                }
+                        }
+                        if(! _block)
+                        {
+                                // 缓冲区来自buffer_pool，复制大量小文件时不会反复分配
+                                _block = boost::make_shared<block>();
+                                if(! buffer_pool::instance().allocate(_block->m_data,
+                                                                      m_options.m_block_size))
+                                {
+                                        _ok = false;
+                                        _errno = ENOMEM;
+                                        break;
+                                }
+                        }
+
+                        // readn只在读到文件末尾时返回0，读了一部分后出错时返回
+                        // 已经读到的长度，下一次再返回-1
+                        const ssize_t _ret = Source::readn(_file, _block->m_data.data(),
+                                                           _block->m_data.size());
+                        if(_ret < 0)
+                        {
+                                _ok = false;
+                                _errno = Source::get_errno();
+                                break;
+                        }
+                        if(_ret == 0)
+                                break;
+                        _block->m_size = _ret;
+                        boost::mutex::scoped_lock _lock(_pipe.m_mutex);
+                        _pipe.m_full.push_back(_block);
+                        _pipe.m_cond.notify_all();
+                }
+                if(_file != Source::bad_file())
+                        Source::close(_file);
+
+                boost::mutex::scoped_lock _lock(_pipe.m_mutex);
+                if(! _ok)
+                {
+                        _pipe.m_failed = true;
+                        _pipe.m_errno = _errno;
+                }
+                _pipe.m_read_done = true;
+                _pipe.m_cond.notify_all();
+        }
+
+        bool write_file(pipe &p_pipe,
+                        const std::string &p_target,
+                        int &p_errno) {
+                typename Target::file_type _file = Target::create(p_target.c_str());
+                bool _ok = (_file != Target::bad_file());
+                if(! _ok)
+                        p_errno = Target::get_errno();
+                while(_ok)
+                {
+                        block_ptr _block;
+                        {
+                                boost::mutex::scoped_lock _lock(p_pipe.m_mutex);
+                                while(p_pipe.m_full.empty() && ! p_pipe.m_read_done)
+                                {
+                                        p_pipe.m_cond.wait(_lock);
+                                }
+                                if(p_pipe.m_failed || p_pipe.m_full.empty())
+                                        break;
+                                _block = p_pipe.m_full.front();
+                                p_pipe.m_full.pop_front();
+                        }
+
+                        const ssize_t _ret = Target::writen(_file, _block->m_data.data(),
+                                                            _block->m_size);
+                        if(_ret != ssize_t(_block->m_size))
+                        {
+                                _ok = false;
+                                p_errno = Target::get_errno();
+                                break;
+                        }
+                        m_bytes += _block->m_size;
+
+                        boost::mutex::scoped_lock _lock(p_pipe.m_mutex);
+                        p_pipe.m_free.push_back(_block);
+                        p_pipe.m_cond.notify_all();
+                }
+                if(_file != Target::bad_file() &&
+                   ! Target::close(_file) && _ok)
+                {
+                        _ok = false;
+                        p_errno = Target::get_errno();
+                }
+                if(! _ok)
+                {
+                        boost::mutex::scoped_lock _lock(p_pipe.m_mutex);
+                        p_pipe.m_failed = true;
+                        p_pipe.m_cond.notify_all();
+                }
+                return _ok;
+        }
+
+        // p_force为false时最多每m_report_interval_ms调用一次
+        void report(bool p_force) {
+                if(! m_report)
+                        return;
+                boost::mutex::scoped_lock _lock(m_report_mutex, boost::try_to_lock);
+                if(! p_force && ! _lock.owns_lock())
+                        return;
+                if(! _lock.owns_lock())
+                        _lock.lock();
+                const uint64_t _now = monotonic_us();
+                if(! p_force &&
+                   _now - m_last_report_us < m_options.m_report_interval_ms * 1000)
+                        return;
+                m_last_report_us = _now;
+                m_report(stats());
+        }
+
+        copy_options m_options;
+        copy_report_type m_report;
+        thread_pool *m_readers;
+
+        boost::atomic<uint64_t> m_files;
+        boost::atomic<uint64_t> m_skipped;
+        boost::atomic<uint64_t> m_failed;
+        boost::atomic<uint64_t> m_directories;
+        boost::atomic<uint64_t> m_bytes;
+        boost::atomic<uint64_t> m_start_us;
+        uint64_t m_last_report_us;
+        boost::mutex m_report_mutex;
+
+        mutable boost::mutex m_failures_mutex;
+        copy_failures m_failures;
+};
+
+} // namespace fsutil
+
+#endif	// _TREE_COPY_HPP_
@@ -0,0 +1,359 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _WALK_HPP_
+#define _WALK_HPP_
+
+//
+// 递归遍历目录树，各文件系统的walk, disk_usage（见walk.ipp）共用。
+//
+// 每个线程有自己的目录队列，新发现的子目录放入自己队列的尾部并
+// 从尾部取出（深度优先，队列不会太长），自己的队列为空时从其它
+// 线程队列的头部窃取（通常是较大的子树），所以一个很大的子目录也
+// 会被分散到所有线程中。
+//
+// 列目录、取文件长度由Source完成：
+//   struct Source
+//   {
+//           // 取得p_path本身的信息，填写m_is_dir, m_size, m_mtime
+//           static bool stat_entry(const std::string &p_path,
+//                                  walk_entry &p_entry);
+//           // 列出目录p_dir下的各项，填写m_path, m_is_dir；p_stat时
+//           // 还要填写文件的m_size, m_mtime
+//           static bool list_entries(const std::string &p_dir,
+//                                    bool p_stat,
+//                                    std::vector<walk_entry> &p_children);
+//           // 取得、设置文件系统的错误码，不一定是errno（如gfs_errno）：
+//           // 上面两个函数失败后用get_errno取得原因，run()失败时用
+//           // set_errno返回第一个错误
+//           static int get_errno();
+//           static void set_errno(int p_errno);
+//   };
+//
+
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace fsutil
+{
+
+struct walk_entry
+{
+        walk_entry()
+                : m_depth(0),
+                  m_is_dir(false),
+                  m_size(0),
+                  m_mtime(0),
+                  m_thread(0) {}
+
+        std::string m_path;	// 包含p_root的完整路径
+        std::size_t m_depth;	// p_root为0，其下一层为1
+        bool m_is_dir;
+        uint64_t m_size;	// 目录或没有stat时为0
+        time_t m_mtime;		// 0表示未知
+        std::size_t m_thread;	// 调用visitor的线程，[0, m_threads)
+};
+
+// 可能在多个线程中同时调用；可以用m_thread按线程汇总结果，避免竞争
+typedef boost::function<void(const walk_entry &)> walk_visitor;
+
+// 返回true时跳过该项：不调用visitor，目录不再深入
+typedef boost::function<bool(const walk_entry &)> walk_prune;
+
+struct walk_options
+{
+        walk_options()
+                : m_threads(8),
+                  m_max_depth(0),
+                  m_stat(true) {}
+
+        std::size_t m_threads;
+        std::size_t m_max_depth;	// 0表示不限，否则只访问深度不超过它的项
+        bool m_stat;			// 取得文件长度、修改时间，disk_usage需要
+        walk_prune m_prune;
+};
+
+struct walk_usage
+{
+        walk_usage()
+                : m_files(0),
+                  m_directories(0),
+                  m_bytes(0) {}
+
+        uint64_t m_files;
+        uint64_t m_directories;	// 包括p_root本身
+        uint64_t m_bytes;	// 文件长度之和
+};
+
+inline
+std::string join_path(const std::string &p_dir,
+                      const std::string &p_name) {
+        if(! p_dir.empty() && p_dir[p_dir.size() - 1] == '/')
+                return p_dir + p_name;
+        return p_dir + "/" + p_name;
+}
+
+template<typename Source>
+class walker : boost::noncopyable
+{
+public:
+        explicit walker(const walk_options &p_options)
+                : m_options(p_options),
+                  m_threads(std::max<std::size_t>(p_options.m_threads, 1)),
+                  m_queues(new queue[m_threads]),
+                  m_pending(0),
+                  m_queued(0),
+                  m_sleeping(0),
+                  m_errno(0) {
+        }
+
+        // 出错的目录被跳过，继续遍历其它目录；有错误时返回false，
+        // Source::get_errno()为第一个错误
+        bool run(const std::string &p_root,
+                 const walk_visitor &p_visitor) {
+                m_visitor = &p_visitor;
+                walk_entry _root;
+                _root.m_path = p_root;
+                if(! Source::stat_entry(p_root, _root))
+                        return false;
+                if(skip(_root))
+                        return true;
+                visit(_root);
+                if(! _root.m_is_dir)
+                        return true;
+
+                push(0, _root);
+                if(m_threads == 1)
+                {
+                        work(0);
+                }
+                else
+                {
+                        boost::thread_group _group;
+                        for(std::size_t i = 1; i < m_threads; ++i)
+                        {
+                                _group.create_thread(boost::bind(&walker::work, this, i));
+                        }
+                        work(0);
+                        _group.join_all();
+                }
+
+                if(m_errno.load() != 0)
+                {
+                        Source::set_errno(m_errno.load());
+                        return false;
+                }
+                return true;
+        }
+
+        std::size_t threads() const {
+                return m_threads;
+        }
+
+private:
+        struct queue
+        {
+                boost::mutex m_mutex;
+                std::deque<walk_entry> m_dirs;
+                char m_padding[64];	// 避免与相邻队列共享缓存行
+        };
+
+        bool skip(const walk_entry &p_entry) const {
+                return m_options.m_prune && m_options.m_prune(p_entry);
+        }
+
+        void visit(const walk_entry &p_entry) const {
+                if(*m_visitor)
+                        (*m_visitor)(p_entry);
+        }
+
+        void failed(int p_errno) {
+                int _expected = 0;
+                m_errno.compare_exchange_strong(_expected, p_errno);
+        }
+
+        void push(std::size_t p_thread,
+                  const walk_entry &p_dir) {
+                ++ m_pending;
+                {
+                        queue &_queue = m_queues[p_thread];
+                        boost::mutex::scoped_lock _lock(_queue.m_mutex);
+                        // 在目录可以被pop之前增加，否则m_queued会先被减到-1
+                        ++ m_queued;
+                        _queue.m_dirs.push_back(p_dir);
+                }
+                if(m_sleeping.load() > 0)
+                {
+                        boost::mutex::scoped_lock _lock(m_mutex);
+                        m_cond.notify_one();
+                }
+        }
+
+        // 先从自己队列的尾部取，再从其它队列的头部窃取
+        bool pop(std::size_t p_thread,
+                 walk_entry &p_dir) {
+                {
+                        queue &_queue = m_queues[p_thread];
+                        boost::mutex::scoped_lock _lock(_queue.m_mutex);
+                        if(! _queue.m_dirs.empty())
+                        {
+                                p_dir.m_path.swap(_queue.m_dirs.back().m_path);
+                                p_dir.m_depth = _queue.m_dirs.back().m_depth;
+                                _queue.m_dirs.pop_back();
+                                -- m_queued;
+                                return true;
+                        }
+                }
+                for(std::size_t i = 1; i < m_threads; ++i)
+                {
+                        queue &_queue = m_queues[(p_thread + i) % m_threads];
+                        boost::mutex::scoped_lock _lock(_queue.m_mutex);
+                        if(! _queue.m_dirs.empty())
+                        {
+                                p_dir.m_path.swap(_queue.m_dirs.front().m_path);
+                                p_dir.m_depth = _queue.m_dirs.front().m_depth;
+                                _queue.m_dirs.pop_front();
+                                -- m_queued;
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        void work(std::size_t p_thread) {
+                walk_entry _dir;
+                std::vector<walk_entry> _children;
+                for(;;)
+                {
+                        if(! pop(p_thread, _dir))
+                        {
+                                // push先增加m_queued再检查m_sleeping，这里先增加
+                                // m_sleeping再检查m_queued，所以不会错过唤醒
+                                boost::mutex::scoped_lock _lock(m_mutex);
+                                ++ m_sleeping;
+                                while(m_queued.load() == 0 && m_pending.load() != 0)
+                                {
+                                        m_cond.wait(_lock);
+                                }
+                                -- m_sleeping;
+                                if(m_pending.load() == 0)
+                                        return;
+                                continue;
+                        }
+
+                        scan(p_thread, _dir, _children);
+
+                        if(m_pending.fetch_sub(1) == 1)
+                        {
+                                boost::mutex::scoped_lock _lock(m_mutex);
+                                m_cond.notify_all();
+                                return;
+                        }
+                }
+        }
+
+        void scan(std::size_t p_thread,
+                  const walk_entry &p_dir,
+                  std::vector<walk_entry> &p_children) {
+                p_children.clear();
+                if(! Source::list_entries(p_dir.m_path, m_options.m_stat, p_children))
+                {
+                        failed(Source::get_errno());
+                        return;
+                }
+                const std::size_t _depth = p_dir.m_depth + 1;
+                for(std::size_t i = 0; i < p_children.size(); ++i)
+                {
+                        walk_entry &_child = p_children[i];
+                        _child.m_depth = _depth;
+                        _child.m_thread = p_thread;
+                        if(skip(_child))
+                                continue;
+                        visit(_child);
+                        if(_child.m_is_dir &&
+                           (m_options.m_max_depth == 0 || _depth < m_options.m_max_depth))
+                        {
+                                push(p_thread, _child);
+                        }
+                }
+        }
+
+        const walk_options &m_options;
+        const walk_visitor *m_visitor;
+        const std::size_t m_threads;
+        boost::scoped_array<queue> m_queues;
+        boost::atomic<std::size_t> m_pending;	// 已发现但还没有扫描完的目录
+        boost::atomic<std::size_t> m_queued;	// 在队列中等待扫描的目录
+        boost::atomic<std::size_t> m_sleeping;
+        boost::atomic<int> m_errno;
+        boost::mutex m_mutex;
+        boost::condition_variable m_cond;
+};
+
+namespace detail
+{
+
+// 每个线程一个，各自占用不同的缓存行
+struct walk_usage_slot
+{
+        walk_usage m_usage;
+        char m_padding[64];
+};
+
+inline
+void count_usage(std::vector<walk_usage_slot> *p_slots,
+                 const walk_entry &p_entry) {
+        walk_usage &_usage = (*p_slots)[p_entry.m_thread].m_usage;
+        if(p_entry.m_is_dir)
+        {
+                ++ _usage.m_directories;
+        }
+        else
+        {
+                ++ _usage.m_files;
+                _usage.m_bytes += p_entry.m_size;
+        }
+}
+
+} // namespace detail
+
+// 统计p_root下的文件数、目录数和文件长度之和；p_options.m_stat总是为true
+template<typename Source>
+bool disk_usage(walk_usage &p_usage,
+                const std::string &p_root,
+                const walk_options &p_options) {
+        walk_options _options = p_options;
+        _options.m_stat = true;
+        walker<Source> _walker(_options);
+        std::vector<detail::walk_usage_slot> _slots(_walker.threads());
+        const walk_visitor _visitor = boost::bind(&detail::count_usage, &_slots,
+                                                  boost::placeholders::_1);
+        const bool _ret = _walker.run(p_root, _visitor);
+
+        p_usage = walk_usage();
+        for(std::size_t i = 0; i < _slots.size(); ++i)
+        {
+                p_usage.m_files += _slots[i].m_usage.m_files;
+                p_usage.m_directories += _slots[i].m_usage.m_directories;
+                p_usage.m_bytes += _slots[i].m_usage.m_bytes;
+        }
+        return _ret;
+}
+
+} // namespace fsutil
+
+#endif	// _WALK_HPP_
@@ -0,0 +1,101 @@
+// -*-mode:c++; coding:utf-8-*-
+
+#ifndef _FILESYSTEM_HPP_
+#error "walk.ipp can ONLY be included into fs.hpp"
+#endif
+
+namespace detail
+{
+
+// path_walk_source的同名成员会隐藏外层的get_errno, set_errno
+inline
+int walk_get_errno() {
+	return get_errno();
+}
+
+inline
+void walk_set_errno(int p_errno) {
+	set_errno(p_errno);
+}
+
+// 只用路径访问的文件系统：目录项的类型取自list_files，
+// 文件长度需要逐个stat
+struct path_walk_source
+{
+	static bool stat_entry(const std::string &p_path,
+			       fsutil::walk_entry &p_entry) {
+		file_status _status;
+		if(! stat(_status, p_path.c_str()))
+			return false;
+		p_entry.m_is_dir = is_directory(_status);
+		p_entry.m_size = p_entry.m_is_dir ? 0 : get_size(_status);
+		p_entry.m_mtime = get_mtime(_status);
+		return true;
+	}
+
+	static bool list_entries(const std::string &p_dir,
+				 bool p_stat,
+				 std::vector<fsutil::walk_entry> &p_children) {
+		std::vector<file_info> _infos;
+		if(! list_files(_infos, p_dir.c_str()))
+			return false;
+		p_children.reserve(_infos.size());
+		for(std::size_t i = 0; i < _infos.size(); ++i)
+		{
+			fsutil::walk_entry _entry;
+			_entry.m_path = fsutil::join_path(p_dir, get_name(_infos[i]));
+			_entry.m_is_dir = is_directory(_infos[i]);
+			// 列出之后被删除的文件跳过
+			if(p_stat && ! _entry.m_is_dir &&
+			   ! stat_entry(_entry.m_path, _entry))
+				continue;
+			p_children.push_back(_entry);
+		}
+		return true;
+	}
+
+	static int get_errno() {
+		return walk_get_errno();
+	}
+
+	static void set_errno(int p_errno) {
+		walk_set_errno(p_errno);
+	}
+};
+
+} // namespace detail
+
+// 递归遍历p_root，对p_root和其下的每一项调用p_visitor，
+// 多个线程同时遍历不同的子目录，p_visitor需要是线程安全的。
+// 无法列出的目录被跳过，此时返回false，get_errno()为第一个错误。
+// walk_source由各文件系统的头文件指定，见walk.hpp
+inline
+bool walk(const char *p_root,
+	  const fsutil::walk_visitor &p_visitor,
+	  const fsutil::walk_options &p_options = fsutil::walk_options()) {
+	fsutil::walker<detail::walk_source> _walker(p_options);
+	return _walker.run(p_root, p_visitor);
+}
+
+inline
+bool walk(const std::string &p_root,
+	  const fsutil::walk_visitor &p_visitor,
+	  const fsutil::walk_options &p_options = fsutil::walk_options()) {
+	return walk(p_root.c_str(), p_visitor, p_options);
+}
+
+// 统计p_root下的文件数、目录数和文件长度之和，各线程分别
+// 累加，最后再合并
+inline
+bool disk_usage(fsutil::walk_usage &p_usage,
+		const char *p_root,
+		const fsutil::walk_options &p_options = fsutil::walk_options()) {
+	return fsutil::disk_usage<detail::walk_source>(p_usage, p_root, p_options);
+}
+
+inline
+bool disk_usage(fsutil::walk_usage &p_usage,
+		const std::string &p_root,
+		const fsutil::walk_options &p_options = fsutil::walk_options()) {
+	return disk_usage(p_usage, p_root.c_str(), p_options);
+}
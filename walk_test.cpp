@@ -0,0 +1,160 @@
+// -*-mode:c++; coding:utf-8-*-
+
+//
+// walk, disk_usage的出错测试：列出某个子目录失败时，其它目录仍然
+// 被遍历，但walk, disk_usage必须返回false，get_errno()为该错误。
+// 失败由fault_source注入：清除errno后只设置文件系统自己的错误码，
+// 与gfs的list_files一样（只设置gfs_errno）。
+//
+// 编译：
+//   g++ -O2 -I. -I<gfs_client所在目录> walk_test.cpp -o walk_test
+//       -lboost_thread -lboost_filesystem -lboost_system -lpthread <gfs client库>
+//
+// 用法：
+//   walk_test <测试目录>
+// 依次测试localfs, gfs, memfs，全部通过时返回0。
+//
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <errno.h>
+
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+
+#include "fs.hpp"
+
+namespace
+{
+
+const int FAULT_ERRNO = 5;
+const std::size_t SUBDIRS = 8;
+const std::size_t FILES = 4;
+
+void count_entry(boost::atomic<std::size_t> *p_count,
+                 const fsutil::walk_entry &) {
+        ++ *p_count;
+}
+
+// 列出s_fail时失败，其它目录交给Base
+template<typename Base>
+struct fault_source : Base
+{
+        static std::string s_fail;
+
+        static bool list_entries(const std::string &p_dir,
+                                 bool p_stat,
+                                 std::vector<fsutil::walk_entry> &p_children) {
+                if(p_dir == s_fail)
+                {
+                        // 对gfs, errno保持为0；localfs, memfs的错误码就是errno
+                        errno = 0;
+                        Base::set_errno(FAULT_ERRNO);
+                        return false;
+                }
+                return Base::list_entries(p_dir, p_stat, p_children);
+        }
+};
+
+template<typename Base>
+std::string fault_source<Base>::s_fail;
+
+} // namespace
+
+#define WALK_TEST(ns)                                                           \
+        struct ns##_test                                                        \
+        {                                                                       \
+                typedef fault_source<ns::detail::walk_source> source;           \
+                                                                                \
+                static bool make_tree(const std::string &p_root) {              \
+                        if(! ns::create_directories(p_root))                    \
+                                return false;                                   \
+                        for(std::size_t i = 0; i < SUBDIRS; ++i)                \
+                        {                                                       \
+                                const std::string _dir = fsutil::join_path(     \
+                                        p_root, std::string(1, char('a' + i))); \
+                                if(! ns::create_directories(_dir))              \
+                                        return false;                           \
+                                for(std::size_t j = 0; j < FILES; ++j)          \
+                                {                                               \
+                                        const std::string _path =               \
+                                                fsutil::join_path(              \
+                                                        _dir,                   \
+                                                        std::string(1, char('0' + j))); \
+                                        ns::file_t _file = ns::open(            \
+                                                _path,                          \
+                                                ns::mode_t(ns::MT_O_WRONLY |    \
+                                                           ns::MT_O_CREATE |    \
+                                                           ns::MT_O_TRUNC));    \
+                                        if(_file == ns::BAD_FILE)               \
+                                                return false;                   \
+                                        ns::close(_file);                       \
+                                }                                               \
+                        }                                                       \
+                        return true;                                            \
+                }                                                               \
+                                                                                \
+                static bool run(const std::string &p_dir) {                     \
+                        const std::string _root = p_dir + "/walk." #ns;         \
+                        ns::remove(_root);                                      \
+                        if(! make_tree(_root))                                  \
+                        {                                                       \
+                                std::cerr << #ns ": make_tree " << _root << ": " \
+                                          << ns::get_errno() << std::endl;      \
+                                return false;                                   \
+                        }                                                       \
+                        source::s_fail = fsutil::join_path(_root, "c");         \
+                                                                                \
+                        fsutil::walk_options _options;                          \
+                        _options.m_threads = 4;                                 \
+                        boost::atomic<std::size_t> _count(0);                   \
+                        const fsutil::walk_visitor _visitor =                   \
+                                boost::bind(&count_entry, &_count,              \
+                                            boost::placeholders::_1);           \
+                        fsutil::walker<source> _walker(_options);               \
+                        ns::set_errno(0);                                       \
+                        const bool _walked = _walker.run(_root, _visitor);      \
+                        const int _walk_errno = ns::get_errno();                \
+                                                                                \
+                        fsutil::walk_usage _usage;                              \
+                        ns::set_errno(0);                                       \
+                        const bool _counted = fsutil::disk_usage<source>(       \
+                                _usage, _root, _options);                       \
+                        const int _usage_errno = ns::get_errno();               \
+                                                                                \
+                        ns::remove(_root);                                      \
+                                                                                \
+                        /* 除了c下面的文件，其它项都被访问 */                                    \
+                        const std::size_t _expected =                           \
+                                1 + SUBDIRS + (SUBDIRS - 1) * FILES;            \
+                        std::cout << #ns ": walk " << _walked                   \
+                                  << " errno " << _walk_errno                   \
+                                  << " entries " << _count.load()               \
+                                  << ", disk_usage " << _counted                \
+                                  << " errno " << _usage_errno                  \
+                                  << " files " << _usage.m_files << std::endl;  \
+                        return ! _walked && _walk_errno == FAULT_ERRNO &&       \
+                               _count.load() == _expected &&                    \
+                               ! _counted && _usage_errno == FAULT_ERRNO &&     \
+                               _usage.m_files == (SUBDIRS - 1) * FILES;         \
+                }                                                               \
+        }
+
+WALK_TEST(localfs);
+WALK_TEST(gfs);
+WALK_TEST(memfs);
+
+int main(int argc, char **argv) {
+        if(argc != 2)
+        {
+                std::cerr << "usage: " << argv[0] << " <dir>" << std::endl;
+                return 2;
+        }
+        const std::string _dir = argv[1];
+        bool _ok = localfs_test::run(_dir);
+        _ok = gfs_test::run(_dir) && _ok;
+        _ok = memfs::create_directories(_dir) && memfs_test::run(_dir) && _ok;
+        return _ok ? 0 : 1;
+}